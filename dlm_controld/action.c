@@ -8,6 +8,7 @@
 
 #include "dlm_daemon.h"
 
+#include <pthread.h>
 #include <corosync/corotypes.h>
 #include <corosync/cmap.h>
 
@@ -170,7 +171,7 @@ int set_sysfs_nodir(char *name, int val)
 	return do_sysfs(name, "nodir", buf);
 }
 
-static int update_dir_members(char *name)
+static int update_dir_members(char *name, int *members, int *count)
 {
 	char path[PATH_MAX];
 	DIR *d;
@@ -186,20 +187,22 @@ static int update_dir_members(char *name)
 		return -1;
 	}
 
-	memset(dir_members, 0, sizeof(dir_members));
-	dir_members_count = 0;
+	memset(members, 0, MAX_NODES * sizeof(int));
+	*count = 0;
 
 	/* FIXME: we should probably read the nodeid in each dir instead */
 
 	while ((de = readdir(d))) {
 		if (de->d_name[0] == '.')
 			continue;
-		dir_members[i++] = atoi(de->d_name);
-		log_debug("dir_member %d", dir_members[i-1]);
+		if (i == MAX_NODES)
+			break;
+		members[i++] = atoi(de->d_name);
+		log_debug("dir_member %d", members[i-1]);
 	}
 	closedir(d);
 
-	dir_members_count = i;
+	*count = i;
 	return 0;
 }
 
@@ -240,41 +243,80 @@ int path_exists(const char *path)
 	return 1;
 }
 
+/* Per lockspace state used by the action threads.  Actions for the same
+   lockspace name are run one at a time, in the order they were queued, so
+   the kernel sees the same sequence of writes as before, but actions for
+   different lockspaces run in parallel.  The nodes/ dir of the lockspace
+   is cached here after it has been read or written, so it doesn't need to
+   be read again for each change. */
+
+struct action_space {
+	struct list_head list;
+	char name[DLM_LOCKSPACE_LEN+1];
+	int busy;
+	int queued;
+	int dir_valid;
+	int dir_count;
+	int dir_members[MAX_NODES];
+};
+
+#define ACTION_THREADS 4
+
+static pthread_t action_threads[ACTION_THREADS];
+static int action_thread_count;
+static pthread_mutex_t action_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t action_cond = PTHREAD_COND_INITIALIZER;
+static int action_pipe[2] = { -1, -1 };
+static int action_quit;
+static uint32_t action_ls_ids;
+static LIST_HEAD(action_spaces);
+static LIST_HEAD(action_queue);
+static LIST_HEAD(action_done);
+
 /* The "renew" nodes are those that have left and rejoined since the last
    call to set_members().  We rmdir/mkdir for these nodes so dlm-kernel
    can notice they've left and rejoined. */
 
-int set_configfs_members(struct lockspace *ls, char *name,
-			 int new_count, int *new_members,
-			 int renew_count, int *renew_members)
+static int set_configfs_members(struct action_space *as, char *name,
+				int new_count, int *new_members,
+				int *new_weights,
+				int renew_count, int *renew_members)
 {
 	char path[PATH_MAX];
 	char buf[32];
-	int i, w, fd, rv, id, old_count, *old_members;
+	int i, w, fd, rv, id, old_count;
+	int old_members[MAX_NODES];
 	int do_renew;
 
 	/*
-	 * create lockspace dir if it doesn't exist yet
+	 * create lockspace dir if it doesn't exist yet, and read the
+	 * current nodes unless they're cached from the last time
 	 */
 
-	memset(path, 0, PATH_MAX);
-	snprintf(path, PATH_MAX, "%s/%s", SPACES_DIR, name);
+	if (!as->dir_valid) {
+		memset(path, 0, PATH_MAX);
+		snprintf(path, PATH_MAX, "%s/%s", SPACES_DIR, name);
 
-	if (!path_exists(path)) {
-		if (create_path(path))
-			return -1;
+		if (!path_exists(path)) {
+			if (create_path(path))
+				return -1;
+		}
+
+		rv = update_dir_members(name, as->dir_members, &as->dir_count);
+		if (rv)
+			return rv;
+		as->dir_valid = 1;
 	}
 
 	/*
 	 * remove/add lockspace members
 	 */
 
-	rv = update_dir_members(name);
-	if (rv)
-		return rv;
+	memcpy(old_members, as->dir_members, sizeof(old_members));
+	old_count = as->dir_count;
 
-	old_members = dir_members;
-	old_count = dir_members_count;
+	/* the cache is only trusted again if all of this succeeds */
+	as->dir_valid = 0;
 
 	for (i = 0; i < old_count; i++) {
 		id = old_members[i];
@@ -308,6 +350,10 @@ int set_configfs_members(struct lockspace *ls, char *name,
 		rv = rmdir(path);
 		if (rv)
 			log_error("%s: rmdir failed: %d", path, errno);
+
+		/* the dir is gone, so it's read again if it's recreated */
+		as->dir_count = 0;
+		return 0;
 	}
 
 	for (i = 0; i < new_count; i++) {
@@ -320,8 +366,6 @@ int set_configfs_members(struct lockspace *ls, char *name,
 		else if (id_exists(id, old_count, old_members))
 			continue;
 
-		if (!is_cluster_member(id))
-			update_cluster();
 		/*
 		 * create node's dir
 		 */
@@ -379,7 +423,7 @@ int set_configfs_members(struct lockspace *ls, char *name,
 		 * set node's weight
 		 */
 
-		w = get_weight(ls, id);
+		w = new_weights[i];
 
 		memset(path, 0, PATH_MAX);
 		snprintf(path, PATH_MAX, "%s/%s/nodes/%d/weight",
@@ -403,11 +447,316 @@ int set_configfs_members(struct lockspace *ls, char *name,
 		close(fd);
 	}
 
+	memcpy(as->dir_members, new_members, new_count * sizeof(int));
+	as->dir_count = new_count;
+	as->dir_valid = 1;
 	rv = 0;
  out:
 	return rv;
 }
 
+void init_action(struct ls_action *act, char *name)
+{
+	memset(act, 0, sizeof(struct ls_action));
+	snprintf(act->name, sizeof(act->name), "%s", name);
+}
+
+/* Fill in the lockspace members for an action.  The weights and the
+   cluster membership come from main thread state, so they are looked up
+   here rather than by the action thread. */
+
+void set_action_members(struct lockspace *ls, struct ls_action *act,
+			int count, int *ids, int renew_count, int *renew_ids)
+{
+	int i;
+
+	act->flags |= ACT_MEMBERS;
+	act->member_count = count;
+	act->renew_count = renew_count;
+
+	for (i = 0; i < count; i++) {
+		act->members[i] = ids[i];
+		act->weights[i] = ls ? get_weight(ls, ids[i]) : 0;
+
+		if (!is_cluster_member(ids[i]))
+			update_cluster();
+	}
+
+	for (i = 0; i < renew_count; i++)
+		act->renew[i] = renew_ids[i];
+}
+
+/* The kernel is stopped before anything else is changed, and started
+   only after the members are set. */
+
+static void do_action(struct action_space *as, struct ls_action *act)
+{
+	char *name = act->name;
+	int rv;
+
+	if ((act->flags & ACT_CONTROL) && !act->control) {
+		rv = set_sysfs_control(name, 0);
+		if (rv && !act->rv)
+			act->rv = rv;
+	}
+
+	if (act->flags & ACT_SET_ID) {
+		rv = set_sysfs_id(name, act->global_id);
+		if (rv && !act->rv)
+			act->rv = rv;
+	}
+
+	if (act->flags & ACT_SET_NODIR) {
+		rv = set_sysfs_nodir(name, 1);
+		if (rv && !act->rv)
+			act->rv = rv;
+	}
+
+	if (act->flags & ACT_MEMBERS) {
+		rv = set_configfs_members(as, name,
+					  act->member_count, act->members,
+					  act->weights,
+					  act->renew_count, act->renew);
+		if (rv && !act->rv)
+			act->rv = rv;
+	}
+
+	if ((act->flags & ACT_CONTROL) && act->control) {
+		rv = set_sysfs_control(name, 1);
+		if (rv && !act->rv)
+			act->rv = rv;
+	}
+
+	if (act->flags & ACT_EVENT_DONE) {
+		rv = set_sysfs_event_done(name, act->event_done);
+		if (rv && !act->rv)
+			act->rv = rv;
+	}
+}
+
+static struct action_space *get_action_space(char *name)
+{
+	struct action_space *as;
+
+	list_for_each_entry(as, &action_spaces, list) {
+		if (!strcmp(as->name, name))
+			return as;
+	}
+
+	as = malloc(sizeof(struct action_space));
+	if (!as)
+		return NULL;
+	memset(as, 0, sizeof(struct action_space));
+	snprintf(as->name, sizeof(as->name), "%s", name);
+	list_add_tail(&as->list, &action_spaces);
+	return as;
+}
+
+/* the first queued action for a lockspace that isn't already busy */
+
+static struct ls_action *next_action(void)
+{
+	struct ls_action *act;
+	struct action_space *as;
+
+	list_for_each_entry(act, &action_queue, list) {
+		as = act->as;
+		if (as->busy)
+			continue;
+		return act;
+	}
+	return NULL;
+}
+
+static void *action_thread(void *arg)
+{
+	struct ls_action *act;
+	struct action_space *as;
+	int rv;
+
+	pthread_mutex_lock(&action_mutex);
+	while (1) {
+		act = next_action();
+		if (!act) {
+			if (action_quit)
+				break;
+			pthread_cond_wait(&action_cond, &action_mutex);
+			continue;
+		}
+
+		as = act->as;
+		as->busy = 1;
+		as->queued--;
+		list_del(&act->list);
+		pthread_mutex_unlock(&action_mutex);
+
+		do_action(as, act);
+
+		pthread_mutex_lock(&action_mutex);
+		as->busy = 0;
+		list_add_tail(&act->list, &action_done);
+
+		/* another thread may be waiting for this lockspace */
+		pthread_cond_broadcast(&action_cond);
+
+		rv = write(action_pipe[1], "a", 1);
+		(void)rv;
+	}
+	pthread_mutex_unlock(&action_mutex);
+	return NULL;
+}
+
+/* The action is copied, so the caller can build it on the stack.  If the
+   copy can't be allocated, or the threads aren't running, the action is
+   done here. */
+
+void queue_action(struct lockspace *ls, struct ls_action *act_in)
+{
+	struct ls_action *act;
+	struct action_space *as;
+
+	pthread_mutex_lock(&action_mutex);
+	as = get_action_space(act_in->name);
+	if (!as) {
+		pthread_mutex_unlock(&action_mutex);
+		log_error("queue_action %s no memory", act_in->name);
+		return;
+	}
+
+	act = NULL;
+	if (action_thread_count)
+		act = malloc(sizeof(struct ls_action));
+	if (!act) {
+		/* keep the order of the actions for this lockspace */
+		while (as->busy || as->queued)
+			pthread_cond_wait(&action_cond, &action_mutex);
+		do_action(as, act_in);
+		pthread_mutex_unlock(&action_mutex);
+		if (act_in->rv)
+			log_error("action %s flags %x error %d", act_in->name,
+				  act_in->flags, act_in->rv);
+		return;
+	}
+
+	memcpy(act, act_in, sizeof(struct ls_action));
+	act->as = as;
+	as->queued++;
+
+	if (ls) {
+		if (!ls->action_id)
+			ls->action_id = ++action_ls_ids;
+		act->ls_id = ls->action_id;
+		ls->actions_pending++;
+	}
+
+	list_add_tail(&act->list, &action_queue);
+	pthread_cond_signal(&action_cond);
+	pthread_mutex_unlock(&action_mutex);
+}
+
+/* completion of actions, called from the main loop */
+
+void process_actions(int ci)
+{
+	struct ls_action *act, *safe;
+	struct action_space *as, *as_safe;
+	struct lockspace *ls;
+	struct list_head done;
+	char buf[64];
+	int rv;
+
+	do {
+		rv = read(action_pipe[0], buf, sizeof(buf));
+	} while (rv == sizeof(buf));
+
+	INIT_LIST_HEAD(&done);
+
+	pthread_mutex_lock(&action_mutex);
+	list_for_each_entry_safe(act, safe, &action_done, list)
+		list_move_tail(&act->list, &done);
+
+	/* forget lockspaces that are idle and have no nodes configured */
+	list_for_each_entry_safe(as, as_safe, &action_spaces, list) {
+		if (as->busy || as->queued || as->dir_count)
+			continue;
+		list_del(&as->list);
+		free(as);
+	}
+	pthread_mutex_unlock(&action_mutex);
+
+	list_for_each_entry_safe(act, safe, &done, list) {
+		list_del(&act->list);
+
+		if (act->rv)
+			log_error("action %s flags %x error %d", act->name,
+				  act->flags, act->rv);
+
+		if (act->ls_id) {
+			ls = find_ls(act->name);
+			if (ls && ls->action_id == act->ls_id) {
+				ls->actions_pending--;
+				if (!ls->actions_pending)
+					poll_lockspaces++;
+			}
+		}
+		free(act);
+	}
+}
+
+int setup_actions(void)
+{
+	int i, rv;
+
+	rv = pipe(action_pipe);
+	if (rv < 0) {
+		log_error("setup_actions pipe error %d", errno);
+		return rv;
+	}
+	fcntl(action_pipe[0], F_SETFL, O_NONBLOCK);
+	fcntl(action_pipe[1], F_SETFL, O_NONBLOCK);
+	fcntl(action_pipe[0], F_SETFD, FD_CLOEXEC);
+	fcntl(action_pipe[1], F_SETFD, FD_CLOEXEC);
+
+	for (i = 0; i < ACTION_THREADS; i++) {
+		rv = pthread_create(&action_threads[i], NULL,
+				    action_thread, NULL);
+		if (rv) {
+			log_error("can't create action thread %d", rv);
+			break;
+		}
+		action_thread_count++;
+	}
+
+	if (!action_thread_count)
+		log_error("no action threads, configuring kernel directly");
+
+	return action_pipe[0];
+}
+
+/* let the threads finish what's queued before clear_configfs */
+
+void close_actions(void)
+{
+	struct action_space *as, *safe;
+	int i;
+
+	pthread_mutex_lock(&action_mutex);
+	action_quit = 1;
+	pthread_cond_broadcast(&action_cond);
+	pthread_mutex_unlock(&action_mutex);
+
+	for (i = 0; i < action_thread_count; i++)
+		pthread_join(action_threads[i], NULL);
+	action_thread_count = 0;
+
+	process_actions(0);
+
+	list_for_each_entry_safe(as, safe, &action_spaces, list) {
+		list_del(&as->list);
+		free(as);
+	}
+}
+
 #if 0
 char *str_ip(char *addr)
 {
@@ -497,7 +846,7 @@ static void clear_configfs_space_nodes(char *name)
 	char path[PATH_MAX];
 	int i, rv;
 
-	rv = update_dir_members(name);
+	rv = update_dir_members(name, dir_members, &dir_members_count);
 	if (rv < 0)
 		return;
 
@@ -63,6 +63,11 @@ struct change {
 	struct list_head list;
 	struct list_head members;
 	struct list_head removed; /* nodes removed by this change */
+	int nomap;   /* a nodeid without a slot, use the lists */
+	uint64_t member_set[NODE_SLOT_WORDS];
+	uint64_t added_set[NODE_SLOT_WORDS];
+	uint64_t removed_set[NODE_SLOT_WORDS];
+	struct member *memb_slot[MAX_NODE_SLOTS];
 	int member_count;
 	int joined_count;
 	int remove_count;
@@ -72,6 +77,7 @@ struct change {
 	uint32_t seq; /* used as a reference for debugging, and for queries */
 	uint32_t combined_seq; /* for queries */
 	uint64_t create_time;
+	uint64_t phase_usec[CG_PHASES]; /* monotime_usec, see CG_PHASE_ */
 };
 
 /* per lockspace change member: cg->members */
@@ -132,9 +138,65 @@ static void ids_in(struct ls_info *li, struct id_info *ids)
 	}
 }
 
-static struct member *find_memb(struct change *cg, int nodeid)
+/* Nodeids are arbitrary 32 bit values, so each lockspace gives every nodeid
+   it sees a small dense slot number.  The member sets of a change are bitmaps
+   indexed by slot, and ls->node_slot[] and cg->memb_slot[] lead from a slot
+   directly to the node history and member structs.  Slots are never reused;
+   if a lockspace sees more than MAX_NODE_SLOTS nodeids, changes involving
+   the extra nodes are flagged nomap and are searched by list. */
+
+static inline void set_slot(uint64_t *set, int slot)
+{
+	set[slot / 64] |= 1ULL << (slot % 64);
+}
+
+static inline int test_slot(uint64_t *set, int slot)
+{
+	return (set[slot / 64] >> (slot % 64)) & 1;
+}
+
+static inline uint32_t node_slot_hash(int nodeid)
+{
+	return ((uint32_t)nodeid * 2654435761U) % NODE_SLOT_HASH;
+}
+
+static int node_slot(struct lockspace *ls, int nodeid, int create)
+{
+	uint32_t h = node_slot_hash(nodeid);
+	int slot;
+
+	while (ls->node_slot_hash[h]) {
+		slot = ls->node_slot_hash[h] - 1;
+		if (ls->node_slot_nodeid[slot] == nodeid)
+			return slot;
+		h = (h + 1) % NODE_SLOT_HASH;
+	}
+
+	if (!create)
+		return -1;
+
+	if (ls->node_slot_count == MAX_NODE_SLOTS) {
+		log_error("%s node_slot none free for nodeid %d",
+			  ls->name, nodeid);
+		return -1;
+	}
+
+	slot = ls->node_slot_count++;
+	ls->node_slot_nodeid[slot] = nodeid;
+	ls->node_slot_hash[h] = slot + 1;
+	return slot;
+}
+
+static struct member *find_memb(struct lockspace *ls, struct change *cg,
+				int nodeid)
 {
 	struct member *memb;
+	int slot;
+
+	if (!cg->nomap) {
+		slot = node_slot(ls, nodeid, 0);
+		return (slot < 0) ? NULL : cg->memb_slot[slot];
+	}
 
 	list_for_each_entry(memb, &cg->members, list) {
 		if (memb->nodeid == nodeid)
@@ -180,10 +242,29 @@ static void free_cg(struct change *cg)
 	free(cg);
 }
 
+/* a plock message from a lockspace cpg, see queue_plock_msg */
+
+struct plock_msg {
+	struct list_head list;
+	int nodeid;
+	int len;
+	char buf[0];
+};
+
+static int plock_msg_fd = -1;
+static int plock_msg_count;
+
 static void free_ls(struct lockspace *ls)
 {
 	struct change *cg, *cg_safe;
 	struct node *node, *node_safe;
+	struct plock_msg *pm, *pm_safe;
+
+	list_for_each_entry_safe(pm, pm_safe, &ls->plock_msgs, list) {
+		list_del(&pm->list);
+		plock_msg_count--;
+		free(pm);
+	}
 
 	list_for_each_entry_safe(cg, cg_safe, &ls->changes, list) {
 		list_del(&cg->list);
@@ -198,6 +279,7 @@ static void free_ls(struct lockspace *ls)
 		free(node);
 	}
 
+	free_deadlk(ls);
 	free(ls);
 }
 
@@ -255,6 +337,14 @@ static void free_ls(struct lockspace *ls)
 static struct node *get_node_history(struct lockspace *ls, int nodeid)
 {
 	struct node *node;
+	int slot;
+
+	slot = node_slot(ls, nodeid, 0);
+	if (slot >= 0)
+		return ls->node_slot[slot];
+
+	if (ls->node_slot_count < MAX_NODE_SLOTS)
+		return NULL;
 
 	list_for_each_entry(node, &ls->node_history, list) {
 		if (node->nodeid == nodeid)
@@ -266,6 +356,7 @@ static struct node *get_node_history(struct lockspace *ls, int nodeid)
 static struct node *get_node_history_create(struct lockspace *ls, int nodeid)
 {
 	struct node *node;
+	int slot;
 
 	node = get_node_history(ls, nodeid);
 	if (node)
@@ -278,6 +369,10 @@ static struct node *get_node_history_create(struct lockspace *ls, int nodeid)
 
 	node->nodeid = nodeid;
 	list_add_tail(&node->list, &ls->node_history);
+
+	slot = node_slot(ls, nodeid, 1);
+	if (slot >= 0)
+		ls->node_slot[slot] = node;
 	return node;
 }
 
@@ -528,12 +623,41 @@ static void format_renew_ids(struct lockspace *ls)
 {
 	struct change *cg, *startcg;
 	struct member *memb, *leftmemb;
+	uint64_t left_set[NODE_SLOT_WORDS];
+	uint64_t w;
+	int i, b, nomap;
 
 	startcg = list_first_entry(&ls->changes, struct change, list);
 
 	memset(renew_ids, 0, sizeof(renew_ids));
 	renew_count = 0;
 
+	memset(left_set, 0, sizeof(left_set));
+	nomap = startcg->nomap;
+
+	list_for_each_entry(cg, &ls->changes, list) {
+		if (cg == startcg)
+			continue;
+		nomap |= cg->nomap;
+		for (i = 0; i < NODE_SLOT_WORDS; i++)
+			left_set[i] |= cg->removed_set[i];
+	}
+
+	if (nomap)
+		goto slow;
+
+	for (i = 0; i < NODE_SLOT_WORDS; i++) {
+		w = left_set[i] & startcg->member_set[i];
+		while (w) {
+			b = __builtin_ctzll(w);
+			w &= w - 1;
+			renew_ids[renew_count++] =
+				ls->node_slot_nodeid[i * 64 + b];
+		}
+	}
+	return;
+
+ slow:
 	list_for_each_entry(memb, &startcg->members, list) {
 		list_for_each_entry(cg, &ls->changes, list) {
 			if (cg == startcg)
@@ -548,9 +672,22 @@ static void format_renew_ids(struct lockspace *ls)
 
 }
 
+/* wait_conditions_done() is repeated until all are done, the first time
+   a phase is passed is the one recorded */
+
+static void set_phase(struct change *cg, int phase)
+{
+	if (!cg->phase_usec[phase])
+		cg->phase_usec[phase] = monotime_usec();
+}
+
+/* The sysfs/configfs writes are queued for the action threads, which keep
+   them in order for the lockspace, so we don't wait for them here. */
+
 static void start_kernel(struct lockspace *ls)
 {
 	struct change *cg = list_first_entry(&ls->changes, struct change, list);
+	struct ls_action act;
 
 	if (!ls->kernel_stopped) {
 		log_error("start_kernel cg %u not stopped", cg->seq);
@@ -560,38 +697,61 @@ static void start_kernel(struct lockspace *ls)
 	log_group(ls, "start_kernel cg %u member_count %d",
 		  cg->seq, cg->member_count);
 
+	set_phase(cg, CG_PHASE_KERNEL);
+
+	ls->recovery_last_usec = cg->phase_usec[CG_PHASE_KERNEL] -
+				 cg->phase_usec[CG_PHASE_CONFCHG];
+	ls->recovery_usec += ls->recovery_last_usec;
+	ls->recovery_count++;
+
+	init_action(&act, ls->name);
+
 	/* needs to happen before setting control which starts recovery */
-	if (ls->joining)
-		set_sysfs_id(ls->name, ls->global_id);
+	if (ls->joining) {
+		act.flags |= ACT_SET_ID;
+		act.global_id = ls->global_id;
+	}
 
 	if (ls->nodir)
-		set_sysfs_nodir(ls->name, 1);
+		act.flags |= ACT_SET_NODIR;
 
 	format_member_ids(ls);
 	format_renew_ids(ls);
-	set_configfs_members(ls, ls->name, member_count, member_ids,
-			     renew_count, renew_ids);
-	set_sysfs_control(ls->name, 1);
+	set_action_members(ls, &act, member_count, member_ids,
+			   renew_count, renew_ids);
+
+	act.flags |= ACT_CONTROL;
+	act.control = 1;
 	ls->kernel_stopped = 0;
 
 	if (ls->joining) {
-		set_sysfs_event_done(ls->name, 0);
+		act.flags |= ACT_EVENT_DONE;
+		act.event_done = 0;
 		ls->joining = 0;
 	}
+
+	queue_action(ls, &act);
 }
 
 static void stop_kernel(struct lockspace *ls, uint32_t seq)
 {
+	struct ls_action act;
+
 	if (!ls->kernel_stopped) {
 		log_group(ls, "stop_kernel cg %u", seq);
-		set_sysfs_control(ls->name, 0);
+
+		init_action(&act, ls->name);
+		act.flags = ACT_CONTROL;
+		act.control = 0;
+		queue_action(ls, &act);
+
 		ls->kernel_stopped = 1;
 	}
 }
 
-/* the first condition is that the local lockspace is stopped which we
-   don't need to check for because stop_kernel(), which is synchronous,
-   was done when the change was created */
+/* the first condition is that the local lockspace is stopped; stop_kernel()
+   was queued when the change was created, so wait for the queued actions
+   of the lockspace to be done */
 
 /* the fencing/quorum/fs conditions need to account for all the changes
    that have occured since the last change applied to dlm-kernel, not
@@ -602,6 +762,19 @@ static void stop_kernel(struct lockspace *ls, uint32_t seq)
 
 static int wait_conditions_done(struct lockspace *ls)
 {
+	struct change *cg = list_first_entry(&ls->changes, struct change, list);
+
+	if (ls->actions_pending) {
+		if (ls->wait_debug != DLMC_LS_WAIT_KERNEL) {
+			ls->wait_debug = DLMC_LS_WAIT_KERNEL;
+			ls->wait_retry = 0;
+			log_group(ls, "wait for kernel actions %d",
+				  ls->actions_pending);
+		}
+		/* process_actions() polls lockspaces when they're done */
+		return 0;
+	}
+
 	if (!check_ringid_done(ls)) {
 		if (ls->wait_debug != DLMC_LS_WAIT_RINGID) {
 			ls->wait_debug = DLMC_LS_WAIT_RINGID;
@@ -613,6 +786,7 @@ static int wait_conditions_done(struct lockspace *ls)
 		poll_lockspaces++;
 		return 0;
 	}
+	set_phase(cg, CG_PHASE_RINGID);
 
 	if (opt(enable_quorum_lockspace_ind) && !cluster_quorate) {
 		if (ls->wait_debug != DLMC_LS_WAIT_QUORUM) {
@@ -625,6 +799,7 @@ static int wait_conditions_done(struct lockspace *ls)
 		poll_lockspaces++;
 		return 0;
 	}
+	set_phase(cg, CG_PHASE_QUORUM);
 
 	if (!check_fencing_done(ls)) {
 		if (ls->wait_debug != DLMC_LS_WAIT_FENCING) {
@@ -637,6 +812,7 @@ static int wait_conditions_done(struct lockspace *ls)
 		poll_lockspaces++;
 		return 0;
 	}
+	set_phase(cg, CG_PHASE_FENCING);
 
 	if (!check_fs_done(ls)) {
 		if (ls->wait_debug != DLMC_LS_WAIT_FSDONE) {
@@ -649,6 +825,7 @@ static int wait_conditions_done(struct lockspace *ls)
 		poll_fs++;
 		return 0;
 	}
+	set_phase(cg, CG_PHASE_FSDONE);
 
 	ls->wait_debug = 0;
 	ls->wait_retry = 0;
@@ -677,6 +854,7 @@ static int wait_messages_done(struct lockspace *ls)
 
 	log_group(ls, "wait_messages cg %u got all %d", cg->seq, total);
 
+	set_phase(cg, CG_PHASE_MESSAGES);
 	ls->wait_debug = 0;
 
 	return 1;
@@ -705,6 +883,36 @@ static void cleanup_changes(struct lockspace *ls)
 	}
 }
 
+static void save_timeline(struct lockspace *ls, struct change *cg)
+{
+	struct cg_timeline *tl;
+
+	tl = &ls->recovery_hist[ls->recovery_hist_count % RECOVERY_HIST_LEN];
+	ls->recovery_hist_count++;
+
+	tl->seq = cg->seq;
+	tl->combined_seq = cg->combined_seq;
+	tl->member_count = cg->member_count;
+	tl->joined_count = cg->joined_count;
+	tl->remove_count = cg->remove_count;
+	tl->failed_count = cg->failed_count;
+	memcpy(tl->phase_usec, cg->phase_usec, sizeof(tl->phase_usec));
+}
+
+/* a joining node gets the plock state after the kernel is started */
+
+static void set_timeline_plocks(struct lockspace *ls)
+{
+	struct cg_timeline *tl;
+
+	if (!ls->recovery_hist_count)
+		return;
+
+	tl = &ls->recovery_hist[(ls->recovery_hist_count - 1) % RECOVERY_HIST_LEN];
+	if (!tl->phase_usec[CG_PHASE_PLOCKS])
+		tl->phase_usec[CG_PHASE_PLOCKS] = monotime_usec();
+}
+
 /* There's a stream of confchg and messages. At one of these
    messages, the low node needs to store plocks and new nodes
    need to begin saving plock messages.  A second message is
@@ -768,7 +976,7 @@ static int match_change(struct lockspace *ls, struct change *cg,
 	struct node *node;
 	uint64_t t;
 	uint32_t seq = hd->msgdata;
-	int i, members_mismatch;
+	int i, slot, members_mismatch;
 
 	/* We can ignore messages if we're not in the list of members.
 	   The one known time this will happen is after we've joined
@@ -783,7 +991,7 @@ static int match_change(struct lockspace *ls, struct change *cg,
 		return 0;
 	}
 
-	memb = find_memb(cg, hd->nodeid);
+	memb = find_memb(ls, cg, hd->nodeid);
 	if (!memb) {
 		log_group(ls, "match_change %d:%u skip %u sender not member",
 			  hd->nodeid, seq, cg->seq);
@@ -852,7 +1060,14 @@ static int match_change(struct lockspace *ls, struct change *cg,
 	id = ids;
 
 	for (i = 0; i < li->id_info_count; i++) {
-		memb = find_memb(cg, id->nodeid);
+		if (cg->nomap) {
+			memb = find_memb(ls, cg, id->nodeid);
+		} else {
+			slot = node_slot(ls, id->nodeid, 0);
+			memb = NULL;
+			if (slot >= 0 && test_slot(cg->member_set, slot))
+				memb = cg->memb_slot[slot];
+		}
 		if (!memb) {
 			log_group(ls, "match_change %d:%u skip %u no memb %d",
 			  	  hd->nodeid, seq, cg->seq, id->nodeid);
@@ -926,9 +1141,17 @@ static int is_added(struct lockspace *ls, int nodeid)
 {
 	struct change *cg;
 	struct member *memb;
+	int slot;
+
+	slot = node_slot(ls, nodeid, 0);
 
 	list_for_each_entry(cg, &ls->changes, list) {
-		memb = find_memb(cg, nodeid);
+		if (!cg->nomap) {
+			if (slot >= 0 && test_slot(cg->added_set, slot))
+				return 1;
+			continue;
+		}
+		memb = find_memb(ls, cg, nodeid);
 		if (memb && memb->added)
 			return 1;
 	}
@@ -956,7 +1179,7 @@ static void receive_start(struct lockspace *ls, struct dlm_header *hd, int len)
 	if (!cg)
 		return;
 
-	memb = find_memb(cg, hd->nodeid);
+	memb = find_memb(ls, cg, hd->nodeid);
 	if (!memb) {
 		/* this should never happen since match_change checks it */
 		log_error("receive_start no member %d", hd->nodeid);
@@ -1032,6 +1255,7 @@ static void receive_plocks_done(struct lockspace *ls, struct dlm_header *hd,
 	process_saved_plocks(ls);
 	ls->need_plocks = 0;
 	ls->save_plocks = 0;
+	set_timeline_plocks(ls);
 
 	log_dlock(ls, "receive_plocks_done %d:%u plocks_data_count %u",
 		  hd->nodeid, hd->msgdata, ls->recv_plocks_data_count);
@@ -1123,12 +1347,22 @@ static void send_plocks_done(struct lockspace *ls, struct change *cg, uint32_t p
 	send_info(ls, cg, DLM_MSG_PLOCKS_DONE, 0, plocks_data);
 }
 
-static int same_members(struct change *cg1, struct change *cg2)
+static int same_members(struct lockspace *ls, struct change *cg1,
+			struct change *cg2)
 {
 	struct member *memb;
+	int i;
+
+	if (!cg1->nomap && !cg2->nomap) {
+		for (i = 0; i < NODE_SLOT_WORDS; i++) {
+			if (cg1->member_set[i] & ~cg2->member_set[i])
+				return 0;
+		}
+		return 1;
+	}
 
 	list_for_each_entry(memb, &cg1->members, list) {
-		if (!find_memb(cg2, memb->nodeid))
+		if (!find_memb(ls, cg2, memb->nodeid))
 			return 0;
 	}
 	return 1;
@@ -1144,7 +1378,7 @@ static void send_nacks(struct lockspace *ls, struct change *startcg)
 		    cg->joined_count == startcg->joined_count &&
 		    cg->remove_count == startcg->remove_count &&
 		    cg->failed_count == startcg->failed_count &&
-		    same_members(cg, startcg)) {
+		    same_members(ls, cg, startcg)) {
 			log_group(ls, "send nack old cg %u new cg %u",
 				   cg->seq, startcg->seq);
 			send_info(ls, cg, DLM_MSG_START, DLM_MFLG_NACK, 0);
@@ -1221,10 +1455,14 @@ static void prepare_plocks(struct lockspace *ls)
 	send_plocks_done(ls, cg, plocks_data);
 }
 
+static void flush_plock_msgs(struct lockspace *ls);
+
 static void apply_changes(struct lockspace *ls)
 {
 	struct change *cg;
 
+	flush_plock_msgs(ls);
+
 	if (list_empty(&ls->changes))
 		return;
 	cg = list_first_entry(&ls->changes, struct change, list);
@@ -1244,7 +1482,10 @@ static void apply_changes(struct lockspace *ls)
 			set_protocol_stateful();
 			start_kernel(ls);
 			prepare_plocks(ls);
+			if (!ls->need_plocks)
+				set_phase(cg, CG_PHASE_PLOCKS);
 			cleanup_changes(ls);
+			save_timeline(ls, cg);
 		}
 		break;
 
@@ -1277,7 +1518,7 @@ static int add_change(struct lockspace *ls,
 {
 	struct change *cg;
 	struct member *memb;
-	int i, error;
+	int i, slot, error;
 	uint64_t now = monotime();
 
 	cg = malloc(sizeof(struct change));
@@ -1288,6 +1529,7 @@ static int add_change(struct lockspace *ls,
 	INIT_LIST_HEAD(&cg->removed);
 	cg->state = CGST_WAIT_CONDITIONS;
 	cg->create_time = now;
+	cg->phase_usec[CG_PHASE_CONFCHG] = monotime_usec();
 	cg->seq = ++ls->change_seq;
 	if (!cg->seq)
 		cg->seq = ++ls->change_seq;
@@ -1303,6 +1545,14 @@ static int add_change(struct lockspace *ls,
 		memset(memb, 0, sizeof(struct member));
 		memb->nodeid = member_list[i].nodeid;
 		list_add_tail(&memb->list, &cg->members);
+
+		slot = node_slot(ls, memb->nodeid, 1);
+		if (slot < 0) {
+			cg->nomap = 1;
+			continue;
+		}
+		set_slot(cg->member_set, slot);
+		cg->memb_slot[slot] = memb;
 	}
 
 	for (i = 0; i < left_list_entries; i++) {
@@ -1318,6 +1568,12 @@ static int add_change(struct lockspace *ls,
 		}
 		list_add_tail(&memb->list, &cg->removed);
 
+		slot = node_slot(ls, memb->nodeid, 1);
+		if (slot < 0)
+			cg->nomap = 1;
+		else
+			set_slot(cg->removed_set, slot);
+
 		if (left_list[i].reason == CPG_REASON_NODEDOWN)
 			ls->cpg_ringid_wait = 1;
 
@@ -1336,7 +1592,7 @@ static int add_change(struct lockspace *ls,
 	}
 
 	for (i = 0; i < joined_list_entries; i++) {
-		memb = find_memb(cg, joined_list[i].nodeid);
+		memb = find_memb(ls, cg, joined_list[i].nodeid);
 		if (!memb) {
 			log_error("no member %d", joined_list[i].nodeid);
 			error = -ENOENT;
@@ -1344,6 +1600,10 @@ static int add_change(struct lockspace *ls,
 		}
 		memb->added = 1;
 
+		slot = node_slot(ls, memb->nodeid, 0);
+		if (slot >= 0)
+			set_slot(cg->added_set, slot);
+
 		if (memb->nodeid == our_nodeid) {
 			cg->we_joined = 1;
 		} else {
@@ -1389,8 +1649,10 @@ static int we_left(const struct cpg_address *left_list,
 	return 0;
 }
 
-static void confchg_cb(cpg_handle_t handle,
-		       const struct cpg_name *group_name,
+/* a membership change of the lockspace, from the lockspace cpg, or from
+   the shared group cpg when ls_cpg_groups is used */
+
+static void ls_confchg(struct lockspace *ls,
 		       const struct cpg_address *member_list,
 		       size_t member_list_entries,
 		       const struct cpg_address *left_list,
@@ -1398,31 +1660,29 @@ static void confchg_cb(cpg_handle_t handle,
 		       const struct cpg_address *joined_list,
 		       size_t joined_list_entries)
 {
-	struct lockspace *ls;
 	struct change *cg;
 	struct member *memb;
+	struct ls_action act;
 	int rv;
 
-	log_config(group_name, member_list, member_list_entries,
-		   left_list, left_list_entries,
-		   joined_list, joined_list_entries);
-
-	ls = find_ls_handle(handle);
-	if (!ls) {
-		log_error("confchg_cb no lockspace for cpg %s",
-			  group_name->value);
-		return;
-	}
+	flush_plock_msgs(ls);
 
 	if (ls->leaving && we_left(left_list, left_list_entries)) {
 		/* we called cpg_leave(), and this should be the final
 		   cpg callback we receive */
 		log_group(ls, "confchg for our leave");
 		stop_kernel(ls, 0);
-		set_configfs_members(ls, ls->name, 0, NULL, 0, NULL);
-		set_sysfs_event_done(ls->name, 0);
-		cpg_finalize(ls->cpg_handle);
-		client_dead(ls->cpg_client);
+
+		init_action(&act, ls->name);
+		set_action_members(ls, &act, 0, NULL, 0, NULL);
+		act.flags |= ACT_EVENT_DONE;
+		act.event_done = 0;
+		queue_action(NULL, &act);
+
+		if (!ls->group) {
+			cpg_finalize(ls->cpg_handle);
+			client_dead(ls->cpg_client);
+		}
 		purge_plocks(ls, our_nodeid, 1);
 		list_del(&ls->list);
 		free_ls(ls);
@@ -1442,49 +1702,51 @@ static void confchg_cb(cpg_handle_t handle,
 
 	apply_changes(ls);
 
-#if 0
 	deadlk_confchg(ls, member_list, member_list_entries,
 		       left_list, left_list_entries,
 		       joined_list, joined_list_entries);
-#endif
 }
 
-/* after our join confchg, we want to ignore plock messages (see need_plocks
-   checks below) until the point in time where the ckpt_node saves plock
-   state (final start message received); at this time we want to shift from
-   ignoring plock messages to saving plock messages to apply on top of the
-   plock state that we read. */
-
-static void deliver_cb(cpg_handle_t handle,
+static void confchg_cb(cpg_handle_t handle,
 		       const struct cpg_name *group_name,
-		       uint32_t nodeid, uint32_t pid,
-		       void *data, size_t len)
+		       const struct cpg_address *member_list,
+		       size_t member_list_entries,
+		       const struct cpg_address *left_list,
+		       size_t left_list_entries,
+		       const struct cpg_address *joined_list,
+		       size_t joined_list_entries)
 {
 	struct lockspace *ls;
-	struct dlm_header *hd;
-	int ignore_plock;
-	int rv;
 
-	int enable_plock = opt(enable_plock_ind);
-	int plock_ownership = opt(plock_ownership_ind);
+	log_config(group_name, member_list, member_list_entries,
+		   left_list, left_list_entries,
+		   joined_list, joined_list_entries);
 
 	ls = find_ls_handle(handle);
 	if (!ls) {
-		log_error("deliver_cb no ls for cpg %s", group_name->value);
+		log_error("confchg_cb no lockspace for cpg %s",
+			  group_name->value);
 		return;
 	}
 
-	if (len < sizeof(struct dlm_header)) {
-		log_error("deliver_cb short message %zd", len);
-		return;
-	}
+	ls_confchg(ls, member_list, member_list_entries,
+		   left_list, left_list_entries,
+		   joined_list, joined_list_entries);
+}
 
-	hd = (struct dlm_header *)data;
-	dlm_header_in(hd);
+/* after our join confchg, we want to ignore plock messages (see need_plocks
+   checks below) until the point in time where the ckpt_node saves plock
+   state (final start message received); at this time we want to shift from
+   ignoring plock messages to saving plock messages to apply on top of the
+   plock state that we read. */
 
-	rv = dlm_header_validate(hd, nodeid);
-	if (rv < 0)
-		return;
+static void receive_ls_message(struct lockspace *ls, struct dlm_header *hd,
+			       uint32_t nodeid, size_t len)
+{
+	int ignore_plock;
+
+	int enable_plock = opt(enable_plock_ind);
+	int plock_ownership = opt(plock_ownership_ind);
 
 	ignore_plock = 0;
 
@@ -1570,39 +1832,45 @@ static void deliver_cb(cpg_handle_t handle,
 				  hd->type, nodeid, enable_plock);
 		break;
 
-#if 0
 	case DLM_MSG_DEADLK_CYCLE_START:
-		if (opt(enable_deadlk))
+		if (opt(enable_deadlk_ind))
 			receive_cycle_start(ls, hd, len);
 		else
 			log_error("msg %d nodeid %d enable_deadlk %d",
-				  hd->type, nodeid, opt(enable_deadlk));
+				  hd->type, nodeid, opt(enable_deadlk_ind));
 		break;
 
 	case DLM_MSG_DEADLK_CYCLE_END:
-		if (opt(enable_deadlk))
+		if (opt(enable_deadlk_ind))
 			receive_cycle_end(ls, hd, len);
 		else
 			log_error("msg %d nodeid %d enable_deadlk %d",
-				  hd->type, nodeid, opt(enable_deadlk));
+				  hd->type, nodeid, opt(enable_deadlk_ind));
 		break;
 
-	case DLM_MSG_DEADLK_CHECKPOINT_READY:
-		if (opt(enable_deadlk))
-			receive_checkpoint_ready(ls, hd, len);
+	case DLM_MSG_DEADLK_LOCKS:
+		if (opt(enable_deadlk_ind))
+			receive_locks(ls, hd, len);
 		else
 			log_error("msg %d nodeid %d enable_deadlk %d",
-				  hd->type, nodeid, opt(enable_deadlk));
+				  hd->type, nodeid, opt(enable_deadlk_ind));
 		break;
 
 	case DLM_MSG_DEADLK_CANCEL_LOCK:
-		if (opt(enable_deadlk))
+		if (opt(enable_deadlk_ind))
 			receive_cancel_lock(ls, hd, len);
 		else
 			log_error("msg %d nodeid %d enable_deadlk %d",
-				  hd->type, nodeid, opt(enable_deadlk));
+				  hd->type, nodeid, opt(enable_deadlk_ind));
+		break;
+
+	case DLM_MSG_DEADLK_TRANS:
+		if (opt(enable_deadlk_ind))
+			receive_trans(ls, hd, len);
+		else
+			log_error("msg %d nodeid %d enable_deadlk %d",
+				  hd->type, nodeid, opt(enable_deadlk_ind));
 		break;
-#endif
 
 	default:
 		log_error("unknown msg type %d", hd->type);
@@ -1615,6 +1883,153 @@ static void deliver_cb(cpg_handle_t handle,
 	apply_changes(ls);
 }
 
+/*
+ * Plock messages from other nodes can come in floods, so they are not run
+ * when the lockspace cpg is dispatched, but queued on the lockspace and run
+ * by process_plock_msgs() in the plock client class.  They must still be
+ * run in agreed order with everything else in the lockspace, so the queue
+ * is flushed before any other message, confchg or change of the lockspace
+ * is handled.
+ */
+
+static int plock_msg_type(int type)
+{
+	switch (type) {
+	case DLM_MSG_PLOCK:
+	case DLM_MSG_PLOCK_OWN:
+	case DLM_MSG_PLOCK_DROP:
+	case DLM_MSG_PLOCK_SYNC_LOCK:
+	case DLM_MSG_PLOCK_SYNC_WAITER:
+		return 1;
+	}
+	return 0;
+}
+
+static int queue_plock_msg(struct lockspace *ls, struct dlm_header *hd,
+			   uint32_t nodeid, size_t len)
+{
+	struct plock_msg *pm;
+	uint64_t one = 1;
+
+	pm = malloc(sizeof(struct plock_msg) + len);
+	if (!pm)
+		return -ENOMEM;
+	pm->nodeid = nodeid;
+	pm->len = len;
+	memcpy(pm->buf, hd, len);
+	list_add_tail(&pm->list, &ls->plock_msgs);
+
+	if (!plock_msg_count++ && write(plock_msg_fd, &one, sizeof(one)) < 0)
+		log_error("queue_plock_msg eventfd write error %d", errno);
+	return 0;
+}
+
+static void run_plock_msg(struct lockspace *ls)
+{
+	struct plock_msg *pm;
+
+	pm = list_first_entry(&ls->plock_msgs, struct plock_msg, list);
+	list_del(&pm->list);
+	plock_msg_count--;
+
+	/* apply_changes from here must not flush the rest of the queue */
+	ls->plock_msgs_run = 1;
+	receive_ls_message(ls, (struct dlm_header *)pm->buf, pm->nodeid,
+			   pm->len);
+	ls->plock_msgs_run = 0;
+	free(pm);
+}
+
+static void flush_plock_msgs(struct lockspace *ls)
+{
+	if (ls->plock_msgs_run)
+		return;
+
+	while (!list_empty(&ls->plock_msgs))
+		run_plock_msg(ls);
+}
+
+static void receive_ls_cpg_message(struct lockspace *ls, struct dlm_header *hd,
+				   uint32_t nodeid, size_t len)
+{
+	if (plock_msg_fd != -1 && plock_msg_type(hd->type) &&
+	    !queue_plock_msg(ls, hd, nodeid, len))
+		return;
+
+	flush_plock_msgs(ls);
+	receive_ls_message(ls, hd, nodeid, len);
+}
+
+/* one message from each lockspace with queued plock messages in turn,
+   within the plock class budget */
+
+void process_plock_msgs(int ci)
+{
+	struct lockspace *ls;
+	uint64_t val;
+	int first = 1;
+
+	if (read(plock_msg_fd, &val, sizeof(val)) < 0 && errno != EAGAIN)
+		log_error("process_plock_msgs eventfd read error %d", errno);
+
+	while (plock_msg_count) {
+		list_for_each_entry(ls, &lockspaces, list) {
+			if (list_empty(&ls->plock_msgs))
+				continue;
+			if (!first && !client_more())
+				goto out;
+			first = 0;
+			run_plock_msg(ls);
+		}
+	}
+ out:
+	/* left for the next loop iteration */
+	val = 1;
+	if (plock_msg_count && write(plock_msg_fd, &val, sizeof(val)) < 0)
+		log_error("process_plock_msgs eventfd write error %d", errno);
+}
+
+int setup_plock_msgs(void)
+{
+	plock_msg_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (plock_msg_fd < 0) {
+		log_error("setup_plock_msgs eventfd error %d", errno);
+		return -1;
+	}
+	return plock_msg_fd;
+}
+
+static void deliver_cb(cpg_handle_t handle,
+		       const struct cpg_name *group_name,
+		       uint32_t nodeid, uint32_t pid,
+		       void *data, size_t len)
+{
+	struct lockspace *ls;
+	struct dlm_header *hd;
+	int rv;
+
+	ls = find_ls_handle(handle);
+	if (!ls) {
+		log_error("deliver_cb no ls for cpg %s", group_name->value);
+		return;
+	}
+
+	if (len < sizeof(struct dlm_header)) {
+		log_error("deliver_cb short message %zd", len);
+		return;
+	}
+
+	hd = (struct dlm_header *)data;
+	dlm_header_in(hd);
+	metrics_recv(hd->type, len);
+
+	rv = dlm_header_validate(hd, nodeid);
+	if (rv < 0)
+		return;
+
+	receive_ls_cpg_message(ls, hd, nodeid, len);
+}
+
 /* save ringid to compare with cman's.
    also save member_list to double check with cman's member list?
    they should match */
@@ -1655,6 +2070,7 @@ static cpg_model_v1_data_t cpg_callbacks = {
 static void process_cpg_lockspace(int ci)
 {
 	struct lockspace *ls;
+	cpg_handle_t h;
 	cs_error_t error;
 
 	ls = find_ls_ci(ci);
@@ -1663,22 +2079,789 @@ static void process_cpg_lockspace(int ci)
 		return;
 	}
 
-	error = cpg_dispatch(ls->cpg_handle, CS_DISPATCH_ALL);
-	if (error != CS_OK && error != CS_ERR_BAD_HANDLE) {
+	/* our leave confchg frees ls and finalizes the handle, after which
+	   dispatch returns BAD_HANDLE */
+	h = ls->cpg_handle;
+
+	/* messages until none are left or the class budget is used up; the
+	   fd is still readable at the next poll if some are left */
+	do {
+		error = cpg_dispatch(h, CS_DISPATCH_ONE_NONBLOCKING);
+	} while (error == CS_OK && client_more());
+
+	if (error != CS_OK && error != CS_ERR_BAD_HANDLE &&
+	    error != CS_ERR_TRY_AGAIN)
 		log_error("cpg_dispatch error %d", error);
-		return;
-	}
 }
 
-/* received an "online" uevent from dlm-kernel */
+/*
+ * Shared lockspace cpgs (ls_cpg_groups > 0)
+ *
+ * Instead of a cpg per lockspace, each lockspace is assigned by global_id
+ * to one of ls_cpg_groups cpgs named "dlm:ls:group:<num>", which are joined
+ * at startup.  Lockspace membership within a group is tracked with ls_join
+ * and ls_leave messages, and by nodes leaving or failing out of the group
+ * cpg.  These all produce the same lockspace change that a lockspace cpg
+ * confchg would, and since they are delivered in the same order on all
+ * nodes, every member sees the same sequence of lockspace changes.  Other
+ * messages are routed to the lockspace by dlm_header.global_id.
+ *
+ * A node joining a group learns the existing lockspace memberships from
+ * the ls_members message that every other member sends when it sees the
+ * group join.  It doesn't send any ls_join until it has heard from all
+ * of the members.
+ *
+ * All nodes must use the same ls_cpg_groups setting.
+ */
 
-int dlm_join_lockspace(struct lockspace *ls)
-{
-	cs_error_t error;
-	cpg_handle_t h;
+#define MAX_LS_CPG_GROUPS 64
+
+struct group_space {
+	struct list_head list;
+	char name[DLM_LOCKSPACE_LEN+1];
+	int member_count;
+	int members[MAX_NODES];
+};
+
+struct ls_group {
+	int num;
+	cpg_handle_t handle;
+	int client;
+	int joined;
+	int synced;
 	struct cpg_name name;
+	struct cpg_ring_id ringid;
+	int sync_count;
+	int sync_nodes[MAX_NODES];
+	struct list_head spaces;
+	struct list_head saved;	/* ls_join/ls_leave from sync_nodes */
+};
+
+/* An ls_join or ls_leave from a node that we have not yet had ls_members
+   from is saved, and applied after its ls_members.  The node may have sent
+   it before seeing our group join, in which case its ls_members does not
+   yet reflect it. */
+
+struct group_msg {
+	struct list_head list;
+	int nodeid;
+	int len;
+	char buf[0];
+};
+
+static struct ls_group *ls_groups;
+static int ls_group_count;
+
+static struct ls_group *find_group_handle(cpg_handle_t h)
+{
+	int i;
+
+	for (i = 0; i < ls_group_count; i++) {
+		if (ls_groups[i].handle == h)
+			return &ls_groups[i];
+	}
+	return NULL;
+}
+
+static struct ls_group *find_group_ci(int ci)
+{
+	int i;
+
+	for (i = 0; i < ls_group_count; i++) {
+		if (ls_groups[i].client == ci)
+			return &ls_groups[i];
+	}
+	return NULL;
+}
+
+static struct lockspace *find_group_ls(struct ls_group *g, const char *name)
+{
+	struct lockspace *ls;
+
+	list_for_each_entry(ls, &lockspaces, list) {
+		if (ls->group == g && !strcmp(ls->name, name))
+			return ls;
+	}
+	return NULL;
+}
+
+static struct lockspace *find_group_ls_id(struct ls_group *g, uint32_t id)
+{
+	struct lockspace *ls;
+
+	list_for_each_entry(ls, &lockspaces, list) {
+		if (ls->group == g && ls->global_id == id)
+			return ls;
+	}
+	return NULL;
+}
+
+static struct group_space *get_group_space(struct ls_group *g,
+					   const char *name, int create)
+{
+	struct group_space *gs;
+
+	list_for_each_entry(gs, &g->spaces, list) {
+		if (!strcmp(gs->name, name))
+			return gs;
+	}
+
+	if (!create)
+		return NULL;
+
+	gs = malloc(sizeof(struct group_space));
+	if (!gs) {
+		log_error("get_group_space no memory");
+		return NULL;
+	}
+	memset(gs, 0, sizeof(struct group_space));
+	snprintf(gs->name, sizeof(gs->name), "%s", name);
+	list_add_tail(&gs->list, &g->spaces);
+	return gs;
+}
+
+static int space_has(struct group_space *gs, int nodeid)
+{
+	int i;
+
+	for (i = 0; i < gs->member_count; i++) {
+		if (gs->members[i] == nodeid)
+			return 1;
+	}
+	return 0;
+}
+
+static void space_add(struct group_space *gs, int nodeid)
+{
+	if (space_has(gs, nodeid) || gs->member_count == MAX_NODES)
+		return;
+	gs->members[gs->member_count++] = nodeid;
+}
+
+static int space_remove(struct group_space *gs, int nodeid)
+{
+	int i;
+
+	for (i = 0; i < gs->member_count; i++) {
+		if (gs->members[i] != nodeid)
+			continue;
+		gs->members[i] = gs->members[--gs->member_count];
+		return 1;
+	}
+	return 0;
+}
+
+static void space_put(struct group_space *gs)
+{
+	if (gs->member_count)
+		return;
+	list_del(&gs->list);
+	free(gs);
+}
+
+/* pass a lockspace change made in the group to the lockspace */
+
+static void space_confchg(struct group_space *gs, struct lockspace *ls,
+			  const struct cpg_address *left_list,
+			  size_t left_list_entries,
+			  const struct cpg_address *joined_list,
+			  size_t joined_list_entries)
+{
+	struct cpg_address member_list[MAX_NODES];
+	struct cpg_name name;
+	int i;
+
+	memset(member_list, 0, sizeof(member_list));
+	for (i = 0; i < gs->member_count; i++)
+		member_list[i].nodeid = gs->members[i];
+
+	memset(&name, 0, sizeof(name));
+	snprintf(name.value, sizeof(name.value), "dlm:ls:%s", ls->name);
+	name.length = strlen(name.value) + 1;
+
+	log_config(&name, member_list, gs->member_count,
+		   left_list, left_list_entries,
+		   joined_list, joined_list_entries);
+
+	ls_confchg(ls, member_list, gs->member_count,
+		   left_list, left_list_entries,
+		   joined_list, joined_list_entries);
+}
+
+static void send_ls_join_leave(struct lockspace *ls, int type)
+{
+	struct dlm_header *hd;
+	char buf[sizeof(struct dlm_header) + DLM_LOCKSPACE_LEN + 1];
+
+	memset(buf, 0, sizeof(buf));
+	hd = (struct dlm_header *)buf;
+	hd->type = type;
+	memcpy(buf + sizeof(struct dlm_header), ls->name,
+	       strlen(ls->name));
+
+	log_group(ls, "send %s group %d", msg_name(type), ls->group->num);
+
+	dlm_send_message(ls, buf, sizeof(buf));
+}
+
+/* tell nodes joining the group which of its lockspaces we're in */
+
+static void send_ls_members(struct ls_group *g)
+{
+	struct group_space *gs;
+	struct dlm_header *hd;
+	char *buf, *p;
+	int count = 0, len;
+
+	list_for_each_entry(gs, &g->spaces, list) {
+		if (space_has(gs, our_nodeid))
+			count++;
+	}
+
+	len = sizeof(struct dlm_header) + count * (DLM_LOCKSPACE_LEN + 1);
+
+	buf = malloc(len);
+	if (!buf) {
+		log_error("send_ls_members no memory");
+		return;
+	}
+	memset(buf, 0, len);
+
+	hd = (struct dlm_header *)buf;
+	hd->type = DLM_MSG_LS_MEMBERS;
+	hd->msgdata = count;
+
+	p = buf + sizeof(struct dlm_header);
+	list_for_each_entry(gs, &g->spaces, list) {
+		if (!space_has(gs, our_nodeid))
+			continue;
+		memcpy(p, gs->name, strlen(gs->name));
+		p += DLM_LOCKSPACE_LEN + 1;
+	}
+
+	log_debug("%s send ls_members count %d", g->name.value, count);
+
+	dlm_send_group_message(g->handle, 0, buf, len);
+	free(buf);
+}
+
+static void group_synced(struct ls_group *g)
+{
+	struct lockspace *ls;
+
+	log_debug("%s synced", g->name.value);
+	g->synced = 1;
+
+	list_for_each_entry(ls, &lockspaces, list) {
+		if (ls->group != g || !ls->group_join_wait)
+			continue;
+		ls->group_join_wait = 0;
+		send_ls_join_leave(ls, DLM_MSG_LS_JOIN);
+	}
+}
+
+static void receive_ls_join_leave(struct ls_group *g, struct dlm_header *hd,
+				  int len);
+
+static void save_group_message(struct ls_group *g, struct dlm_header *hd,
+			       int len)
+{
+	struct group_msg *gm;
+
+	gm = malloc(sizeof(struct group_msg) + len);
+	if (!gm) {
+		log_error("%s save %s no memory", g->name.value,
+			  msg_name(hd->type));
+		return;
+	}
+	memset(gm, 0, sizeof(struct group_msg) + len);
+
+	memcpy(&gm->buf, hd, len);
+	gm->len = len;
+	gm->nodeid = hd->nodeid;
+
+	log_debug("%s save %s from %d", g->name.value, msg_name(hd->type),
+		  hd->nodeid);
+
+	list_add_tail(&gm->list, &g->saved);
+}
+
+/* apply = 0 when the node left the group, which removed it from all
+   lockspaces, so anything it sent before leaving no longer matters */
+
+static void process_saved_group(struct ls_group *g, int nodeid, int apply)
+{
+	struct group_msg *gm, *safe;
+
+	list_for_each_entry_safe(gm, safe, &g->saved, list) {
+		if (gm->nodeid != nodeid)
+			continue;
+		list_del(&gm->list);
+		if (apply)
+			receive_ls_join_leave(g, (struct dlm_header *)gm->buf,
+					      gm->len);
+		free(gm);
+	}
+}
+
+static void group_sync_done(struct ls_group *g, int nodeid, int apply)
+{
+	int i;
+
+	if (g->synced)
+		return;
+
+	for (i = 0; i < g->sync_count; i++) {
+		if (g->sync_nodes[i] != nodeid)
+			continue;
+		g->sync_nodes[i] = g->sync_nodes[--g->sync_count];
+		break;
+	}
+
+	process_saved_group(g, nodeid, apply);
+
+	if (!g->sync_count)
+		group_synced(g);
+}
+
+static int group_sync_wait(struct ls_group *g, int nodeid)
+{
+	int i;
+
+	if (g->synced)
+		return 0;
+
+	for (i = 0; i < g->sync_count; i++) {
+		if (g->sync_nodes[i] == nodeid)
+			return 1;
+	}
+	return 0;
+}
+
+static void receive_ls_members(struct ls_group *g, struct dlm_header *hd,
+			       int len)
+{
+	struct group_space *gs;
+	char name[DLM_LOCKSPACE_LEN+1];
+	char *p;
+	int i, count = hd->msgdata;
+
+	if (!group_sync_wait(g, hd->nodeid))
+		return;
+
+	if (len < sizeof(struct dlm_header) + count * (DLM_LOCKSPACE_LEN + 1)) {
+		log_error("%s ls_members from %d bad len %d count %d",
+			  g->name.value, hd->nodeid, len, count);
+		return;
+	}
+
+	log_debug("%s receive ls_members from %d count %d",
+		  g->name.value, hd->nodeid, count);
+
+	p = (char *)hd + sizeof(struct dlm_header);
+	for (i = 0; i < count; i++) {
+		memset(name, 0, sizeof(name));
+		memcpy(name, p, DLM_LOCKSPACE_LEN);
+		p += DLM_LOCKSPACE_LEN + 1;
+
+		gs = get_group_space(g, name, 1);
+		if (gs)
+			space_add(gs, hd->nodeid);
+	}
+
+	group_sync_done(g, hd->nodeid, 1);
+}
+
+static void receive_ls_join_leave(struct ls_group *g, struct dlm_header *hd,
+				  int len)
+{
+	struct group_space *gs;
+	struct lockspace *ls;
+	struct cpg_address addr;
+	char name[DLM_LOCKSPACE_LEN+1];
+	int nodeid = hd->nodeid;
+
+	if (len < sizeof(struct dlm_header) + DLM_LOCKSPACE_LEN + 1) {
+		log_error("%s %s from %d bad len %d", g->name.value,
+			  msg_name(hd->type), nodeid, len);
+		return;
+	}
+
+	memset(name, 0, sizeof(name));
+	memcpy(name, (char *)hd + sizeof(struct dlm_header), DLM_LOCKSPACE_LEN);
+
+	gs = get_group_space(g, name, hd->type == DLM_MSG_LS_JOIN);
+	if (!gs)
+		return;
+
+	if (hd->type == DLM_MSG_LS_JOIN) {
+		if (space_has(gs, nodeid)) {
+			log_error("%s ls_join %s from member %d",
+				  g->name.value, name, nodeid);
+			return;
+		}
+		space_add(gs, nodeid);
+	} else {
+		if (!space_remove(gs, nodeid)) {
+			log_error("%s ls_leave %s from non-member %d",
+				  g->name.value, name, nodeid);
+			space_put(gs);
+			return;
+		}
+	}
+
+	ls = find_group_ls(g, name);
+
+	if (ls && nodeid == our_nodeid && hd->type == DLM_MSG_LS_JOIN)
+		ls->group_joined = 1;
+
+	if (ls && ls->group_joined) {
+		memset(&addr, 0, sizeof(addr));
+		addr.nodeid = nodeid;
+
+		if (hd->type == DLM_MSG_LS_JOIN) {
+			addr.reason = CPG_REASON_JOIN;
+			space_confchg(gs, ls, NULL, 0, &addr, 1);
+		} else {
+			addr.reason = CPG_REASON_LEAVE;
+			space_confchg(gs, ls, &addr, 1, NULL, 0);
+		}
+	}
+
+	space_put(gs);
+}
+
+static void deliver_cb_group(cpg_handle_t handle,
+			     const struct cpg_name *group_name,
+			     uint32_t nodeid, uint32_t pid,
+			     void *data, size_t len)
+{
+	struct ls_group *g;
+	struct lockspace *ls;
+	struct dlm_header *hd;
+	int rv;
+
+	g = find_group_handle(handle);
+	if (!g) {
+		log_error("deliver_cb_group no group for cpg %s",
+			  group_name->value);
+		return;
+	}
+
+	if (len < sizeof(struct dlm_header)) {
+		log_error("deliver_cb_group short message %zd", len);
+		return;
+	}
+
+	hd = (struct dlm_header *)data;
+	dlm_header_in(hd);
+	metrics_recv(hd->type, len);
+
+	rv = dlm_header_validate(hd, nodeid);
+	if (rv < 0)
+		return;
+
+	switch (hd->type) {
+	case DLM_MSG_LS_MEMBERS:
+		receive_ls_members(g, hd, len);
+		return;
+	case DLM_MSG_LS_JOIN:
+	case DLM_MSG_LS_LEAVE:
+		if (group_sync_wait(g, hd->nodeid))
+			save_group_message(g, hd, len);
+		else
+			receive_ls_join_leave(g, hd, len);
+		return;
+	}
+
+	ls = find_group_ls_id(g, hd->global_id);
+	if (!ls || !ls->group_joined)
+		return;
+
+	receive_ls_cpg_message(ls, hd, nodeid, len);
+}
+
+static void confchg_cb_group(cpg_handle_t handle,
+			     const struct cpg_name *group_name,
+			     const struct cpg_address *member_list,
+			     size_t member_list_entries,
+			     const struct cpg_address *left_list,
+			     size_t left_list_entries,
+			     const struct cpg_address *joined_list,
+			     size_t joined_list_entries)
+{
+	struct cpg_address space_left[MAX_NODES];
+	struct group_space *gs, *safe;
+	struct ls_group *g;
+	struct lockspace *ls;
+	int i, count, we_joined = 0;
+
+	log_config(group_name, member_list, member_list_entries,
+		   left_list, left_list_entries,
+		   joined_list, joined_list_entries);
+
+	g = find_group_handle(handle);
+	if (!g) {
+		log_error("confchg_cb_group no group for cpg %s",
+			  group_name->value);
+		return;
+	}
+
+	for (i = 0; i < joined_list_entries; i++) {
+		if (joined_list[i].nodeid == our_nodeid &&
+		    joined_list[i].pid == getpid())
+			we_joined = 1;
+	}
+
+	if (we_joined) {
+		g->joined = 1;
+		g->sync_count = 0;
+		for (i = 0; i < member_list_entries; i++) {
+			if (member_list[i].nodeid == our_nodeid)
+				continue;
+			g->sync_nodes[g->sync_count++] = member_list[i].nodeid;
+		}
+		/* others joining with us are waiting to hear from us */
+		if (g->sync_count)
+			send_ls_members(g);
+		else
+			group_synced(g);
+		return;
+	}
+
+	if (!g->joined)
+		return;
+
+	/* nodes leaving the group leave all their lockspaces */
+
+	list_for_each_entry_safe(gs, safe, &g->spaces, list) {
+		count = 0;
+		for (i = 0; i < left_list_entries; i++) {
+			if (space_remove(gs, left_list[i].nodeid))
+				space_left[count++] = left_list[i];
+		}
+		if (!count)
+			continue;
+
+		ls = find_group_ls(g, gs->name);
+		if (ls && ls->group_joined)
+			space_confchg(gs, ls, space_left, count, NULL, 0);
+
+		space_put(gs);
+	}
+
+	for (i = 0; i < left_list_entries; i++)
+		group_sync_done(g, left_list[i].nodeid, 0);
+
+	if (joined_list_entries)
+		send_ls_members(g);
+}
+
+static void totem_cb_group(cpg_handle_t handle,
+			   struct cpg_ring_id ring_id,
+			   uint32_t member_list_entries,
+			   const uint32_t *member_list)
+{
+	struct ls_group *g;
+	struct lockspace *ls, *safe;
+
+	g = find_group_handle(handle);
+	if (!g) {
+		log_error("totem_cb_group no group for handle");
+		return;
+	}
+
+	log_ringid(g->name.value, &ring_id, member_list, member_list_entries);
+
+	g->ringid.nodeid = ring_id.nodeid;
+	g->ringid.seq = ring_id.seq;
+
+	list_for_each_entry_safe(ls, safe, &lockspaces, list) {
+		if (ls->group != g)
+			continue;
+		ls->cpg_ringid.nodeid = ring_id.nodeid;
+		ls->cpg_ringid.seq = ring_id.seq;
+		ls->cpg_ringid_wait = 0;
+		apply_changes(ls);
+	}
+}
+
+static cpg_model_v1_data_t cpg_callbacks_group = {
+	.cpg_deliver_fn = deliver_cb_group,
+	.cpg_confchg_fn = confchg_cb_group,
+	.cpg_totem_confchg_fn = totem_cb_group,
+	.flags = CPG_MODEL_V1_DELIVER_INITIAL_TOTEM_CONF,
+};
+
+static void process_ls_group(int ci)
+{
+	struct ls_group *g;
+	cs_error_t error;
+
+	g = find_group_ci(ci);
+	if (!g) {
+		log_error("process_ls_group no group for ci %d", ci);
+		return;
+	}
+
+	/* as process_cpg_lockspace */
+	do {
+		error = cpg_dispatch(g->handle, CS_DISPATCH_ONE_NONBLOCKING);
+	} while (error == CS_OK && client_more());
+
+	if (error != CS_OK && error != CS_ERR_BAD_HANDLE &&
+	    error != CS_ERR_TRY_AGAIN)
+		log_error("cpg_dispatch error %d", error);
+}
+
+int setup_ls_groups(void)
+{
+	struct ls_group *g;
+	cs_error_t error;
+	int i, j, fd;
+
+	ls_group_count = opt(ls_cpg_groups_ind);
+	if (ls_group_count <= 0) {
+		ls_group_count = 0;
+		return 0;
+	}
+	if (ls_group_count > MAX_LS_CPG_GROUPS) {
+		log_error("ls_cpg_groups %d reduced to %d",
+			  ls_group_count, MAX_LS_CPG_GROUPS);
+		ls_group_count = MAX_LS_CPG_GROUPS;
+	}
+
+	ls_groups = malloc(ls_group_count * sizeof(struct ls_group));
+	if (!ls_groups) {
+		ls_group_count = 0;
+		return -ENOMEM;
+	}
+	memset(ls_groups, 0, ls_group_count * sizeof(struct ls_group));
+
+	for (i = 0; i < ls_group_count; i++) {
+		g = &ls_groups[i];
+		g->num = i;
+		g->client = -1;
+		INIT_LIST_HEAD(&g->spaces);
+		INIT_LIST_HEAD(&g->saved);
+
+		error = cpg_model_initialize(&g->handle, CPG_MODEL_V1,
+				(cpg_model_data_t *)&cpg_callbacks_group, NULL);
+		if (error != CS_OK) {
+			log_error("group cpg_model_initialize error %d", error);
+			return -1;
+		}
+
+		cpg_fd_get(g->handle, &fd);
+		g->client = client_add(fd, process_ls_group, NULL);
+
+		sprintf(g->name.value, "dlm:ls:group:%d", i);
+		g->name.length = strlen(g->name.value) + 1;
+
+		log_debug("cpg_join %s ...", g->name.value);
+		j = 0;
+ retry:
+		error = cpg_join(g->handle, &g->name);
+		if (error == CS_ERR_TRY_AGAIN) {
+			sleep(1);
+			if (!(++j % 10))
+				log_error("group cpg_join error retrying");
+			goto retry;
+		}
+		if (error != CS_OK) {
+			log_error("group cpg_join error %d", error);
+			return -1;
+		}
+	}
+	return 0;
+}
+
+void close_ls_groups(void)
+{
+	struct group_space *gs, *safe;
+	struct group_msg *gm, *gm_safe;
+	int i;
+
+	for (i = 0; i < ls_group_count; i++) {
+		if (ls_groups[i].handle)
+			cpg_finalize(ls_groups[i].handle);
+
+		list_for_each_entry_safe(gs, safe, &ls_groups[i].spaces, list) {
+			list_del(&gs->list);
+			free(gs);
+		}
+
+		list_for_each_entry_safe(gm, gm_safe, &ls_groups[i].saved, list) {
+			list_del(&gm->list);
+			free(gm);
+		}
+	}
+	free(ls_groups);
+	ls_groups = NULL;
+	ls_group_count = 0;
+}
+
+static int join_lockspace_group(struct lockspace *ls)
+{
+	struct ls_group *g = &ls_groups[ls->global_id % ls_group_count];
+
+	list_add(&ls->list, &lockspaces);
+
+	ls->group = g;
+	ls->cpg_handle = g->handle;
+	ls->cpg_client = -1;
+	ls->cpg_fd = -1;
+	ls->cpg_ringid = g->ringid;
+	ls->kernel_stopped = 1;
+	ls->need_plocks = 1;
+	ls->joining = 1;
+
+	if (g->synced) {
+		send_ls_join_leave(ls, DLM_MSG_LS_JOIN);
+	} else {
+		log_group(ls, "wait for %s sync", g->name.value);
+		ls->group_join_wait = 1;
+	}
+	return 0;
+}
+
+static int leave_lockspace_group(struct lockspace *ls)
+{
+	struct cpg_address addr;
+
+	/* our ls_join was never sent, so nobody else has seen us */
+
+	if (ls->group_join_wait) {
+		memset(&addr, 0, sizeof(addr));
+		addr.nodeid = our_nodeid;
+		addr.reason = CPG_REASON_LEAVE;
+		ls_confchg(ls, NULL, 0, &addr, 1, NULL, 0);
+		return 0;
+	}
+
+	send_ls_join_leave(ls, DLM_MSG_LS_LEAVE);
+	return 0;
+}
+
+/* received an "online" uevent from dlm-kernel */
+
+int dlm_join_lockspace(struct lockspace *ls)
+{
+	cs_error_t error;
+	cpg_handle_t h;
+	struct cpg_name name;
+	struct ls_action act;
 	int i = 0, fd, ci, rv;
 
+	if (ls_group_count) {
+		memset(&name, 0, sizeof(name));
+		sprintf(name.value, "dlm:ls:%s", ls->name);
+		name.length = strlen(name.value) + 1;
+		ls->global_id = cpgname_to_crc(name.value, name.length);
+
+		return join_lockspace_group(ls);
+	}
+
 	error = cpg_model_initialize(&h, CPG_MODEL_V1,
 				     (cpg_model_data_t *)&cpg_callbacks, NULL);
 	if (error != CS_OK) {
@@ -1730,7 +2913,10 @@ int dlm_join_lockspace(struct lockspace *ls)
 	client_dead(ci);
 	cpg_finalize(h);
  fail_free:
-	set_sysfs_event_done(ls->name, rv);
+	init_action(&act, ls->name);
+	act.flags = ACT_EVENT_DONE;
+	act.event_done = rv;
+	queue_action(NULL, &act);
 	free_ls(ls);
 	return rv;
 }
@@ -1745,6 +2931,9 @@ int dlm_leave_lockspace(struct lockspace *ls)
 
 	ls->leaving = 1;
 
+	if (ls->group)
+		return leave_lockspace_group(ls);
+
 	memset(&name, 0, sizeof(name));
 	sprintf(name.value, "dlm:ls:%s", ls->name);
 	name.length = strlen(name.value) + 1;
@@ -1774,7 +2963,7 @@ int set_fs_notified(struct lockspace *ls, int nodeid)
 		return -ESRCH;
 	}
 
-	if (!find_memb(ls->started_change, nodeid)) {
+	if (!find_memb(ls, ls->started_change, nodeid)) {
 		log_group(ls, "set_fs_notified %d not in ls", nodeid);
 		return 0;
 	}
@@ -1845,6 +3034,100 @@ int set_lockspace_info(struct lockspace *ls, struct dlmc_lockspace *lockspace)
 	return 0;
 }
 
+static const char *phase_names[CG_PHASES] = {
+	"confchg", "ringid", "quorum", "fencing",
+	"fsdone", "messages", "kernel", "plocks",
+};
+
+/* One line per change: the confchg monotonic time in seconds, then the
+   ms after it that each phase was passed, or - if it was not (yet). */
+
+static int format_timeline(struct cg_timeline *tl, const char *state,
+			   char *buf, int len)
+{
+	uint64_t t0 = tl->phase_usec[CG_PHASE_CONFCHG];
+	int i, ret, pos = 0;
+
+	ret = snprintf(buf, len,
+		       "seq %u,%u member %d joined %d remove %d failed %d %s "
+		       "confchg %llu.%03llu",
+		       tl->combined_seq, tl->seq, tl->member_count,
+		       tl->joined_count, tl->remove_count, tl->failed_count,
+		       state, (unsigned long long)(t0 / 1000000),
+		       (unsigned long long)(t0 % 1000000 / 1000));
+	if (ret >= len)
+		return -ENOSPC;
+	pos += ret;
+
+	for (i = CG_PHASE_CONFCHG + 1; i < CG_PHASES; i++) {
+		if (tl->phase_usec[i])
+			ret = snprintf(buf + pos, len - pos, " %s %llu",
+				       phase_names[i],
+				       (unsigned long long)
+				       ((tl->phase_usec[i] - t0) / 1000));
+		else
+			ret = snprintf(buf + pos, len - pos, " %s -",
+				       phase_names[i]);
+		if (ret >= len - pos)
+			return -ENOSPC;
+		pos += ret;
+	}
+
+	ret = snprintf(buf + pos, len - pos, "\n");
+	if (ret >= len - pos)
+		return -ENOSPC;
+	pos += ret;
+
+	return pos;
+}
+
+/* Recent changes oldest first, followed by the change being applied. */
+
+int copy_recovery_timeline(struct lockspace *ls, char *buf, int *len_out)
+{
+	struct change *cg, *last = NULL;
+	struct cg_timeline cur;
+	uint32_t i, start;
+	int len = DLMC_DUMP_SIZE, pos = 0, ret;
+
+	start = 0;
+	if (ls->recovery_hist_count > RECOVERY_HIST_LEN)
+		start = ls->recovery_hist_count - RECOVERY_HIST_LEN;
+
+	for (i = start; i < ls->recovery_hist_count; i++) {
+		ret = format_timeline(&ls->recovery_hist[i % RECOVERY_HIST_LEN],
+				      "done", buf + pos, len - pos);
+		if (ret < 0)
+			goto out;
+		pos += ret;
+	}
+
+	if (list_empty(&ls->changes))
+		goto out;
+
+	list_for_each_entry(cg, &ls->changes, list)
+		last = cg;
+
+	cg = list_first_entry(&ls->changes, struct change, list);
+
+	memset(&cur, 0, sizeof(cur));
+	cur.seq = cg->seq;
+	cur.combined_seq = last->seq;
+	cur.member_count = cg->member_count;
+	cur.joined_count = cg->joined_count;
+	cur.remove_count = cg->remove_count;
+	cur.failed_count = cg->failed_count;
+	memcpy(cur.phase_usec, cg->phase_usec, sizeof(cur.phase_usec));
+
+	ret = format_timeline(&cur, "wait", buf + pos, len - pos);
+	if (ret < 0)
+		goto out;
+	pos += ret;
+ out:
+	*len_out = pos;
+	return 0;
+}
+
 static int _set_node_info(struct lockspace *ls, struct change *cg, int nodeid,
 			  struct dlmc_node *node)
 {
@@ -1854,7 +3137,7 @@ static int _set_node_info(struct lockspace *ls, struct change *cg, int nodeid,
 	node->nodeid = nodeid;
 
 	if (cg)
-		m = find_memb(cg, nodeid);
+		m = find_memb(ls, cg, nodeid);
 	if (!m)
 		goto history;
 
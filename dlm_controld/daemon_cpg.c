@@ -76,6 +76,11 @@ struct node_daemon {
 	int fence_pid;
 	int fence_pid_wait;
 	int fence_result_wait;
+	int fence_pids[FENCE_CONFIG_DEVS_MAX];	/* parallel agents running */
+	int fence_pid_ci[FENCE_CONFIG_DEVS_MAX];	/* pidfd client or -1 */
+	int fence_pid_count;
+	int fence_pid_result;	/* first failure among the agents */
+	uint64_t fence_pid_start;
 	int fence_actor_done; /* for status/debug */
 	int fence_actor_last; /* for status/debug */
 	int fence_actors[MAX_NODES];
@@ -114,12 +119,19 @@ static int fence_in_progress_unknown = 1;
 
 #define MAX_ZOMBIES 16
 static int zombie_pids[MAX_ZOMBIES];
+static int zombie_ci[MAX_ZOMBIES];	/* pidfd client or -1 */
 static int zombie_count;
 
 static int fence_result_pid;
 static unsigned int fence_result_try;
 static int stateful_merge_wait; /* cluster is stuck in waiting for manual intervention */
 
+/* metrics, fencing done by this node as actor */
+static uint64_t fence_ok_count;
+static uint64_t fence_fail_count;
+static uint64_t fence_sum_sec;
+static uint64_t fence_last_sec;
+
 static void send_fence_result(int nodeid, int result, uint32_t flags, uint64_t walltime);
 static void send_fence_clear(int nodeid, int result, uint32_t flags, uint64_t walltime);
 
@@ -231,6 +243,12 @@ const char *msg_name(int type)
 		return "fence_result";
 	case DLM_MSG_FENCE_CLEAR:
 		return "fence_clear";
+	case DLM_MSG_LS_JOIN:
+		return "ls_join";
+	case DLM_MSG_LS_LEAVE:
+		return "ls_leave";
+	case DLM_MSG_LS_MEMBERS:
+		return "ls_members";
 
 	case DLM_MSG_START:
 		return "start";
@@ -252,10 +270,12 @@ const char *msg_name(int type)
 		return "deadlk_cycle_start";
 	case DLM_MSG_DEADLK_CYCLE_END:
 		return "deadlk_cycle_end";
-	case DLM_MSG_DEADLK_CHECKPOINT_READY:
-		return "deadlk_checkpoint_ready";
+	case DLM_MSG_DEADLK_LOCKS:
+		return "deadlk_locks";
 	case DLM_MSG_DEADLK_CANCEL_LOCK:
 		return "deadlk_cancel_lock";
+	case DLM_MSG_DEADLK_TRANS:
+		return "deadlk_trans";
 	default:
 		return "unknown";
 	}
@@ -290,12 +310,19 @@ static int _send_message(cpg_handle_t h, void *buf, int len, int type)
 		log_debug("cpg_mcast_joined retried %d %s",
 			  retries, msg_name(type));
 
+	metrics_send(type, len, retries);
 	return 0;
 }
 
 /* header fields caller needs to set: type, to_nodeid, flags, msgdata */
 
 void dlm_send_message(struct lockspace *ls, char *buf, int len)
+{
+	dlm_send_group_message(ls->cpg_handle, ls->global_id, buf, len);
+}
+
+void dlm_send_group_message(cpg_handle_t h, uint32_t global_id,
+			    char *buf, int len)
 {
 	struct dlm_header *hd = (struct dlm_header *) buf;
 	int type = hd->type;
@@ -306,12 +333,12 @@ void dlm_send_message(struct lockspace *ls, char *buf, int len)
 	hd->type	= cpu_to_le16(hd->type);
 	hd->nodeid      = cpu_to_le32(our_nodeid);
 	hd->to_nodeid   = cpu_to_le32(hd->to_nodeid);
-	hd->global_id   = cpu_to_le32(ls->global_id);
+	hd->global_id   = cpu_to_le32(global_id);
 	hd->flags       = cpu_to_le32(hd->flags);
 	hd->msgdata     = cpu_to_le32(hd->msgdata);
 	hd->msgdata2    = cpu_to_le32(hd->msgdata2);
 
-	_send_message(ls->cpg_handle, buf, len, type);
+	_send_message(h, buf, len, type);
 }
 
 void dlm_header_in(struct dlm_header *hd)
@@ -461,7 +488,7 @@ static struct node_daemon *add_node_daemon(int nodeid)
 {
 	struct node_daemon *node;
 	struct fence_config *fc;
-	int rv;
+	int i, rv;
 
 	node = get_node_daemon(nodeid);
 	if (node)
@@ -474,6 +501,8 @@ static struct node_daemon *add_node_daemon(int nodeid)
 	}
 	memset(node, 0, sizeof(struct node_daemon));
 	node->nodeid = nodeid;
+	for (i = 0; i < FENCE_CONFIG_DEVS_MAX; i++)
+		node->fence_pid_ci[i] = -1;
 	list_add_tail(&node->list, &daemon_nodes);
 
 	/* TODO: allow the config to be reread */
@@ -623,39 +652,205 @@ static void clear_zombies(void)
 		log_debug("cleared zombie %d rv %d result %d",
 			  zombie_pids[i], rv, result);
 
+		if (zombie_ci[i] != -1)
+			client_dead(zombie_ci[i]);
 		zombie_pids[i] = 0;
 		zombie_count--;
 	}
 }
 
-static void add_zombie(int pid)
+/* a killed agent that has not exited yet; its pidfd client, if any, now
+   belongs to the zombie and wakes us to collect it */
+
+static void add_zombie(int pid, int ci)
 {
 	int i;
 
 	for (i = 0; i < MAX_ZOMBIES; i++) {
 		if (!zombie_pids[i]) {
 			zombie_pids[i] = pid;
+			zombie_ci[i] = ci;
 			zombie_count++;
 			return;
 		}
 	}
+
+	log_error("add_zombie pid %d no room", pid);
+	if (ci != -1)
+		client_dead(ci);
+}
+
+static void daemon_fence_work(void);
+
+/* the agent's pidfd is readable when it exits; the result is collected
+   by daemon_fence_work, or by clear_zombies for an agent we killed */
+
+static void fence_pidfd_work(int ci)
+{
+	struct node_daemon *node;
+	int i;
+
+	for (i = 0; i < MAX_ZOMBIES; i++) {
+		if (zombie_pids[i] && zombie_ci[i] == ci) {
+			clear_zombies();
+			return;
+		}
+	}
+
+	list_for_each_entry(node, &daemon_nodes, list) {
+		for (i = 0; i < node->fence_pid_count; i++) {
+			if (node->fence_pid_ci[i] == ci)
+				node->fence_pid_ci[i] = -1;
+		}
+	}
+	client_dead(ci);
+
+	daemon_fence_work();
+}
+
+static void clear_fence_agent(struct node_daemon *node, int i)
+{
+	if (node->fence_pid_ci[i] != -1) {
+		client_dead(node->fence_pid_ci[i]);
+		node->fence_pid_ci[i] = -1;
+	}
+	node->fence_pids[i] = 0;
+}
+
+/* kill all the agents first, then collect the ones that have exited
+   already; the rest are left as zombies for clear_zombies, without
+   waiting for them here */
+
+static void cancel_fence_agents(struct node_daemon *node)
+{
+	int i, rv, result;
+
+	for (i = 0; i < node->fence_pid_count; i++) {
+		if (!node->fence_pids[i])
+			continue;
+		log_debug("cancel_fence_agents nodeid %d pid %d sigkill",
+			  node->nodeid, node->fence_pids[i]);
+		kill(node->fence_pids[i], SIGKILL);
+	}
+
+	for (i = 0; i < node->fence_pid_count; i++) {
+		if (!node->fence_pids[i])
+			continue;
+
+		result = 0;
+		rv = fence_result(node->nodeid, node->fence_pids[i], &result);
+		if (rv == -EAGAIN) {
+			add_zombie(node->fence_pids[i], node->fence_pid_ci[i]);
+			node->fence_pid_ci[i] = -1;
+		}
+
+		log_debug("cancel_fence_agents nodeid %d pid %d rv %d result %d",
+			  node->nodeid, node->fence_pids[i], rv, result);
+		clear_fence_agent(node, i);
+	}
+	node->fence_pid_count = 0;
+	node->fence_pid_result = 0;
+}
+
+/* run the agents for the device at fence_config.pos and the devices
+   parallel to it at the same time, leaving pos at the last of them */
+
+static int start_fence_agents(struct node_daemon *node)
+{
+	struct fence_config *fc = &node->fence_config;
+	int rv, pid, pidfd, n = 0;
+
+	node->fence_pid_count = 0;
+	node->fence_pid_result = 0;
+
+	while (1) {
+		pidfd = -1;
+
+		rv = fence_request(node->nodeid,
+				   node->fail_walltime,
+				   node->fail_monotime,
+				   fc,
+				   node->left_reason,
+				   &pid, &pidfd);
+		if (rv < 0) {
+			cancel_fence_agents(node);
+			return rv;
+		}
+
+		node->fence_pids[n] = pid;
+		node->fence_pid_ci[n] = -1;
+		if (pidfd >= 0)
+			node->fence_pid_ci[n] = client_add(pidfd, fence_pidfd_work, NULL);
+		node->fence_pid_count = ++n;
+
+		if (fence_config_next_parallel(fc) < 0)
+			break;
+	}
+
+	node->fence_pid = node->fence_pids[0];
+	node->fence_pid_start = monotime();
+	return 0;
 }
 
-static void fence_pid_cancel(int nodeid, int pid)
+/*
+ * Returns -EAGAIN while the agents are running.  Otherwise, result is 0
+ * if they all succeeded, or the first failure.  One failing, or running
+ * past fence_agent_timeout, fails them all, and the others are killed.
+ */
+
+static int check_fence_agents(struct node_daemon *node, int *result)
 {
-	int rv, result = 0;
+	int i, rv, res, running = 0;
+
+	for (i = 0; i < node->fence_pid_count; i++) {
+		if (!node->fence_pids[i])
+			continue;
+
+		res = 0;
+		rv = fence_result(node->nodeid, node->fence_pids[i], &res);
+		if (rv == -EAGAIN) {
+			if (!running++)
+				node->fence_pid = node->fence_pids[i];
+			continue;
+		}
+		if (rv < 0)
+			res = rv;
+
+		clear_fence_agent(node, i);
 
-	log_debug("fence_pid_cancel nodeid %d pid %d sigkill", nodeid, pid);
+		if (res && !node->fence_pid_result)
+			node->fence_pid_result = res;
+	}
 
-	kill(pid, SIGKILL);
-	usleep(500000);
+	if (running && !node->fence_pid_result && opt(fence_agent_timeout_ind) &&
+	    monotime() - node->fence_pid_start >= opt(fence_agent_timeout_ind)) {
+		log_error("fence wait %d agents timed out after %d sec",
+			  node->nodeid, opt(fence_agent_timeout_ind));
+		node->fence_pid_result = -ETIMEDOUT;
+	}
 
-	rv = fence_result(nodeid, pid, &result);
-	if (rv == -EAGAIN)
-		add_zombie(pid);
+	if (running && !node->fence_pid_result)
+		return -EAGAIN;
 
-	log_debug("fence_pid_cancel nodeid %d pid %d rv %d result %d",
-		  nodeid, pid, rv, result);
+	*result = node->fence_pid_result;
+	cancel_fence_agents(node);
+	return 0;
+}
+
+/* agents without a pidfd, or with a timeout, need the 1 sec retry */
+
+static int fence_agents_poll(struct node_daemon *node)
+{
+	int i;
+
+	if (opt(fence_agent_timeout_ind))
+		return 1;
+
+	for (i = 0; i < node->fence_pid_count; i++) {
+		if (node->fence_pids[i] && node->fence_pid_ci[i] == -1)
+			return 1;
+	}
+	return 0;
 }
 
 static void kick_stateful_merge_members(void)
@@ -994,12 +1189,7 @@ static void daemon_fence_work(void)
 		log_debug("fence request %d pos %d",
 			  node->nodeid, node->fence_config.pos);
 
-		rv = fence_request(node->nodeid,
-				   node->fail_walltime,
-				   node->fail_monotime,
-				   &node->fence_config,
-				   node->left_reason,
-				   &pid);
+		rv = start_fence_agents(node);
 		if (rv < 0) {
 			send_fence_result(node->nodeid, rv, 0, time(NULL));
 			node->fence_result_wait = 1;
@@ -1007,8 +1197,7 @@ static void daemon_fence_work(void)
 		}
 
 		node->fence_pid_wait = 1;
-		node->fence_pid = pid;
-		daemon_fence_pid = pid;
+		daemon_fence_pid = node->fence_pid;
 	}
 
 	/*
@@ -1062,15 +1251,19 @@ static void daemon_fence_work(void)
 			node->fence_pid = 0;
 			daemon_fence_pid = 0;
 
-			fence_pid_cancel(nodeid, pid);
+			cancel_fence_agents(node);
 			continue;
 		}
 
-		retry = 1;
+		/* otherwise an agent exiting wakes us through its pidfd */
 
-		rv = fence_result(nodeid, pid, &result);
+		if (fence_agents_poll(node))
+			retry = 1;
+
+		rv = check_fence_agents(node, &result);
 		if (rv == -EAGAIN) {
-			/* agent pid is still running */
+			/* agent pids are still running */
+			pid = node->fence_pid;
 
 			if (fence_result_pid != pid) {
 				fence_result_try = 0;
@@ -1086,23 +1279,13 @@ static void daemon_fence_work(void)
 		node->fence_pid = 0;
 		daemon_fence_pid = 0;
 
-		if (rv < 0) {
-			/* shouldn't happen */
-			log_error("fence wait %d pid %d error %d", nodeid, pid, rv);
-			continue;
-		}
-
 		log_debug("fence wait %d pid %d result %d", nodeid, pid, result);
 
 		if (!result) {
-			/* agent exit 0, if there's another agent to run in
-			   parallel, set it to run next, otherwise success */
+			/* agents for all the parallel devices exit 0, success */
 
-			rv = fence_config_next_parallel(&node->fence_config);
-			if (rv < 0) {
-				send_fence_result(nodeid, 0, 0, time(NULL));
-				node->fence_result_wait = 1;
-			}
+			send_fence_result(nodeid, 0, 0, time(NULL));
+			node->fence_result_wait = 1;
 		} else {
 			/* agent exit 1, if there's another agent to run at
 			   next priority, set it to run next, otherwise fail */
@@ -1111,6 +1294,8 @@ static void daemon_fence_work(void)
 			if (rv < 0) {
 				send_fence_result(nodeid, result, 0, time(NULL));
 				node->fence_result_wait = 1;
+			} else {
+				retry = 1;
 			}
 		}
 	}
@@ -1410,6 +1595,16 @@ static void receive_fence_result(struct dlm_header *hd, int len)
 		  (unsigned long long)fr->fence_walltime,
 		  (unsigned long long)now);
 
+	if (hd->nodeid == our_nodeid && fr->result != -ECANCELED) {
+		if (!fr->result) {
+			fence_ok_count++;
+			fence_last_sec = now - node->fail_monotime;
+			fence_sum_sec += fence_last_sec;
+		} else {
+			fence_fail_count++;
+		}
+	}
+
 	if (!fr->result || (fr->result == -ECANCELED)) {
 		node->need_fencing = 0;
 		node->delay_fencing = 0;
@@ -1422,7 +1617,7 @@ static void receive_fence_result(struct dlm_header *hd, int len)
 	}
 
 	if ((fr->result == -ECANCELED) && node->fence_pid_wait && node->fence_pid) {
-		fence_pid_cancel(node->nodeid, node->fence_pid);
+		cancel_fence_agents(node);
 
 		node->fence_pid_wait = 0;
 		node->fence_pid = 0;
@@ -1430,6 +1625,26 @@ static void receive_fence_result(struct dlm_header *hd, int len)
 	}
 }
 
+void write_fence_metrics(FILE *fp)
+{
+	fprintf(fp, "# TYPE dlm_fence_seconds summary\n");
+	fprintf(fp, "# UNIT dlm_fence_seconds seconds\n");
+	fprintf(fp, "# HELP dlm_fence_seconds node failure to fence success, as fence actor\n");
+	fprintf(fp, "dlm_fence_seconds_count %llu\n",
+		(unsigned long long)fence_ok_count);
+	fprintf(fp, "dlm_fence_seconds_sum %llu\n",
+		(unsigned long long)fence_sum_sec);
+
+	fprintf(fp, "# TYPE dlm_fence_last_seconds gauge\n");
+	fprintf(fp, "# UNIT dlm_fence_last_seconds seconds\n");
+	fprintf(fp, "dlm_fence_last_seconds %llu\n",
+		(unsigned long long)fence_last_sec);
+
+	fprintf(fp, "# TYPE dlm_fence_failures counter\n");
+	fprintf(fp, "dlm_fence_failures_total %llu\n",
+		(unsigned long long)fence_fail_count);
+}
+
 static void send_fence_result(int nodeid, int result, uint32_t flags, uint64_t walltime)
 {
 	struct dlm_header *hd;
@@ -1943,6 +2158,7 @@ static void deliver_cb_daemon(cpg_handle_t handle,
 
 	hd = (struct dlm_header *)data;
 	dlm_header_in(hd);
+	metrics_recv(hd->type, len);
 
 	if (!daemon_fence_allow && hd->type != DLM_MSG_PROTOCOL) {
 		/* don't think this will happen; if it does we may
@@ -2277,7 +2493,7 @@ void close_cpg_daemon(void)
 		log_error("daemon cpg_leave error %d", error);
  fin:
 	list_for_each_entry(ls, &lockspaces, list) {
-		if (ls->cpg_handle)
+		if (ls->cpg_handle && !ls->group)
 			cpg_finalize(ls->cpg_handle);
 	}
 	cpg_finalize(cpg_handle_daemon);
@@ -2388,7 +2604,19 @@ static int print_state_daemon(char *str)
 		 "fence_in_progress_unknown=%d "
 		 "zombie_count=%d "
 		 "monotime=%llu "
-		 "stateful_merge_wait=%d ",
+		 "stateful_merge_wait=%d "
+		 "member_calls=%llu "
+		 "member_deferred=%llu "
+		 "member_usec=%llu "
+		 "control_calls=%llu "
+		 "control_deferred=%llu "
+		 "control_usec=%llu "
+		 "plock_calls=%llu "
+		 "plock_deferred=%llu "
+		 "plock_usec=%llu "
+		 "cluster_calls=%llu "
+		 "cluster_deferred=%llu "
+		 "cluster_usec=%llu ",
 		 daemon_member_count,
 		 daemon_joined_count,
 		 daemon_remove_count,
@@ -2399,11 +2627,117 @@ static int print_state_daemon(char *str)
 		 fence_in_progress_unknown,
 		 zombie_count,
 		 (unsigned long long)monotime(),
-		 stateful_merge_wait);
+		 stateful_merge_wait,
+		 (unsigned long long)loop_stats[CLIENT_CLASS_MEMBER].calls,
+		 (unsigned long long)loop_stats[CLIENT_CLASS_MEMBER].deferred,
+		 (unsigned long long)loop_stats[CLIENT_CLASS_MEMBER].usec,
+		 (unsigned long long)loop_stats[CLIENT_CLASS_CONTROL].calls,
+		 (unsigned long long)loop_stats[CLIENT_CLASS_CONTROL].deferred,
+		 (unsigned long long)loop_stats[CLIENT_CLASS_CONTROL].usec,
+		 (unsigned long long)loop_stats[CLIENT_CLASS_PLOCK].calls,
+		 (unsigned long long)loop_stats[CLIENT_CLASS_PLOCK].deferred,
+		 (unsigned long long)loop_stats[CLIENT_CLASS_PLOCK].usec,
+		 (unsigned long long)loop_stats[CLIENT_CLASS_CLUSTER].calls,
+		 (unsigned long long)loop_stats[CLIENT_CLASS_CLUSTER].deferred,
+		 (unsigned long long)loop_stats[CLIENT_CLASS_CLUSTER].usec);
 
 	return strlen(str) + 1;
 }
 
+static void set_node_status(struct node_daemon *node, uint32_t flags,
+			    struct dlmc_node_status *ns)
+{
+	ns->nodeid = node->nodeid;
+	ns->flags = flags;
+
+	if (node->daemon_member)
+		ns->flags |= DLMC_NS_MEMBER;
+	if (node->killed)
+		ns->flags |= DLMC_NS_KILLED;
+	if (node->need_fencing)
+		ns->flags |= DLMC_NS_NEED_FENCING;
+	if (node->delay_fencing)
+		ns->flags |= DLMC_NS_DELAY_FENCING;
+	if (node->fence_result_wait)
+		ns->flags |= DLMC_NS_RESULT_WAIT;
+
+	ns->fence_pid = node->fence_pid;
+	ns->fence_actor_last = node->fence_actor_last;
+	ns->fence_actor_done = node->fence_actor_done;
+	strncpy(ns->left_reason, reason_str(node->left_reason),
+		sizeof(ns->left_reason) - 1);
+	ns->add_time = node->daemon_add_time;
+	ns->rem_time = node->daemon_rem_time;
+	ns->fail_walltime = node->fail_walltime;
+	ns->fail_monotime = node->fail_monotime;
+	ns->fence_walltime = node->fence_walltime;
+	ns->fence_monotime = node->fence_monotime;
+}
+
+/* a dlmc_daemon_status followed by a dlmc_node_status for each node */
+
+int set_daemon_status(char **buf_out, int *len_out)
+{
+	struct dlmc_daemon_status *ds;
+	struct dlmc_node_status *ns;
+	struct node_daemon *node;
+	int node_count = 0;
+	int len;
+
+	list_for_each_entry(node, &daemon_nodes, list)
+		node_count++;
+	list_for_each_entry(node, &startup_nodes, list)
+		node_count++;
+
+	len = sizeof(struct dlmc_daemon_status) +
+	      node_count * sizeof(struct dlmc_node_status);
+
+	ds = malloc(len);
+	if (!ds)
+		return -ENOMEM;
+	memset(ds, 0, len);
+
+	ds->version = DLMC_STATUS_VERSION;
+	ds->size = sizeof(struct dlmc_daemon_status);
+	ds->node_size = sizeof(struct dlmc_node_status);
+	ds->node_count = node_count;
+	ds->our_nodeid = our_nodeid;
+	ds->quorate = cluster_quorate;
+	ds->cluster_ringid = cluster_ringid_seq;
+	ds->daemon_ringid = daemon_ringid.seq;
+	ds->monotime = monotime();
+	ds->member_count = daemon_member_count;
+	ds->joined_count = daemon_joined_count;
+	ds->remove_count = daemon_remove_count;
+	ds->zombie_count = zombie_count;
+	ds->fence_pid = daemon_fence_pid;
+	ds->fence_in_progress_unknown = fence_in_progress_unknown;
+	ds->stateful_merge_wait = stateful_merge_wait;
+	ds->member_calls = loop_stats[CLIENT_CLASS_MEMBER].calls;
+	ds->member_deferred = loop_stats[CLIENT_CLASS_MEMBER].deferred;
+	ds->member_usec = loop_stats[CLIENT_CLASS_MEMBER].usec;
+	ds->control_calls = loop_stats[CLIENT_CLASS_CONTROL].calls;
+	ds->control_deferred = loop_stats[CLIENT_CLASS_CONTROL].deferred;
+	ds->control_usec = loop_stats[CLIENT_CLASS_CONTROL].usec;
+	ds->plock_calls = loop_stats[CLIENT_CLASS_PLOCK].calls;
+	ds->plock_deferred = loop_stats[CLIENT_CLASS_PLOCK].deferred;
+	ds->plock_usec = loop_stats[CLIENT_CLASS_PLOCK].usec;
+	ds->cluster_calls = loop_stats[CLIENT_CLASS_CLUSTER].calls;
+	ds->cluster_deferred = loop_stats[CLIENT_CLASS_CLUSTER].deferred;
+	ds->cluster_usec = loop_stats[CLIENT_CLASS_CLUSTER].usec;
+
+	ns = (struct dlmc_node_status *)(ds + 1);
+
+	list_for_each_entry(node, &daemon_nodes, list)
+		set_node_status(node, 0, ns++);
+	list_for_each_entry(node, &startup_nodes, list)
+		set_node_status(node, DLMC_NS_STARTUP, ns++);
+
+	*buf_out = (char *)ds;
+	*len_out = len;
+	return 0;
+}
+
 void send_state_daemon(int fd)
 {
 	struct dlmc_state st;
@@ -9,48 +9,111 @@
 #include "dlm_daemon.h"
 #include "libdlm.h"
 
-static SaCkptHandleT global_ckpt_h;
-static SaCkptCallbacksT callbacks = { 0, 0 };
-static SaVersionT version = { 'B', 1, 1 };
-static char section_buf[10 * 1024 * 1024];  /* 10MB of pack_lock's enough? */
-static uint32_t section_len;
-static uint32_t section_max;
-
-struct node {
-	struct list_head	list;
-	int			nodeid;
-	int			checkpoint_ready; /* we've read its ckpt */
-	int			in_cycle;         /* participating in cycle */
-};
+/*
+ * A deadlock cycle:
+ *
+ * - a node sends cycle_start (after a timewarn or dlm_tool deadlock_check)
+ * - every node reads its debugfs locks and sends them to the lockspace cpg
+ *   in DLM_MSG_DEADLK_LOCKS batches, the final batch flagged DLM_MFLG_LAST
+ * - every node adds every batch (including its own) to the lockspace's
+ *   deadlk_graph, combining the master and process copies of each lock
+ * - when the last batch from every node in the cycle has arrived, the low
+ *   nodeid groups the locks into transactions (by xid), builds the waitfor
+ *   graph, and finds all the deadlocks in one pass for the strongly
+ *   connected components of the graph
+ * - a victim transaction is picked from each deadlocked component by the
+ *   deadlk_victim policy, and the blocked locks of the victim are canceled
+ *   by sending cancel_lock to the node where the lock owner lives
+ * - the low nodeid sends cycle_end and every node frees the graph
+ *
+ * The graph is kept on every node, so if the low nodeid fails during the
+ * cycle, the next lowest can resolve the deadlock instead.
+ */
+
+/* locks are sent in batches of up to this size, including the header */
+#define DEADLK_MSG_MAX		(64 * 1024)
+
+/* initial number of hash buckets, grown as entries are added */
+#define DEADLK_HASH_SIZE	256
+
+/* searches for cycles left after canceling victims; any remaining after
+   this are left for the next cycle, after the victims have backed out */
+#define DEADLK_MAX_PASSES	16
+
+/* transactions of a deadlock that are logged */
+#define DEADLK_DUMP_TRANS	16
+
+/* minimum time between cycles started by timewarns */
+#define DEADLK_CHECK_SECS	10
 
 enum {
 	LOCAL_COPY = 1,
 	MASTER_COPY = 2,
 };
 
+/* deadlk_victim policies */
+enum {
+	VICTIM_YOUNGEST = 0,	/* highest xid */
+	VICTIM_FEWEST_LOCKS = 1,
+	VICTIM_MOST_WAITERS = 2,
+};
+
 /* from linux/fs/dlm/dlm_internal.h */
 #define DLM_LKSTS_WAITING       1
 #define DLM_LKSTS_GRANTED       2
 #define DLM_LKSTS_CONVERT       3
 
+struct deadlk_node {
+	struct list_head	list;
+	int			nodeid;
+	int			locks_ready;	/* we've received its locks */
+	int			in_cycle;	/* participating in cycle */
+};
+
+/* one lock in a DLM_MSG_DEADLK_LOCKS message, followed by namelen bytes
+   of resource name, padded to 8 bytes; fields are little endian */
+
 struct pack_lock {
 	uint64_t		xid;
 	uint32_t		id;
-	int			nodeid;
+	int32_t			nodeid;
 	uint32_t		remid;
-	int			ownpid;
+	int32_t			ownpid;
 	uint32_t		exflags;
 	uint32_t		flags;
 	int8_t			status;
 	int8_t			grmode;
 	int8_t			rqmode;
 	int8_t			copy;
+	uint16_t		namelen;
+	uint16_t		pad;
+};
+
+#define PACK_LOCK_LEN(namelen) \
+	((sizeof(struct pack_lock) + (namelen) + 7) & ~7)
+
+/* hash tables are chained through an entry embedded in each object */
+
+struct deadlk_hent {
+	struct deadlk_hent	*next;
+	uint32_t		hval;
+};
+
+struct deadlk_htab {
+	struct deadlk_hent	**buckets;
+	uint32_t		size;		/* power of two */
+	uint32_t		count;
 };
 
+#define htab_for_each(e, t, h) \
+	for (e = (t)->buckets[(h) & ((t)->size - 1)]; e; e = e->next) \
+		if (e->hval == (h))
+
 struct dlm_rsb {
+	struct deadlk_hent	hent;
 	struct list_head	list;
 	struct list_head	locks;
-	char			name[DLM_RESNAME_MAXLEN];
+	char			name[DLM_RESNAME_MAXLEN+1];
 	int			len;
 };
 
@@ -58,33 +121,50 @@ struct dlm_rsb {
    local or master copy, not the process copy */
 
 struct dlm_lkb {
+	struct deadlk_hent	hent;       /* master copies, by rsb,nodeid,id */
 	struct list_head        list;       /* r->locks */
-	struct pack_lock	lock;       /* data from debugfs/checkpoint */
+	struct pack_lock	lock;       /* data from debugfs/message */
 	int			home;       /* node where the lock owner lives*/
+	int			purged;     /* home node left during cycle */
 	struct dlm_rsb		*rsb;       /* lock is on resource */
 	struct trans		*trans;     /* lock owned by this transaction */
 	struct list_head	trans_list; /* tr->locks */
-	struct trans		*waitfor_trans; /* the trans that's holding the
-						   lock that's blocking us */
 };
 
-/* waitfor pointers alloc'ed 4 at at time */
-#define TR_NALLOC		4
-
 struct trans {
-	struct list_head	list;
+	struct deadlk_hent	hent;
 	struct list_head	locks;
 	uint64_t		xid;
-	int			others_waiting_on_us; /* count of trans's
-							 pointing to us in
-							 waitfor */
-	int			waitfor_alloc;
-	int			waitfor_count;        /* count of in-use
-							 waitfor slots and
-						         num of trans's we're
-						         waiting on */
-	struct trans		**waitfor;	      /* waitfor_alloc trans
-							 pointers */
+	uint32_t		num;		/* index in graph->trans */
+	uint32_t		edge_stamp;	/* num+1 of last trans to add
+						   an edge to us */
+	int			held;		/* granted or converting locks */
+	int			waiters;	/* trans's waiting on us */
+	int			canceled;	/* chosen as victim */
+
+	/* scc search */
+	uint32_t		scc_index;	/* 0 until visited */
+	uint32_t		scc_low;
+	uint32_t		edge_pos;
+	int			on_stack;
+};
+
+struct deadlk_graph {
+	struct deadlk_htab	rsb_hash;
+	struct deadlk_htab	lkb_hash;
+	struct deadlk_htab	trans_hash;
+	struct list_head	resources;
+	int			lkb_count;
+
+	/* waitfor graph: the edges of trans[i] are
+	   edges[edge_start[i]] .. edges[edge_start[i+1] - 1] */
+	struct trans		**trans;
+	uint32_t		trans_count;
+	uint32_t		trans_alloc;
+	uint32_t		*edge_start;
+	uint32_t		*edges;
+	uint32_t		edge_count;
+	uint32_t		edge_alloc;
 };
 
 static const int __dlm_compat_matrix[8][8] = {
@@ -117,174 +197,228 @@ static const char *status_str(int lksts)
 	return "?";
 }
 
-static void free_resources(struct lockspace *ls)
+static inline uint32_t hash_u64(uint64_t val)
 {
+	val ^= val >> 33;
+	val *= 0xff51afd7ed558ccdULL;
+	val ^= val >> 33;
+	return (uint32_t)val;
+}
+
+static int htab_init(struct deadlk_htab *t)
+{
+	t->buckets = calloc(DEADLK_HASH_SIZE, sizeof(struct deadlk_hent *));
+	if (!t->buckets)
+		return -ENOMEM;
+	t->size = DEADLK_HASH_SIZE;
+	t->count = 0;
+	return 0;
+}
+
+/* double the buckets when there are more entries than buckets; if that
+   fails, the table keeps working with longer chains */
+
+static void htab_grow(struct deadlk_htab *t)
+{
+	struct deadlk_hent **buckets, *e, *next;
+	uint32_t size = t->size * 2;
+	uint32_t i, b;
+
+	buckets = calloc(size, sizeof(struct deadlk_hent *));
+	if (!buckets)
+		return;
+
+	for (i = 0; i < t->size; i++) {
+		for (e = t->buckets[i]; e; e = next) {
+			next = e->next;
+			b = e->hval & (size - 1);
+			e->next = buckets[b];
+			buckets[b] = e;
+		}
+	}
+	free(t->buckets);
+	t->buckets = buckets;
+	t->size = size;
+}
+
+static void htab_add(struct deadlk_htab *t, struct deadlk_hent *e,
+		     uint32_t hval)
+{
+	uint32_t b;
+
+	if (t->count >= t->size)
+		htab_grow(t);
+
+	b = hval & (t->size - 1);
+	e->hval = hval;
+	e->next = t->buckets[b];
+	t->buckets[b] = e;
+	t->count++;
+}
+
+static void free_graph(struct lockspace *ls)
+{
+	struct deadlk_graph *g = ls->deadlk;
 	struct dlm_rsb *r, *r_safe;
 	struct dlm_lkb *lkb, *lkb_safe;
+	uint32_t i;
+
+	if (!g)
+		return;
 
-	list_for_each_entry_safe(r, r_safe, &ls->resources, list) {
+	list_for_each_entry_safe(r, r_safe, &g->resources, list) {
 		list_for_each_entry_safe(lkb, lkb_safe, &r->locks, list) {
 			list_del(&lkb->list);
-			if (!list_empty(&lkb->trans_list))
-				list_del(&lkb->trans_list);
 			free(lkb);
 		}
 		list_del(&r->list);
 		free(r);
 	}
-}
 
-static void free_transactions(struct lockspace *ls)
-{
-	struct trans *tr, *tr_safe;
+	for (i = 0; i < g->trans_count; i++)
+		free(g->trans[i]);
 
-	list_for_each_entry_safe(tr, tr_safe, &ls->transactions, list) {
-		list_del(&tr->list);
-		if (tr->waitfor)
-			free(tr->waitfor);
-		free(tr);
-	}
+	free(g->trans);
+	free(g->edge_start);
+	free(g->edges);
+	free(g->rsb_hash.buckets);
+	free(g->lkb_hash.buckets);
+	free(g->trans_hash.buckets);
+	free(g);
+	ls->deadlk = NULL;
 }
 
-static void disable_deadlock(void)
+static struct deadlk_graph *create_graph(struct lockspace *ls)
 {
-	log_error("FIXME: deadlock detection disabled");
-}
+	struct deadlk_graph *g;
 
-void setup_deadlock(void)
-{
-	SaAisErrorT rv;
+	free_graph(ls);
 
-	if (!cfgd_enable_deadlk)
-		return;
+	g = malloc(sizeof(struct deadlk_graph));
+	if (!g)
+		goto fail;
+	memset(g, 0, sizeof(struct deadlk_graph));
+	INIT_LIST_HEAD(&g->resources);
+	ls->deadlk = g;
+
+	if (htab_init(&g->rsb_hash) || htab_init(&g->lkb_hash) ||
+	    htab_init(&g->trans_hash))
+		goto fail;
 
-	rv = saCkptInitialize(&global_ckpt_h, &callbacks, &version);
-	if (rv != SA_AIS_OK)
-		log_error("ckpt init error %d", rv);
+	return g;
+ fail:
+	log_error("%s deadlock graph no memory", ls->name);
+	free_graph(ls);
+	return NULL;
 }
 
-static struct dlm_rsb *get_resource(struct lockspace *ls, char *name, int len)
+static struct dlm_rsb *get_resource(struct deadlk_graph *g, char *name,
+				    int len)
 {
+	struct deadlk_hent *e;
 	struct dlm_rsb *r;
+	uint32_t hval;
+
+	hval = cpgname_to_crc(name, len);
 
-	list_for_each_entry(r, &ls->resources, list) {
-		if (r->len == len && !strncmp(r->name, name, len))
+	htab_for_each(e, &g->rsb_hash, hval) {
+		r = container_of(e, struct dlm_rsb, hent);
+		if (r->len == len && !memcmp(r->name, name, len))
 			return r;
 	}
 
 	r = malloc(sizeof(struct dlm_rsb));
 	if (!r) {
 		log_error("get_resource: no memory");
-		disable_deadlock();
 		return NULL;
 	}
 	memset(r, 0, sizeof(struct dlm_rsb));
 	memcpy(r->name, name, len);
 	r->len = len;
 	INIT_LIST_HEAD(&r->locks);
-	list_add(&r->list, &ls->resources);
+	list_add(&r->list, &g->resources);
+	htab_add(&g->rsb_hash, &r->hent, hval);
 	return r;
 }
 
-static struct dlm_lkb *create_lkb(void)
+static inline uint32_t lkb_hash(struct dlm_rsb *r, struct pack_lock *lock)
 {
+	return hash_u64(((uint64_t)(uint32_t)lock->nodeid << 32 | lock->id) ^
+			(uint64_t)(unsigned long)r);
+}
+
+/* the real master copy and the partial master copy (from the process copy)
+   of a lock are combined in one lkb, found by master lkid and owner nodeid */
+
+static struct dlm_lkb *get_lkb(struct deadlk_graph *g, struct dlm_rsb *r,
+			       struct pack_lock *lock)
+{
+	struct deadlk_hent *e;
 	struct dlm_lkb *lkb;
+	uint32_t hval = 0;
+
+	if (lock->copy == MASTER_COPY) {
+		hval = lkb_hash(r, lock);
+
+		htab_for_each(e, &g->lkb_hash, hval) {
+			lkb = container_of(e, struct dlm_lkb, hent);
+			if (lkb->rsb == r &&
+			    lkb->lock.nodeid == lock->nodeid &&
+			    lkb->lock.id == lock->id)
+				return lkb;
+		}
+	}
 
 	lkb = malloc(sizeof(struct dlm_lkb));
 	if (!lkb) {
-		log_error("create_lkb: no memory");
-		disable_deadlock();
-	} else {
-		memset(lkb, 0, sizeof(struct dlm_lkb));
-		INIT_LIST_HEAD(&lkb->list);
-		INIT_LIST_HEAD(&lkb->trans_list);
+		log_error("get_lkb: no memory");
+		return NULL;
 	}
-	return lkb;
-}
-
-static void add_lkb(struct dlm_rsb *r, struct dlm_lkb *lkb)
-{
+	memset(lkb, 0, sizeof(struct dlm_lkb));
+	INIT_LIST_HEAD(&lkb->trans_list);
 	list_add(&lkb->list, &r->locks);
 	lkb->rsb = r;
-}
-
-/* from linux/fs/dlm/dlm_internal.h */
-#define IFL_MSTCPY 0x00010000
+	g->lkb_count++;
 
-/* called on a lock that's just been read from debugfs */
+	if (lock->copy == MASTER_COPY)
+		htab_add(&g->lkb_hash, &lkb->hent, hval);
+	return lkb;
+}
 
-static void set_copy(struct pack_lock *lock)
+static struct deadlk_node *get_deadlk_node(struct lockspace *ls, int nodeid)
 {
-	uint32_t id, remid;
+	struct deadlk_node *node;
 
-	if (!lock->nodeid)
-		lock->copy = LOCAL_COPY;
-	else if (lock->flags & IFL_MSTCPY)
-		lock->copy = MASTER_COPY;
-	else {
-		/* process copy lock is converted to a partial master copy
-		   lock that will be combined with the real master copy */
-		lock->copy = MASTER_COPY;
-		id = lock->id;
-		remid = lock->remid;
-		lock->id = remid;
-		lock->remid = id;
-		lock->nodeid = our_nodeid;
+	list_for_each_entry(node, &ls->deadlk_nodes, list) {
+		if (node->nodeid == nodeid)
+			return node;
 	}
+	return NULL;
 }
 
 /* xid is always zero in the real master copy, xid should always be non-zero
    in the partial master copy (what was a process copy) */
-/* TODO: confirm or enforce that the partial will always have non-zero xid */
 
 static int partial_master_copy(struct pack_lock *lock)
 {
 	return (lock->xid != 0);
 }
 
-static struct dlm_lkb *get_lkb(struct dlm_rsb *r, struct pack_lock *lock)
-{
-	struct dlm_lkb *lkb;
-
-	if (lock->copy != MASTER_COPY)
-		goto out;
-
-	list_for_each_entry(lkb, &r->locks, list) {
-		if (lkb->lock.nodeid == lock->nodeid &&
-		    lkb->lock.id == lock->id)
-			return lkb;
-	}
- out:
-	return create_lkb();
-}
-
-static struct dlm_lkb *add_lock(struct lockspace *ls, struct dlm_rsb *r,
-				int from_nodeid, struct pack_lock *lock)
+static void add_lock(struct lockspace *ls, struct deadlk_graph *g,
+		     struct dlm_rsb *r, int from_nodeid,
+		     struct pack_lock *lock)
 {
+	struct deadlk_node *node;
 	struct dlm_lkb *lkb;
 
-	lkb = get_lkb(r, lock);
+	lkb = get_lkb(g, r, lock);
 	if (!lkb)
-		return NULL;
+		return;
 
 	switch (lock->copy) {
 	case LOCAL_COPY:
-		lkb->lock.xid     = lock->xid;
-		lkb->lock.nodeid  = lock->nodeid;
-		lkb->lock.id      = lock->id;
-		lkb->lock.remid   = lock->remid;
-		lkb->lock.ownpid  = lock->ownpid;
-		lkb->lock.exflags = lock->exflags;
-		lkb->lock.flags   = lock->flags;
-		lkb->lock.status  = lock->status;
-		lkb->lock.grmode  = lock->grmode;
-		lkb->lock.rqmode  = lock->rqmode;
-		lkb->lock.copy    = LOCAL_COPY;
+		lkb->lock = *lock;
 		lkb->home = from_nodeid;
-
-		log_group(ls, "add %s local nodeid %d id %x remid %x xid %llx",
-			  r->name, lock->nodeid, lock->id, lock->remid,
-			  (unsigned long long)lock->xid);
 		break;
 
 	case MASTER_COPY:
@@ -310,550 +444,260 @@ static struct dlm_lkb *add_lock(struct lockspace *ls, struct dlm_rsb *r,
 		}
 		lkb->home = lock->nodeid;
 
-		log_group(ls, "add %s master nodeid %d id %x remid %x xid %llx",
-			  r->name, lock->nodeid, lock->id, lock->remid,
-			  (unsigned long long)lock->xid);
+		/* the owner has left since the cycle started */
+		if (lkb->home != from_nodeid) {
+			node = get_deadlk_node(ls, lkb->home);
+			if (!node || !node->in_cycle)
+				lkb->purged = 1;
+		}
 		break;
 	}
-
-	if (list_empty(&lkb->list))
-		add_lkb(r, lkb);
-	return lkb;
 }
 
-static void parse_r_name(char *line, char *name)
-{
-	char *p;
-	int i = 0;
-	int begin = 0;
-
-	for (p = line; ; p++) {
-		if (*p == '"') {
-			if (begin)
-				break;
-			begin = 1;
-			continue;
-		}
-		if (begin)
-			name[i++] = *p;
-	}
-}
+/* from linux/fs/dlm/dlm_internal.h */
+#define IFL_MSTCPY 0x00010000
 
-#define LOCK_LINE_MAX 1024
+/* called on a lock that's just been read from debugfs */
 
-static int read_debugfs_locks(struct lockspace *ls)
+static void set_copy(struct pack_lock *lock)
 {
-	FILE *file;
-	char path[PATH_MAX];
-	char line[LOCK_LINE_MAX];
-	struct dlm_rsb *r;
-	struct pack_lock lock;
-	char r_name[65];
-	unsigned long long xid;
-	unsigned int waiting;
-	int r_nodeid;
-	int r_len;
-	int rv;
-
-	snprintf(path, PATH_MAX, "/sys/kernel/debug/dlm/%s_locks", ls->name);
-
-	file = fopen(path, "r");
-	if (!file)
-		return -1;
+	uint32_t id, remid;
 
-	/* skip the header on the first line */
-	if (!fgets(line, LOCK_LINE_MAX, file)) {
-		log_error("Unable to read %s: %d", path, errno);
-		goto out;
+	if (!lock->nodeid)
+		lock->copy = LOCAL_COPY;
+	else if (lock->flags & IFL_MSTCPY)
+		lock->copy = MASTER_COPY;
+	else {
+		/* process copy lock is converted to a partial master copy
+		   lock that will be combined with the real master copy */
+		lock->copy = MASTER_COPY;
+		id = lock->id;
+		remid = lock->remid;
+		lock->id = remid;
+		lock->remid = id;
+		lock->nodeid = our_nodeid;
 	}
+}
 
-	while (fgets(line, LOCK_LINE_MAX, file)) {
-		memset(&lock, 0, sizeof(struct pack_lock));
-
-		rv = sscanf(line, "%x %d %x %u %llu %x %x %hhd %hhd %hhd %u %d %d",
-			    &lock.id,
-			    &lock.nodeid,
-			    &lock.remid,
-			    &lock.ownpid,
-			    &xid,
-			    &lock.exflags,
-			    &lock.flags,
-			    &lock.status,
-			    &lock.grmode,
-			    &lock.rqmode,
-			    &waiting,
-			    &r_nodeid,
-			    &r_len);
-
-		lock.xid = xid; /* hack to avoid warning */
-
-		if (rv != 13) {
-			log_error("invalid debugfs line %d: %s", rv, line);
-			goto out;
-		}
+/* the name is quoted at the end of the line and may contain spaces */
 
-		memset(r_name, 0, sizeof(r_name));
-		parse_r_name(line, r_name);
+static int parse_r_name(char *line, char *name, int len)
+{
+	char *p;
 
-		r = get_resource(ls, r_name, r_len);
-		if (!r)
-			break;
+	p = strchr(line, '"');
+	if (!p || len > DLM_RESNAME_MAXLEN || strlen(p + 1) < len)
+		return -1;
 
-		set_copy(&lock);
-		add_lock(ls, r, our_nodeid, &lock);
-	}
- out:
-	fclose(file);
+	memcpy(name, p + 1, len);
 	return 0;
 }
 
-static int read_checkpoint_locks(struct lockspace *ls, int from_nodeid,
-			         char *numbuf, int buflen)
+static void send_message(struct lockspace *ls, int type,
+			 uint32_t to_nodeid, uint32_t msgdata, uint32_t flags)
 {
-	struct dlm_rsb *r;
-	struct pack_lock *lock;
-	int count = section_len / sizeof(struct pack_lock);
-	int i;
-
-	r = get_resource(ls, numbuf, buflen - 1);
-	if (!r)
-		return -1;
-
-	lock = (struct pack_lock *) &section_buf;
+	struct dlm_header hd;
 
-	for (i = 0; i < count; i++) {
-		lock->xid     = le64_to_cpu(lock->xid);
-		lock->id      = le32_to_cpu(lock->id);
-		lock->nodeid  = le32_to_cpu(lock->nodeid);
-		lock->remid   = le32_to_cpu(lock->remid);
-		lock->ownpid  = le32_to_cpu(lock->ownpid);
-		lock->exflags = le32_to_cpu(lock->exflags);
-		lock->flags   = le32_to_cpu(lock->flags);
+	memset(&hd, 0, sizeof(hd));
+	hd.type = type;
+	hd.to_nodeid = to_nodeid;
+	hd.msgdata = msgdata;
+	hd.flags = flags;
 
-		add_lock(ls, r, from_nodeid, lock);
-		lock++;
-	}
-	return 0;
+	dlm_send_message(ls, (char *)&hd, sizeof(hd));
 }
 
-static int pack_lkb_list(struct list_head *q, struct pack_lock **lockp)
+static void send_locks(struct lockspace *ls, char *buf, int len, int count,
+		       int last)
 {
-	struct dlm_lkb *lkb;
-	struct pack_lock *lock = *lockp;
-	int count = 0;
+	struct dlm_header *hd = (struct dlm_header *)buf;
 
-	list_for_each_entry(lkb, q, list) {
-		if (count + 1 > section_max) {
-			log_error("too many locks %d for ckpt buf", count);
-			break;
-		}
+	hd->type = DLM_MSG_DEADLK_LOCKS;
+	hd->msgdata = count;
+	hd->flags = last ? DLM_MFLG_LAST : 0;
 
-		lock->xid     = cpu_to_le64(lkb->lock.xid);
-		lock->id      = cpu_to_le32(lkb->lock.id);
-		lock->nodeid  = cpu_to_le32(lkb->lock.nodeid);
-		lock->remid   = cpu_to_le32(lkb->lock.remid);
-		lock->ownpid  = cpu_to_le32(lkb->lock.ownpid);
-		lock->exflags = cpu_to_le32(lkb->lock.exflags);
-		lock->flags   = cpu_to_le32(lkb->lock.flags);
-		lock->status  = lkb->lock.status;
-		lock->grmode  = lkb->lock.grmode;
-		lock->rqmode  = lkb->lock.rqmode;
-		lock->copy    = lkb->lock.copy;
-
-		lock++;
-		count++;
-	}
-	return count;
+	dlm_send_message(ls, buf, len);
 }
 
-static void pack_section_buf(struct lockspace *ls, struct dlm_rsb *r)
+static void pack_lock_out(struct pack_lock *lock, char *p, char *name)
 {
-	struct pack_lock *lock;
-	int count;
+	struct pack_lock *pl = (struct pack_lock *)p;
+
+	pl->xid     = cpu_to_le64(lock->xid);
+	pl->id      = cpu_to_le32(lock->id);
+	pl->nodeid  = cpu_to_le32(lock->nodeid);
+	pl->remid   = cpu_to_le32(lock->remid);
+	pl->ownpid  = cpu_to_le32(lock->ownpid);
+	pl->exflags = cpu_to_le32(lock->exflags);
+	pl->flags   = cpu_to_le32(lock->flags);
+	pl->status  = lock->status;
+	pl->grmode  = lock->grmode;
+	pl->rqmode  = lock->rqmode;
+	pl->copy    = lock->copy;
+	pl->namelen = cpu_to_le16(lock->namelen);
+	memcpy(p + sizeof(struct pack_lock), name, lock->namelen);
+}
 
-	memset(&section_buf, 0, sizeof(section_buf));
-	section_max = sizeof(section_buf) / sizeof(struct pack_lock);
+/* returns the next record, or NULL if the record at p is bad; the
+   name follows the pack_lock at p */
 
-	lock = (struct pack_lock *) &section_buf;
+static char *pack_lock_in(char *p, char *end, struct pack_lock *lock)
+{
+	int len;
 
-	count = pack_lkb_list(&r->locks, &lock);
+	if (end - p < sizeof(struct pack_lock))
+		return NULL;
 
-	section_len = count * sizeof(struct pack_lock);
+	memcpy(lock, p, sizeof(struct pack_lock));
+	lock->xid     = le64_to_cpu(lock->xid);
+	lock->id      = le32_to_cpu(lock->id);
+	lock->nodeid  = le32_to_cpu(lock->nodeid);
+	lock->remid   = le32_to_cpu(lock->remid);
+	lock->ownpid  = le32_to_cpu(lock->ownpid);
+	lock->exflags = le32_to_cpu(lock->exflags);
+	lock->flags   = le32_to_cpu(lock->flags);
+	lock->namelen = le16_to_cpu(lock->namelen);
+
+	len = PACK_LOCK_LEN(lock->namelen);
+	if (lock->namelen > DLM_RESNAME_MAXLEN || end - p < len)
+		return NULL;
+	return p + len;
 }
 
-static int _unlink_checkpoint(struct lockspace *ls, SaNameT *name)
+#define LOCK_LINE_MAX 1024
+
+static FILE *open_debugfs_locks(struct lockspace *ls)
 {
-	SaCkptCheckpointHandleT h;
-	SaCkptCheckpointDescriptorT s;
-	SaAisErrorT rv;
-	int ret = 0;
-	int retries;
+	FILE *file;
+	char path[PATH_MAX];
+	char line[LOCK_LINE_MAX];
 
-	h = (SaCkptCheckpointHandleT) ls->deadlk_ckpt_handle;
-	log_group(ls, "unlink ckpt %llx", (unsigned long long)h);
+	snprintf(path, PATH_MAX, "/sys/kernel/debug/dlm/%s_locks", ls->name);
 
-	retries = 0;
- unlink_retry:
-	rv = saCkptCheckpointUnlink(global_ckpt_h, name);
-	if (rv == SA_AIS_ERR_TRY_AGAIN) {
-		log_group(ls, "unlink ckpt retry");
-		sleep(1);
-		if (retries++ < 10)
-			goto unlink_retry;
+	file = fopen(path, "r");
+	if (!file) {
+		log_error("can't read dlm debugfs file %s: %s",
+			  path, strerror(errno));
+		return NULL;
 	}
-	if (rv == SA_AIS_OK)
-		goto out_close;
-	if (!h)
-		goto out;
 
-	log_error("unlink ckpt error %d %s", rv, ls->name);
-	ret = -1;
-
-	retries = 0;
- status_retry:
-	rv = saCkptCheckpointStatusGet(h, &s);
-	if (rv == SA_AIS_ERR_TRY_AGAIN) {
-		log_group(ls, "unlink ckpt status retry");
-		sleep(1);
-		if (retries++ < 10)
-			goto status_retry;
-	}
-	if (rv != SA_AIS_OK) {
-		log_error("unlink ckpt status error %d %s", rv, ls->name);
-		goto out_close;
-	}
-
-	log_group(ls, "unlink ckpt status: size %llu, max sections %u, "
-		      "max section size %llu, section count %u, mem %u",
-		 (unsigned long long)s.checkpointCreationAttributes.checkpointSize,
-		 s.checkpointCreationAttributes.maxSections,
-		 (unsigned long long)s.checkpointCreationAttributes.maxSectionSize,
-		 s.numberOfSections, s.memoryUsed);
-
- out_close:
-	retries = 0;
- close_retry:
-	rv = saCkptCheckpointClose(h);
-	if (rv == SA_AIS_ERR_TRY_AGAIN) {
-		log_group(ls, "unlink ckpt close retry");
-		sleep(1);
-		if (retries++ < 10)
-			goto close_retry;
-	}
-	if (rv != SA_AIS_OK) {
-		log_error("unlink ckpt %llx close err %d %s",
-			  (unsigned long long)h, rv, ls->name);
+	/* skip the header on the first line */
+	if (!fgets(line, LOCK_LINE_MAX, file)) {
+		log_error("Unable to read %s: %d", path, errno);
+		fclose(file);
+		return NULL;
 	}
- out:
-	ls->deadlk_ckpt_handle = 0;
-	return ret;
+	return file;
 }
 
-static int unlink_checkpoint(struct lockspace *ls)
-{
-	SaNameT name;
-	int len;
-
-	len = snprintf((char *)name.value, SA_MAX_NAME_LENGTH, "dlmdeadlk.%s.%d",
-		       ls->name, our_nodeid);
-	name.length = len;
-
-	return _unlink_checkpoint(ls, &name);
-}
+/* lock is from the perspective of the debugfs copy, set_copy() is not
+   done; waiting is the time in usec since the lock was added to its
+   current queue (the time_ms column is really usecs) */
 
-static void read_checkpoint(struct lockspace *ls, int nodeid)
+static int parse_lock_line(char *line, struct pack_lock *lock, char *r_name,
+			   unsigned long long *waiting)
 {
-	SaCkptCheckpointHandleT h;
-	SaCkptSectionIterationHandleT itr;
-	SaCkptSectionDescriptorT desc;
-	SaCkptIOVectorElementT iov;
-	SaNameT name;
-	SaAisErrorT rv;
-	char buf[DLM_RESNAME_MAXLEN];
-	int len;
-	int retries;
+	unsigned long long xid;
+	int r_nodeid, r_len;
+	int rv;
 
-	if (nodeid == our_nodeid)
-		return;
+	memset(lock, 0, sizeof(struct pack_lock));
+
+	rv = sscanf(line, "%x %d %x %u %llu %x %x %hhd %hhd %hhd %llu %d %d",
+		    &lock->id,
+		    &lock->nodeid,
+		    &lock->remid,
+		    &lock->ownpid,
+		    &xid,
+		    &lock->exflags,
+		    &lock->flags,
+		    &lock->status,
+		    &lock->grmode,
+		    &lock->rqmode,
+		    waiting,
+		    &r_nodeid,
+		    &r_len);
+
+	lock->xid = xid; /* hack to avoid warning */
+
+	if (rv != 13 || parse_r_name(line, r_name, r_len) < 0) {
+		log_error("invalid debugfs line %d: %s", rv, line);
+		return -EINVAL;
+	}
+	lock->namelen = r_len;
+	return 0;
+}
 
-	log_group(ls, "read_checkpoint %d", nodeid);
+/* read our debugfs locks and send them in batches; the last batch is sent
+   even if it's empty so others know we're done */
 
-	len = snprintf((char *)name.value, SA_MAX_NAME_LENGTH, "dlmdeadlk.%s.%d",
-		       ls->name, nodeid);
-	name.length = len;
+static void send_debugfs_locks(struct lockspace *ls)
+{
+	FILE *file;
+	char line[LOCK_LINE_MAX];
+	char r_name[DLM_RESNAME_MAXLEN];
+	struct pack_lock lock;
+	unsigned long long waiting;
+	int len, count, total = 0, msgs = 0;
+	char *buf;
 
-	retries = 0;
- open_retry:
-	rv = saCkptCheckpointOpen(global_ckpt_h, &name, NULL,
-				  SA_CKPT_CHECKPOINT_READ, 0, &h);
-	if (rv == SA_AIS_ERR_TRY_AGAIN) {
-		log_group(ls, "read_checkpoint: %d ckpt open retry", nodeid);
-		sleep(1);
-		if (retries++ < 10)
-			goto open_retry;
-	}
-	if (rv != SA_AIS_OK) {
-		log_error("read_checkpoint: %d ckpt open error %d", nodeid, rv);
+	buf = malloc(DEADLK_MSG_MAX);
+	if (!buf) {
+		/* others still need our last message to finish the cycle */
+		log_error("send_debugfs_locks: no memory");
+		send_message(ls, DLM_MSG_DEADLK_LOCKS, 0, 0, DLM_MFLG_LAST);
 		return;
 	}
+	memset(buf, 0, sizeof(struct dlm_header));
+	len = sizeof(struct dlm_header);
+	count = 0;
 
-	retries = 0;
- init_retry:
-	rv = saCkptSectionIterationInitialize(h, SA_CKPT_SECTIONS_ANY, 0, &itr);
-	if (rv == SA_AIS_ERR_TRY_AGAIN) {
-		log_group(ls, "read_checkpoint: ckpt iterinit retry");
-		sleep(1);
-		if (retries++ < 10)
-			goto init_retry;
-	}
-	if (rv != SA_AIS_OK) {
-		log_error("read_checkpoint: %d ckpt iterinit error %d", nodeid, rv);
-		goto out;
-	}
+	file = open_debugfs_locks(ls);
+	if (!file)
+		goto out_send;
 
-	while (1) {
-		retries = 0;
-	 next_retry:
-		rv = saCkptSectionIterationNext(itr, &desc);
-		if (rv == SA_AIS_ERR_NO_SECTIONS)
+	while (fgets(line, LOCK_LINE_MAX, file)) {
+		if (parse_lock_line(line, &lock, r_name, &waiting) < 0)
 			break;
-		if (rv == SA_AIS_ERR_TRY_AGAIN) {
-			log_group(ls, "read_checkpoint: ckpt iternext retry");
-			sleep(1);
-			if (retries++ < 10)
-				goto next_retry;
-		}
-		if (rv != SA_AIS_OK) {
-			log_error("read_checkpoint: %d ckpt iternext error %d",
-				  nodeid, rv);
-			goto out_it;
-		}
-
-		if (!desc.sectionSize)
-			continue;
 
-		iov.sectionId = desc.sectionId;
-		iov.dataBuffer = &section_buf;
-		iov.dataSize = desc.sectionSize;
-		iov.dataOffset = 0;
-
-		memset(&buf, 0, sizeof(buf));
-		snprintf(buf, sizeof(buf), "%s", desc.sectionId.id);
-
-		log_group(ls, "read_checkpoint: section size %llu id %u \"%s\"",
-			  (unsigned long long)iov.dataSize,
-			  iov.sectionId.idLen, buf);
-
-		retries = 0;
-	 read_retry:
-		rv = saCkptCheckpointRead(h, &iov, 1, NULL);
-		if (rv == SA_AIS_ERR_TRY_AGAIN) {
-			log_group(ls, "read_checkpoint: ckpt read retry");
-			sleep(1);
-			if (retries++ < 10)
-				goto read_retry;
-		}
-		if (rv != SA_AIS_OK) {
-			log_error("read_checkpoint: %d ckpt read error %d",
-				  nodeid, rv);
-			goto out_it;
-		}
-
-		section_len = iov.readSize;
-
-		if (!section_len)
-		       continue;
+		set_copy(&lock);
 
-		if (section_len % sizeof(struct pack_lock)) {
-			log_error("read_checkpoint: %d bad section len %d",
-				  nodeid, section_len);
-			continue;
+		if (len + PACK_LOCK_LEN(lock.namelen) > DEADLK_MSG_MAX) {
+			send_locks(ls, buf, len, count, 0);
+			memset(buf, 0, sizeof(struct dlm_header));
+			len = sizeof(struct dlm_header);
+			count = 0;
+			msgs++;
 		}
 
-		read_checkpoint_locks(ls, nodeid, (char *)desc.sectionId.id,
-				      desc.sectionId.idLen);
+		memset(buf + len, 0, PACK_LOCK_LEN(lock.namelen));
+		pack_lock_out(&lock, buf + len, r_name);
+		len += PACK_LOCK_LEN(lock.namelen);
+		count++;
+		total++;
 	}
+	fclose(file);
+ out_send:
+	send_locks(ls, buf, len, count, 1);
+	msgs++;
+	free(buf);
 
- out_it:
-	saCkptSectionIterationFinalize(itr);
-	retries = 0;
- out:
-	rv = saCkptCheckpointClose(h);
-	if (rv == SA_AIS_ERR_TRY_AGAIN) {
-		log_group(ls, "read_checkpoint: unlink ckpt close retry");
-		sleep(1);
-		if (retries++ < 10)
-			goto out;
-	}
-	if (rv != SA_AIS_OK)
-		log_error("read_checkpoint: %d close error %d", nodeid, rv);
-}
-
-static void write_checkpoint(struct lockspace *ls)
-{
-	SaCkptCheckpointCreationAttributesT attr;
-	SaCkptCheckpointHandleT h;
-	SaCkptSectionIdT section_id;
-	SaCkptSectionCreationAttributesT section_attr;
-	SaCkptCheckpointOpenFlagsT flags;
-	SaNameT name;
-	SaAisErrorT rv;
-	char buf[DLM_RESNAME_MAXLEN];
-	struct dlm_rsb *r;
-	struct dlm_lkb *lkb;
-	int r_count, lock_count, total_size, section_size, max_section_size;
-	int len;
+	log_group(ls, "send_debugfs_locks locks %d msgs %d", total, msgs);
+}
 
-	len = snprintf((char *)name.value, SA_MAX_NAME_LENGTH, "dlmdeadlk.%s.%d",
-		      ls->name, our_nodeid);
-	name.length = len;
+void send_cycle_start(struct lockspace *ls)
+{
+	log_group(ls, "send_cycle_start");
+	send_message(ls, DLM_MSG_DEADLK_CYCLE_START, 0, 0, 0);
+}
 
-	/* unlink an old checkpoint before we create a new one */
-	if (ls->deadlk_ckpt_handle) {
-		log_error("write_checkpoint: old ckpt");
-		if (_unlink_checkpoint(ls, &name))
-			return;
-	}
+static void send_cycle_end(struct lockspace *ls)
+{
+	log_group(ls, "send_cycle_end");
+	send_message(ls, DLM_MSG_DEADLK_CYCLE_END, 0, 0, 0);
+}
 
-	/* loop through all locks to figure out sizes to set in
-	   the attr fields */
-
-	r_count = 0;
-	lock_count = 0;
-	total_size = 0;
-	max_section_size = 0;
-
-	list_for_each_entry(r, &ls->resources, list) {
-		r_count++;
-		section_size = 0;
-		list_for_each_entry(lkb, &r->locks, list) {
-			section_size += sizeof(struct pack_lock);
-			lock_count++;
-		}
-		total_size += section_size;
-		if (section_size > max_section_size)
-			max_section_size = section_size;
-	}
-
-	log_group(ls, "write_checkpoint: r_count %d, lock_count %d",
-		  r_count, lock_count);
-
-	log_group(ls, "write_checkpoint: total %d bytes, max_section %d bytes",
-		  total_size, max_section_size);
-
-	attr.creationFlags = SA_CKPT_WR_ALL_REPLICAS;
-	attr.checkpointSize = total_size;
-	attr.retentionDuration = SA_TIME_MAX;
-	attr.maxSections = r_count + 1;      /* don't know why we need +1 */
-	attr.maxSectionSize = max_section_size;
-	attr.maxSectionIdSize = DLM_RESNAME_MAXLEN;
-
-	flags = SA_CKPT_CHECKPOINT_READ |
-		SA_CKPT_CHECKPOINT_WRITE |
-		SA_CKPT_CHECKPOINT_CREATE;
-
- open_retry:
-	rv = saCkptCheckpointOpen(global_ckpt_h, &name, &attr, flags, 0, &h);
-	if (rv == SA_AIS_ERR_TRY_AGAIN) {
-		log_group(ls, "write_checkpoint: ckpt open retry");
-		sleep(1);
-		goto open_retry;
-	}
-	if (rv == SA_AIS_ERR_EXIST) {
-		log_group(ls, "write_checkpoint: ckpt already exists");
-		return;
-	}
-	if (rv != SA_AIS_OK) {
-		log_group(ls, "write_checkpoint: ckpt open error %d", rv);
-		return;
-	}
-
-	log_group(ls, "write_checkpoint: open ckpt handle %llx",
-		  (unsigned long long)h);
-	ls->deadlk_ckpt_handle = (uint64_t) h;
-
-	list_for_each_entry(r, &ls->resources, list) {
-		memset(buf, 0, sizeof(buf));
-		len = snprintf(buf, sizeof(buf), "%s", r->name);
-
-		section_id.id = (void *)buf;
-		section_id.idLen = len + 1;
-		section_attr.sectionId = &section_id;
-		section_attr.expirationTime = SA_TIME_END;
-
-		pack_section_buf(ls, r);
-
-		log_group(ls, "write_checkpoint: section size %u id %u \"%s\"",
-			  section_len, section_id.idLen, buf);
-
-	 create_retry:
-		rv = saCkptSectionCreate(h, &section_attr, &section_buf,
-					 section_len);
-		if (rv == SA_AIS_ERR_TRY_AGAIN) {
-			log_group(ls, "write_checkpoint: ckpt create retry");
-			sleep(1);
-			goto create_retry;
-		}
-		if (rv == SA_AIS_ERR_EXIST) {
-			/* this shouldn't happen in general */
-			log_error("write_checkpoint: clearing old ckpt");
-			saCkptCheckpointClose(h);
-			_unlink_checkpoint(ls, &name);
-			goto open_retry;
-		}
-		if (rv != SA_AIS_OK) {
-			log_error("write_checkpoint: section create %d", rv);
-			break;
-		}
-	}
-}
-
-static void send_message(struct lockspace *ls, int type,
-			 uint32_t to_nodeid, uint32_t msgdata)
-{
-	struct dlm_header *hd;
-	int len;
-	char *buf;
-
-	len = sizeof(struct dlm_header);
-	buf = malloc(len);
-	if (!buf) {
-		log_error("send_message: no memory");
-		disable_deadlock();
-		return;
-	}
-	memset(buf, 0, len);
-
-	hd = (struct dlm_header *)buf;
-	hd->type = type;
-	hd->to_nodeid = to_nodeid;
-	hd->msgdata = msgdata;
-
-	dlm_send_message(ls, buf, len);
-
-	free(buf);
-}
-
-static void send_checkpoint_ready(struct lockspace *ls)
-{
-	log_group(ls, "send_checkpoint_ready");
-	send_message(ls, DLM_MSG_DEADLK_CHECKPOINT_READY, 0, 0);
-}
-
-void send_cycle_start(struct lockspace *ls)
-{
-	log_group(ls, "send_cycle_start");
-	send_message(ls, DLM_MSG_DEADLK_CYCLE_START, 0, 0);
-}
-
-static void send_cycle_end(struct lockspace *ls)
-{
-	log_group(ls, "send_cycle_end");
-	send_message(ls, DLM_MSG_DEADLK_CYCLE_END, 0, 0);
-}
-
-static void send_cancel_lock(struct lockspace *ls, struct trans *tr,
-			     struct dlm_lkb *lkb)
+static void send_cancel_lock(struct lockspace *ls, struct dlm_lkb *lkb)
 {
 	int to_nodeid;
 	uint32_t lkid;
@@ -868,56 +712,30 @@ static void send_cancel_lock(struct lockspace *ls, struct trans *tr,
 		  to_nodeid, lkb->rsb->name, lkid,
 		  (unsigned long long)lkb->lock.xid);
 
-	send_message(ls, DLM_MSG_DEADLK_CANCEL_LOCK, to_nodeid, lkid);
-}
-
-static void dump_resources(struct lockspace *ls)
-{
-	struct dlm_rsb *r;
-	struct dlm_lkb *lkb;
-
-	log_group(ls, "Resource dump:");
-
-	list_for_each_entry(r, &ls->resources, list) {
-		log_group(ls, "\"%s\" len %d", r->name, r->len);
-		list_for_each_entry(lkb, &r->locks, list) {
-			log_group(ls, "  %s: nodeid %d id %08x remid %08x gr %s rq %s pid %u xid %llx",
-			  	  status_str(lkb->lock.status),
-				  lkb->lock.nodeid,
-			  	  lkb->lock.id,
-			  	  lkb->lock.remid,
-			  	  dlm_mode_str(lkb->lock.grmode),
-			          dlm_mode_str(lkb->lock.rqmode),
-			          lkb->lock.ownpid,
-				  (unsigned long long)lkb->lock.xid);
-		}
-	}
+	send_message(ls, DLM_MSG_DEADLK_CANCEL_LOCK, to_nodeid, lkid, 0);
 }
 
 static void find_deadlock(struct lockspace *ls);
 
 static void run_deadlock(struct lockspace *ls)
 {
-	struct node *node;
+	struct deadlk_node *node;
 	int not_ready = 0;
 	int low = -1;
 
-	if (ls->all_checkpoints_ready)
-		log_group(ls, "WARNING: run_deadlock all_checkpoints_ready");
+	if (ls->all_locks_ready)
+		log_group(ls, "WARNING: run_deadlock all_locks_ready");
 
 	list_for_each_entry(node, &ls->deadlk_nodes, list) {
 		if (!node->in_cycle)
 			continue;
-		if (!node->checkpoint_ready)
+		if (!node->locks_ready)
 			not_ready++;
-
-		log_group(ls, "nodeid %d checkpoint_ready = %d",
-			  node->nodeid, node->checkpoint_ready);
 	}
 	if (not_ready)
 		return;
 
-	ls->all_checkpoints_ready = 1;
+	ls->all_locks_ready = 1;
 
 	list_for_each_entry(node, &ls->deadlk_nodes, list) {
 		if (!node->in_cycle)
@@ -933,31 +751,61 @@ static void run_deadlock(struct lockspace *ls)
 		log_group(ls, "defer resolution to low nodeid %d", low);
 }
 
-void receive_checkpoint_ready(struct lockspace *ls, struct dlm_header *hd,
-			      int len)
+void receive_locks(struct lockspace *ls, struct dlm_header *hd, int len)
 {
-	struct node *node;
+	struct deadlk_graph *g = ls->deadlk;
+	struct deadlk_node *node;
+	struct pack_lock lock;
+	struct dlm_rsb *r;
+	char *p, *next, *end;
 	int nodeid = hd->nodeid;
+	int count = hd->msgdata;
+	int i;
 
-	log_group(ls, "receive_checkpoint_ready from %d", nodeid);
+	if (!ls->cycle_running) {
+		log_group(ls, "receive_locks from %d no cycle running", nodeid);
+		return;
+	}
 
-	read_checkpoint(ls, nodeid);
+	node = get_deadlk_node(ls, nodeid);
+	if (!node || !node->in_cycle) {
+		log_group(ls, "receive_locks from %d not in cycle", nodeid);
+		return;
+	}
 
-	list_for_each_entry(node, &ls->deadlk_nodes, list) {
-		if (node->nodeid == nodeid) {
-			node->checkpoint_ready = 1;
-			break;
-		}
+	p = (char *)hd + sizeof(struct dlm_header);
+	end = (char *)hd + len;
+
+	for (i = 0; i < count && g; i++) {
+		next = pack_lock_in(p, end, &lock);
+		if (!next)
+			goto bad;
+
+		r = get_resource(g, p + sizeof(struct pack_lock),
+				 lock.namelen);
+		if (r)
+			add_lock(ls, g, r, nodeid, &lock);
+		p = next;
 	}
 
+	if (!(hd->flags & DLM_MFLG_LAST))
+		return;
+
+	log_group(ls, "receive_locks from %d done, total locks %d", nodeid,
+		  g ? g->lkb_count : 0);
+
+	node->locks_ready = 1;
 	run_deadlock(ls);
+	return;
+ bad:
+	log_error("receive_locks from %d bad len %d count %d at %d",
+		  nodeid, len, count, i);
 }
 
 void receive_cycle_start(struct lockspace *ls, struct dlm_header *hd, int len)
 {
-	struct node *node;
+	struct deadlk_node *node;
 	int nodeid = hd->nodeid;
-	int rv;
 
 	log_group(ls, "receive_cycle_start from %d", nodeid);
 
@@ -966,19 +814,14 @@ void receive_cycle_start(struct lockspace *ls, struct dlm_header *hd, int len)
 		return;
 	}
 	ls->cycle_running = 1;
+	ls->deadlk_candidate = 0;
 	gettimeofday(&ls->cycle_start_time, NULL);
 
 	list_for_each_entry(node, &ls->deadlk_nodes, list)
 		node->in_cycle = 1;
 
-	rv = read_debugfs_locks(ls);
-	if (rv < 0) {
-		log_error("can't read dlm debugfs file: %s", strerror(errno));
-		return;
-	}
-
-	write_checkpoint(ls);
-	send_checkpoint_ready(ls);
+	create_graph(ls);
+	send_debugfs_locks(ls);
 }
 
 static uint64_t dt_usec(struct timeval *start, struct timeval *stop)
@@ -991,18 +834,18 @@ static uint64_t dt_usec(struct timeval *start, struct timeval *stop)
 	return dt;
 }
 
-/* TODO: nodes added during a cycle - what will they do with messages
-   they recv from other nodes running the cycle? */
+/* Nodes added during a cycle don't have in_cycle set; they don't send
+   locks, and ignore the locks and cycle_end of the current cycle. */
 
 void receive_cycle_end(struct lockspace *ls, struct dlm_header *hd, int len)
 {
-	struct node *node;
+	struct deadlk_node *node;
 	int nodeid = hd->nodeid;
 	uint64_t usec;
 
 	if (!ls->cycle_running) {
-		log_error("receive_cycle_end %s from %d: no cycle running",
-			  ls->name, nodeid);
+		log_group(ls, "receive_cycle_end from %d: no cycle running",
+			  nodeid);
 		return;
 	}
 
@@ -1012,14 +855,20 @@ void receive_cycle_end(struct lockspace *ls, struct dlm_header *hd, int len)
 		  nodeid, usec * 1.e-6);
 
 	ls->cycle_running = 0;
-	ls->all_checkpoints_ready = 0;
+	ls->all_locks_ready = 0;
 
-	list_for_each_entry(node, &ls->deadlk_nodes, list)
-		node->checkpoint_ready = 0;
+	list_for_each_entry(node, &ls->deadlk_nodes, list) {
+		node->locks_ready = 0;
+		node->in_cycle = 0;
+	}
 
-	free_resources(ls);
-	free_transactions(ls);
-	unlink_checkpoint(ls);
+	free_graph(ls);
+
+	/* victims were canceled, so blocked transactions have changed */
+	if (ls->deadlk_inc) {
+		ls->deadlk_refresh = 1;
+		poll_deadlk = 1;
+	}
 }
 
 void receive_cancel_lock(struct lockspace *ls, struct dlm_header *hd, int len)
@@ -1029,7 +878,7 @@ void receive_cancel_lock(struct lockspace *ls, struct dlm_header *hd, int len)
 	uint32_t lkid = hd->msgdata;
 	int rv;
 
-	if (nodeid != our_nodeid)
+	if (hd->to_nodeid != our_nodeid)
 		return;
 
 	h = dlm_open_lockspace(ls->name);
@@ -1043,7 +892,7 @@ void receive_cancel_lock(struct lockspace *ls, struct dlm_header *hd, int len)
 
 	rv = dlm_ls_deadlock_cancel(h, lkid, 0);
 	if (rv < 0) {
-		log_error("deadlock cancel %x from %x lib cancel errno %d",
+		log_error("deadlock cancel %x from %d lib cancel errno %d",
 			  lkid, nodeid, errno);
 	}
 
@@ -1052,15 +901,14 @@ void receive_cancel_lock(struct lockspace *ls, struct dlm_header *hd, int len)
 
 static void node_joined(struct lockspace *ls, int nodeid)
 {
-	struct node *node;
+	struct deadlk_node *node;
 
-	node = malloc(sizeof(struct node));
+	node = malloc(sizeof(struct deadlk_node));
 	if (!node) {
 		log_error("node_joined: no memory");
-		disable_deadlock();
 		return;
 	}
-	memset(node, 0, sizeof(struct node));
+	memset(node, 0, sizeof(struct deadlk_node));
 	node->nodeid = nodeid;
 	list_add_tail(&node->list, &ls->deadlk_nodes);
 	log_group(ls, "node %d joined deadlock cpg", nodeid);
@@ -1068,7 +916,7 @@ static void node_joined(struct lockspace *ls, int nodeid)
 
 static void node_left(struct lockspace *ls, int nodeid, int reason)
 {
-	struct node *node, *safe;
+	struct deadlk_node *node, *safe;
 
 	list_for_each_entry_safe(node, safe, &ls->deadlk_nodes, list) {
 		if (node->nodeid != nodeid)
@@ -1080,7 +928,28 @@ static void node_left(struct lockspace *ls, int nodeid, int reason)
 	}
 }
 
-static void purge_locks(struct lockspace *ls, int nodeid);
+static void inc_confchg(struct lockspace *ls,
+			const struct cpg_address *left_list,
+			size_t left_list_entries, size_t joined_list_entries);
+
+/* the locks of a node that left can't be part of a deadlock any longer */
+
+static void purge_locks(struct lockspace *ls, int nodeid)
+{
+	struct deadlk_graph *g = ls->deadlk;
+	struct dlm_rsb *r;
+	struct dlm_lkb *lkb;
+
+	if (!g)
+		return;
+
+	list_for_each_entry(r, &g->resources, list) {
+		list_for_each_entry(lkb, &r->locks, list) {
+			if (lkb->home == nodeid)
+				lkb->purged = 1;
+		}
+	}
+}
 
 void deadlk_confchg(struct lockspace *ls,
 		const struct cpg_address *member_list,
@@ -1092,7 +961,7 @@ void deadlk_confchg(struct lockspace *ls,
 {
 	int i;
 
-	if (!cfgd_enable_deadlk)
+	if (!opt(enable_deadlk_ind))
 		return;
 
 	if (!ls->deadlk_confchg_init) {
@@ -1111,447 +980,1263 @@ void deadlk_confchg(struct lockspace *ls,
 	for (i = 0; i < left_list_entries; i++)
 		node_left(ls, left_list[i].nodeid, left_list[i].reason);
 
+	if (opt(deadlk_incremental_ind))
+		inc_confchg(ls, left_list, left_list_entries,
+			    joined_list_entries);
+
 	if (!ls->cycle_running)
 		return;
 
 	if (!left_list_entries)
 		return;
 
-	if (!ls->all_checkpoints_ready) {
+	for (i = 0; i < left_list_entries; i++)
+		purge_locks(ls, left_list[i].nodeid);
+
+	if (!ls->all_locks_ready) {
 		run_deadlock(ls);
 		return;
 	}
 
-	for (i = 0; i < left_list_entries; i++)
-		purge_locks(ls, left_list[i].nodeid);
-
 	for (i = 0; i < left_list_entries; i++) {
 		if (left_list[i].nodeid != ls->deadlk_low_nodeid)
 			continue;
 		/* this will set a new low node which will call find_deadlock */
+		ls->all_locks_ready = 0;
 		run_deadlock(ls);
 		break;
 	}
 }
 
-/* would we ever call this after we've created the transaction lists?
-   I don't think so; I think it can only be called between reading
-   checkpoints */
-
-static void purge_locks(struct lockspace *ls, int nodeid)
+static struct trans *new_trans(struct deadlk_graph *g, uint64_t xid)
 {
-	struct dlm_rsb *r;
-	struct dlm_lkb *lkb, *safe;
-
-	list_for_each_entry(r, &ls->resources, list) {
-		list_for_each_entry_safe(lkb, safe, &r->locks, list) {
-			if (lkb->home == nodeid) {
-				list_del(&lkb->list);
-				if (list_empty(&lkb->trans_list))
-					free(lkb);
-				else
-					log_group(ls, "purge %d %x on trans",
-						  nodeid, lkb->lock.id);
-			}
+	struct trans *tr, **trans;
+
+	if (g->trans_count == g->trans_alloc) {
+		g->trans_alloc = g->trans_alloc ? g->trans_alloc * 2 : 256;
+		trans = realloc(g->trans, g->trans_alloc * sizeof(tr));
+		if (!trans) {
+			log_error("new_trans: no memory %u", g->trans_alloc);
+			return NULL;
 		}
+		g->trans = trans;
 	}
-}
 
-static void add_lkb_trans(struct trans *tr, struct dlm_lkb *lkb)
-{
-	list_add(&lkb->trans_list, &tr->locks);
-	lkb->trans = tr;
+	tr = malloc(sizeof(struct trans));
+	if (!tr) {
+		log_error("new_trans: no memory");
+		return NULL;
+	}
+	memset(tr, 0, sizeof(struct trans));
+	tr->xid = xid;
+	tr->num = g->trans_count;
+	INIT_LIST_HEAD(&tr->locks);
+	g->trans[g->trans_count++] = tr;
+	return tr;
 }
 
-static struct trans *get_trans(struct lockspace *ls, uint64_t xid)
+/* Locks without an xid were not requested as part of a transaction, so
+   each one is treated as a transaction by itself. */
+
+static struct trans *get_trans(struct deadlk_graph *g, uint64_t xid)
 {
+	struct deadlk_hent *e;
 	struct trans *tr;
+	uint32_t hval;
+
+	if (!xid)
+		return new_trans(g, xid);
+
+	hval = hash_u64(xid);
 
-	list_for_each_entry(tr, &ls->transactions, list) {
+	htab_for_each(e, &g->trans_hash, hval) {
+		tr = container_of(e, struct trans, hent);
 		if (tr->xid == xid)
 			return tr;
 	}
 
-	tr = malloc(sizeof(struct trans));
-	if (!tr) {
-		log_error("get_trans: no memory");
-		disable_deadlock();
-		return NULL;
-	}
-	memset(tr, 0, sizeof(struct trans));
-	tr->xid = xid;
-	tr->waitfor = NULL;
-	tr->waitfor_alloc = 0;
-	tr->waitfor_count = 0;
-	INIT_LIST_HEAD(&tr->locks);
-	list_add(&tr->list, &ls->transactions);
+	tr = new_trans(g, xid);
+	if (tr)
+		htab_add(&g->trans_hash, &tr->hent, hval);
 	return tr;
 }
 
 /* for each rsb, for each lock, find/create trans, add lkb to the trans list */
 
-static void create_trans_list(struct lockspace *ls)
+static int create_trans_list(struct lockspace *ls, struct deadlk_graph *g)
 {
 	struct dlm_rsb *r;
 	struct dlm_lkb *lkb;
 	struct trans *tr;
 	int r_count = 0, lkb_count = 0;
 
-	list_for_each_entry(r, &ls->resources, list) {
+	list_for_each_entry(r, &g->resources, list) {
 		r_count++;
 		list_for_each_entry(lkb, &r->locks, list) {
+			if (lkb->purged)
+				continue;
 			lkb_count++;
-			tr = get_trans(ls, lkb->lock.xid);
+			tr = get_trans(g, lkb->lock.xid);
 			if (!tr)
-				goto out;
-			add_lkb_trans(tr, lkb);
+				return -ENOMEM;
+			list_add(&lkb->trans_list, &tr->locks);
+			lkb->trans = tr;
+			if (lkb->lock.status != DLM_LKSTS_WAITING)
+				tr->held++;
 		}
 	}
- out:
-	log_group(ls, "create_trans_list: r_count %d lkb_count %d",
-		  r_count, lkb_count);
+
+	log_group(ls, "create_trans_list: r_count %d lkb_count %d trans %u",
+		  r_count, lkb_count, g->trans_count);
+	return 0;
 }
 
-static int locks_compat(struct dlm_lkb *waiting_lkb,
-			struct dlm_lkb *granted_lkb)
+static int add_edge(struct deadlk_graph *g, struct trans *to)
 {
-	if (waiting_lkb == granted_lkb) {
-		log_debug("waiting and granted same lock");
-		return 0;
-	}
-
-	if (waiting_lkb->trans->xid == granted_lkb->trans->xid) {
-		log_debug("waiting and granted same trans %llx",
-			  (unsigned long long)waiting_lkb->trans->xid);
-		return 0;
+	uint32_t *edges;
+
+	if (g->edge_count == g->edge_alloc) {
+		g->edge_alloc = g->edge_alloc ? g->edge_alloc * 2 : 1024;
+		edges = realloc(g->edges, g->edge_alloc * sizeof(uint32_t));
+		if (!edges) {
+			log_error("add_edge: no memory %u", g->edge_alloc);
+			return -ENOMEM;
+		}
+		g->edges = edges;
 	}
-
-	return dlm_modes_compat(granted_lkb->lock.grmode,
-				waiting_lkb->lock.rqmode);
+	g->edges[g->edge_count++] = to->num;
+	to->waiters++;
+	return 0;
 }
 
-static int in_waitfor(struct trans *tr, struct trans *add_tr)
+/* For each trans, for each waiting lock, go to rsb of the lock, find
+   granted locks on that rsb that block it, and add an edge from our trans
+   to the trans of the granted lock.  The edges of each trans are added
+   together, so edge_stamp keeps a trans from being added twice. */
+
+static int create_waitfor_graph(struct lockspace *ls, struct deadlk_graph *g)
 {
-	int i;
+	struct dlm_lkb *waiting_lkb, *granted_lkb;
+	struct trans *tr, *gr_tr;
+	uint32_t i;
 
-	for (i = 0; i < tr->waitfor_alloc; i++) {
-		if (!tr->waitfor[i])
-			continue;
-		if (tr->waitfor[i] == add_tr)
-			return 1;
+	g->edge_start = malloc((g->trans_count + 1) * sizeof(uint32_t));
+	if (!g->edge_start)
+		return -ENOMEM;
+
+	for (i = 0; i < g->trans_count; i++) {
+		tr = g->trans[i];
+		g->edge_start[i] = g->edge_count;
+
+		list_for_each_entry(waiting_lkb, &tr->locks, trans_list) {
+			if (waiting_lkb->lock.status == DLM_LKSTS_GRANTED)
+				continue;
+			/* waiting_lkb status is CONVERT or WAITING */
+
+			list_for_each_entry(granted_lkb, &waiting_lkb->rsb->locks,
+					    list) {
+				if (granted_lkb->purged)
+					continue;
+				if (granted_lkb->lock.status == DLM_LKSTS_WAITING)
+					continue;
+				/* granted_lkb status is GRANTED or CONVERT */
+
+				gr_tr = granted_lkb->trans;
+				if (gr_tr == tr || gr_tr->edge_stamp == i + 1)
+					continue;
+				if (dlm_modes_compat(granted_lkb->lock.grmode,
+						     waiting_lkb->lock.rqmode))
+					continue;
+
+				gr_tr->edge_stamp = i + 1;
+				if (add_edge(g, gr_tr) < 0)
+					return -ENOMEM;
+			}
+		}
 	}
+	g->edge_start[g->trans_count] = g->edge_count;
+
+	log_group(ls, "create_waitfor_graph: trans %u edges %u",
+		  g->trans_count, g->edge_count);
 	return 0;
 }
 
-static void add_waitfor(struct lockspace *ls, struct dlm_lkb *waiting_lkb,
-			struct dlm_lkb *granted_lkb)
+static void dump_trans(struct lockspace *ls, struct deadlk_graph *g,
+		       struct trans *tr)
 {
-	struct trans *tr = waiting_lkb->trans;
-	int i;
+	struct dlm_lkb *lkb;
+	uint32_t e;
 
-	if (locks_compat(waiting_lkb, granted_lkb))
-		return;
+	log_group(ls, "trans xid %llx held %d waiters %d",
+		  (unsigned long long)tr->xid, tr->held, tr->waiters);
 
-	/* this shouldn't happen AFAIK */
-	if (tr == granted_lkb->trans) {
-		log_group(ls, "trans %llx waiting on self",
-			  (unsigned long long)tr->xid);
-		return;
+	list_for_each_entry(lkb, &tr->locks, trans_list) {
+		log_group(ls, "  %s: id %08x gr %s rq %s pid %u:%u \"%s\"",
+			  status_str(lkb->lock.status),
+			  lkb->lock.id,
+			  dlm_mode_str(lkb->lock.grmode),
+			  dlm_mode_str(lkb->lock.rqmode),
+			  lkb->home,
+			  lkb->lock.ownpid,
+			  lkb->rsb->name);
 	}
 
-	/* don't add the same trans to the waitfor list multiple times */
-	if (tr->waitfor_count && in_waitfor(tr, granted_lkb->trans)) {
-		log_group(ls, "trans %llx already waiting for trans %llx, "
-			  "waiting %x %s, granted %x %s",
-			  (unsigned long long)waiting_lkb->trans->xid,
-			  (unsigned long long)granted_lkb->trans->xid,
-			  waiting_lkb->lock.id, waiting_lkb->rsb->name,
-			  granted_lkb->lock.id, granted_lkb->rsb->name);
-		return;
+	for (e = g->edge_start[tr->num]; e < g->edge_start[tr->num + 1]; e++)
+		log_group(ls, "  waitfor xid %llx",
+			  (unsigned long long)g->trans[g->edges[e]]->xid);
+}
+
+/* returns non-zero if a should be canceled rather than b */
+
+static int better_victim(struct trans *a, struct trans *b)
+{
+	switch (opt(deadlk_victim_ind)) {
+	case VICTIM_FEWEST_LOCKS:
+		if (a->held != b->held)
+			return a->held < b->held;
+		break;
+	case VICTIM_MOST_WAITERS:
+		if (a->waiters != b->waiters)
+			return a->waiters > b->waiters;
+		break;
 	}
+	return a->xid > b->xid;
+}
 
-	if (tr->waitfor_count == tr->waitfor_alloc) {
-		struct trans **old_waitfor = tr->waitfor;
-		tr->waitfor_alloc += TR_NALLOC;
-		tr->waitfor = malloc(tr->waitfor_alloc * sizeof(tr));
-		if (!tr->waitfor) {
-			log_error("add_waitfor no mem %u", tr->waitfor_alloc);
-			return;
-		}
-		memset(tr->waitfor, 0, tr->waitfor_alloc * sizeof(tr));
+/* the trans's in stack[0] .. stack[count-1] form a strongly connected
+   component of the waitfor graph, i.e. each is waiting on all the others */
+
+static void cancel_victim(struct lockspace *ls, struct deadlk_graph *g,
+			  uint32_t *stack, uint32_t count)
+{
+	struct trans *tr, *victim = NULL;
+	struct dlm_lkb *lkb;
+	uint32_t i;
+
+	log_group(ls, "found deadlock of %u transactions", count);
 
-		/* copy then free old set of pointers */
-		for (i = 0; i < tr->waitfor_count; i++)
-			tr->waitfor[i] = old_waitfor[i];
-		if (old_waitfor)
-			free(old_waitfor);
+	for (i = 0; i < count; i++) {
+		tr = g->trans[stack[i]];
+		if (i < DEADLK_DUMP_TRANS)
+			dump_trans(ls, g, tr);
+		if (!victim || better_victim(tr, victim))
+			victim = tr;
 	}
 
-	tr->waitfor[tr->waitfor_count++] = granted_lkb->trans;
-	granted_lkb->trans->others_waiting_on_us++;
-	waiting_lkb->waitfor_trans = granted_lkb->trans;
+	log_group(ls, "cancel trans xid %llx held %d waiters %d",
+		  (unsigned long long)victim->xid, victim->held,
+		  victim->waiters);
+
+	list_for_each_entry(lkb, &victim->locks, trans_list) {
+		if (lkb->lock.status == DLM_LKSTS_GRANTED)
+			continue;
+		send_cancel_lock(ls, lkb);
+	}
+	victim->canceled = 1;
 }
 
-/* for each trans, for each waiting lock, go to rsb of the lock,
-   find granted locks on that rsb, then find the trans the
-   granted lock belongs to, add that trans to our waitfor list */
+/* Tarjan's strongly connected components, without recursion: call[] holds
+   the trans's being visited, stack[] the trans's not yet assigned to a
+   component.  Every component of more than one trans is a deadlock, and a
+   victim is canceled in each.  Canceled trans's are left out of the search,
+   so repeating it finds any cycles that remain in a component after its
+   victim is removed.  Returns the number of deadlocks found. */
 
-static void create_waitfor_graph(struct lockspace *ls)
+static int find_sccs(struct lockspace *ls, struct deadlk_graph *g,
+		     uint32_t *call, uint32_t *stack)
 {
-	struct dlm_lkb *waiting_lkb, *granted_lkb;
-	struct dlm_rsb *r;
-	struct trans *tr;
-	int depend_count = 0;
+	struct trans *tr, *v, *w;
+	uint32_t index = 0, csp, sp = 0, start, root;
+	int found = 0;
 
-	list_for_each_entry(tr, &ls->transactions, list) {
-		list_for_each_entry(waiting_lkb, &tr->locks, trans_list) {
-			if (waiting_lkb->lock.status == DLM_LKSTS_GRANTED)
-				continue;
-			/* waiting_lkb status is CONVERT or WAITING */
+	for (root = 0; root < g->trans_count; root++) {
+		tr = g->trans[root];
+		tr->scc_index = 0;
+		tr->on_stack = 0;
+		tr->edge_pos = g->edge_start[root];
+	}
 
-			r = waiting_lkb->rsb;
+	for (root = 0; root < g->trans_count; root++) {
+		tr = g->trans[root];
+		if (tr->scc_index || tr->canceled)
+			continue;
 
-			list_for_each_entry(granted_lkb, &r->locks, list) {
-				if (granted_lkb->lock.status==DLM_LKSTS_WAITING)
+		tr->scc_index = tr->scc_low = ++index;
+		tr->on_stack = 1;
+		stack[sp++] = root;
+		call[0] = root;
+		csp = 1;
+
+		while (csp) {
+			v = g->trans[call[csp - 1]];
+
+			if (v->edge_pos < g->edge_start[v->num + 1]) {
+				w = g->trans[g->edges[v->edge_pos++]];
+				if (w->canceled)
 					continue;
-				/* granted_lkb status is GRANTED or CONVERT */
-				add_waitfor(ls, waiting_lkb, granted_lkb);
-				depend_count++;
+				if (!w->scc_index) {
+					w->scc_index = w->scc_low = ++index;
+					w->on_stack = 1;
+					stack[sp++] = w->num;
+					call[csp++] = w->num;
+				} else if (w->on_stack &&
+					   w->scc_index < v->scc_low) {
+					v->scc_low = w->scc_index;
+				}
+				continue;
+			}
+
+			csp--;
+			if (csp) {
+				w = g->trans[call[csp - 1]];
+				if (v->scc_low < w->scc_low)
+					w->scc_low = v->scc_low;
+			}
+
+			if (v->scc_low != v->scc_index)
+				continue;
+
+			/* v is the root of a component */
+			start = sp;
+			do {
+				w = g->trans[stack[--start]];
+				w->on_stack = 0;
+			} while (w != v);
+
+			if (sp - start > 1) {
+				cancel_victim(ls, g, stack + start, sp - start);
+				found++;
 			}
+			sp = start;
 		}
 	}
+	return found;
+}
+
+static void find_deadlock(struct lockspace *ls)
+{
+	struct deadlk_graph *g = ls->deadlk;
+	uint32_t *call = NULL, *stack = NULL;
+	int found, total = 0, passes = 0;
+
+	if (!g) {
+		log_error("%s no deadlock graph", ls->name);
+		goto out;
+	}
+
+	if (list_empty(&g->resources)) {
+		log_group(ls, "no deadlock: no resources");
+		goto out;
+	}
+
+	if (create_trans_list(ls, g) < 0 || create_waitfor_graph(ls, g) < 0)
+		goto fail;
 
-	log_group(ls, "create_waitfor_graph: depend_count %d", depend_count);
+	if (!g->trans_count) {
+		log_group(ls, "no deadlock: no locks");
+		goto out;
+	}
+
+	call = malloc(g->trans_count * sizeof(uint32_t));
+	stack = malloc(g->trans_count * sizeof(uint32_t));
+	if (!call || !stack)
+		goto fail;
+
+	do {
+		found = find_sccs(ls, g, call, stack);
+		total += found;
+		passes++;
+	} while (found && passes < DEADLK_MAX_PASSES);
+
+	if (!total)
+		log_group(ls, "no deadlock: trans %u edges %u",
+			  g->trans_count, g->edge_count);
+	else if (found)
+		log_error("%s canceled %d deadlocks, more remain after %d passes",
+			  ls->name, total, passes);
+	else
+		log_group(ls, "resolved %d deadlocks in %d passes",
+			  total, passes);
+	goto out;
+ fail:
+	log_error("%s deadlock detection no memory", ls->name);
+ out:
+	free(call);
+	free(stack);
+	send_cycle_end(ls);
 }
 
-/* Assume a transaction that's not waiting on any locks will complete, release
-   all the locks it currently holds, and exit.  Other transactions that were
-   blocked waiting on the removed transaction's now-released locks may now be
-   unblocked, complete, release all held locks and exit.  Repeat this until
-   no more transactions can be removed.  If there are transactions remaining,
-   then they are deadlocked. */
+/*
+ * Incremental mode (deadlk_incremental)
+ *
+ * Only transactions that are waiting can be part of a deadlock, and every
+ * lock waiting in a deadlock causes a kernel timewarn on the node where its
+ * owner lives.  So instead of collecting every lock in the lockspace after
+ * each timewarn, every node keeps a graph of just the blocked transactions:
+ *
+ * - a timewarn names the xid of the waiting lock; after timewarns, a node
+ *   collects the debugfs locks of just those xids and the blocked ones it
+ *   sent before, and sends the ones with a lock waiting longer than the
+ *   timewarn time in a deadlk_trans message, with an empty record for any
+ *   it sent before that is no longer blocked; unchanged transactions are
+ *   not sent again
+ * - every node replaces the locks of just those transactions in its graph,
+ *   which adds and removes their waitfor edges, and searches for cycles
+ *   only from those transactions
+ * - other transactions in a cycle may have changed since they were sent,
+ *   so the low nodeid starts a full cycle to confirm and resolve it
+ *
+ * The kernel has no debugfs file for one xid, so the _locks file is still
+ * read, but lines of other xids are skipped after parsing the xid.  While a
+ * node has blocked transactions, it refreshes them every DEADLK_REFRESH_SECS
+ * to remove the ones that are no longer blocked.
+ */
 
-static void remove_waitfor(struct trans *tr, struct trans *remove_tr)
-{
-	int i;
+#define DEADLK_REFRESH_SECS	10
 
-	for (i = 0; i < tr->waitfor_alloc; i++) {
-		if (!tr->waitfor_count)
-			break;
+/* used for the blocked time when the timewarn option is not set, the
+   default kernel timewarn_cs */
+#define DEADLK_WARN_US		5000000ULL
 
-		if (!tr->waitfor[i])
-			continue;
+struct inc_lock {
+	struct list_head	list;		/* tr->locks */
+	struct list_head	rsb_list;	/* r->locks */
+	struct inc_trans	*trans;
+	struct inc_rsb		*rsb;
+	uint32_t		id;
+	int8_t			status;
+	int8_t			grmode;
+	int8_t			rqmode;
+};
+
+struct inc_rsb {
+	struct deadlk_hent	hent;
+	struct list_head	locks;
+	int			len;
+	char			name[DLM_RESNAME_MAXLEN+1];
+};
+
+struct inc_trans {
+	struct deadlk_hent	hent;
+	struct list_head	list;		/* inc->trans */
+	struct list_head	locks;
+	uint64_t		xid;
+	int			nodeid;		/* where the owner lives */
+	int			lock_count;
+	uint32_t		sig;		/* sum of lock_sig()'s */
+	int			blocked;	/* refresh_own_trans */
+
+	/* scc search */
+	uint32_t		search;		/* inc->search when visited */
+	uint32_t		scc_index;
+	uint32_t		scc_low;
+	int			on_stack;
+	uint32_t		edge_stamp;
+	struct inc_trans	**edges;
+	int			edge_count;
+	int			edge_alloc;
+	int			edge_pos;
+};
 
-		if (tr->waitfor[i] == remove_tr) {
-			tr->waitfor[i] = NULL;
-			tr->waitfor_count--;
-			remove_tr->others_waiting_on_us--;
+struct deadlk_inc {
+	struct deadlk_htab	rsb_hash;
+	struct deadlk_htab	trans_hash;
+	struct list_head	trans;
+	int			trans_count;
+	int			own_count;	/* trans's with our nodeid */
+	uint64_t		*warn_xids;	/* timewarns since the last refresh */
+	int			warn_count;
+	int			warn_alloc;
+	uint32_t		search;
+	uint32_t		stamp;
+};
+
+/* one transaction in a DLM_MSG_DEADLK_TRANS message, followed by count
+   pack_lock records; count is 0 when it's no longer blocked */
+
+struct pack_trans {
+	uint64_t		xid;
+	uint32_t		count;
+	uint32_t		pad;
+};
+
+static void htab_del(struct deadlk_htab *t, struct deadlk_hent *e)
+{
+	struct deadlk_hent **pp;
+
+	for (pp = &t->buckets[e->hval & (t->size - 1)]; *pp; pp = &(*pp)->next) {
+		if (*pp == e) {
+			*pp = e->next;
+			t->count--;
+			return;
 		}
 	}
 }
 
-/* remove_tr is not waiting for anything, assume it completes and goes away
-   and remove it from any other transaction's waitfor list */
+static struct deadlk_inc *create_inc(void)
+{
+	struct deadlk_inc *inc;
+
+	inc = malloc(sizeof(struct deadlk_inc));
+	if (!inc)
+		return NULL;
+	memset(inc, 0, sizeof(struct deadlk_inc));
+	INIT_LIST_HEAD(&inc->trans);
+
+	if (htab_init(&inc->rsb_hash) || htab_init(&inc->trans_hash)) {
+		free(inc->rsb_hash.buckets);
+		free(inc);
+		return NULL;
+	}
+	return inc;
+}
+
+static struct inc_trans *inc_find_trans(struct deadlk_inc *inc, uint64_t xid)
+{
+	struct deadlk_hent *e;
+	struct inc_trans *tr;
+	uint32_t hval = hash_u64(xid);
+
+	htab_for_each(e, &inc->trans_hash, hval) {
+		tr = container_of(e, struct inc_trans, hent);
+		if (tr->xid == xid)
+			return tr;
+	}
+	return NULL;
+}
 
-static void remove_trans(struct lockspace *ls, struct trans *remove_tr)
+static struct inc_trans *inc_new_trans(struct deadlk_inc *inc, uint64_t xid,
+				       int nodeid)
 {
-	struct trans *tr;
+	struct inc_trans *tr;
 
-	list_for_each_entry(tr, &ls->transactions, list) {
-		if (tr == remove_tr)
-			continue;
-		if (!remove_tr->others_waiting_on_us)
+	tr = malloc(sizeof(struct inc_trans));
+	if (!tr) {
+		log_error("inc_new_trans: no memory");
+		return NULL;
+	}
+	memset(tr, 0, sizeof(struct inc_trans));
+	tr->xid = xid;
+	tr->nodeid = nodeid;
+	INIT_LIST_HEAD(&tr->locks);
+	list_add_tail(&tr->list, &inc->trans);
+	htab_add(&inc->trans_hash, &tr->hent, hash_u64(xid));
+	inc->trans_count++;
+	if (nodeid == our_nodeid) {
+		inc->own_count++;
+		poll_deadlk = 1;
+	}
+	return tr;
+}
+
+static uint32_t lock_sig(struct inc_lock *lk)
+{
+	return hash_u64((uint64_t)lk->id << 32 |
+			(uint32_t)(uint8_t)lk->status << 16 |
+			(uint32_t)(uint8_t)lk->grmode << 8 |
+			(uint8_t)lk->rqmode) + lk->rsb->hent.hval;
+}
+
+static int inc_add_lock(struct deadlk_inc *inc, struct inc_trans *tr,
+			struct pack_lock *lock, char *name)
+{
+	struct deadlk_hent *e;
+	struct inc_rsb *r = NULL;
+	struct inc_lock *lk;
+	uint32_t hval;
+
+	hval = cpgname_to_crc(name, lock->namelen);
+
+	htab_for_each(e, &inc->rsb_hash, hval) {
+		r = container_of(e, struct inc_rsb, hent);
+		if (r->len == lock->namelen && !memcmp(r->name, name, r->len))
 			break;
-		remove_waitfor(tr, remove_tr);
+		r = NULL;
+	}
+
+	if (!r) {
+		r = malloc(sizeof(struct inc_rsb));
+		if (!r)
+			return -ENOMEM;
+		memset(r, 0, sizeof(struct inc_rsb));
+		memcpy(r->name, name, lock->namelen);
+		r->len = lock->namelen;
+		INIT_LIST_HEAD(&r->locks);
+		htab_add(&inc->rsb_hash, &r->hent, hval);
+	}
+
+	lk = malloc(sizeof(struct inc_lock));
+	if (!lk) {
+		if (list_empty(&r->locks)) {
+			htab_del(&inc->rsb_hash, &r->hent);
+			free(r);
+		}
+		return -ENOMEM;
+	}
+	lk->trans = tr;
+	lk->rsb = r;
+	lk->id = lock->id;
+	lk->status = lock->status;
+	lk->grmode = lock->grmode;
+	lk->rqmode = lock->rqmode;
+	list_add_tail(&lk->list, &tr->locks);
+	list_add_tail(&lk->rsb_list, &r->locks);
+	tr->lock_count++;
+	tr->sig += lock_sig(lk);
+	return 0;
+}
+
+static void inc_clear_locks(struct deadlk_inc *inc, struct inc_trans *tr)
+{
+	struct inc_lock *lk, *safe;
+	struct inc_rsb *r;
+
+	list_for_each_entry_safe(lk, safe, &tr->locks, list) {
+		r = lk->rsb;
+		list_del(&lk->list);
+		list_del(&lk->rsb_list);
+		free(lk);
+
+		if (list_empty(&r->locks)) {
+			htab_del(&inc->rsb_hash, &r->hent);
+			free(r);
+		}
 	}
+	tr->lock_count = 0;
+	tr->sig = 0;
+}
+
+static void inc_del_trans(struct deadlk_inc *inc, struct inc_trans *tr)
+{
+	inc_clear_locks(inc, tr);
+	htab_del(&inc->trans_hash, &tr->hent);
+	list_del(&tr->list);
+	inc->trans_count--;
+	if (tr->nodeid == our_nodeid)
+		inc->own_count--;
+	free(tr->edges);
+	free(tr);
+}
 
-	if (remove_tr->others_waiting_on_us)
-		log_group(ls, "trans %llx removed others waiting %d",
-			  (unsigned long long)remove_tr->xid,
-			  remove_tr->others_waiting_on_us);
+static void free_inc(struct deadlk_inc *inc)
+{
+	struct inc_trans *tr, *safe;
+
+	if (!inc)
+		return;
+
+	list_for_each_entry_safe(tr, safe, &inc->trans, list)
+		inc_del_trans(inc, tr);
+
+	free(inc->warn_xids);
+	free(inc->rsb_hash.buckets);
+	free(inc->trans_hash.buckets);
+	free(inc);
 }
 
-static int reduce_waitfor_graph(struct lockspace *ls)
+/* the trans's that tr is waiting on; only blocked trans's are in the graph,
+   and those are the only ones that can be part of a cycle */
+
+static int inc_edges(struct deadlk_inc *inc, struct inc_trans *tr)
 {
-	struct trans *tr, *safe;
-	int blocked = 0;
-	int removed = 0;
+	struct inc_lock *wait, *hold;
+	struct inc_trans **edges;
+	uint32_t stamp = ++inc->stamp;
 
-	list_for_each_entry_safe(tr, safe, &ls->transactions, list) {
-		if (tr->waitfor_count) {
-			blocked++;
+	tr->edge_count = 0;
+	tr->edge_pos = 0;
+
+	list_for_each_entry(wait, &tr->locks, list) {
+		if (wait->status == DLM_LKSTS_GRANTED)
 			continue;
+
+		list_for_each_entry(hold, &wait->rsb->locks, rsb_list) {
+			if (hold->trans == tr || hold->status == DLM_LKSTS_WAITING)
+				continue;
+			if (hold->trans->edge_stamp == stamp)
+				continue;
+			if (dlm_modes_compat(hold->grmode, wait->rqmode))
+				continue;
+
+			if (tr->edge_count == tr->edge_alloc) {
+				tr->edge_alloc = tr->edge_alloc ? tr->edge_alloc * 2 : 4;
+				edges = realloc(tr->edges, tr->edge_alloc *
+						sizeof(struct inc_trans *));
+				if (!edges)
+					return -ENOMEM;
+				tr->edges = edges;
+			}
+			hold->trans->edge_stamp = stamp;
+			tr->edges[tr->edge_count++] = hold->trans;
 		}
-		remove_trans(ls, tr);
-		list_del(&tr->list);
-		if (tr->waitfor)
-			free(tr->waitfor);
-		free(tr);
-		removed++;
 	}
+	return 0;
+}
+
+/* Tarjan's strongly connected components, as in find_sccs(), but only
+   through the trans's reachable from the roots. */
+
+static int inc_search(struct lockspace *ls, struct deadlk_inc *inc,
+		      struct inc_trans **roots, int nroots)
+{
+	struct inc_trans **call, **stack, *v, *w;
+	uint32_t search = ++inc->search;
+	uint32_t index = 0;
+	int csp, sp = 0, start, i, j;
+	int found = 0;
+
+	call = malloc(inc->trans_count * sizeof(struct inc_trans *));
+	stack = malloc(inc->trans_count * sizeof(struct inc_trans *));
+	if (!call || !stack)
+		goto fail;
+
+	for (i = 0; i < nroots; i++) {
+		v = roots[i];
+		if (v->search == search)
+			continue;
+
+		v->search = search;
+		v->scc_index = v->scc_low = ++index;
+		v->on_stack = 1;
+		if (inc_edges(inc, v) < 0)
+			goto fail;
+		stack[sp++] = v;
+		call[0] = v;
+		csp = 1;
+
+		while (csp) {
+			v = call[csp - 1];
+
+			if (v->edge_pos < v->edge_count) {
+				w = v->edges[v->edge_pos++];
+				if (w->search != search) {
+					w->search = search;
+					w->scc_index = w->scc_low = ++index;
+					w->on_stack = 1;
+					if (inc_edges(inc, w) < 0)
+						goto fail;
+					stack[sp++] = w;
+					call[csp++] = w;
+				} else if (w->on_stack &&
+					   w->scc_index < v->scc_low) {
+					v->scc_low = w->scc_index;
+				}
+				continue;
+			}
+
+			csp--;
+			if (csp) {
+				w = call[csp - 1];
+				if (v->scc_low < w->scc_low)
+					w->scc_low = v->scc_low;
+			}
+
+			if (v->scc_low != v->scc_index)
+				continue;
 
-	log_group(ls, "reduce_waitfor_graph: %d blocked, %d removed",
-		  blocked, removed);
-	return removed;
+			start = sp;
+			do {
+				w = stack[--start];
+				w->on_stack = 0;
+			} while (w != v);
+
+			if (sp - start > 1) {
+				log_group(ls, "blocked transactions in a cycle:");
+				for (j = start; j < sp && j < start + DEADLK_DUMP_TRANS; j++)
+					log_group(ls, "  xid %llx nodeid %d locks %d",
+						  (unsigned long long)stack[j]->xid,
+						  stack[j]->nodeid,
+						  stack[j]->lock_count);
+				found++;
+			}
+			sp = start;
+		}
+	}
+	free(call);
+	free(stack);
+	return found;
+ fail:
+	log_error("%s inc_search no memory", ls->name);
+	free(call);
+	free(stack);
+	return 0;
 }
 
-static void reduce_waitfor_graph_loop(struct lockspace *ls)
+static int low_deadlk_nodeid(struct lockspace *ls)
 {
-	int removed;
+	struct deadlk_node *node;
+	int low = -1;
 
-	while (1) {
-		removed = reduce_waitfor_graph(ls);
-		if (!removed)
-			break;
+	list_for_each_entry(node, &ls->deadlk_nodes, list) {
+		if (node->nodeid < low || low == -1)
+			low = node->nodeid;
 	}
+	return low;
 }
 
-static struct trans *find_trans_to_cancel(struct lockspace *ls)
+/* don't send a new start until at least DEADLK_CHECK_SECS after the last
+   we sent, and at least DEADLK_CHECK_SECS after the last completed cycle */
+
+int request_cycle_start(struct lockspace *ls)
 {
-	struct trans *tr;
+	struct timeval now;
+	unsigned int sec;
 
-	list_for_each_entry(tr, &ls->transactions, list) {
-		if (!tr->others_waiting_on_us)
-			continue;
-		return tr;
+	if (ls->cycle_running)
+		return -EBUSY;
+
+	gettimeofday(&now, NULL);
+
+	sec = now.tv_sec - ls->last_send_cycle_start.tv_sec;
+
+	if (sec < DEADLK_CHECK_SECS) {
+		log_group(ls, "skip send: recent send cycle %d sec", sec);
+		return -EAGAIN;
 	}
-	return NULL;
+
+	sec = now.tv_sec - ls->cycle_end_time.tv_sec;
+
+	if (sec < DEADLK_CHECK_SECS) {
+		log_group(ls, "skip send: recent cycle end %d sec", sec);
+		return -EAGAIN;
+	}
+
+	gettimeofday(&ls->last_send_cycle_start, NULL);
+	send_cycle_start(ls);
+	return 0;
 }
 
-static void cancel_trans(struct lockspace *ls)
+/* a cycle was found among the blocked transactions; the low nodeid starts
+   a full cycle, retried from process_deadlk() if one was recently done */
+
+static void check_candidate(struct lockspace *ls)
 {
-	struct trans *tr;
-	struct dlm_lkb *lkb;
-	int removed;
+	if (!ls->deadlk_candidate)
+		return;
 
-	tr = find_trans_to_cancel(ls);
-	if (!tr) {
-		log_group(ls, "cancel_trans: no trans found");
+	if (low_deadlk_nodeid(ls) != our_nodeid) {
+		ls->deadlk_candidate = 0;
 		return;
 	}
 
-	list_for_each_entry(lkb, &tr->locks, trans_list) {
-		if (lkb->lock.status == DLM_LKSTS_GRANTED)
+	if (!request_cycle_start(ls))
+		ls->deadlk_candidate = 0;
+	else
+		poll_deadlk = 1;
+}
+
+void receive_trans(struct lockspace *ls, struct dlm_header *hd, int len)
+{
+	struct deadlk_inc *inc;
+	struct inc_trans *tr, **roots;
+	struct pack_trans pt;
+	struct pack_lock lock;
+	char *p, *next, *end;
+	int nodeid = hd->nodeid;
+	int count = hd->msgdata;
+	int nroots = 0;
+	int i, j, k;
+
+	if (!opt(deadlk_incremental_ind))
+		return;
+
+	if (!ls->deadlk_inc) {
+		ls->deadlk_inc = create_inc();
+		if (!ls->deadlk_inc) {
+			log_error("%s receive_trans no memory", ls->name);
+			return;
+		}
+	}
+	inc = ls->deadlk_inc;
+
+	roots = malloc(count * sizeof(struct inc_trans *));
+	if (!roots && count) {
+		log_error("%s receive_trans no memory", ls->name);
+		return;
+	}
+
+	p = (char *)hd + sizeof(struct dlm_header);
+	end = (char *)hd + len;
+
+	for (i = 0; i < count; i++) {
+		if (end - p < sizeof(struct pack_trans))
+			goto bad;
+		memcpy(&pt, p, sizeof(struct pack_trans));
+		pt.xid = le64_to_cpu(pt.xid);
+		pt.count = le32_to_cpu(pt.count);
+		p += sizeof(struct pack_trans);
+
+		tr = inc_find_trans(inc, pt.xid);
+		if (tr && tr->nodeid != nodeid)
+			log_group(ls, "receive_trans xid %llx from %d was %d",
+				  (unsigned long long)pt.xid, nodeid,
+				  tr->nodeid);
+
+		if (tr && !pt.count) {
+			/* only the owner's node can say it's no longer blocked */
+			if (tr->nodeid != nodeid)
+				continue;
+			for (j = 0; j < nroots; j++) {
+				if (roots[j] == tr)
+					roots[j] = roots[--nroots];
+			}
+			inc_del_trans(inc, tr);
 			continue;
-		send_cancel_lock(ls, tr, lkb);
+		}
 
-		/* When this canceled trans has multiple locks all blocked by
-		   locks held by one other trans, that other trans is only
-		   added to tr->waitfor once, and only one of these waiting
-		   locks will have waitfor_trans set.  So, the lkb with
-		   non-null waitfor_trans was the first one responsible
-		   for adding waitfor_trans to tr->waitfor.
+		if (tr && tr->nodeid != nodeid) {
+			inc_del_trans(inc, tr);
+			tr = NULL;
+		}
 
-		   We could potentially forget about keeping track of lkb->
-		   waitfor_trans, forget about calling remove_waitfor()
-		   here and just set tr->waitfor_count = 0 after this loop.
-		   The loss would be that waitfor_trans->others_waiting_on_us
-		   would not get decremented. */
+		if (tr)
+			inc_clear_locks(inc, tr);
+		else if (pt.count)
+			tr = inc_new_trans(inc, pt.xid, nodeid);
+
+		for (k = 0; k < pt.count; k++) {
+			next = pack_lock_in(p, end, &lock);
+			if (!next)
+				goto bad;
+			if (tr && inc_add_lock(inc, tr, &lock,
+					       p + sizeof(struct pack_lock)) < 0)
+				log_error("%s receive_trans no memory", ls->name);
+			p = next;
+		}
 
-		if (lkb->waitfor_trans)
-			remove_waitfor(tr, lkb->waitfor_trans);
+		if (tr)
+			roots[nroots++] = tr;
 	}
 
-	/* this shouldn't happen, if it does something's not working right */
-	if (tr->waitfor_count) {
-		log_group(ls, "cancel_trans: %llx non-zero waitfor_count %d",
-			  (unsigned long long)tr->xid, tr->waitfor_count);
+	log_group(ls, "receive_trans from %d count %d blocked %d",
+		  nodeid, count, inc->trans_count);
+
+	if (nroots && inc_search(ls, inc, roots, nroots)) {
+		ls->deadlk_candidate = 1;
+		check_candidate(ls);
 	}
+	free(roots);
+	return;
+ bad:
+	log_error("receive_trans from %d bad len %d count %d at %d",
+		  nodeid, len, count, i);
+	free(roots);
+}
+
+struct trans_msg {
+	char			*buf;
+	int			len;
+	int			alloc;
+	int			count;
+};
+
+static void trans_msg_send(struct lockspace *ls, struct trans_msg *m)
+{
+	struct dlm_header *hd = (struct dlm_header *)m->buf;
+
+	if (!m->count)
+		return;
 
-	/* this should now remove the canceled trans since it now has a zero
-	   waitfor_count */
-	removed = reduce_waitfor_graph(ls);
+	memset(hd, 0, sizeof(struct dlm_header));
+	hd->type = DLM_MSG_DEADLK_TRANS;
+	hd->msgdata = m->count;
 
-	if (!removed)
-		log_group(ls, "canceled trans not removed from graph");
+	dlm_send_message(ls, m->buf, m->len);
 
-	/* now call reduce_waitfor_graph() in another loop and it
-	   should completely reduce */
+	m->len = sizeof(struct dlm_header);
+	m->count = 0;
 }
 
-static void dump_trans(struct lockspace *ls, struct trans *tr)
+/* a trans is never split between messages, so a message may be larger than
+   DEADLK_MSG_MAX when one trans has many locks */
+
+static int trans_msg_add(struct lockspace *ls, struct trans_msg *m,
+			 struct inc_trans *tr, uint64_t xid)
 {
-	struct dlm_lkb *lkb;
-	struct trans *wf;
+	struct pack_trans *pt;
+	struct pack_lock lock;
+	struct inc_lock *lk;
+	int need;
+	char *buf;
+
+	need = sizeof(struct pack_trans);
+	if (tr) {
+		list_for_each_entry(lk, &tr->locks, list)
+			need += PACK_LOCK_LEN(lk->rsb->len);
+	}
+
+	if (m->count && m->len + need > DEADLK_MSG_MAX)
+		trans_msg_send(ls, m);
+
+	if (!m->buf || m->len + need > m->alloc) {
+		if (!m->buf)
+			m->len = sizeof(struct dlm_header);
+		buf = realloc(m->buf, m->len + need > DEADLK_MSG_MAX ?
+				      m->len + need : DEADLK_MSG_MAX);
+		if (!buf)
+			return -ENOMEM;
+		m->buf = buf;
+		m->alloc = m->len + need > DEADLK_MSG_MAX ?
+			   m->len + need : DEADLK_MSG_MAX;
+	}
+
+	memset(m->buf + m->len, 0, need);
+	pt = (struct pack_trans *)(m->buf + m->len);
+	pt->xid = cpu_to_le64(xid);
+	pt->count = cpu_to_le32(tr ? tr->lock_count : 0);
+	m->len += sizeof(struct pack_trans);
+
+	if (tr) {
+		list_for_each_entry(lk, &tr->locks, list) {
+			memset(&lock, 0, sizeof(lock));
+			lock.xid = xid;
+			lock.id = lk->id;
+			lock.status = lk->status;
+			lock.grmode = lk->grmode;
+			lock.rqmode = lk->rqmode;
+			lock.copy = LOCAL_COPY;
+			lock.namelen = lk->rsb->len;
+			pack_lock_out(&lock, m->buf + m->len, lk->rsb->name);
+			m->len += PACK_LOCK_LEN(lk->rsb->len);
+		}
+	}
+	m->count++;
+	return 0;
+}
+
+/* the debugfs copy is ours if it's a local copy or a process copy */
+
+static int our_lock(struct pack_lock *lock)
+{
+	return !lock->nodeid || !(lock->flags & IFL_MSTCPY);
+}
+
+/* Read the locks of the trans's named by timewarns since the last refresh,
+   and of our blocked trans's, and send the ones that are new or changed
+   since we last sent them, and the ones that are no longer blocked.  Only
+   the xid is parsed from the lines of other trans's. */
+
+static void refresh_own_trans(struct lockspace *ls)
+{
+	struct deadlk_inc *cur, *inc = ls->deadlk_inc;
+	struct inc_trans *tr, *old, *safe;
+	struct trans_msg m;
+	struct pack_lock lock;
+	char line[LOCK_LINE_MAX];
+	char r_name[DLM_RESNAME_MAXLEN];
+	unsigned long long xid, waiting, warn_us;
+	FILE *file;
 	int i;
 
-	log_group(ls, "trans xid %llx waitfor_count %d others_waiting_on_us %d",
-		  (unsigned long long)tr->xid, tr->waitfor_count,
-		  tr->others_waiting_on_us);
+	ls->deadlk_refresh = 0;
+	ls->deadlk_refresh_time = monotime();
 
-	log_group(ls, "locks:");
-	
-	list_for_each_entry(lkb, &tr->locks, trans_list) {
-		log_group(ls, "  %s: id %08x gr %s rq %s pid %u:%u \"%s\"",
-			  status_str(lkb->lock.status),
-			  lkb->lock.id,
-			  dlm_mode_str(lkb->lock.grmode),
-			  dlm_mode_str(lkb->lock.rqmode),
-			  lkb->home,
-			  lkb->lock.ownpid,
-			  lkb->rsb->name);
+	if (!inc || (!inc->warn_count && !inc->own_count))
+		return;
+
+	/* timewarn is in centiseconds */
+	warn_us = opt(timewarn_ind) ? opt(timewarn_ind) * 10000ULL : DEADLK_WARN_US;
+
+	cur = create_inc();
+	if (!cur)
+		goto out_warn;
+
+	for (i = 0; i < inc->warn_count; i++) {
+		if (!inc_find_trans(cur, inc->warn_xids[i]) &&
+		    !inc_new_trans(cur, inc->warn_xids[i], our_nodeid))
+			goto out_warn;
+	}
+
+	list_for_each_entry(old, &inc->trans, list) {
+		if (old->nodeid != our_nodeid)
+			continue;
+		if (!inc_find_trans(cur, old->xid) &&
+		    !inc_new_trans(cur, old->xid, our_nodeid))
+			goto out_warn;
+	}
+	inc->warn_count = 0;
+
+	file = open_debugfs_locks(ls);
+	if (!file)
+		goto out_cur;
+
+	while (fgets(line, LOCK_LINE_MAX, file)) {
+		if (sscanf(line, "%*x %*d %*x %*u %llu", &xid) != 1)
+			continue;
+		tr = inc_find_trans(cur, xid);
+		if (!tr)
+			continue;
+		if (parse_lock_line(line, &lock, r_name, &waiting) < 0)
+			goto out_file;
+		if (!our_lock(&lock))
+			continue;
+		if (inc_add_lock(cur, tr, &lock, r_name) < 0)
+			goto out_file;
+		if (lock.status != DLM_LKSTS_GRANTED && waiting >= warn_us)
+			tr->blocked = 1;
+	}
+
+	list_for_each_entry_safe(tr, safe, &cur->trans, list) {
+		if (!tr->blocked)
+			inc_del_trans(cur, tr);
 	}
 
-	if (!tr->waitfor_count)
+	if (!cur->trans_count && !inc->own_count)
+		goto out_file;
+
+	memset(&m, 0, sizeof(m));
+
+	list_for_each_entry(tr, &cur->trans, list) {
+		old = inc_find_trans(inc, tr->xid);
+		if (old && old->nodeid == our_nodeid &&
+		    old->lock_count == tr->lock_count && old->sig == tr->sig)
+			continue;
+		if (trans_msg_add(ls, &m, tr, tr->xid) < 0)
+			goto out_mem;
+	}
+
+	list_for_each_entry(old, &inc->trans, list) {
+		if (old->nodeid != our_nodeid)
+			continue;
+		if (inc_find_trans(cur, old->xid))
+			continue;
+		if (trans_msg_add(ls, &m, NULL, old->xid) < 0)
+			goto out_mem;
+	}
+
+	log_group(ls, "refresh_own_trans blocked %d send %d",
+		  cur->trans_count, m.count);
+	trans_msg_send(ls, &m);
+	goto out_buf;
+ out_mem:
+	log_error("%s refresh_own_trans no memory", ls->name);
+ out_buf:
+	free(m.buf);
+ out_file:
+	fclose(file);
+ out_cur:
+	free_inc(cur);
+	return;
+ out_warn:
+	log_error("%s refresh_own_trans no memory", ls->name);
+	inc->warn_count = 0;
+	free_inc(cur);
+}
+
+/* a joining node has none of the blocked trans's, so everyone sends theirs */
+
+static void send_own_trans(struct lockspace *ls)
+{
+	struct deadlk_inc *inc = ls->deadlk_inc;
+	struct inc_trans *tr;
+	struct trans_msg m;
+
+	if (!inc || !inc->own_count)
 		return;
 
-	log_group(ls, "waitfor:");
+	memset(&m, 0, sizeof(m));
 
-	for (i = 0; i < tr->waitfor_alloc; i++) {
-		if (!tr->waitfor[i])
+	list_for_each_entry(tr, &inc->trans, list) {
+		if (tr->nodeid != our_nodeid)
 			continue;
-		wf = tr->waitfor[i];
-		log_group(ls, "  xid %llx", (unsigned long long)wf->xid);
+		if (trans_msg_add(ls, &m, tr, tr->xid) < 0) {
+			log_error("%s send_own_trans no memory", ls->name);
+			break;
+		}
 	}
+	trans_msg_send(ls, &m);
+	free(m.buf);
 }
 
-static void dump_all_trans(struct lockspace *ls)
+static void inc_confchg(struct lockspace *ls,
+			const struct cpg_address *left_list,
+			size_t left_list_entries, size_t joined_list_entries)
 {
-	struct trans *tr;
+	struct deadlk_inc *inc = ls->deadlk_inc;
+	struct inc_trans *tr, *safe;
+	int i;
+
+	if (!inc)
+		return;
 
-	log_group(ls, "Transaction dump:");
+	for (i = 0; i < left_list_entries; i++) {
+		list_for_each_entry_safe(tr, safe, &inc->trans, list) {
+			if (tr->nodeid == left_list[i].nodeid)
+				inc_del_trans(inc, tr);
+		}
+	}
 
-	list_for_each_entry(tr, &ls->transactions, list)
-		dump_trans(ls, tr);
+	if (joined_list_entries)
+		send_own_trans(ls);
 }
 
-static void find_deadlock(struct lockspace *ls)
+/* only locks in a transaction can be part of a deadlock between trans's */
+
+void deadlk_timewarn(struct lockspace *ls, uint64_t xid)
 {
-	if (list_empty(&ls->resources)) {
-		log_group(ls, "no deadlock: no resources");
-		goto out;
+	struct deadlk_inc *inc;
+	uint64_t *xids;
+	int alloc;
+
+	if (!xid)
+		return;
+
+	if (!ls->deadlk_inc) {
+		ls->deadlk_inc = create_inc();
+		if (!ls->deadlk_inc)
+			goto fail;
 	}
+	inc = ls->deadlk_inc;
 
-	if (!list_empty(&ls->transactions)) {
-		log_group(ls, "transactions list should be empty");
-		goto out;
+	if (inc->warn_count == inc->warn_alloc) {
+		alloc = inc->warn_alloc ? inc->warn_alloc * 2 : 16;
+		xids = realloc(inc->warn_xids, alloc * sizeof(uint64_t));
+		if (!xids)
+			goto fail;
+		inc->warn_xids = xids;
+		inc->warn_alloc = alloc;
 	}
+	inc->warn_xids[inc->warn_count++] = xid;
 
-	dump_resources(ls);
-	create_trans_list(ls);
-	create_waitfor_graph(ls);
-	dump_all_trans(ls);
-	reduce_waitfor_graph_loop(ls);
+	ls->deadlk_refresh = 1;
+	poll_deadlk = 1;
+	return;
+ fail:
+	log_error("%s deadlk_timewarn no memory", ls->name);
+}
 
-	if (list_empty(&ls->transactions)) {
-		log_group(ls, "no deadlock: all transactions reduced");
-		goto out;
-	}
+/* called from the main loop after timewarns, and every second while any
+   lockspace has blocked transactions of ours or a cycle to confirm */
 
-	log_group(ls, "found deadlock");
-	dump_all_trans(ls);
+void process_deadlk(void)
+{
+	struct lockspace *ls;
+	uint64_t now = monotime();
 
-	cancel_trans(ls);
-	reduce_waitfor_graph_loop(ls);
+	poll_deadlk = 0;
 
-	if (list_empty(&ls->transactions)) {
-		log_group(ls, "resolved deadlock with cancel");
-		goto out;
-	}
+	list_for_each_entry(ls, &lockspaces, list) {
+		if (ls->deadlk_refresh ||
+		    (ls->deadlk_inc && ls->deadlk_inc->own_count &&
+		     now - ls->deadlk_refresh_time >= DEADLK_REFRESH_SECS))
+			refresh_own_trans(ls);
 
-	log_error("deadlock resolution failed");
-	dump_all_trans(ls);
- out:
-	send_cycle_end(ls);
+		check_candidate(ls);
+
+		if (ls->deadlk_inc && ls->deadlk_inc->own_count)
+			poll_deadlk = 1;
+	}
 }
 
+void free_deadlk(struct lockspace *ls)
+{
+	struct deadlk_node *node, *safe;
+
+	list_for_each_entry_safe(node, safe, &ls->deadlk_nodes, list) {
+		list_del(&node->list);
+		free(node);
+	}
+	free_graph(ls);
+	free_inc(ls->deadlk_inc);
+	ls->deadlk_inc = NULL;
+}
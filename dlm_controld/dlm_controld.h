@@ -32,6 +32,14 @@
 #define DLMC_CMD_FENCE_ACK		12
 #define DLMC_CMD_DUMP_STATUS		13
 #define DLMC_CMD_DUMP_CONFIG		14
+#define DLMC_CMD_STATUS			15
+#define DLMC_CMD_DUMP_RECOVERY		16
+
+/* dlmc_header flags: the query connection is kept open for more requests
+   after the reply.  Only for commands whose reply is a header giving its
+   length, i.e. not DLMC_CMD_DUMP_STATUS, which is ended by closing the
+   connection. */
+#define DLMC_HF_PERSIST			0x00000001
 
 struct dlmc_header {
 	unsigned int magic;
@@ -40,7 +48,7 @@ struct dlmc_header {
 	unsigned int option;
 	unsigned int len;
 	int data;	/* embedded command-specific data, for convenience */
-	int unused1;
+	int flags;	/* DLMC_HF_ */
 	int unsued2;
 	char name[DLM_LOCKSPACE_LEN]; /* no terminating null space */
 };
@@ -20,6 +20,7 @@
 #include <sys/poll.h>
 #include <sys/time.h>
 #include <sys/wait.h>
+#include <sys/eventfd.h>
 #include <netinet/in.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
@@ -69,10 +70,12 @@
 #define RUN_FILE_NAME            "dlm_controld.pid"
 #define LOG_FILE_NAME            "dlm_controld.log"
 #define CONF_FILE_NAME           "dlm.conf"
+#define METRICS_FILE_NAME        "metrics"
 
 #define RUN_FILE_PATH            RUNDIR "/" RUN_FILE_NAME
 #define LOG_FILE_PATH            LOGDIR "/" LOG_FILE_NAME
 #define CONF_FILE_PATH           CONFDIR "/" CONF_FILE_NAME
+#define METRICS_FILE_PATH        RUNDIR "/" METRICS_FILE_NAME
 
 #define DEFAULT_LOG_MODE         LOG_MODE_OUTPUT_FILE | LOG_MODE_OUTPUT_SYSLOG
 #define DEFAULT_SYSLOG_FACILITY  LOG_LOCAL4
@@ -105,9 +108,15 @@ enum {
         post_join_delay_ind,
         enable_fencing_ind,
         enable_concurrent_fencing_ind,
+        fence_agent_timeout_ind,
         enable_startup_fencing_ind,
         enable_quorum_fencing_ind,
         enable_quorum_lockspace_ind,
+        ls_cpg_groups_ind,
+        enable_deadlk_ind,
+        deadlk_victim_ind,
+        deadlk_incremental_ind,
+        metrics_interval_ind,
         help_ind,
         version_ind,
         dlm_options_max,
@@ -149,6 +158,42 @@ EXTERN struct dlm_option dlm_options[dlm_options_max];
 
 #define MAX_NODES	128
 
+/* Each lockspace maps the nodeids it sees to dense slot numbers which index
+   the membership bitmaps and per-node arrays in cpg.c.  Slots are not reused,
+   so allow for some nodeid churn beyond MAX_NODES. */
+
+#define MAX_NODE_SLOTS	(MAX_NODES * 4)
+#define NODE_SLOT_WORDS	(MAX_NODE_SLOTS / 64)
+#define NODE_SLOT_HASH	(MAX_NODE_SLOTS * 2)
+
+/* Recovery phases of a lockspace change, in the order they complete.
+   Each change records when it got through each phase, and the last
+   RECOVERY_HIST_LEN changes are kept per lockspace for queries. */
+
+enum {
+	CG_PHASE_CONFCHG = 0,
+	CG_PHASE_RINGID,
+	CG_PHASE_QUORUM,
+	CG_PHASE_FENCING,
+	CG_PHASE_FSDONE,
+	CG_PHASE_MESSAGES,
+	CG_PHASE_KERNEL,
+	CG_PHASE_PLOCKS,
+	CG_PHASES,		/* keep last */
+};
+
+#define RECOVERY_HIST_LEN 16
+
+struct cg_timeline {
+	uint32_t seq;
+	uint32_t combined_seq;
+	int member_count;
+	int joined_count;
+	int remove_count;
+	int failed_count;
+	uint64_t phase_usec[CG_PHASES];	/* monotime_usec, 0 if not reached */
+};
+
 /* Maximum number of IP addresses per node, when using SCTP and multi-ring in
    corosync  In dlm-kernel this is DLM_MAX_ADDR_COUNT, currently 3. */
 
@@ -158,6 +203,25 @@ EXTERN struct dlm_option dlm_options[dlm_options_max];
 #define PROTO_SCTP 1
 #define PROTO_DETECT 2
 
+/* Each main loop iteration runs ready clients by class, in this order, with
+   a budget of work per class.  Cluster is corosync quorum and cfg and the
+   daemon cpg; membership is the lockspace cpgs, uevents and action threads;
+   control is the dlmc socket connections; plock is the plock device and the
+   plock messages from other nodes, which are queued by the lockspace cpgs
+   (see queue_plock_msg) and run from here. */
+
+#define CLIENT_CLASS_CLUSTER	0
+#define CLIENT_CLASS_MEMBER	1
+#define CLIENT_CLASS_CONTROL	2
+#define CLIENT_CLASS_PLOCK	3
+#define CLIENT_CLASSES		4
+
+struct loop_stats {
+	uint64_t calls;
+	uint64_t deferred;
+	uint64_t usec;
+};
+
 EXTERN int daemon_quit;
 EXTERN int cluster_down;
 EXTERN int poll_lockspaces;
@@ -166,6 +230,7 @@ EXTERN int daemon_fence_allow;
 EXTERN int poll_fs;
 EXTERN int poll_ignore_plock;
 EXTERN int poll_drop_plock;
+EXTERN int poll_deadlk;
 EXTERN int plock_fd;
 EXTERN int plock_ci;
 EXTERN struct list_head lockspaces;
@@ -182,6 +247,7 @@ EXTERN uint32_t control_minor;
 EXTERN uint32_t monitor_minor;
 EXTERN uint32_t plock_minor;
 EXTERN struct fence_device fence_all_device;
+EXTERN struct loop_stats loop_stats[CLIENT_CLASSES];
 
 #define LOG_DUMP_SIZE DLMC_DUMP_SIZE
 
@@ -195,9 +261,27 @@ void log_level(char *name_in, uint32_t level_in, const char *fmt, ...);
 #define log_erros(ls, fmt, args...) log_level((ls)->name, LOG_ERR, fmt, ##args)
 #define log_group(ls, fmt, args...) log_level((ls)->name, LOG_DEBUG, fmt, ##args)
 
-#define log_plock(ls, fmt, args...) log_level((ls)->name, LOG_PLOCK|LOG_NONE, fmt, ##args)
-#define log_dlock(ls, fmt, args...) log_level((ls)->name, LOG_PLOCK|LOG_DEBUG, fmt, ##args)
-#define log_elock(ls, fmt, args...) log_level((ls)->name, LOG_PLOCK|LOG_ERR, fmt, ##args)
+/* The plock log (dlm_tool log_plock) is a ring of binary records that are
+   formatted when dumped, see logging.c.  log_plock only goes there, and
+   %s args must be static strings.  Plock log levels above PLOCK_LOG_LEVEL
+   are compiled out, e.g. -DPLOCK_LOG_LEVEL=LOG_DEBUG removes log_plock. */
+
+#ifndef PLOCK_LOG_LEVEL
+#define PLOCK_LOG_LEVEL LOG_NONE
+#endif
+
+#define PLOCK_LOG(level) ((level) <= PLOCK_LOG_LEVEL ? LOG_PLOCK : 0)
+
+void log_plock_rec(char *name, const char *fmt, ...)
+	__attribute__((format(printf, 2, 3)));
+
+#define log_plock(ls, fmt, args...) \
+do { \
+	if (LOG_NONE <= PLOCK_LOG_LEVEL) \
+		log_plock_rec((ls)->name, fmt, ##args); \
+} while (0)
+#define log_dlock(ls, fmt, args...) log_level((ls)->name, PLOCK_LOG(LOG_DEBUG)|LOG_DEBUG, fmt, ##args)
+#define log_elock(ls, fmt, args...) log_level((ls)->name, PLOCK_LOG(LOG_ERR)|LOG_ERR, fmt, ##args)
 
 /* dlm_header types */
 enum {
@@ -212,10 +296,15 @@ enum {
 	DLM_MSG_PLOCKS_DATA,
 	DLM_MSG_DEADLK_CYCLE_START,
 	DLM_MSG_DEADLK_CYCLE_END,
-	DLM_MSG_DEADLK_CHECKPOINT_READY,
+	DLM_MSG_DEADLK_LOCKS,
 	DLM_MSG_DEADLK_CANCEL_LOCK,
 	DLM_MSG_FENCE_RESULT,
 	DLM_MSG_FENCE_CLEAR,
+	DLM_MSG_LS_JOIN,
+	DLM_MSG_LS_LEAVE,
+	DLM_MSG_LS_MEMBERS,
+	DLM_MSG_DEADLK_TRANS,
+	DLM_MSG_TYPES,		/* keep last */
 };
 
 /* dlm_header flags */
@@ -223,6 +312,7 @@ enum {
 #define DLM_MFLG_HAVEPLOCK 2  /* accompanies start, we have plock state */
 #define DLM_MFLG_NACK      4  /* accompanies start, prevent wrong match when
 				 two outstanding changes are the same */
+#define DLM_MFLG_LAST      8  /* accompanies deadlk_locks, final batch */
 
 struct dlm_header {
 	uint16_t version[3];
@@ -256,6 +346,9 @@ struct lockspace {
 	int			cpg_ringid_wait;
 	int			cpg_client;
 	int			cpg_fd;
+	struct ls_group		*group;	/* shared cpg, ls_cpg_groups */
+	int			group_join_wait;
+	int			group_joined;
 	int			joining;
 	int			leaving;
 	int			kernel_stopped;
@@ -267,6 +360,14 @@ struct lockspace {
 	struct change		*started_change;
 	struct list_head	changes;
 	struct list_head	node_history;
+	struct cg_timeline	recovery_hist[RECOVERY_HIST_LEN];
+	uint32_t		recovery_hist_count;
+	int			node_slot_count;
+	int			node_slot_nodeid[MAX_NODE_SLOTS];
+	uint16_t		node_slot_hash[NODE_SLOT_HASH];
+	struct node		*node_slot[MAX_NODE_SLOTS];
+	uint32_t		action_id;
+	int			actions_pending;
 
 	/* plock stuff */
 
@@ -276,26 +377,58 @@ struct lockspace {
 	int			disable_plock;
 	uint32_t		recv_plocks_data_count;
 	struct list_head	saved_messages;
+	struct list_head	plock_msgs;	/* queue_plock_msg */
+	int			plock_msgs_run;
 	struct list_head	plock_resources;
 	struct rb_root		plock_resources_root;
 	time_t			last_plock_time;
 	struct timeval		drop_resources_last;
 
-#if 0
 	/* deadlock stuff */
 
 	int			deadlk_low_nodeid;
 	struct list_head	deadlk_nodes;
-	uint64_t		deadlk_ckpt_handle;
 	int			deadlk_confchg_init;
-	struct list_head	transactions;
-	struct list_head	resources;
+	struct deadlk_graph	*deadlk;	/* locks of the running cycle */
 	struct timeval		cycle_start_time;
 	struct timeval		cycle_end_time;
 	struct timeval		last_send_cycle_start;
 	int			cycle_running;
-	int			all_checkpoints_ready;
-#endif
+	int			all_locks_ready;
+	struct deadlk_inc	*deadlk_inc;	/* blocked transactions */
+	int			deadlk_refresh;
+	int			deadlk_candidate;
+	uint64_t		deadlk_refresh_time;
+
+	/* metrics */
+	uint64_t		recovery_count;
+	uint64_t		recovery_usec;
+	uint64_t		recovery_last_usec;
+};
+
+/* kernel sysfs/configfs updates for a lockspace, done by action threads */
+
+#define ACT_CONTROL	0x00000001
+#define ACT_SET_ID	0x00000002
+#define ACT_SET_NODIR	0x00000004
+#define ACT_MEMBERS	0x00000008
+#define ACT_EVENT_DONE	0x00000010
+
+struct ls_action {
+	struct list_head	list;
+	struct action_space	*as;
+	char			name[DLM_LOCKSPACE_LEN+1];
+	uint32_t		flags;
+	uint32_t		ls_id;	/* ls->action_id, 0 if not counted */
+	uint32_t		global_id;
+	int			control;
+	int			event_done;
+	int			rv;
+	int			member_count;
+	int			renew_count;
+	int			members[MAX_NODES];
+	int			weights[MAX_NODES];
+	int			renew[MAX_NODES];
 };
 
 /* action.c */
@@ -303,9 +436,13 @@ int set_sysfs_control(char *name, int val);
 int set_sysfs_event_done(char *name, int val);
 int set_sysfs_id(char *name, uint32_t id);
 int set_sysfs_nodir(char *name, int val);
-int set_configfs_members(struct lockspace *ls, char *name,
-			 int new_count, int *new_members,
-			 int renew_count, int *renew_members);
+void init_action(struct ls_action *act, char *name);
+void set_action_members(struct lockspace *ls, struct ls_action *act,
+			int count, int *ids, int renew_count, int *renew_ids);
+void queue_action(struct lockspace *ls, struct ls_action *act);
+void process_actions(int ci);
+int setup_actions(void);
+void close_actions(void);
 int add_configfs_node(int nodeid, char *addr, int addrlen, int local);
 void del_configfs_node(int nodeid);
 void clear_configfs(void);
@@ -332,14 +469,22 @@ int set_lockspaces(int *count, struct dlmc_lockspace **lss_out);
 int set_lockspace_nodes(struct lockspace *ls, int option, int *node_count,
 			struct dlmc_node **nodes_out);
 int set_fs_notified(struct lockspace *ls, int nodeid);
+int copy_recovery_timeline(struct lockspace *ls, char *buf, int *len_out);
+int setup_ls_groups(void);
+int setup_plock_msgs(void);
+void process_plock_msgs(int ci);
+void close_ls_groups(void);
 
 /* daemon_cpg.c */
 void init_daemon(void);
 void fence_ack_node(int nodeid);
+void write_fence_metrics(FILE *fp);
 void add_startup_node(int nodeid);
 const char *reason_str(int reason);
 const char *msg_name(int type);
 void dlm_send_message(struct lockspace *ls, char *buf, int len);
+void dlm_send_group_message(cpg_handle_t h, uint32_t global_id,
+			    char *buf, int len);
 void dlm_header_in(struct dlm_header *hd);
 int dlm_header_validate(struct dlm_header *hd, int nodeid);
 int fence_node_time(int nodeid, uint64_t *last_fenced);
@@ -352,6 +497,7 @@ int set_protocol(void);
 void send_state_daemon_nodes(int fd);
 void send_state_daemon(int fd);
 void send_state_startup_nodes(int fd);
+int set_daemon_status(char **buf_out, int *len_out);
 
 void log_config(const struct cpg_name *group_name,
                 const struct cpg_address *member_list,
@@ -367,10 +513,8 @@ void log_ringid(const char *name,
                 size_t member_list_entries);
 
 /* deadlock.c */
-void setup_deadlock(void);
 void send_cycle_start(struct lockspace *ls);
-void receive_checkpoint_ready(struct lockspace *ls, struct dlm_header *hd,
-			int len);
+void receive_locks(struct lockspace *ls, struct dlm_header *hd, int len);
 void receive_cycle_start(struct lockspace *ls, struct dlm_header *hd, int len);
 void receive_cycle_end(struct lockspace *ls, struct dlm_header *hd, int len);
 void receive_cancel_lock(struct lockspace *ls, struct dlm_header *hd, int len);
@@ -381,16 +525,24 @@ void deadlk_confchg(struct lockspace *ls,
 		size_t left_list_entries,
 		const struct cpg_address *joined_list,
 		size_t joined_list_entries);
+void receive_trans(struct lockspace *ls, struct dlm_header *hd, int len);
+int request_cycle_start(struct lockspace *ls);
+void deadlk_timewarn(struct lockspace *ls, uint64_t xid);
+void process_deadlk(void);
+void free_deadlk(struct lockspace *ls);
 
 /* main.c */
 int do_read(int fd, void *buf, size_t count);
 int do_write(int fd, void *buf, size_t count);
 uint64_t monotime(void);
+uint64_t monotime_usec(void);
 void client_dead(int ci);
 int client_add(int fd, void (*workfn)(int ci), void (*deadfn)(int ci));
 int client_fd(int ci);
 void client_ignore(int ci, int fd);
 void client_back(int ci, int fd);
+void client_class(int ci, int class);
+int client_more(void);
 struct lockspace *find_ls(char *name);
 struct lockspace *find_ls_id(uint32_t id);
 const char *dlm_mode_str(int mode);
@@ -412,7 +564,8 @@ int setup_node_config(void);
 
 /* fence.c */
 int fence_request(int nodeid, uint64_t fail_walltime, uint64_t fail_monotime,
-                  struct fence_config *fc, int reason, int *pid_out);
+                  struct fence_config *fc, int reason, int *pid_out,
+                  int *pidfd_out);
 int fence_result(int nodeid, int pid, int *result);
 int unfence_node(int nodeid);
 
@@ -437,6 +590,7 @@ int copy_plock_state(struct lockspace *ls, char *buf, int *len_out);
 void send_all_plocks_data(struct lockspace *ls, uint32_t seq, uint32_t *plocks_data);
 void receive_plocks_data(struct lockspace *ls, struct dlm_header *hd, int len);
 void clear_plocks_data(struct lockspace *ls);
+void write_plock_metrics(FILE *fp);
 
 /* logging.c */
 
@@ -445,6 +599,14 @@ void close_logging(void);
 void copy_log_dump(char *buf, int *len);
 void copy_log_dump_plock(char *buf, int *len);
 
+/* metrics.c */
+#define METRICS_LABEL_LEN	(2 * DLM_LOCKSPACE_LEN + 1)
+char *metrics_label(const char *val, char *buf);
+void metrics_send(int type, int len, int retries);
+void metrics_recv(int type, int len);
+void process_metrics(void);
+void close_metrics(void);
+
 /* crc.c */
 uint32_t cpgname_to_crc(const char *data, int len);
 
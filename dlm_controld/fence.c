@@ -7,8 +7,22 @@
  */
 
 #include "dlm_daemon.h"
+#include <sys/syscall.h>
 
-static int run_agent(char *agent, char *args, int *pid_out)
+/* a pidfd becomes readable when the agent exits, so the main loop can
+   collect the result right away; -1 with kernels that don't have them */
+
+static int agent_pidfd(int pid)
+{
+#ifdef SYS_pidfd_open
+	return syscall(SYS_pidfd_open, pid, 0);
+#else
+	errno = ENOSYS;
+	return -1;
+#endif
+}
+
+static int run_agent(char *agent, char *args, int *pid_out, int *pidfd_out)
 {
 	int pid, len;
 	int pw_fd = -1;  /* parent write file descriptor */
@@ -45,6 +59,8 @@ static int run_agent(char *agent, char *args, int *pid_out)
 		close(pw_fd);
 
 		*pid_out = pid;
+		if (pidfd_out)
+			*pidfd_out = agent_pidfd(pid);
 		return 0;
 	} else {
 		/* child */
@@ -78,7 +94,8 @@ static int run_agent(char *agent, char *args, int *pid_out)
 }
 
 int fence_request(int nodeid, uint64_t fail_walltime, uint64_t fail_monotime,
-		  struct fence_config *fc, int reason, int *pid_out)
+		  struct fence_config *fc, int reason, int *pid_out,
+		  int *pidfd_out)
 {
 	struct fence_device *dev;
 	char args[FENCE_CONFIG_ARGS_MAX];
@@ -102,7 +119,7 @@ int fence_request(int nodeid, uint64_t fail_walltime, uint64_t fail_monotime,
 		return rv;
 	}
 
-	rv = run_agent(dev->agent, args, &pid);
+	rv = run_agent(dev->agent, args, &pid, pidfd_out);
 	if (rv < 0) {
 		log_error("fence request %d pid %d %s time %llu %s %s run error %d",
 			  nodeid, pid, reason_str(reason), (unsigned long long)fail_walltime,
@@ -219,7 +236,7 @@ int unfence_node(int nodeid)
 			break;
 		}
 
-		rv = run_agent(dev->agent, args, &pid);
+		rv = run_agent(dev->agent, args, &pid, NULL);
 		if (rv < 0) {
 			log_error("unfence %d %s %s run error %d", nodeid,
 				  dev->name, dev->agent, rv);
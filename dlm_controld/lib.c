@@ -95,15 +95,13 @@ static void init_header(struct dlmc_header *h, int cmd, char *name,
 		strncpy(h->name, name, DLM_LOCKSPACE_LEN);
 }
 
-static char copy_buf[DLMC_DUMP_SIZE];
+/* the reply is read straight into the caller's DLMC_DUMP_SIZE buffer */
 
 static int do_dump(int cmd, char *name, char *buf)
 {
 	struct dlmc_header h;
 	int fd, rv, len;
 
-	memset(copy_buf, 0, DLMC_DUMP_SIZE);
-
 	init_header(&h, cmd, name, 0);
 
 	fd = do_connect(DLMC_QUERY_SOCK_PATH);
@@ -127,11 +125,12 @@ static int do_dump(int cmd, char *name, char *buf)
 	if (len <= 0 || len > DLMC_DUMP_SIZE)
 		goto out_close;
 
-	rv = do_read(fd, copy_buf, len);
+	rv = do_read(fd, buf, len);
 	if (rv < 0)
 		goto out_close;
 
-	memcpy(buf, copy_buf, len);
+	if (len < DLMC_DUMP_SIZE)
+		buf[len] = '\0';
  out_close:
 	close(fd);
  out:
@@ -158,6 +157,11 @@ int dlmc_dump_plocks(char *name, char *buf)
 	return do_dump(DLMC_CMD_DUMP_PLOCKS, name, buf);
 }
 
+int dlmc_dump_recovery(char *name, char *buf)
+{
+	return do_dump(DLMC_CMD_DUMP_RECOVERY, name, buf);
+}
+
 static int nodeid_compare(const void *va, const void *vb)
 {
 	const int *a = va;
@@ -521,6 +525,137 @@ int dlmc_print_status(uint32_t flags)
 	return rv;
 }
 
+int dlmc_query_connect(void)
+{
+	return do_connect(DLMC_QUERY_SOCK_PATH);
+}
+
+void dlmc_query_disconnect(int fd)
+{
+	close(fd);
+}
+
+/* Reads a len byte struct from the daemon into a buf_len byte struct,
+   zeroing what the daemon did not send and discarding what the caller
+   does not know; buf may be NULL to discard it all. */
+
+static int read_struct(int fd, void *buf, int buf_len, int len)
+{
+	char skip[256];
+	int n, rv;
+
+	if (!buf)
+		buf_len = 0;
+
+	n = len < buf_len ? len : buf_len;
+	if (buf) {
+		memset((char *)buf + n, 0, buf_len - n);
+		rv = do_read(fd, buf, n);
+		if (rv < 0)
+			return rv;
+	}
+
+	for (len -= n; len > 0; len -= n) {
+		n = len < sizeof(skip) ? len : sizeof(skip);
+		rv = do_read(fd, skip, n);
+		if (rv < 0)
+			return rv;
+	}
+	return 0;
+}
+
+/* Copies what both the daemon and the caller know of each struct, and
+   zeroes the rest.  Returns the number of nodes, which may be more than
+   max, and count is the number copied.  The reply is read straight into
+   status and nodes, so polling allocates nothing. */
+
+int dlmc_get_status(int fd, struct dlmc_daemon_status *status, int max,
+		    int *count, struct dlmc_node_status *nodes)
+{
+	struct dlmc_header h;
+	uint32_t sizes[4];	/* version, size, node_size, node_count */
+	int own_fd = 0;
+	int rv, len, i;
+
+	init_header(&h, DLMC_CMD_STATUS, NULL, 0);
+
+	if (fd < 0) {
+		fd = do_connect(DLMC_QUERY_SOCK_PATH);
+		if (fd < 0) {
+			rv = fd;
+			goto out;
+		}
+		own_fd = 1;
+	} else {
+		h.flags = DLMC_HF_PERSIST;
+	}
+
+	rv = do_write(fd, &h, sizeof(h));
+	if (rv < 0)
+		goto out_close;
+
+	rv = do_read(fd, &h, sizeof(h));
+	if (rv < 0)
+		goto out_close;
+
+	len = h.len - sizeof(h);
+	if (len < 0 || len > DLMC_DUMP_SIZE) {
+		rv = -EPROTO;
+		goto out_close;
+	}
+
+	if (h.data < 0) {
+		rv = read_struct(fd, NULL, 0, len);
+		if (!rv)
+			rv = h.data;
+		goto out_close;
+	}
+
+	if (len < sizeof(sizes)) {
+		rv = -EPROTO;
+		goto out_close;
+	}
+
+	rv = do_read(fd, sizes, sizeof(sizes));
+	if (rv < 0)
+		goto out_close;
+
+	if (sizes[1] < sizeof(sizes) || sizes[1] > len ||
+	    (uint64_t)sizes[2] * sizes[3] > len - sizes[1]) {
+		rv = -EPROTO;
+		goto out_close;
+	}
+
+	memset(status, 0, sizeof(struct dlmc_daemon_status));
+	memcpy(status, sizes, sizeof(sizes));
+
+	rv = read_struct(fd, (char *)status + sizeof(sizes),
+			 sizeof(struct dlmc_daemon_status) - sizeof(sizes),
+			 sizes[1] - sizeof(sizes));
+	if (rv < 0)
+		goto out_close;
+
+	for (i = 0; i < sizes[3]; i++) {
+		rv = read_struct(fd, i < max ? &nodes[i] : NULL,
+				 sizeof(struct dlmc_node_status), sizes[2]);
+		if (rv < 0)
+			goto out_close;
+	}
+
+	rv = read_struct(fd, NULL, 0, len - sizes[1] - sizes[2] * sizes[3]);
+	if (rv < 0)
+		goto out_close;
+
+	if (count)
+		*count = sizes[3] < max ? sizes[3] : max;
+	rv = sizes[3];
+ out_close:
+	if (own_fd)
+		close(fd);
+ out:
+	return rv;
+}
+
 int dlmc_node_info(char *name, int nodeid, struct dlmc_node *node)
 {
 	struct dlmc_header h, *rh;
@@ -31,6 +31,7 @@ struct dlmc_node {
 #define DLMC_LS_WAIT_QUORUM	2
 #define DLMC_LS_WAIT_FENCING	3
 #define DLMC_LS_WAIT_FSDONE	4
+#define DLMC_LS_WAIT_KERNEL	5
 
 struct dlmc_change {
 	int member_count;
@@ -80,10 +81,74 @@ struct dlmc_lockspace {
 
 #define DLMC_STATUS_VERBOSE	0x00000001
 
+/* dlmc_get_status() returns the daemon state as binary structs, so it can
+   be polled cheaply over a connection from dlmc_query_connect().  The
+   daemon sends the size of each struct, so fields may be added at the end
+   without breaking older or newer callers; fields the other side does not
+   know about are zero. */
+
+#define DLMC_STATUS_VERSION	1
+
+struct dlmc_daemon_status {
+	uint32_t version;	/* DLMC_STATUS_VERSION of the daemon */
+	uint32_t size;		/* sizeof(struct dlmc_daemon_status) */
+	uint32_t node_size;	/* sizeof(struct dlmc_node_status) */
+	uint32_t node_count;	/* nodes known to the daemon */
+	int32_t our_nodeid;
+	uint32_t quorate;
+	uint64_t cluster_ringid;
+	uint64_t daemon_ringid;
+	uint64_t monotime;
+	uint32_t member_count;
+	uint32_t joined_count;
+	uint32_t remove_count;
+	uint32_t zombie_count;
+	int32_t fence_pid;
+	uint32_t fence_in_progress_unknown;
+	uint32_t stateful_merge_wait;
+	uint32_t unused;
+	uint64_t member_calls;
+	uint64_t member_deferred;
+	uint64_t member_usec;
+	uint64_t control_calls;
+	uint64_t control_deferred;
+	uint64_t control_usec;
+	uint64_t plock_calls;
+	uint64_t plock_deferred;
+	uint64_t plock_usec;
+	uint64_t cluster_calls;
+	uint64_t cluster_deferred;
+	uint64_t cluster_usec;
+};
+
+#define DLMC_NS_MEMBER		0x00000001 /* node is a daemon cpg member */
+#define DLMC_NS_STARTUP		0x00000002 /* node needs startup fencing */
+#define DLMC_NS_KILLED		0x00000004
+#define DLMC_NS_NEED_FENCING	0x00000008
+#define DLMC_NS_DELAY_FENCING	0x00000010
+#define DLMC_NS_RESULT_WAIT	0x00000020
+
+struct dlmc_node_status {
+	int32_t nodeid;
+	uint32_t flags;		/* DLMC_NS_ */
+	int32_t fence_pid;
+	int32_t fence_actor_last;
+	int32_t fence_actor_done;
+	uint32_t unused;
+	char left_reason[16];
+	uint64_t add_time;
+	uint64_t rem_time;
+	uint64_t fail_walltime;
+	uint64_t fail_monotime;
+	uint64_t fence_walltime;
+	uint64_t fence_monotime;
+};
+
 int dlmc_dump_debug(char *buf);
 int dlmc_dump_config(char *buf);
 int dlmc_dump_log_plock(char *buf);
 int dlmc_dump_plocks(char *name, char *buf);
+int dlmc_dump_recovery(char *name, char *buf);
 int dlmc_lockspace_info(char *lsname, struct dlmc_lockspace *ls);
 int dlmc_node_info(char *lsname, int nodeid, struct dlmc_node *node);
 int dlmc_lockspaces(int max, int *count, struct dlmc_lockspace *lss);
@@ -91,6 +156,12 @@ int dlmc_lockspace_nodes(char *lsname, int type, int max, int *count,
 			 struct dlmc_node *nodes);
 int dlmc_print_status(uint32_t flags);
 
+/* fd from dlmc_query_connect(), or -1 for a connection just for this call */
+int dlmc_query_connect(void);
+void dlmc_query_disconnect(int fd);
+int dlmc_get_status(int fd, struct dlmc_daemon_status *status, int max,
+		    int *count, struct dlmc_node_status *nodes);
+
 #define DLMC_RESULT_REGISTER	1
 #define DLMC_RESULT_NOTIFIED	2
 
@@ -8,11 +8,16 @@
 
 #include "dlm_daemon.h"
 
+#include <pthread.h>
+
 static int syslog_facility;
 static int syslog_priority;
 static int logfile_priority;
 static char logfile[PATH_MAX];
-static FILE *logfile_fp;
+static int logfile_fd = -1;
+
+static void start_log_thread(void);
+static void stop_log_thread(void);
 
 void init_logging(void)
 {
@@ -27,36 +32,87 @@ void init_logging(void)
 	if (opt(debug_logfile_ind))
 		logfile_priority = LOG_DEBUG;
 
-	if (logfile[0]) {
-		logfile_fp = fopen(logfile, "a+");
-		if (logfile_fp != NULL) {
-			int fd = fileno(logfile_fp);
-			fcntl(fd, F_SETFD, fcntl(fd, F_GETFD, 0) | FD_CLOEXEC);
-		}
-	}
+	/* written with write(2) by the log thread, so a forked fence agent
+	   has no stdio buffer of it to flush */
+
+	if (logfile[0])
+		logfile_fd = open(logfile, O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC,
+				  0666);
 
 	openlog(DAEMON_NAME, LOG_CONS | LOG_PID, syslog_facility);
+
+	start_log_thread();
 }
 
+/* lines still queued are written before returning */
+
 void close_logging(void)
 {
+	stop_log_thread();
 	closelog();
-	if (logfile_fp)
-		fclose(logfile_fp);
+	if (logfile_fd != -1) {
+		close(logfile_fd);
+		logfile_fd = -1;
+	}
 }
 
 #define NAME_ID_SIZE 32
 #define LOG_STR_LEN 512
 static char log_str[LOG_STR_LEN];
 
+/* log_level is also called from the action threads */
+static pthread_mutex_t log_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/*
+ * The plock log is a flight recorder of fixed size binary records, each
+ * holding the format and the raw arguments of one log_plock/dlock/elock.
+ * Nothing is formatted until the plock log is dumped.
+ *
+ * The records are only written by the main thread, which holds query_lock
+ * while it processes plocks, and they're only read by query_dump_log_plock
+ * under query_lock, so the ring needs no locking.  log_plock %s arguments
+ * must be static strings since only the pointer is saved.
+ */
+
+#define PLOCK_REC_ARGS	10
+#define PLOCK_FMT_MAX	256	/* distinct formats, power of 2 */
+
+enum {
+	ARG_INT = 0,
+	ARG_LONG,
+	ARG_LLONG,
+	ARG_DOUBLE,
+	ARG_PTR,
+	ARG_NONE,
+};
+
+/* the args of a format are found once, the first time it's logged */
+
+struct plock_fmt {
+	const char *fmt;
+	int nargs;			/* -1 if the format isn't supported */
+	uint8_t type[PLOCK_REC_ARGS];
+	uint16_t end[PLOCK_REC_ARGS];	/* offset after each conversion */
+};
+
+struct plock_rec {
+	uint64_t time;
+	uint16_t fmt_id;
+	char name[NAME_ID_SIZE];
+	uint64_t args[PLOCK_REC_ARGS];
+};
+
+#define PLOCK_REC_COUNT (LOG_DUMP_SIZE / sizeof(struct plock_rec))
+
+static struct plock_fmt plock_fmts[PLOCK_FMT_MAX];
+static struct plock_rec plock_recs[PLOCK_REC_COUNT];
+static unsigned int plock_rec_point;
+static unsigned int plock_rec_wrap;
+
 static char log_dump[LOG_DUMP_SIZE];
 static unsigned int log_point;
 static unsigned int log_wrap;
 
-static char log_dump_plock[LOG_DUMP_SIZE];
-static unsigned int log_point_plock;
-static unsigned int log_wrap_plock;
-
 static void log_copy(char *buf, int *len, char *log_buf,
 		     unsigned int *point, unsigned int *wrap)
 {
@@ -80,12 +136,9 @@ static void log_copy(char *buf, int *len, char *log_buf,
 
 void copy_log_dump(char *buf, int *len)
 {
+	pthread_mutex_lock(&log_mutex);
 	log_copy(buf, len, log_dump, &log_point, &log_wrap);
-}
-
-void copy_log_dump_plock(char *buf, int *len)
-{
-	log_copy(buf, len, log_dump_plock, &log_point_plock, &log_wrap_plock);
+	pthread_mutex_unlock(&log_mutex);
 }
 
 static void log_save_str(int len, char *log_buf, unsigned int *point,
@@ -119,6 +172,431 @@ static void log_save_str(int len, char *log_buf, unsigned int *point,
 	*wrap = w;
 }
 
+static int parse_plock_fmt(struct plock_fmt *f, const char *fmt)
+{
+	const char *p = fmt;
+	int type, n = 0;
+
+	while ((p = strchr(p, '%'))) {
+		p++;
+		if (*p == '%') {
+			p++;
+			continue;
+		}
+		p += strspn(p, "#0- +'");
+		p += strspn(p, "0123456789");
+		if (*p == '.') {
+			p++;
+			p += strspn(p, "0123456789");
+		}
+
+		type = ARG_INT;
+		if (*p == 'h') {
+			p++;
+			if (*p == 'h')
+				p++;
+		} else if (*p == 'l') {
+			p++;
+			type = ARG_LONG;
+			if (*p == 'l') {
+				p++;
+				type = ARG_LLONG;
+			}
+		} else if (*p == 'j') {
+			p++;
+			type = ARG_LLONG;
+		} else if (*p == 'z' || *p == 't') {
+			p++;
+			type = ARG_LONG;
+		}
+
+		if (!*p || n == PLOCK_REC_ARGS || p - fmt >= 0xFFFF)
+			return -1;
+
+		if (strchr("diouxXc", *p))
+			;
+		else if (strchr("eEfFgGaA", *p) && type == ARG_INT)
+			type = ARG_DOUBLE;
+		else if ((*p == 's' || *p == 'p') && type == ARG_INT)
+			type = ARG_PTR;
+		else
+			return -1;
+
+		p++;
+		f->type[n] = type;
+		f->end[n] = p - fmt;
+		n++;
+	}
+	return n;
+}
+
+static int get_plock_fmt(const char *fmt)
+{
+	struct plock_fmt *f;
+	unsigned int i = ((uintptr_t)fmt >> 3) & (PLOCK_FMT_MAX - 1);
+	int n;
+
+	for (n = 0; n < PLOCK_FMT_MAX; n++) {
+		f = &plock_fmts[i];
+
+		if (f->fmt == fmt)
+			return i;
+
+		if (!f->fmt) {
+			f->fmt = fmt;
+			f->nargs = parse_plock_fmt(f, fmt);
+			return i;
+		}
+		i = (i + 1) & (PLOCK_FMT_MAX - 1);
+	}
+	return -1;
+}
+
+static int format_plock_rec(struct plock_rec *rec, char *buf, int len)
+{
+	struct plock_fmt *f = &plock_fmts[rec->fmt_id];
+	char seg[LOG_STR_LEN];
+	int i, n, seg_len, start = 0, pos;
+	double d;
+
+	pos = snprintf(buf, len, "%llu %s%s", (unsigned long long)rec->time,
+		       rec->name, rec->name[0] ? " " : "");
+
+	if (f->nargs < 0) {
+		pos += snprintf(buf + pos, len - pos, "(unsupported) %s", f->fmt);
+		goto out;
+	}
+
+	/* each segment of the format has at most one conversion */
+
+	for (i = 0; i <= f->nargs && pos < len; i++) {
+		if (i < f->nargs)
+			seg_len = f->end[i] - start;
+		else
+			seg_len = strlen(f->fmt + start);
+
+		if (seg_len > LOG_STR_LEN - 1)
+			seg_len = LOG_STR_LEN - 1;
+		memcpy(seg, f->fmt + start, seg_len);
+		seg[seg_len] = '\0';
+		if (i < f->nargs)
+			start = f->end[i];
+
+		switch (i < f->nargs ? f->type[i] : ARG_NONE) {
+		case ARG_INT:
+			n = snprintf(buf + pos, len - pos, seg, (int)rec->args[i]);
+			break;
+		case ARG_LONG:
+			n = snprintf(buf + pos, len - pos, seg, (long)rec->args[i]);
+			break;
+		case ARG_LLONG:
+			n = snprintf(buf + pos, len - pos, seg, (long long)rec->args[i]);
+			break;
+		case ARG_DOUBLE:
+			memcpy(&d, &rec->args[i], sizeof(d));
+			n = snprintf(buf + pos, len - pos, seg, d);
+			break;
+		case ARG_PTR:
+			n = snprintf(buf + pos, len - pos, seg, (void *)(uintptr_t)rec->args[i]);
+			break;
+		default:
+			/* the tail may still have %% */
+			n = snprintf(buf + pos, len - pos, seg, 0);
+		}
+		pos += n;
+	}
+ out:
+	if (pos > len - 2)
+		pos = len - 2;
+	buf[pos++] = '\n';
+	buf[pos] = '\0';
+	return pos;
+}
+
+static struct plock_rec *plock_save(const char *name, const char *fmt,
+				     va_list ap)
+{
+	struct plock_rec *rec = &plock_recs[plock_rec_point];
+	struct plock_fmt *f;
+	struct timespec ts;
+	double d;
+	int i, id;
+
+	id = get_plock_fmt(fmt);
+	if (id < 0)
+		return NULL;
+	f = &plock_fmts[id];
+
+	clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+	rec->time = ts.tv_sec;
+	rec->fmt_id = id;
+	if (name)
+		strncpy(rec->name, name, NAME_ID_SIZE - 1);
+	else
+		rec->name[0] = '\0';
+	rec->name[NAME_ID_SIZE - 1] = '\0';
+
+	for (i = 0; i < f->nargs; i++) {
+		switch (f->type[i]) {
+		case ARG_INT:
+			rec->args[i] = va_arg(ap, int);
+			break;
+		case ARG_LONG:
+			rec->args[i] = va_arg(ap, long);
+			break;
+		case ARG_LLONG:
+			rec->args[i] = va_arg(ap, long long);
+			break;
+		case ARG_DOUBLE:
+			d = va_arg(ap, double);
+			memcpy(&rec->args[i], &d, sizeof(d));
+			break;
+		case ARG_PTR:
+			rec->args[i] = (uintptr_t)va_arg(ap, void *);
+			break;
+		}
+	}
+
+	if (++plock_rec_point == PLOCK_REC_COUNT) {
+		plock_rec_point = 0;
+		plock_rec_wrap = 1;
+	}
+	return rec;
+}
+
+/* log_plock; log_dlock and log_elock go through log_level */
+
+void log_plock_rec(char *name, const char *fmt, ...)
+{
+	struct plock_rec *rec;
+	char line[LOG_STR_LEN];
+	va_list ap;
+
+	va_start(ap, fmt);
+	rec = plock_save(name, fmt, ap);
+	va_end(ap);
+
+	if (rec && opt(daemon_debug_ind) && opt(plock_debug_ind)) {
+		format_plock_rec(rec, line, sizeof(line));
+		pthread_mutex_lock(&log_mutex);
+		fprintf(stderr, "%s", line);
+		pthread_mutex_unlock(&log_mutex);
+	}
+}
+
+/* the newest records that fit in buf (LOG_DUMP_SIZE) are formatted */
+
+void copy_log_dump_plock(char *buf, int *len)
+{
+	char line[LOG_STR_LEN];
+	unsigned int count, first, i;
+	int n, pos = 0;
+
+	count = plock_rec_wrap ? PLOCK_REC_COUNT : plock_rec_point;
+	first = plock_rec_wrap ? plock_rec_point : 0;
+
+	/* build from the end of buf back, then move to the start */
+
+	for (i = 0; i < count; i++) {
+		n = format_plock_rec(&plock_recs[(first + count - 1 - i) % PLOCK_REC_COUNT],
+				     line, sizeof(line));
+		if (pos + n > LOG_DUMP_SIZE)
+			break;
+		pos += n;
+		memcpy(buf + LOG_DUMP_SIZE - pos, line, n);
+	}
+
+	memmove(buf, buf + LOG_DUMP_SIZE - pos, pos);
+	*len = pos;
+}
+
+/*
+ * Lines for syslog and the logfile are queued for the log thread, so the
+ * daemon never waits for a slow disk or syslog.  The thread wakes every
+ * LOG_FLUSH_MS, or right away for errors or a half full queue, and
+ * writes all the queued lines for the logfile with one write.  When the
+ * queue is full, lines are dropped and counted, and the count is logged
+ * when there's room.
+ */
+
+#define LOG_QUEUE_LEN	4096	/* power of 2 */
+#define LOG_FLUSH_MS	200
+#define LOG_WRITE_SIZE	(64 * 1024)
+
+#define LQ_SYSLOG	1
+#define LQ_LOGFILE	2
+
+struct log_entry {
+	time_t time;
+	int level;
+	int flags;		/* LQ_ */
+	char str[LOG_STR_LEN];
+};
+
+static struct log_entry log_queue[LOG_QUEUE_LEN];
+static unsigned int log_queue_head;	/* next for the thread to write */
+static unsigned int log_queue_tail;	/* next for log_level to fill */
+static unsigned int log_dropped;
+static pthread_t log_thread;
+static pthread_cond_t log_cond = PTHREAD_COND_INITIALIZER;
+static int log_thread_running;
+static int log_thread_quit;
+
+static void write_logfile(char *buf, int len)
+{
+	int rv;
+
+	while (len > 0) {
+		rv = write(logfile_fd, buf, len);
+		if (rv < 0 && errno == EINTR)
+			continue;
+		if (rv <= 0)
+			return;
+		buf += rv;
+		len -= rv;
+	}
+}
+
+/* entries [head, tail) belong to the thread until head is advanced */
+
+static void write_entries(unsigned int head, unsigned int tail)
+{
+	static char buf[LOG_WRITE_SIZE];
+	struct log_entry *e;
+	char tbuf[64];
+	struct tm tm;
+	int len = 0;
+
+	for (; head != tail; head++) {
+		e = &log_queue[head & (LOG_QUEUE_LEN - 1)];
+
+		if (e->flags & LQ_SYSLOG)
+			syslog(e->level, "%s", e->str);
+
+		if (!(e->flags & LQ_LOGFILE) || logfile_fd == -1)
+			continue;
+
+		if (len > LOG_WRITE_SIZE - LOG_STR_LEN - (int)sizeof(tbuf)) {
+			write_logfile(buf, len);
+			len = 0;
+		}
+
+		strftime(tbuf, sizeof(tbuf), "%b %d %T", localtime_r(&e->time, &tm));
+		len += snprintf(buf + len, LOG_WRITE_SIZE - len, "%s %s", tbuf, e->str);
+	}
+
+	if (len)
+		write_logfile(buf, len);
+}
+
+static void *log_thread_fn(void *arg)
+{
+	struct log_entry *e;
+	struct timespec ts;
+	unsigned int head, tail, dropped;
+
+	pthread_mutex_lock(&log_mutex);
+
+	while (1) {
+		if (!log_thread_quit) {
+			clock_gettime(CLOCK_REALTIME, &ts);
+			ts.tv_nsec += LOG_FLUSH_MS * 1000000;
+			if (ts.tv_nsec >= 1000000000) {
+				ts.tv_sec++;
+				ts.tv_nsec -= 1000000000;
+			}
+			pthread_cond_timedwait(&log_cond, &log_mutex, &ts);
+		}
+
+		if (log_queue_head == log_queue_tail && !log_dropped) {
+			if (log_thread_quit)
+				break;
+			continue;
+		}
+
+		head = log_queue_head;
+		tail = log_queue_tail;
+		dropped = log_dropped;
+		log_dropped = 0;
+		pthread_mutex_unlock(&log_mutex);
+
+		write_entries(head, tail);
+
+		pthread_mutex_lock(&log_mutex);
+		log_queue_head = tail;
+
+		if (dropped && log_queue_tail - log_queue_head == LOG_QUEUE_LEN) {
+			log_dropped += dropped;
+		} else if (dropped) {
+			e = &log_queue[log_queue_tail++ & (LOG_QUEUE_LEN - 1)];
+			e->time = time(NULL);
+			e->level = LOG_ERR;
+			e->flags = LQ_SYSLOG | LQ_LOGFILE;
+			snprintf(e->str, LOG_STR_LEN, "%llu log queue full, dropped %u\n",
+				 (unsigned long long)monotime(), dropped);
+		}
+	}
+
+	pthread_mutex_unlock(&log_mutex);
+	return NULL;
+}
+
+static void start_log_thread(void)
+{
+	int rv;
+
+	rv = pthread_create(&log_thread, NULL, log_thread_fn, NULL);
+	if (rv) {
+		log_error("can't create log thread %d", rv);
+		return;
+	}
+	log_thread_running = 1;
+}
+
+static void stop_log_thread(void)
+{
+	if (!log_thread_running)
+		return;
+
+	pthread_mutex_lock(&log_mutex);
+	log_thread_quit = 1;
+	pthread_cond_signal(&log_cond);
+	pthread_mutex_unlock(&log_mutex);
+
+	pthread_join(log_thread, NULL);
+	log_thread_running = 0;
+}
+
+/* called with log_mutex held; without the thread, e.g. before
+   init_logging, the line is written directly */
+
+static void queue_log_str(int level, int flags, int len)
+{
+	struct log_entry *e;
+	unsigned int tail = log_queue_tail;
+
+	if (tail - log_queue_head == LOG_QUEUE_LEN) {
+		log_dropped++;
+		return;
+	}
+
+	e = &log_queue[tail & (LOG_QUEUE_LEN - 1)];
+	e->time = time(NULL);
+	e->level = level;
+	e->flags = flags;
+	memcpy(e->str, log_str, len + 1);
+
+	if (!log_thread_running) {
+		write_entries(tail, tail + 1);
+		return;
+	}
+
+	log_queue_tail++;
+
+	if (level <= LOG_ERR || log_queue_tail - log_queue_head == LOG_QUEUE_LEN / 2)
+		pthread_cond_signal(&log_cond);
+}
+
 void log_level(char *name_in, uint32_t level_in, const char *fmt, ...)
 {
 	va_list ap;
@@ -129,9 +607,18 @@ void log_level(char *name_in, uint32_t level_in, const char *fmt, ...)
 	int len = LOG_STR_LEN - 2;
 	int namelen = 0;
 	int plock = extra & LOG_PLOCK;
+	int flags;
+
+	if (plock) {
+		va_start(ap, fmt);
+		plock_save(name_in, fmt, ap);
+		va_end(ap);
+	}
 
 	memset(name, 0, sizeof(name));
 
+	pthread_mutex_lock(&log_mutex);
+
 	if (name_in) {
 		namelen = snprintf(name, NAME_ID_SIZE + 1, "%s", name_in);
 		if (namelen > NAME_ID_SIZE)
@@ -159,24 +646,21 @@ void log_level(char *name_in, uint32_t level_in, const char *fmt, ...)
 
 	if (level < LOG_NONE)
 		log_save_str(pos - 1, log_dump, &log_point, &log_wrap);
-	if (plock)
-		log_save_str(pos - 1, log_dump_plock, &log_point_plock, &log_wrap_plock);
 
+	flags = 0;
 	if (level <= syslog_priority)
-		syslog(level, "%s", log_str);
-
-	if (level <= logfile_priority && logfile_fp) {
-		time_t logtime = time(NULL);
-		char tbuf[64];
-		strftime(tbuf, sizeof(tbuf), "%b %d %T", localtime(&logtime));
-		fprintf(logfile_fp, "%s %s", tbuf, log_str);
-		fflush(logfile_fp);
-	}
+		flags |= LQ_SYSLOG;
+	if (level <= logfile_priority && logfile_fd != -1)
+		flags |= LQ_LOGFILE;
+	if (flags)
+		queue_log_str(level, flags, pos - 1);
 
 	if (!dlm_options[daemon_debug_ind].use_int)
-		return;
+		goto out;
 
-	if ((level < LOG_NONE) || (plock && opt(plock_debug_ind)))
+	if (level < LOG_NONE)
 		fprintf(stderr, "%s", log_str);
+ out:
+	pthread_mutex_unlock(&log_mutex);
 }
 
@@ -33,11 +33,29 @@ static int kernel_monitor_fd;
 
 struct client {
 	int fd;
+	int class;
 	void *workfn;
 	void *deadfn;
 	struct lockspace *ls;
 };
 
+/*
+ * Max units of work for each client class in one loop iteration: a workfn
+ * call is one, and a workfn that handles several messages per call takes
+ * one more for each from client_more().  Ready clients left over when a
+ * budget runs out are still ready at the next poll, and are the first of
+ * their class to be run then.
+ */
+static int class_budget[CLIENT_CLASSES] = {
+	[CLIENT_CLASS_CLUSTER] = 64,
+	[CLIENT_CLASS_MEMBER] = 64,
+	[CLIENT_CLASS_CONTROL] = 32,
+	[CLIENT_CLASS_PLOCK] = 128,
+};
+
+static int class_next[CLIENT_CLASSES];
+static int run_budget;
+
 int do_read(int fd, void *buf, size_t count)
 {
 	int rv, off = 0;
@@ -83,6 +101,13 @@ uint64_t monotime(void)
 	return ts.tv_sec;
 }
 
+uint64_t monotime_usec(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
 static void client_alloc(void)
 {
 	int i;
@@ -105,6 +130,7 @@ static void client_alloc(void)
 		client[i].workfn = NULL;
 		client[i].deadfn = NULL;
 		client[i].fd = -1;
+		client[i].class = CLIENT_CLASS_MEMBER;
 		pollfd[i].fd = -1;
 		pollfd[i].revents = 0;
 	}
@@ -134,8 +160,10 @@ int client_add(int fd, void (*workfn)(int ci), void (*deadfn)(int ci))
 			else
 				client[i].deadfn = client_dead;
 			client[i].fd = fd;
+			client[i].class = CLIENT_CLASS_MEMBER;
 			pollfd[i].fd = fd;
 			pollfd[i].events = POLLIN;
+			pollfd[i].revents = 0;
 			if (i > client_maxi)
 				client_maxi = i;
 			return i;
@@ -146,6 +174,11 @@ int client_add(int fd, void (*workfn)(int ci), void (*deadfn)(int ci))
 	goto again;
 }
 
+void client_class(int ci, int class)
+{
+	client[ci].class = class;
+}
+
 int client_fd(int ci)
 {
 	return client[ci].fd;
@@ -163,6 +196,70 @@ void client_back(int ci, int fd)
 	pollfd[ci].events = POLLIN;
 }
 
+/*
+ * Called by a workfn before handling another message in the same call,
+ * takes one from the budget of the class being run.
+ */
+
+int client_more(void)
+{
+	if (run_budget <= 0)
+		return 0;
+	run_budget--;
+	return 1;
+}
+
+/*
+ * Run the clients of one class that the main poll found ready, round
+ * robin, once each, until the class budget is used up.  A workfn that
+ * handles several messages in one call takes them from the same budget
+ * with client_more().  The revents of
+ * the main poll are used as is; a client with more input is found ready
+ * again by the next poll.  pollfd revents POLLIN is cleared for each
+ * client that has been run, so clients with POLLIN remaining were
+ * deferred by the budget.
+ */
+
+static void run_class(int class, int maxi)
+{
+	void (*workfn) (int ci);
+	uint64_t begin;
+	int start, n, i;
+
+	begin = monotime_usec();
+	run_budget = class_budget[class];
+
+	start = class_next[class];
+	if (start > maxi)
+		start = 0;
+
+	for (n = 0; n <= maxi; n++) {
+		i = (start + n) % (maxi + 1);
+
+		if (client[i].fd < 0 || client[i].class != class)
+			continue;
+		if (!(pollfd[i].revents & POLLIN))
+			continue;
+
+		if (run_budget <= 0) {
+			class_next[class] = i;
+			loop_stats[class].deferred++;
+			goto out;
+		}
+
+		run_budget--;
+		workfn = client[i].workfn;
+		workfn(i);
+		loop_stats[class].calls++;
+
+		pollfd[i].revents &= ~POLLIN;
+	}
+
+	class_next[class] = 0;
+ out:
+	loop_stats[class].usec += monotime_usec() - begin;
+}
+
 static void sigterm_handler(int sig)
 {
 	daemon_quit = 1;
@@ -185,13 +282,10 @@ static struct lockspace *create_ls(char *name)
 	INIT_LIST_HEAD(&ls->changes);
 	INIT_LIST_HEAD(&ls->node_history);
 	INIT_LIST_HEAD(&ls->saved_messages);
+	INIT_LIST_HEAD(&ls->plock_msgs);
 	INIT_LIST_HEAD(&ls->plock_resources);
 	ls->plock_resources_root = RB_ROOT;
-#if 0
 	INIT_LIST_HEAD(&ls->deadlk_nodes);
-	INIT_LIST_HEAD(&ls->transactions);
-	INIT_LIST_HEAD(&ls->resources);
-#endif
 	setup_lockspace_config(ls);
  out:
 	return ls;
@@ -527,6 +621,28 @@ static void query_dump_plocks(int fd, char *name)
 		send(fd, copy_buf, len, MSG_NOSIGNAL);
 }
 
+static void query_dump_recovery(int fd, char *name)
+{
+	struct lockspace *ls;
+	struct dlmc_header h;
+	int len = 0;
+	int rv;
+
+	ls = find_ls(name);
+	if (!ls) {
+		rv = -ENOENT;
+		goto out;
+	}
+
+	rv = copy_recovery_timeline(ls, copy_buf, &len);
+ out:
+	init_header(&h, DLMC_CMD_DUMP_RECOVERY, name, rv, len);
+	send(fd, &h, sizeof(h), MSG_NOSIGNAL);
+
+	if (len)
+		send(fd, copy_buf, len, MSG_NOSIGNAL);
+}
+
 /* combines a header and the data and sends it back to the client in
    a single do_write() call */
 
@@ -736,14 +852,12 @@ static void process_connection(int ci)
 			 h.data, NULL, 0);
 		break;
 
-#if 0
 	case DLMC_CMD_DEADLOCK_CHECK:
 		ls = find_ls(h.name);
-		if (ls)
+		if (ls && opt(enable_deadlk_ind))
 			send_cycle_start(ls);
 		client_dead(ci);
 		break;
-#endif
 	default:
 		log_error("process_connection %d unknown command %d",
 			  ci, h.command);
@@ -764,6 +878,7 @@ static void process_listener(int ci)
 	}
 	
 	i = client_add(fd, process_connection, NULL);
+	client_class(i, CLIENT_CLASS_CONTROL);
 
 	log_debug("client connection %d fd %d", i, fd);
 }
@@ -813,15 +928,109 @@ static void query_unlock(void)
 	pthread_mutex_unlock(&query_mutex);
 }
 
-/* This is a thread, so we have to be careful, don't call log_ functions.
-   We need a thread to process queries because the main thread may block
+static void query_status(int fd)
+{
+	char *buf = NULL;
+	int len = 0;
+	int rv;
+
+	rv = set_daemon_status(&buf, &len);
+
+	do_reply(fd, DLMC_CMD_STATUS, NULL, rv, 0, buf, len);
+
+	if (buf)
+		free(buf);
+}
+
+#define MAX_QUERY_CONNS 16
+
+/* returns 1 if the client wants the connection kept for more queries;
+   when full, there is no room to keep it, and the client is told so with
+   -EBUSY instead of finding it closed after the first query */
+
+static int process_query(int f, int full)
+{
+	struct dlmc_header h;
+	int rv;
+
+	rv = do_read(f, &h, sizeof(h));
+	if (rv < 0)
+		return rv;
+
+	if (h.magic != DLMC_MAGIC)
+		return -EINVAL;
+
+	if ((h.version & 0xFFFF0000) != (DLMC_VERSION & 0xFFFF0000))
+		return -EINVAL;
+
+	query_lock();
+
+	if (full && (h.flags & DLMC_HF_PERSIST)) {
+		log_error("query connection refused, %d are open",
+			  MAX_QUERY_CONNS);
+		do_reply(f, h.command, h.name, -EBUSY, 0, NULL, 0);
+		query_unlock();
+		return -EBUSY;
+	}
+
+	switch (h.command) {
+	case DLMC_CMD_DUMP_DEBUG:
+		query_dump_debug(f);
+		break;
+	case DLMC_CMD_DUMP_CONFIG:
+		query_dump_config(f);
+		break;
+	case DLMC_CMD_DUMP_LOG_PLOCK:
+		query_dump_log_plock(f);
+		break;
+	case DLMC_CMD_DUMP_PLOCKS:
+		query_dump_plocks(f, h.name);
+		break;
+	case DLMC_CMD_DUMP_RECOVERY:
+		query_dump_recovery(f, h.name);
+		break;
+	case DLMC_CMD_LOCKSPACE_INFO:
+		query_lockspace_info(f, h.name);
+		break;
+	case DLMC_CMD_NODE_INFO:
+		query_node_info(f, h.name, h.data);
+		break;
+	case DLMC_CMD_LOCKSPACES:
+		query_lockspaces(f, h.data);
+		break;
+	case DLMC_CMD_LOCKSPACE_NODES:
+		query_lockspace_nodes(f, h.name, h.option, h.data);
+		break;
+	case DLMC_CMD_DUMP_STATUS:
+		send_state_daemon(f);
+		send_state_daemon_nodes(f);
+		send_state_startup_nodes(f);
+		h.flags &= ~DLMC_HF_PERSIST;
+		break;
+	case DLMC_CMD_STATUS:
+		query_status(f);
+		break;
+	default:
+		break;
+	}
+	query_unlock();
+
+	return (h.flags & DLMC_HF_PERSIST) ? 1 : 0;
+}
+
+/* This is a thread, so we have to be careful, don't call log_ functions
+   without holding query_lock.  We need a thread to process queries because the main thread may block
    for long periods when writing to sysfs to stop dlm-kernel (any maybe
-   other places). */
+   other places).  Connections are closed after one query, unless the
+   client asks to keep them open, so that a monitor polling the daemon
+   does not connect for each query. */
 
 static void *process_queries(void *arg)
 {
-	struct dlmc_header h;
-	int s, f, rv;
+	struct pollfd pfd[MAX_QUERY_CONNS + 1];
+	int conns[MAX_QUERY_CONNS];
+	int conn_count = 0;
+	int s, f, i, rv;
 
 	rv = setup_listener(DLMC_QUERY_SOCK_PATH);
 	if (rv < 0)
@@ -830,62 +1039,47 @@ static void *process_queries(void *arg)
 	s = rv;
 
 	for (;;) {
-		f = accept(s, NULL, NULL);
-		if (f < 0)
+		pfd[0].fd = s;
+		pfd[0].events = POLLIN;
+		pfd[0].revents = 0;
+
+		for (i = 0; i < conn_count; i++) {
+			pfd[i + 1].fd = conns[i];
+			pfd[i + 1].events = POLLIN;
+			pfd[i + 1].revents = 0;
+		}
+
+		rv = poll(pfd, conn_count + 1, -1);
+		if (rv < 0 && errno == EINTR)
+			continue;
+		if (rv < 0)
 			return NULL;
 
-		rv = do_read(f, &h, sizeof(h));
-		if (rv < 0) {
-			goto out;
-		}
+		/* a closed connection is replaced by the last one, which
+		   has already been looked at */
 
-		if (h.magic != DLMC_MAGIC) {
-			goto out;
-		}
+		for (i = conn_count - 1; i >= 0; i--) {
+			if (!pfd[i + 1].revents)
+				continue;
 
-		if ((h.version & 0xFFFF0000) != (DLMC_VERSION & 0xFFFF0000)) {
-			goto out;
+			if (process_query(conns[i], 0) > 0)
+				continue;
+
+			close(conns[i]);
+			conns[i] = conns[--conn_count];
 		}
 
-		query_lock();
+		if (!(pfd[0].revents & POLLIN))
+			continue;
 
-		switch (h.command) {
-		case DLMC_CMD_DUMP_DEBUG:
-			query_dump_debug(f);
-			break;
-		case DLMC_CMD_DUMP_CONFIG:
-			query_dump_config(f);
-			break;
-		case DLMC_CMD_DUMP_LOG_PLOCK:
-			query_dump_log_plock(f);
-			break;
-		case DLMC_CMD_DUMP_PLOCKS:
-			query_dump_plocks(f, h.name);
-			break;
-		case DLMC_CMD_LOCKSPACE_INFO:
-			query_lockspace_info(f, h.name);
-			break;
-		case DLMC_CMD_NODE_INFO:
-			query_node_info(f, h.name, h.data);
-			break;
-		case DLMC_CMD_LOCKSPACES:
-			query_lockspaces(f, h.data);
-			break;
-		case DLMC_CMD_LOCKSPACE_NODES:
-			query_lockspace_nodes(f, h.name, h.option, h.data);
-			break;
-		case DLMC_CMD_DUMP_STATUS:
-			send_state_daemon(f);
-			send_state_daemon_nodes(f);
-			send_state_startup_nodes(f);
-			break;
-		default:
-			break;
-		}
-		query_unlock();
+		f = accept(s, NULL, NULL);
+		if (f < 0)
+			return NULL;
 
- out:
-		close(f);
+		if (process_query(f, conn_count == MAX_QUERY_CONNS) > 0)
+			conns[conn_count++] = f;
+		else
+			close(f);
 	}
 }
 
@@ -929,24 +1123,31 @@ static int loop(void)
 {
 	struct lockspace *ls;
 	int poll_timeout = -1;
-	int rv, i;
-	void (*workfn) (int ci);
+	int rv, i, c, maxi;
 	void (*deadfn) (int ci);
 
 	rv = setup_queries();
 	if (rv < 0)
 		goto out;
 
+	rv = setup_actions();
+	if (rv < 0)
+		goto out;
+	client_add(rv, process_actions, NULL);
+
 	rv = setup_listener(DLMC_SOCK_PATH);
 	if (rv < 0)
 		goto out;
-	client_add(rv, process_listener, NULL);
+	i = client_add(rv, process_listener, NULL);
+	client_class(i, CLIENT_CLASS_CONTROL);
 
 	rv = setup_cluster_cfg();
 	if (rv < 0)
 		goto out;
-	if (rv > 0) 
-		client_add(rv, process_cluster_cfg, cluster_dead);
+	if (rv > 0) {
+		i = client_add(rv, process_cluster_cfg, cluster_dead);
+		client_class(i, CLIENT_CLASS_CLUSTER);
+	}
 
 	rv = check_uncontrolled_lockspaces();
 	if (rv < 0)
@@ -970,7 +1171,8 @@ static int loop(void)
 	rv = setup_cluster();
 	if (rv < 0)
 		goto out;
-	client_add(rv, process_cluster, cluster_dead);
+	i = client_add(rv, process_cluster, cluster_dead);
+	client_class(i, CLIENT_CLASS_CLUSTER);
 
 	rv = setup_misc_devices();
 	if (rv < 0)
@@ -994,28 +1196,39 @@ static int loop(void)
 	rv = setup_cpg_daemon();
 	if (rv < 0)
 		goto out;
-	client_add(rv, process_cpg_daemon, cluster_dead);
+	i = client_add(rv, process_cpg_daemon, cluster_dead);
+	client_class(i, CLIENT_CLASS_CLUSTER);
 
 	rv = set_protocol();
 	if (rv < 0)
 		goto out;
 
-#if 0
+	rv = setup_ls_groups();
+	if (rv < 0)
+		goto out;
+
 	if (opt(enable_deadlk_ind)) {
+		/* without timewarns, only requested checks find deadlocks */
 		rv = setup_netlink();
 		if (rv < 0)
-			goto out;
-		client_add(rv, process_netlink, NULL);
-
-		setup_deadlock();
+			log_error("no netlink timewarns, deadlock detection "
+				  "from timewarns disabled");
+		else
+			client_add(rv, process_netlink, NULL);
 	}
-#endif
 
 	rv = setup_plocks();
 	if (rv < 0)
 		goto out;
 	plock_fd = rv;
 	plock_ci = client_add(rv, process_plocks, NULL);
+	client_class(plock_ci, CLIENT_CLASS_PLOCK);
+
+	rv = setup_plock_msgs();
+	if (rv < 0)
+		goto out;
+	i = client_add(rv, process_plock_msgs, NULL);
+	client_class(i, CLIENT_CLASS_PLOCK);
 
 #ifdef USE_SD_NOTIFY
 	sd_notify(0, "READY=1");
@@ -1045,13 +1258,17 @@ static int loop(void)
 
 		query_lock();
 
-		for (i = 0; i <= client_maxi; i++) {
+		maxi = client_maxi;
+
+		for (c = 0; c < CLIENT_CLASSES; c++)
+			run_class(c, maxi);
+
+		for (i = 0; i <= maxi; i++) {
 			if (client[i].fd < 0)
 				continue;
-			if (pollfd[i].revents & POLLIN) {
-				workfn = client[i].workfn;
-				workfn(i);
-			}
+			/* deferred by the class budget, still ready next poll */
+			if (pollfd[i].revents & POLLIN)
+				continue;
 			if (pollfd[i].revents & (POLLERR | POLLHUP | POLLNVAL)) {
 				deadfn = client[i].deadfn;
 				deadfn(i);
@@ -1090,12 +1307,26 @@ static int loop(void)
 				poll_timeout = 1000;
 		}
 
+		if (poll_deadlk) {
+			process_deadlk();
+			if (poll_deadlk)
+				poll_timeout = 1000;
+		}
+
+		if (opt(metrics_interval_ind)) {
+			process_metrics();
+			poll_timeout = 1000;
+		}
+
 		query_unlock();
 	}
  out:
 	log_debug("shutdown");
+	close_metrics();
 	close_plocks();
 	close_cpg_daemon();
+	close_ls_groups();
+	close_actions();
 	clear_configfs();
 	close_logging();
 	close_cluster();
@@ -1341,6 +1572,11 @@ static void set_opt_defaults(void)
 			0, NULL,
 			"enable/disable concurrent fencing");
 
+	set_opt_default(fence_agent_timeout_ind,
+			"fence_agent_timeout", '\0', req_arg_int,
+			0, NULL,
+			"seconds before a fence agent is killed and fails (0 no limit)");
+
 	set_opt_default(enable_startup_fencing_ind,
 			"enable_startup_fencing", 's', req_arg_bool,
 			1, NULL,
@@ -1356,6 +1592,31 @@ static void set_opt_defaults(void)
 			1, NULL,
 			"enable/disable quorum requirement for lockspace operations");
 
+	set_opt_default(ls_cpg_groups_ind,
+			"ls_cpg_groups", '\0', req_arg_int,
+			0, NULL,
+			"number of cpgs shared by all lockspaces (0 for a cpg per lockspace)");
+
+	set_opt_default(enable_deadlk_ind,
+			"enable_deadlk", '\0', req_arg_bool,
+			0, NULL,
+			"enable/disable deadlock detection");
+
+	set_opt_default(deadlk_victim_ind,
+			"deadlk_victim", '\0', req_arg_int,
+			0, NULL,
+			"deadlock victim: 0 youngest xid, 1 fewest locks, 2 most waiters");
+
+	set_opt_default(deadlk_incremental_ind,
+			"deadlk_incremental", '\0', req_arg_bool,
+			1, NULL,
+			"track blocked transactions between deadlock cycles");
+
+	set_opt_default(metrics_interval_ind,
+			"metrics_interval", '\0', req_arg_int,
+			0, NULL,
+			"write metrics file every N seconds (0 off)");
+
 	set_opt_default(help_ind,
 			"help", 'h', no_arg,
 			-1, NULL,
@@ -0,0 +1,188 @@
+/*
+ * Copyright 2026 The dlm authors.
+ *
+ * This copyrighted material is made available to anyone wishing to use,
+ * modify, copy, or redistribute it subject to the terms and conditions
+ * of the GNU General Public License v2 or (at your option) any later version.
+ */
+
+#include "dlm_daemon.h"
+
+/*
+ * With metrics_interval, METRICS_FILE_PATH is rewritten every interval
+ * seconds in the OpenMetrics text format.  The counters are only updated
+ * by the main thread, which also writes the file, so collecting them
+ * needs no locking.  The file is written to a temp file and renamed, so
+ * readers never see a partial file.
+ */
+
+struct msg_stats {
+	uint64_t send_count;
+	uint64_t send_bytes;
+	uint64_t recv_count;
+	uint64_t recv_bytes;
+};
+
+static struct msg_stats msg_stats[DLM_MSG_TYPES];
+static uint64_t send_retries;
+static uint64_t last_write;
+
+void metrics_send(int type, int len, int retries)
+{
+	send_retries += retries;
+
+	if (type < 0 || type >= DLM_MSG_TYPES)
+		return;
+	msg_stats[type].send_count++;
+	msg_stats[type].send_bytes += len;
+}
+
+void metrics_recv(int type, int len)
+{
+	if (type < 0 || type >= DLM_MSG_TYPES)
+		return;
+	msg_stats[type].recv_count++;
+	msg_stats[type].recv_bytes += len;
+}
+
+/* a lockspace name as a label value, with \, " and newline escaped;
+   buf is METRICS_LABEL_LEN */
+
+char *metrics_label(const char *val, char *buf)
+{
+	int i, j = 0;
+
+	for (i = 0; val[i] && j < METRICS_LABEL_LEN - 2; i++) {
+		if (val[i] == '\\' || val[i] == '"') {
+			buf[j++] = '\\';
+			buf[j++] = val[i];
+		} else if (val[i] == '\n') {
+			buf[j++] = '\\';
+			buf[j++] = 'n';
+		} else {
+			buf[j++] = val[i];
+		}
+	}
+	buf[j] = '\0';
+	return buf;
+}
+
+static void write_msg_metrics(FILE *fp)
+{
+	int i;
+
+	fprintf(fp, "# TYPE dlm_messages_sent counter\n");
+	fprintf(fp, "# HELP dlm_messages_sent cpg messages sent by type\n");
+	for (i = 0; i < DLM_MSG_TYPES; i++) {
+		if (!msg_stats[i].send_count && !msg_stats[i].recv_count)
+			continue;
+		fprintf(fp, "dlm_messages_sent_total{type=\"%s\"} %llu\n",
+			msg_name(i), (unsigned long long)msg_stats[i].send_count);
+	}
+
+	fprintf(fp, "# TYPE dlm_message_sent_bytes counter\n");
+	fprintf(fp, "# UNIT dlm_message_sent_bytes bytes\n");
+	for (i = 0; i < DLM_MSG_TYPES; i++) {
+		if (!msg_stats[i].send_count && !msg_stats[i].recv_count)
+			continue;
+		fprintf(fp, "dlm_message_sent_bytes_total{type=\"%s\"} %llu\n",
+			msg_name(i), (unsigned long long)msg_stats[i].send_bytes);
+	}
+
+	fprintf(fp, "# TYPE dlm_messages_received counter\n");
+	fprintf(fp, "# HELP dlm_messages_received cpg messages received by type\n");
+	for (i = 0; i < DLM_MSG_TYPES; i++) {
+		if (!msg_stats[i].send_count && !msg_stats[i].recv_count)
+			continue;
+		fprintf(fp, "dlm_messages_received_total{type=\"%s\"} %llu\n",
+			msg_name(i), (unsigned long long)msg_stats[i].recv_count);
+	}
+
+	fprintf(fp, "# TYPE dlm_message_received_bytes counter\n");
+	fprintf(fp, "# UNIT dlm_message_received_bytes bytes\n");
+	for (i = 0; i < DLM_MSG_TYPES; i++) {
+		if (!msg_stats[i].send_count && !msg_stats[i].recv_count)
+			continue;
+		fprintf(fp, "dlm_message_received_bytes_total{type=\"%s\"} %llu\n",
+			msg_name(i), (unsigned long long)msg_stats[i].recv_bytes);
+	}
+
+	fprintf(fp, "# TYPE dlm_cpg_send_retries counter\n");
+	fprintf(fp, "# HELP dlm_cpg_send_retries cpg_mcast_joined TRY_AGAIN retries\n");
+	fprintf(fp, "dlm_cpg_send_retries_total %llu\n",
+		(unsigned long long)send_retries);
+}
+
+static void write_recovery_metrics(FILE *fp)
+{
+	struct lockspace *ls;
+	char label[METRICS_LABEL_LEN];
+
+	fprintf(fp, "# TYPE dlm_recovery_seconds summary\n");
+	fprintf(fp, "# UNIT dlm_recovery_seconds seconds\n");
+	fprintf(fp, "# HELP dlm_recovery_seconds lockspace change to kernel start\n");
+	list_for_each_entry(ls, &lockspaces, list) {
+		metrics_label(ls->name, label);
+		fprintf(fp, "dlm_recovery_seconds_count{lockspace=\"%s\"} %llu\n",
+			label, (unsigned long long)ls->recovery_count);
+		fprintf(fp, "dlm_recovery_seconds_sum{lockspace=\"%s\"} %.6f\n",
+			label, ls->recovery_usec * 1.e-6);
+	}
+
+	fprintf(fp, "# TYPE dlm_recovery_last_seconds gauge\n");
+	fprintf(fp, "# UNIT dlm_recovery_last_seconds seconds\n");
+	list_for_each_entry(ls, &lockspaces, list) {
+		fprintf(fp, "dlm_recovery_last_seconds{lockspace=\"%s\"} %.6f\n",
+			metrics_label(ls->name, label),
+			ls->recovery_last_usec * 1.e-6);
+	}
+}
+
+static void write_metrics(void)
+{
+	char path[PATH_MAX];
+	FILE *fp;
+
+	snprintf(path, sizeof(path), "%s.tmp", METRICS_FILE_PATH);
+
+	fp = fopen(path, "w");
+	if (!fp) {
+		log_debug("write_metrics open %s error %d", path, errno);
+		return;
+	}
+
+	write_msg_metrics(fp);
+	write_plock_metrics(fp);
+	write_recovery_metrics(fp);
+	write_fence_metrics(fp);
+
+	fprintf(fp, "# EOF\n");
+
+	if (fclose(fp)) {
+		log_debug("write_metrics write %s error %d", path, errno);
+		unlink(path);
+		return;
+	}
+
+	if (rename(path, METRICS_FILE_PATH) < 0) {
+		log_debug("write_metrics rename error %d", errno);
+		unlink(path);
+	}
+}
+
+void process_metrics(void)
+{
+	uint64_t now = monotime();
+
+	if (now - last_write < opt(metrics_interval_ind))
+		return;
+	last_write = now;
+
+	write_metrics();
+}
+
+void close_metrics(void)
+{
+	if (opt(metrics_interval_ind))
+		unlink(METRICS_FILE_PATH);
+}
@@ -12,8 +12,6 @@
 #include <linux/genetlink.h>
 #include <linux/dlm_netlink.h>
 
-#define DEADLOCK_CHECK_SECS		10
-
 /* FIXME: look into using libnl/libnetlink */
 
 #define GENLMSG_DATA(glh)       ((void *)((char *)NLMSG_DATA(glh) + GENL_HDRLEN))
@@ -91,6 +89,8 @@ static int get_family_id(int sd)
 	rc = send_genetlink_cmd(sd, GENL_ID_CTRL, getpid(), CTRL_CMD_GETFAMILY,
 				CTRL_ATTR_FAMILY_NAME, (void *)genl_name,
 				strlen(DLM_GENL_NAME)+1);
+	if (rc < 0)
+		return 0;
 
 	rep_len = recv(sd, &ans, sizeof(ans), 0);
 	if (ans.n.nlmsg_type == NLMSG_ERROR ||
@@ -149,8 +149,6 @@ int setup_netlink(void)
 static void process_timewarn(struct dlm_lock_data *data)
 {
 	struct lockspace *ls;
-	struct timeval now;
-	unsigned int sec;
 
 	ls = find_ls_id(data->lockspace_id);
 	if (!ls)
@@ -158,8 +156,9 @@ static void process_timewarn(struct dlm_lock_data *data)
 
 	data->resource_name[data->resource_namelen] = '\0';
 
-	log_group(ls, "timewarn: lkid %x pid %d name %s",
-		  data->id, data->ownpid, data->resource_name);
+	log_group(ls, "timewarn: lkid %x xid %llx pid %d name %s",
+		  data->id, (unsigned long long)data->xid, data->ownpid,
+		  data->resource_name);
 
 	/* Problem: we don't want to get a timewarn, assume it's resolved
 	   by the current cycle, but in fact it's from a deadlock that
@@ -178,29 +177,10 @@ static void process_timewarn(struct dlm_lock_data *data)
 	   which timewarns are addressed by a given cycle and which aren't.  */
 
 
-	gettimeofday(&now, NULL);
-
-	/* don't send a new start until at least SECS after the last
-	   we sent, and at least SECS after the last completed cycle */
-
-	sec = now.tv_sec - ls->last_send_cycle_start.tv_sec;
-
-	if (sec < DEADLOCK_CHECK_SECS) {
-		log_group(ls, "skip send: recent send cycle %d sec", sec);
-		return;
-	}
-
-	sec = now.tv_sec - ls->cycle_end_time.tv_sec;
-
-	if (sec < DEADLOCK_CHECK_SECS) {
-		log_group(ls, "skip send: recent cycle end %d sec", sec);
-		return;
-	}
-
-	gettimeofday(&ls->last_send_cycle_start, NULL);
-
-	if (cfgd_enable_deadlk)
-		send_cycle_start(ls);
+	if (opt(deadlk_incremental_ind))
+		deadlk_timewarn(ls, data->xid);
+	else
+		request_cycle_start(ls);
 }
 
 void process_netlink(int ci)
@@ -25,6 +25,11 @@ static struct timeval plock_read_time;
 static struct timeval plock_recv_time;
 static struct timeval plock_rate_last;
 
+/* cumulative, for metrics; index is optype, 0 for anything else */
+static uint64_t plock_read_ops[DLM_PLOCK_OP_GET + 1];
+static uint64_t plock_recv_total;
+static uint64_t plock_delay_total;
+
 static int plock_device_fd = -1;
 
 #define RD_CONTINUE 0x00000001
@@ -859,6 +864,7 @@ static void _receive_plock(struct lockspace *ls, struct dlm_header *hd, int len)
 		  info.nodeid, info.pid, (unsigned long long)info.owner,
 		  info.wait);
 
+	plock_recv_total++;
 	plock_recv_count++;
 	if (!(plock_recv_count % 1000)) {
 		gettimeofday(&now, NULL);
@@ -1492,6 +1498,7 @@ int limit_plocks(void)
 	if (!(plock_read_count % opt(plock_rate_limit_ind))) {
 		if (time_diff_ms(&plock_rate_last, &now) < 1000) {
 			plock_rate_delays++;
+			plock_delay_total++;
 			return 2;
 		}
 		plock_rate_last = now;
@@ -1554,6 +1561,11 @@ void process_plocks(int ci)
 		  info.nodeid, info.pid, (unsigned long long)info.owner,
 		  info.wait);
 
+	if (info.optype > 0 && info.optype <= DLM_PLOCK_OP_GET)
+		plock_read_ops[info.optype]++;
+	else
+		plock_read_ops[0]++;
+
 	/* report plock rate and any delays since the last report */
 	plock_read_count++;
 	if (!(plock_read_count % 1000)) {
@@ -2152,3 +2164,90 @@ int copy_plock_state(struct lockspace *ls, char *buf, int *len_out)
 	return rv;
 }
 
+static const char *plock_ops_label[] = { "other", "lock", "unlock", "get" };
+
+struct plock_counts {
+	char label[METRICS_LABEL_LEN];
+	uint64_t resources;
+	uint64_t locks;
+	uint64_t waiters;
+};
+
+static void count_plocks(struct lockspace *ls, struct plock_counts *pc)
+{
+	struct resource *r;
+	struct posix_lock *po;
+	struct lock_waiter *w;
+
+	memset(pc, 0, sizeof(struct plock_counts));
+	metrics_label(ls->name, pc->label);
+
+	list_for_each_entry(r, &ls->plock_resources, list) {
+		pc->resources++;
+		list_for_each_entry(po, &r->locks, list)
+			pc->locks++;
+		list_for_each_entry(w, &r->waiters, list)
+			pc->waiters++;
+	}
+}
+
+/* OpenMetrics wants the samples of a family together, so the plocks of
+   each lockspace are counted once, and each gauge is printed from the
+   counts. */
+
+void write_plock_metrics(FILE *fp)
+{
+	struct lockspace *ls;
+	struct plock_counts *counts;
+	int i, n = 0;
+
+	fprintf(fp, "# TYPE dlm_plock_ops counter\n");
+	fprintf(fp, "# HELP dlm_plock_ops plock ops read from the kernel\n");
+	for (i = 0; i <= DLM_PLOCK_OP_GET; i++) {
+		fprintf(fp, "dlm_plock_ops_total{op=\"%s\"} %llu\n",
+			plock_ops_label[i], (unsigned long long)plock_read_ops[i]);
+	}
+
+	fprintf(fp, "# TYPE dlm_plock_messages counter\n");
+	fprintf(fp, "# HELP dlm_plock_messages plock ops received from the cluster\n");
+	fprintf(fp, "dlm_plock_messages_total %llu\n",
+		(unsigned long long)plock_recv_total);
+
+	fprintf(fp, "# TYPE dlm_plock_rate_delays counter\n");
+	fprintf(fp, "# HELP dlm_plock_rate_delays reads delayed by plock_rate_limit\n");
+	fprintf(fp, "dlm_plock_rate_delays_total %llu\n",
+		(unsigned long long)plock_delay_total);
+
+	list_for_each_entry(ls, &lockspaces, list)
+		n++;
+	if (!n)
+		return;
+
+	counts = malloc(n * sizeof(struct plock_counts));
+	if (!counts) {
+		log_debug("write_plock_metrics no memory");
+		return;
+	}
+
+	n = 0;
+	list_for_each_entry(ls, &lockspaces, list)
+		count_plocks(ls, &counts[n++]);
+
+	fprintf(fp, "# TYPE dlm_plock_resources gauge\n");
+	for (i = 0; i < n; i++)
+		fprintf(fp, "dlm_plock_resources{lockspace=\"%s\"} %llu\n",
+			counts[i].label,
+			(unsigned long long)counts[i].resources);
+
+	fprintf(fp, "# TYPE dlm_plock_locks gauge\n");
+	for (i = 0; i < n; i++)
+		fprintf(fp, "dlm_plock_locks{lockspace=\"%s\"} %llu\n",
+			counts[i].label, (unsigned long long)counts[i].locks);
+
+	fprintf(fp, "# TYPE dlm_plock_waiters gauge\n");
+	for (i = 0; i < n; i++)
+		fprintf(fp, "dlm_plock_waiters{lockspace=\"%s\"} %llu\n",
+			counts[i].label, (unsigned long long)counts[i].waiters);
+
+	free(counts);
+}
@@ -19,6 +19,7 @@
 #include <sys/un.h>
 #include <inttypes.h>
 #include <netinet/in.h>
+#include <time.h>
 
 #include <linux/dlmconstants.h>
 #include "libdlm.h"
@@ -41,6 +42,7 @@
 #define OP_FENCE_ACK			11
 #define OP_STATUS			12
 #define OP_DUMP_CONFIG			13
+#define OP_TOP				14
 
 static char *prog_name;
 static char *lsname;
@@ -54,6 +56,13 @@ static mode_t create_mode = 0600;
 static int verbose;
 static int wide;
 static int summarize;
+static int summary_only;
+static char *opt_resource;
+static int opt_nodeid = -1;
+static int opt_mode = -1;
+static int opt_waiting;
+static unsigned int top_interval = 2;
+static int top_count;
 
 #define MAX_LS 128
 #define MAX_NODES 128
@@ -143,6 +152,17 @@ static const char *mode_str(int mode)
 	return "??";
 }
 
+static int str_mode(const char *str)
+{
+	int mode;
+
+	for (mode = LKM_NLMODE; mode <= LKM_EXMODE; mode++) {
+		if (!strcasecmp(str, mode_str(mode)))
+			return mode;
+	}
+	return -1;
+}
+
 static const char *msg_str(int type)
 {
 	switch (type) {
@@ -188,22 +208,29 @@ static void print_usage(void)
 	printf("Commands:\n");
 	printf("ls, status, dump, dump_config, fence_ack\n");
 	printf("log_plock, plocks\n");
-	printf("join, leave, lockdebug\n");
+	printf("join, leave, lockdebug, lockdump, top\n");
 	printf("\n");
 	printf("Options:\n");
 	printf("  -n               Show all node information in ls\n");
 	printf("  -e 0|1           Exclusive create off/on in join, default 0\n");
 	printf("  -f 0|1           FS (filesystem) flag off/on in join, default 0\n");
 	printf("  -m <mode>        Permission mode for lockspace device (octal), default 0600\n");
-	printf("  -s               Summary following lockdebug output (experimental)\n");
-	printf("  -v               Verbose lockdebug output\n");
+	printf("  -s               Summary following lockdebug or lockdump output (experimental)\n");
+	printf("  -v               Verbose lockdebug output, recovery history in ls\n");
 	printf("  -w               Wide lockdebug output\n");
+	printf("  -S               Only the summary of lockdebug or lockdump output\n");
+	printf("  -r <prefix>      Only resources whose name begins with prefix\n");
+	printf("  -N <nodeid>      Only locks held by nodeid (0 for this node)\n");
+	printf("  -L <mode>        Only locks granted or requested in mode (NL,CR,CW,PR,PW,EX)\n");
+	printf("  -W               Only locks that are waiting or converting\n");
+	printf("  -i <sec>         Seconds between top samples, default 2\n");
+	printf("  -c <count>       Number of top samples, default 0 (until interrupted)\n");
 	printf("  -h               Print help, then exit\n");
 	printf("  -V               Print program version information, then exit\n");
 	printf("\n");
 }
 
-#define OPTION_STRING "MhVnm:e:f:vws"
+#define OPTION_STRING "MhVnm:e:f:vwsSr:N:L:Wi:c:"
 
 static void decode_arguments(int argc, char **argv)
 {
@@ -242,6 +269,40 @@ static void decode_arguments(int argc, char **argv)
 			summarize = 1;
 			break;
 
+		case 'S':
+			summary_only = 1;
+			break;
+
+		case 'r':
+			opt_resource = optarg;
+			break;
+
+		case 'N':
+			opt_nodeid = atoi(optarg);
+			break;
+
+		case 'L':
+			opt_mode = str_mode(optarg);
+			if (opt_mode < 0) {
+				fprintf(stderr, "unknown lock mode: %s\n", optarg);
+				exit(EXIT_FAILURE);
+			}
+			break;
+
+		case 'W':
+			opt_waiting = 1;
+			break;
+
+		case 'i':
+			top_interval = atoi(optarg);
+			if (!top_interval)
+				top_interval = 1;
+			break;
+
+		case 'c':
+			top_count = atoi(optarg);
+			break;
+
 		case 'v':
 			verbose = 1;
 			break;
@@ -369,6 +430,12 @@ static void decode_arguments(int argc, char **argv)
 			operation = OP_LOCKDEBUG;
 			opt_ind = optind + 1;
 			break;
+		} else if (!strncmp(argv[optind], "top", 3) &&
+			   (strlen(argv[optind]) == 3)) {
+			operation = OP_TOP;
+			opt_ind = optind + 1;
+			need_lsname = 0;
+			break;
 		}
 		optind++;
 	}
@@ -502,87 +569,306 @@ static char *pr_extra(uint32_t flags, int root_list, int recover_list,
 	return buf;
 }
 
-static void print_rsb(char *line, struct rinfo *ri)
+/*
+ * debugfs lock dumps can have millions of lines, so they are read in large
+ * blocks, and each line is split into fields in place rather than copied
+ * out with fgets and parsed with sscanf.
+ */
+
+#define DUMP_BUF_SIZE (1024 * 1024)
+
+struct dump_file {
+	int fd;
+	char *buf;
+	size_t size;
+	size_t start;
+	size_t end;
+	int eof;
+};
+
+static int dump_open(struct dump_file *df, const char *path)
+{
+	memset(df, 0, sizeof(struct dump_file));
+
+	df->fd = open(path, O_RDONLY);
+	if (df->fd < 0)
+		return -1;
+
+	df->size = DUMP_BUF_SIZE;
+	df->buf = malloc(df->size);
+	if (!df->buf) {
+		close(df->fd);
+		return -1;
+	}
+	return 0;
+}
+
+static void dump_close(struct dump_file *df)
+{
+	close(df->fd);
+	free(df->buf);
+}
+
+/* the next line without its newline, valid until the next call */
+static char *dump_line(struct dump_file *df)
 {
-	char type[4], namefmt[4], *p;
-	char addr[64];
-	char first_lkid[64];
-	int rv, nodeid, root_list, recover_list, recover_locks_count, namelen;
+	char *line, *nl, *buf;
+	size_t len;
+	ssize_t rv;
+
+	for (;;) {
+		line = df->buf + df->start;
+		len = df->end - df->start;
+
+		nl = memchr(line, '\n', len);
+		if (nl) {
+			*nl = '\0';
+			df->start += nl - line + 1;
+			return line;
+		}
+
+		if (df->eof) {
+			if (!len)
+				return NULL;
+			line[len] = '\0';
+			df->start = df->end;
+			return line;
+		}
+
+		/* move the partial line to the front and read more after it */
+		memmove(df->buf, line, len);
+		df->start = 0;
+		df->end = len;
+
+		if (df->end >= df->size - 1) {
+			buf = realloc(df->buf, df->size * 2);
+			if (!buf) {
+				df->eof = 1;
+				continue;
+			}
+			df->buf = buf;
+			df->size *= 2;
+		}
+
+		rv = read(df->fd, df->buf + df->end, df->size - 1 - df->end);
+		if (rv <= 0)
+			df->eof = 1;
+		else
+			df->end += rv;
+	}
+}
+
+/* split off the next space separated field, advancing *p past it */
+static char *next_field(char **p)
+{
+	char *s = *p;
+	char *f;
+
+	while (*s == ' ')
+		s++;
+	if (!*s)
+		return NULL;
+
+	f = s;
+	while (*s && *s != ' ')
+		s++;
+	if (*s)
+		*s++ = '\0';
+	*p = s;
+	return f;
+}
+
+/* undo next_field() up to p, to print the whole line in an error */
+static char *unsplit(char *line, char *p)
+{
+	char *s;
+
+	for (s = line; s < p; s++) {
+		if (!*s)
+			*s = ' ';
+	}
+	return line;
+}
+
+static int next_int(char **p, int *val)
+{
+	char *f = next_field(p);
+	char *end;
+
+	if (!f)
+		return -1;
+	*val = strtol(f, &end, 10);
+	return *end ? -1 : 0;
+}
+
+static int next_u32(char **p, int base, uint32_t *val)
+{
+	char *f = next_field(p);
+	char *end;
+
+	if (!f)
+		return -1;
+	*val = strtoul(f, &end, base);
+	return *end ? -1 : 0;
+}
+
+static int next_u64(char **p, uint64_t *val)
+{
+	char *f = next_field(p);
+	char *end;
+
+	if (!f)
+		return -1;
+	*val = strtoull(f, &end, 10);
+	return *end ? -1 : 0;
+}
+
+/*
+ * Filters from the command line.  A resource matches if its name starts
+ * with the prefix; a lock matches if it is held by the nodeid (0 for this
+ * node), is granted or requested in the mode, and is waiting or converting.
+ */
+
+static int lock_filters(void)
+{
+	return opt_nodeid != -1 || opt_mode != -1 || opt_waiting;
+}
+
+static int match_name(const char *name)
+{
+	if (!opt_resource)
+		return 1;
+	return !strncmp(name, opt_resource, strlen(opt_resource));
+}
+
+static int match_lock(int nodeid, int status, int grmode, int rqmode)
+{
+	if (opt_nodeid != -1 && nodeid != opt_nodeid)
+		return 0;
+
+	if (opt_waiting && status != DLM_LKSTS_WAITING &&
+	    status != DLM_LKSTS_CONVERT)
+		return 0;
+
+	if (opt_mode != -1) {
+		if ((status == DLM_LKSTS_GRANTED ||
+		     status == DLM_LKSTS_CONVERT) && grmode == opt_mode)
+			return 1;
+		if ((status == DLM_LKSTS_WAITING ||
+		     status == DLM_LKSTS_CONVERT) && rqmode == opt_mode)
+			return 1;
+		return 0;
+	}
+	return 1;
+}
+
+struct rsb_line {
+	int nodeid;
 	uint32_t flags;
+	int root_list;
+	int recover_list;
+	uint32_t recover_locks_count;
+	int namelen;
+	int hex;
+	char first_lkid[16];
+	char name[DLM_RESNAME_MAXLEN * 3 + 1];
+};
 
-	rv = sscanf(line, "%s %s %d %s %u %d %d %u %u %s",
-		    type,
-		    addr,
-		    &nodeid,
-		    first_lkid,
-		    &flags,
-		    &root_list,
-		    &recover_list,
-		    &recover_locks_count,
-		    &namelen,
-		    namefmt);
-
-	if (rv != 10)
-		goto fail;
+static int parse_rsb(char *line, struct rsb_line *r)
+{
+	char *p = line;
+	char *f;
 
-	/* used for lkb prints */
-	ri->nodeid = nodeid;
+	/* "rsb" and the address */
+	if (!next_field(&p) || !next_field(&p))
+		goto fail;
 
-	ri->namelen = namelen;
-	
-	p = strchr(line, '\n');
-	if (!p)
+	if (next_int(&p, &r->nodeid))
 		goto fail;
-	*p = '\0';
 
-	p = strstr(line, namefmt);
-	if (!p)
+	f = next_field(&p);
+	if (!f)
 		goto fail;
-	p += 4;
+	snprintf(r->first_lkid, sizeof(r->first_lkid), "%s", f);
 
-	strcat(addr, " ");
+	if (next_u32(&p, 16, &r->flags) ||
+	    next_int(&p, &r->root_list) ||
+	    next_int(&p, &r->recover_list) ||
+	    next_u32(&p, 10, &r->recover_locks_count) ||
+	    next_int(&p, &r->namelen))
+		goto fail;
 
-	if (!strncmp(namefmt, "str", 3))
-		printf("Resource len %2d  \"%s\"\n", namelen, p);
-	else if (!strncmp(namefmt, "hex", 3))
-		printf("Resource len %2d hex %s\n", namelen, p);
+	/* the name is the rest of the line, and may contain spaces */
+	f = next_field(&p);
+	if (!f)
+		goto fail;
+	if (!strcmp(f, "str"))
+		r->hex = 0;
+	else if (!strcmp(f, "hex"))
+		r->hex = 1;
 	else
 		goto fail;
 
-	printf("%-16s %s\n",
-		pr_master(nodeid),
-		pr_extra(flags, root_list, recover_list, recover_locks_count, first_lkid));
-	return;
+	snprintf(r->name, sizeof(r->name), "%s", p);
+	return 0;
 
  fail:
-	fprintf(stderr, "print_rsb error rv %d line \"%s\"\n", rv, line);
+	unsplit(line, p);
+	return -1;
 }
 
-static void print_lvb(char *line)
+static void print_rsb(struct rsb_line *r)
 {
-	char lvb[1024];
-	char type[4];
-	int i, c, rv, lvblen;
+	if (!r->hex)
+		printf("Resource len %2d  \"%s\"\n", r->namelen, r->name);
+	else
+		printf("Resource len %2d hex %s\n", r->namelen, r->name);
+
+	printf("%-16s %s\n",
+		pr_master(r->nodeid),
+		pr_extra(r->flags, r->root_list, r->recover_list,
+			 r->recover_locks_count, r->first_lkid));
+}
+
+struct lvb_line {
 	uint32_t lvbseq;
+	int lvblen;
+	char lvb[1024];
+};
 
-	memset(lvb, 0, 1024);
+static int parse_lvb(char *line, struct lvb_line *l)
+{
+	char *p = line;
 
-	rv = sscanf(line, "%s %u %d %[0-9A-Fa-f ]", type, &lvbseq, &lvblen, lvb);
+	if (!next_field(&p) ||
+	    next_u32(&p, 10, &l->lvbseq) ||
+	    next_int(&p, &l->lvblen))
+		goto fail;
 
-	if (rv != 4) {
-		fprintf(stderr, "print_lvb error rv %d line \"%s\"\n", rv, line);
-		return;
-	}
+	while (*p == ' ')
+		p++;
+	snprintf(l->lvb, sizeof(l->lvb), "%s", p);
+	return 0;
+
+ fail:
+	unsplit(line, p);
+	return -1;
+}
+
+static void print_lvb(struct lvb_line *l)
+{
+	const char *lvb = l->lvb;
+	int i, c;
 
-	printf("LVB len %d seq %u\n", lvblen, lvbseq);
+	printf("LVB len %d seq %u\n", l->lvblen, l->lvbseq);
 
-	for (c = 0, i = 0; ; i++) {
+	for (c = 0, i = 0; lvb[i]; i++) {
 		printf("%c", lvb[i]);
 		if (lvb[i] != ' ')
 			c++;
 		if (!wide && lvb[i] == ' ' && !(c % 32))
 			printf("\n");
-		if (c == (lvblen * 2))
+		if (c == (l->lvblen * 2))
 			break;
 	}
 	printf("\n");
@@ -667,117 +953,110 @@ static char *pr_verbose(struct lkb *lkb)
 	return buf;
 }
 
-static void print_lkb(char *line, struct rinfo *ri)
+static int parse_lkb(char *line, struct lkb *lkb)
 {
-	struct lkb lkb;
-	char type[4];
-	int rv;
-
-	rv = sscanf(line, "%s %x %d %x %u %llu %x %x %d %d %d %d %d %d %u %llu %llu",
-		    type,
-		    &lkb.id,
-		    &lkb.nodeid,
-		    &lkb.remid,
-		    &lkb.ownpid,
-		    (unsigned long long *)&lkb.xid,
-		    &lkb.exflags,
-		    &lkb.flags,
-		    &lkb.status,
-		    &lkb.grmode,
-		    &lkb.rqmode,
-		    &lkb.highbast,
-		    &lkb.rsb_lookup,
-		    &lkb.wait_type,
-		    &lkb.lvbseq,
-		    (unsigned long long *)&lkb.timestamp,
-		    (unsigned long long *)&lkb.time_bast);
+	char *p = line;
+
+	if (!next_field(&p) ||
+	    next_u32(&p, 16, &lkb->id) ||
+	    next_int(&p, &lkb->nodeid) ||
+	    next_u32(&p, 16, &lkb->remid) ||
+	    next_int(&p, &lkb->ownpid) ||
+	    next_u64(&p, &lkb->xid) ||
+	    next_u32(&p, 16, &lkb->exflags) ||
+	    next_u32(&p, 16, &lkb->flags) ||
+	    next_int(&p, &lkb->status) ||
+	    next_int(&p, &lkb->grmode) ||
+	    next_int(&p, &lkb->rqmode) ||
+	    next_int(&p, &lkb->highbast) ||
+	    next_int(&p, &lkb->rsb_lookup) ||
+	    next_int(&p, &lkb->wait_type) ||
+	    next_u32(&p, 10, &lkb->lvbseq) ||
+	    next_u64(&p, &lkb->timestamp) ||
+	    next_u64(&p, &lkb->time_bast)) {
+		unsplit(line, p);
+		return -1;
+	}
+	return 0;
+}
 
+static void count_lkb(struct lkb *lkb, struct rinfo *ri)
+{
 	ri->lkb_count++;
 
-	if (lkb.status == DLM_LKSTS_GRANTED) {
-	       	if (!ri->print_granted++)
-			printf("Granted\n");
+	if (lkb->status == DLM_LKSTS_GRANTED)
 		ri->lkb_granted++;
-	}
-	if (lkb.status == DLM_LKSTS_CONVERT) {
-		if (!ri->print_convert++)
-			printf("Convert\n");
+	if (lkb->status == DLM_LKSTS_CONVERT)
 		ri->lkb_convert++;
-	}
-	if (lkb.status == DLM_LKSTS_WAITING) {
-	       	if (!ri->print_waiting++)
-			printf("Waiting\n");
+	if (lkb->status == DLM_LKSTS_WAITING)
 		ri->lkb_waiting++;
-	}
-	if (lkb.rsb_lookup) {
-	       	if (!ri->print_lookup++)
-			printf("Lookup\n");
+	if (lkb->rsb_lookup)
 		ri->lkb_lookup++;
-	}
-
-	if (lkb.wait_type)
+	if (lkb->wait_type)
 		ri->lkb_wait_msg++;
 
 	if (!ri->nodeid) {
-		if (lkb.nodeid)
+		if (lkb->nodeid)
 			ri->lkb_master_copy++;
 		else
 			ri->lkb_local_copy++;
 	} else {
 		ri->lkb_process_copy++;
 	}
+}
+
+static void print_lkb(struct lkb *lkb, struct rinfo *ri)
+{
+	if (lkb->status == DLM_LKSTS_GRANTED && !ri->print_granted++)
+		printf("Granted\n");
+	if (lkb->status == DLM_LKSTS_CONVERT && !ri->print_convert++)
+		printf("Convert\n");
+	if (lkb->status == DLM_LKSTS_WAITING && !ri->print_waiting++)
+		printf("Waiting\n");
+	if (lkb->rsb_lookup && !ri->print_lookup++)
+		printf("Lookup\n");
 
 	printf("%08x %s %s %s %s %s\n",
-	       lkb.id, pr_grmode(&lkb), pr_rqmode(&lkb),
-	       pr_remote(&lkb, ri), pr_wait(&lkb),
-	       (verbose && wide) ? pr_verbose(&lkb) : "");
+	       lkb->id, pr_grmode(lkb), pr_rqmode(lkb),
+	       pr_remote(lkb, ri), pr_wait(lkb),
+	       (verbose && wide) ? pr_verbose(lkb) : "");
 
 	if (verbose && !wide)
-		printf("%s\n", pr_verbose(&lkb));
+		printf("%s\n", pr_verbose(lkb));
 }
 
-static void print_rsb_toss(char *line)
+/* returns 1 if the inactive rsb matches the filters */
+static int print_rsb_toss(char *line)
 {
-	char type[4], namefmt[4], *p;
-	char addr[64];
-	char toss_time[16];
+	char *p = line;
+	char *namefmt;
 	int res_nodeid, master_nodeid, dir_nodeid, our_nodeid;
-	int rv, namelen;
-	uint32_t flags;
+	int namelen;
 
-	rv = sscanf(line, "%s %s %d %d %d %d %s %u %u %s",
-		    type,
-		    addr,
-		    &res_nodeid,
-		    &master_nodeid,
-		    &dir_nodeid,
-		    &our_nodeid,
-		    toss_time,
-		    &flags,
-		    &namelen,
-		    namefmt);
-
-	if (rv != 10)
+	if (!next_field(&p) || !next_field(&p) ||
+	    next_int(&p, &res_nodeid) ||
+	    next_int(&p, &master_nodeid) ||
+	    next_int(&p, &dir_nodeid) ||
+	    next_int(&p, &our_nodeid) ||
+	    !next_field(&p) || !next_field(&p) ||
+	    next_int(&p, &namelen))
 		goto fail;
 
-	p = strchr(line, '\n');
-	if (!p)
+	namefmt = next_field(&p);
+	if (!namefmt || (strcmp(namefmt, "str") && strcmp(namefmt, "hex")))
 		goto fail;
-	*p = '\0';
 
-	p = strstr(line, namefmt);
-	if (!p)
-		goto fail;
-	p += 4;
+	/* inactive rsbs have no locks */
+	if (lock_filters() || !match_name(p))
+		return 0;
 
-	strcat(addr, " ");
+	if (summary_only)
+		return 1;
 
-	if (!strncmp(namefmt, "str", 3))
+	if (!strcmp(namefmt, "str"))
 		printf("Resource len %2d  \"%s\"\n", namelen, p);
-	else if (!strncmp(namefmt, "hex", 3))
-		printf("Resource len %2d hex %s\n", namelen, p);
 	else
-		goto fail;
+		printf("Resource len %2d hex %s\n", namelen, p);
 
 	if (master_nodeid != our_nodeid)
 		printf("Master:%d", master_nodeid);
@@ -792,12 +1071,12 @@ static void print_rsb_toss(char *line)
 	if (master_nodeid == our_nodeid && res_nodeid != 0)
 		printf(" res_nodeid %d", res_nodeid);
 
-	printf("\n");
-
-	return;
+	printf("\n\n");
+	return 1;
 
  fail:
-	fprintf(stderr, "print_rsb_toss error rv %d line \"%s\"\n", rv, line);
+	fprintf(stderr, "print_rsb_toss error line \"%s\"\n", unsplit(line, p));
+	return 0;
 }
 
 static void clear_rinfo(struct rinfo *ri)
@@ -819,7 +1098,8 @@ static void count_rinfo(struct summary *s, struct rinfo *ri)
 
 	if (!ri->lkb_count) {
 		s->rsb_no_locks++;
-		printf("no locks\n");
+		if (!summary_only)
+			printf("no locks\n");
 	}
 
 	if (!ri->nodeid)
@@ -868,106 +1148,89 @@ static void print_summary(struct summary *s)
 	printf("  expect reply  %u\n", s->expect_replies);
 }
 
-#define LOCK_LINE_MAX 1024
-
 static void do_waiters(char *name, struct summary *sum)
 {
-	FILE *file;
+	struct dump_file df;
 	char path[PATH_MAX];
-	char line[LOCK_LINE_MAX];
-	char rname[DLM_RESNAME_MAXLEN+1];
+	char *line, *p;
 	int header = 0;
-	int i, j, spaces;
-	int rv, nodeid, wait_type;
+	int nodeid, wait_type;
 	uint32_t id;
 
 	snprintf(path, PATH_MAX, "/sys/kernel/debug/dlm/%s_waiters", name);
 
-	file = fopen(path, "r");
-	if (!file)
+	if (dump_open(&df, path) < 0)
 		return;
 
-	while (fgets(line, LOCK_LINE_MAX, file)) {
-		if (!header) {
+	while ((line = dump_line(&df))) {
+		if (!header && !summary_only) {
 			printf("\n");
 			printf("Expecting reply\n");
 			header = 1;
 		}
 
-		rv = sscanf(line, "%x %d %d",
-			    &id, &wait_type, &nodeid);
+		p = line;
 
-		if (rv != 3) {
-			printf("waiters: %s", line);
+		if (next_u32(&p, 16, &id) ||
+		    next_int(&p, &wait_type) ||
+		    next_int(&p, &nodeid)) {
+			printf("waiters: %s\n", unsplit(line, p));
 			continue;
 		}
 
-		/* parse the resource name from the remainder of the line */
-		j = 0;
-		spaces = 0;
-		memset(rname, 0, sizeof(rname));
-
-		for (i = 0; i < LOCK_LINE_MAX; i++) {
-			if (line[i] == '\n')
-				break;
-			if (spaces == 3) {
-				rname[j++] = line[i];
-				if (j == (sizeof(rname) - 1))
-					break;
-			} else if (line[i] == ' ') {
-				spaces++;
-			}
-		}
+		/* the resource name is the remainder of the line */
+		if (!match_name(p))
+			continue;
+		if (opt_nodeid != -1 && nodeid != opt_nodeid)
+			continue;
 
-		printf("nodeid %2d msg %s lkid %08x resource \"%s\"\n",
-		       nodeid, msg_str(wait_type), id, rname);
+		if (!summary_only)
+			printf("nodeid %2d msg %s lkid %08x resource \"%s\"\n",
+			       nodeid, msg_str(wait_type), id, p);
 
 		sum->expect_replies++;
 	}
-	fclose(file);
+	dump_close(&df);
 }
 
 static void do_toss(char *name, struct summary *sum)
 {
-	FILE *file;
+	struct dump_file df;
 	char path[PATH_MAX];
-	char line[LOCK_LINE_MAX];
+	char *line;
 
 	snprintf(path, PATH_MAX, "/sys/kernel/debug/dlm/%s_toss", name);
 
-	file = fopen(path, "r");
-	if (!file)
+	if (dump_open(&df, path) < 0)
 		return;
 
-	while (fgets(line, LOCK_LINE_MAX, file)) {
-		if (!strncmp(line, "version", 7))
-			continue;
-
-		if (!strncmp(line, "rsb", 3)) {
-			print_rsb_toss(line);
+	while ((line = dump_line(&df))) {
+		if (!strncmp(line, "rsb", 3) && print_rsb_toss(line))
 			sum->toss_total++;
-			printf("\n");
-		}
 	}
-	fclose(file);
+	dump_close(&df);
 }
 
 static void do_lockdebug(char *name)
 {
 	struct summary summary;
 	struct rinfo info;
-	FILE *file;
+	struct dump_file df;
+	struct rsb_line rsb;
+	struct lvb_line lvb;
+	struct lkb lkb;
 	char path[PATH_MAX];
-	char line[LOCK_LINE_MAX];
+	char *line;
 	int old = 0;
+	int skip = 1;
+	int shown = 0;
+	int have_lvb = 0;
 
 	snprintf(path, PATH_MAX, "/sys/kernel/debug/dlm/%s_all", name);
 
-	file = fopen(path, "r");
-	if (!file) {
+	if (dump_open(&df, path) < 0) {
 		snprintf(path, PATH_MAX, "/sys/kernel/debug/dlm/%s", name);
-		file = fopen(path, "r");
-		if (!file) {
+		if (dump_open(&df, path) < 0) {
 			fprintf(stderr, "can't open %s: %s\n", path, strerror(errno));
 			return;
 		}
@@ -977,7 +1240,7 @@ static void do_lockdebug(char *name)
 	memset(&summary, 0, sizeof(struct summary));
 	memset(&info, 0, sizeof(struct rinfo));
 
-	while (fgets(line, LOCK_LINE_MAX, file)) {
+	while ((line = dump_line(&df))) {
 
 		if (old)
 			goto raw;
@@ -986,124 +1249,198 @@ static void do_lockdebug(char *name)
 			continue;
 
 		if (!strncmp(line, "rsb", 3)) {
-			count_rinfo(&summary, &info);
+			if (shown)
+				count_rinfo(&summary, &info);
 			clear_rinfo(&info);
-			printf("\n");
-			print_rsb(line, &info);
+			shown = 0;
+			have_lvb = 0;
+
+			if (parse_rsb(line, &rsb) < 0) {
+				fprintf(stderr, "print_rsb error line \"%s\"\n", line);
+				skip = 1;
+				continue;
+			}
+
+			skip = !match_name(rsb.name);
+			if (skip)
+				continue;
+
+			/* used for lkb prints */
+			info.nodeid = rsb.nodeid;
+			info.namelen = rsb.namelen;
+
+			/* with lock filters, wait for a lock that matches */
+			if (lock_filters())
+				continue;
+
+			shown = 1;
+			if (!summary_only) {
+				printf("\n");
+				print_rsb(&rsb);
+			}
 			continue;
 		}
-		
+
+		if (skip)
+			continue;
+
 		if (!strncmp(line, "lvb", 3)) {
-			print_lvb(line);
+			if (parse_lvb(line, &lvb) < 0) {
+				fprintf(stderr, "print_lvb error line \"%s\"\n", line);
+				continue;
+			}
 			info.lvb = 1;
+			have_lvb = 1;
+			if (shown && !summary_only)
+				print_lvb(&lvb);
 			continue;
 		}
-		
+
 		if (!strncmp(line, "lkb", 3)) {
-			print_lkb(line, &info);
+			if (parse_lkb(line, &lkb) < 0) {
+				fprintf(stderr, "print_lkb error line \"%s\"\n", line);
+				continue;
+			}
+			if (!match_lock(lkb.nodeid, lkb.status, lkb.grmode, lkb.rqmode))
+				continue;
+
+			if (!shown) {
+				shown = 1;
+				if (!summary_only) {
+					printf("\n");
+					print_rsb(&rsb);
+					if (have_lvb)
+						print_lvb(&lvb);
+				}
+			}
+
+			count_lkb(&lkb, &info);
+			if (!summary_only)
+				print_lkb(&lkb, &info);
 			continue;
 		}
  raw:
-		printf("%s", line);
+		if (!summary_only)
+			printf("%s\n", line);
 	}
-	count_rinfo(&summary, &info);
+	if (shown)
+		count_rinfo(&summary, &info);
 	clear_rinfo(&info);
-	printf("\n");
-	fclose(file);
+	if (!summary_only)
+		printf("\n");
+	dump_close(&df);
 
 	do_toss(name, &summary);
 
 	do_waiters(name, &summary);
 
-	if (summarize) {
+	if (summary_only) {
+		print_summary(&summary);
+	} else if (summarize) {
 		printf("\n");
 		print_summary(&summary);
 	}
 }
 
-static void parse_r_name(char *line, char *name)
+struct lockdump_summary {
+	unsigned int total;
+	unsigned int granted;
+	unsigned int convert;
+	unsigned int waiting;
+	unsigned int mstcpy;
+	unsigned int grmode[LKM_EXMODE + 1];
+	unsigned int rqmode[LKM_EXMODE + 1];
+};
+
+static void print_lockdump_summary(struct lockdump_summary *s)
 {
-	char *p;
-	int i = 0;
-	int begin = 0;
+	int i;
 
-	for (p = line; ; p++) {
-		if (*p == '"') {
-			if (begin)
-				break;
-			begin = 1;
-			continue;
-		}
-		if (begin)
-			name[i++] = *p;
-	}
+	printf("locks\n");
+	printf("  total         %u\n", s->total);
+	printf("  granted       %u\n", s->granted);
+	printf("  convert       %u\n", s->convert);
+	printf("  waiting       %u\n", s->waiting);
+	printf("  master copy   %u\n", s->mstcpy);
+	printf("\n");
+
+	printf("mode     granted requested\n");
+	for (i = LKM_NLMODE; i <= LKM_EXMODE; i++)
+		printf("  %s     %7u %9u\n", mode_str(i), s->grmode[i], s->rqmode[i]);
 }
 
 static void do_lockdump(char *name)
 {
-	FILE *file;
+	struct lockdump_summary sum;
+	struct dump_file df;
 	char path[PATH_MAX];
-	char line[LOCK_LINE_MAX];
-	char r_name[DLM_RESNAME_MAXLEN+1];
+	char *line, *p, *r_name, *end;
 	int r_nodeid;
 	int r_len;
-	int rv;
-	unsigned int tm;
-	unsigned long long xid;
+	uint64_t tm;
+	uint64_t xid;
 	uint32_t	id;
 	int		nodeid;
 	uint32_t	remid;
 	int		ownpid;
 	uint32_t	exflags;
 	uint32_t	flags;
-	int8_t		status;
-	int8_t		grmode;
-	int8_t		rqmode;
+	int		status;
+	int		grmode;
+	int		rqmode;
 
 	snprintf(path, PATH_MAX, "/sys/kernel/debug/dlm/%s_locks", name);
 
-	file = fopen(path, "r");
-	if (!file) {
+	if (dump_open(&df, path) < 0) {
 		fprintf(stderr, "can't open %s: %s\n", path, strerror(errno));
 		return;
 	}
 
-	/* skip the header on the first line */
-	if (!fgets(line, LOCK_LINE_MAX, file))
-		return;
+	memset(&sum, 0, sizeof(sum));
 
-	while (fgets(line, LOCK_LINE_MAX, file)) {
-		rv = sscanf(line, "%x %d %x %u %llu %x %x %hhd %hhd %hhd %u %d %d",
-		       &id,
-		       &nodeid,
-		       &remid,
-		       &ownpid,
-		       &xid,
-		       &exflags,
-		       &flags,
-		       &status,
-		       &grmode,
-		       &rqmode,
-		       &tm,
-		       &r_nodeid,
-		       &r_len);
-
-		if (rv != 13) {
-			fprintf(stderr, "invalid debugfs line %d: %s\n",
-				rv, line);
-			return;
-		}
-
-		memset(r_name, 0, sizeof(r_name));
-		parse_r_name(line, r_name);
+	/* skip the header on the first line */
+	if (!dump_line(&df))
+		goto out;
+
+	while ((line = dump_line(&df))) {
+		p = line;
+
+		if (next_u32(&p, 16, &id) ||
+		    next_int(&p, &nodeid) ||
+		    next_u32(&p, 16, &remid) ||
+		    next_int(&p, &ownpid) ||
+		    next_u64(&p, &xid) ||
+		    next_u32(&p, 16, &exflags) ||
+		    next_u32(&p, 16, &flags) ||
+		    next_int(&p, &status) ||
+		    next_int(&p, &grmode) ||
+		    next_int(&p, &rqmode) ||
+		    next_u64(&p, &tm) ||
+		    next_int(&p, &r_nodeid) ||
+		    next_int(&p, &r_len))
+			goto bad;
+
+		/* the name is quoted, and may contain spaces and quotes */
+		r_name = strchr(p, '"');
+		end = strrchr(p, '"');
+		if (!r_name || end == r_name)
+			goto bad;
+		r_name++;
+		*end = '\0';
+
+		if (!match_name(r_name) ||
+		    !match_lock(nodeid, status, grmode, rqmode))
+			continue;
 
 		/* don't print MSTCPY locks without -M */
 		if (!r_nodeid && nodeid) {
 			if (!dump_mstcpy)
 				continue;
-			printf("id %08x gr %s rq %s pid %u MSTCPY %d \"%s\"\n",
-				id, mode_str(grmode), mode_str(rqmode),
-				ownpid, nodeid, r_name);
+			sum.mstcpy++;
+			if (!summary_only)
+				printf("id %08x gr %s rq %s pid %u MSTCPY %d \"%s\"\n",
+				       id, mode_str(grmode), mode_str(rqmode),
+				       ownpid, nodeid, r_name);
 			continue;
 		}
 
@@ -1116,12 +1453,39 @@ static void do_lockdump(char *name)
 		if (status == DLM_LKSTS_GRANTED)
 			rqmode = LKM_IVMODE;
 
-		printf("id %08x gr %s rq %s pid %u master %d \"%s\"\n",
-			id, mode_str(grmode), mode_str(rqmode),
-			ownpid, nodeid, r_name);
+		sum.total++;
+		if (status == DLM_LKSTS_GRANTED)
+			sum.granted++;
+		else if (status == DLM_LKSTS_CONVERT)
+			sum.convert++;
+		else if (status == DLM_LKSTS_WAITING)
+			sum.waiting++;
+		if (status != DLM_LKSTS_WAITING &&
+		    grmode >= LKM_NLMODE && grmode <= LKM_EXMODE)
+			sum.grmode[grmode]++;
+		if (status != DLM_LKSTS_GRANTED &&
+		    rqmode >= LKM_NLMODE && rqmode <= LKM_EXMODE)
+			sum.rqmode[rqmode]++;
+
+		if (!summary_only)
+			printf("id %08x gr %s rq %s pid %u master %d \"%s\"\n",
+			       id, mode_str(grmode), mode_str(rqmode),
+			       ownpid, nodeid, r_name);
 	}
 
-	fclose(file);
+	if (summary_only) {
+		print_lockdump_summary(&sum);
+	} else if (summarize) {
+		printf("\n");
+		print_lockdump_summary(&sum);
+	}
+ out:
+	dump_close(&df);
+	return;
+
+ bad:
+	fprintf(stderr, "invalid debugfs line: %s\n", unsplit(line, p));
+	dump_close(&df);
 }
 
 static char *dlmc_lf_str(uint32_t flags)
@@ -1187,6 +1551,8 @@ static const char *condition_str(int cond)
 		return "fencing";
 	case DLMC_LS_WAIT_FSDONE:
 		return "fsdone";
+	case DLMC_LS_WAIT_KERNEL:
+		return "kernel";
 	default:
 		return "unknown";
 	}
@@ -1292,6 +1658,24 @@ static void show_all_nodes(int count, struct dlmc_node *nodes_in)
 	}
 }
 
+/* ms after the confchg that each phase of recovery was passed */
+
+static void show_recovery(char *name)
+{
+	char buf[DLMC_DUMP_SIZE];
+
+	memset(buf, 0, sizeof(buf));
+
+	if (dlmc_dump_recovery(name, buf) < 0) {
+		printf("recovery      error\n");
+		return;
+	}
+
+	buf[DLMC_DUMP_SIZE-1] = '\0';
+
+	printf("recovery\n%s", buf);
+}
+
 static void do_list(char *name)
 {
 	struct dlmc_lockspace *ls;
@@ -1320,6 +1704,9 @@ static void do_list(char *name)
 
 		show_ls(ls);
 
+		if (verbose)
+			show_recovery(ls->name);
+
 		if (!ls_all_nodes)
 			goto next;
 
@@ -1396,6 +1783,468 @@ static void do_log_plock(void)
 	printf("\n");
 }
 
+/*
+ * top: sample the debugfs state of lockspaces at an interval, and show how
+ * it changed.  Each sample keeps the locks sorted by id, so new, released
+ * and converted locks are found with one merge against the previous sample.
+ */
+
+#define TOP_RES 10
+
+struct top_lock {
+	uint32_t id;
+	int status;
+	int grmode;
+};
+
+struct top_ls {
+	char name[DLM_LOCKSPACE_LEN+1];
+	uint32_t flags;
+	int seen;
+	int sampled;
+	struct top_lock *locks;
+	struct top_lock *prev;
+	unsigned int count;
+	unsigned int prev_count;
+	unsigned int size;
+	unsigned int prev_size;
+	unsigned int rsbs;
+	unsigned int waiting;
+	unsigned int convert;
+	unsigned int replies;
+	unsigned int toss;
+	unsigned int plocks;
+	unsigned int plock_waiters;
+	unsigned int new_locks;
+	unsigned int gone_locks;
+	unsigned int converted;
+};
+
+struct top_res {
+	char ls[DLM_LOCKSPACE_LEN+1];
+	char name[DLM_RESNAME_MAXLEN * 3 + 1];
+	int hex;
+	unsigned int waiters;
+	uint64_t age_ns;
+};
+
+static struct top_ls top_lss[MAX_LS];
+static struct top_res top_res[TOP_RES];
+static int top_res_count;
+static char *top_plock_buf;
+static int top_query_fd = -1;
+static int top_query_busy;
+
+static uint64_t top_now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static int top_lock_compare(const void *va, const void *vb)
+{
+	const struct top_lock *a = va;
+	const struct top_lock *b = vb;
+
+	if (a->id < b->id)
+		return -1;
+	return a->id > b->id;
+}
+
+static int top_add_lock(struct top_ls *tl, struct lkb *lkb)
+{
+	struct top_lock *locks;
+	unsigned int size;
+
+	if (tl->count == tl->size) {
+		size = tl->size ? tl->size * 2 : 1024;
+		locks = realloc(tl->locks, size * sizeof(struct top_lock));
+		if (!locks)
+			return -ENOMEM;
+		tl->locks = locks;
+		tl->size = size;
+	}
+
+	tl->locks[tl->count].id = lkb->id;
+	tl->locks[tl->count].status = lkb->status;
+	tl->locks[tl->count].grmode = lkb->grmode;
+	tl->count++;
+	return 0;
+}
+
+/* keep the resources with the most waiters, then the oldest wait */
+static void top_add_res(struct top_ls *tl, struct rsb_line *rsb,
+			unsigned int waiters, uint64_t age_ns)
+{
+	struct top_res *res;
+	int i;
+
+	for (i = top_res_count; i > 0; i--) {
+		res = &top_res[i - 1];
+		if (res->waiters > waiters ||
+		    (res->waiters == waiters && res->age_ns >= age_ns))
+			break;
+		if (i < TOP_RES)
+			top_res[i] = *res;
+	}
+	if (i == TOP_RES)
+		return;
+
+	res = &top_res[i];
+	snprintf(res->ls, sizeof(res->ls), "%s", tl->name);
+	snprintf(res->name, sizeof(res->name), "%s", rsb->name);
+	res->hex = rsb->hex;
+	res->waiters = waiters;
+	res->age_ns = age_ns;
+
+	if (top_res_count < TOP_RES)
+		top_res_count++;
+}
+
+static unsigned int top_count_lines(const char *path, const char *prefix)
+{
+	struct dump_file df;
+	unsigned int count = 0;
+	char *line;
+
+	if (dump_open(&df, path) < 0)
+		return 0;
+
+	while ((line = dump_line(&df))) {
+		if (!prefix || !strncmp(line, prefix, strlen(prefix)))
+			count++;
+	}
+	dump_close(&df);
+	return count;
+}
+
+static void top_sample_plocks(struct top_ls *tl)
+{
+	char *p, *nl;
+
+	tl->plocks = 0;
+	tl->plock_waiters = 0;
+
+	if (!(tl->flags & DLMC_LF_FS_REGISTERED))
+		return;
+
+	if (!top_plock_buf) {
+		top_plock_buf = malloc(DLMC_DUMP_SIZE);
+		if (!top_plock_buf)
+			return;
+	}
+
+	memset(top_plock_buf, 0, DLMC_DUMP_SIZE);
+	if (dlmc_dump_plocks(tl->name, top_plock_buf) < 0)
+		return;
+
+	for (p = top_plock_buf; *p; p = nl + 1) {
+		nl = strchr(p, '\n');
+		if (!nl)
+			break;
+		*nl = '\0';
+
+		if (strstr(p, " WAITING") || strstr(p, " PENDING"))
+			tl->plock_waiters++;
+		else if (!strstr(p, "unused_ms"))
+			tl->plocks++;
+	}
+}
+
+/* compare the sorted locks of this sample with the previous one */
+static void top_diff_locks(struct top_ls *tl)
+{
+	struct top_lock *cur = tl->locks;
+	struct top_lock *old = tl->prev;
+	unsigned int c = 0, o = 0;
+
+	tl->new_locks = 0;
+	tl->gone_locks = 0;
+	tl->converted = 0;
+
+	while (c < tl->count || o < tl->prev_count) {
+		if (o == tl->prev_count ||
+		    (c < tl->count && cur[c].id < old[o].id)) {
+			tl->new_locks++;
+			c++;
+		} else if (c == tl->count || old[o].id < cur[c].id) {
+			tl->gone_locks++;
+			o++;
+		} else {
+			if (cur[c].grmode != old[o].grmode ||
+			    (cur[c].status == DLM_LKSTS_CONVERT &&
+			     old[o].status != DLM_LKSTS_CONVERT))
+				tl->converted++;
+			c++;
+			o++;
+		}
+	}
+}
+
+static void top_sample_ls(struct top_ls *tl, uint64_t now)
+{
+	struct dump_file df;
+	struct rsb_line rsb;
+	struct top_lock *locks;
+	struct lkb lkb;
+	char path[PATH_MAX];
+	char *line;
+	unsigned int size;
+	unsigned int waiters = 0;
+	uint64_t oldest = 0;
+	int have_rsb = 0;
+
+	/* the previous sample's array is reused for this one */
+	locks = tl->prev;
+	tl->prev = tl->locks;
+	tl->prev_count = tl->count;
+	tl->locks = locks;
+	tl->count = 0;
+	size = tl->prev_size;
+	tl->prev_size = tl->size;
+	tl->size = size;
+
+	tl->rsbs = 0;
+	tl->waiting = 0;
+	tl->convert = 0;
+
+	snprintf(path, PATH_MAX, "/sys/kernel/debug/dlm/%s_all", tl->name);
+
+	if (dump_open(&df, path) < 0) {
+		tl->sampled = 0;
+		return;
+	}
+
+	while ((line = dump_line(&df))) {
+		if (!strncmp(line, "rsb", 3)) {
+			if (have_rsb && waiters)
+				top_add_res(tl, &rsb, waiters, now - oldest);
+			have_rsb = !parse_rsb(line, &rsb);
+			waiters = 0;
+			oldest = now;
+			tl->rsbs++;
+			continue;
+		}
+
+		if (strncmp(line, "lkb", 3) || parse_lkb(line, &lkb) < 0)
+			continue;
+
+		if (top_add_lock(tl, &lkb) < 0)
+			break;
+
+		if (lkb.status == DLM_LKSTS_GRANTED)
+			continue;
+		if (lkb.status == DLM_LKSTS_WAITING)
+			tl->waiting++;
+		else
+			tl->convert++;
+
+		waiters++;
+		if (lkb.timestamp && lkb.timestamp < oldest)
+			oldest = lkb.timestamp;
+	}
+	if (have_rsb && waiters)
+		top_add_res(tl, &rsb, waiters, now - oldest);
+	dump_close(&df);
+
+	qsort(tl->locks, tl->count, sizeof(struct top_lock), top_lock_compare);
+
+	if (tl->sampled)
+		top_diff_locks(tl);
+
+	snprintf(path, PATH_MAX, "/sys/kernel/debug/dlm/%s_waiters", tl->name);
+	tl->replies = top_count_lines(path, NULL);
+
+	snprintf(path, PATH_MAX, "/sys/kernel/debug/dlm/%s_toss", tl->name);
+	tl->toss = top_count_lines(path, "rsb");
+
+	top_sample_plocks(tl);
+
+	tl->sampled++;
+}
+
+static struct top_ls *top_find_ls(const char *name, uint32_t flags)
+{
+	struct top_ls *tl, *free_tl = NULL;
+	int i;
+
+	for (i = 0; i < MAX_LS; i++) {
+		tl = &top_lss[i];
+		if (!tl->name[0]) {
+			if (!free_tl)
+				free_tl = tl;
+			continue;
+		}
+		if (!strcmp(tl->name, name))
+			goto out;
+	}
+
+	tl = free_tl;
+	if (!tl)
+		return NULL;
+	snprintf(tl->name, sizeof(tl->name), "%s", name);
+ out:
+	tl->flags = flags;
+	tl->seen = 1;
+	return tl;
+}
+
+static void top_free_ls(struct top_ls *tl)
+{
+	free(tl->locks);
+	free(tl->prev);
+	memset(tl, 0, sizeof(struct top_ls));
+}
+
+static void top_sample(uint64_t now)
+{
+	struct dlmc_lockspace *ls;
+	struct top_ls *tl;
+	int ls_count = 0;
+	int i, rv;
+
+	for (i = 0; i < MAX_LS; i++)
+		top_lss[i].seen = 0;
+
+	top_res_count = 0;
+
+	if (lsname) {
+		memset(lss, 0, sizeof(lss));
+		rv = dlmc_lockspace_info(lsname, &lss[0]);
+		if (rv < 0)
+			snprintf(lss[0].name, sizeof(lss[0].name), "%s", lsname);
+		ls_count = 1;
+	} else {
+		rv = dlmc_lockspaces(MAX_LS, &ls_count, lss);
+		if (rv < 0)
+			ls_count = 0;
+		if (ls_count > MAX_LS)
+			ls_count = MAX_LS;
+	}
+
+	for (i = 0; i < ls_count; i++) {
+		ls = &lss[i];
+		tl = top_find_ls(ls->name, ls->flags);
+		if (tl)
+			top_sample_ls(tl, now);
+	}
+
+	for (i = 0; i < MAX_LS; i++) {
+		tl = &top_lss[i];
+		if (tl->name[0] && !tl->seen)
+			top_free_ls(tl);
+	}
+}
+
+static double top_rate(unsigned int count, uint64_t elapsed_ns)
+{
+	if (!elapsed_ns)
+		return 0;
+	return count * 1e9 / elapsed_ns;
+}
+
+/* the daemon state is polled over one connection kept for all samples */
+static void top_print_daemon(void)
+{
+	struct dlmc_daemon_status ds;
+	int rv;
+
+	/* the daemon keeps a limited number of connections open */
+	if (top_query_busy) {
+		if (dlmc_get_status(-1, &ds, 0, NULL, NULL) < 0)
+			return;
+		goto print;
+	}
+
+	if (top_query_fd < 0)
+		top_query_fd = dlmc_query_connect();
+	if (top_query_fd < 0)
+		return;
+
+	rv = dlmc_get_status(top_query_fd, &ds, 0, NULL, NULL);
+	if (rv < 0) {
+		dlmc_query_disconnect(top_query_fd);
+		top_query_fd = -1;
+		if (rv == -EBUSY)
+			top_query_busy = 1;
+		return;
+	}
+ print:
+	printf("nodeid %d quorate %u members %u ring seq %llu %llu fence_pid %d\n\n",
+	       ds.our_nodeid, ds.quorate, ds.member_count,
+	       (unsigned long long)ds.cluster_ringid,
+	       (unsigned long long)ds.daemon_ringid, ds.fence_pid);
+}
+
+static void top_print(uint64_t elapsed_ns, int clear)
+{
+	struct top_ls *tl;
+	struct top_res *res;
+	int i;
+
+	if (clear)
+		printf("\033[H\033[2J");
+
+	top_print_daemon();
+
+	printf("%-16s %7s %8s %7s %7s %7s %7s %7s %7s %6s %6s %6s\n",
+	       "lockspace", "rsbs", "locks", "new/s", "unlk/s", "conv/s",
+	       "waiting", "convert", "replies", "toss", "plocks", "plockw");
+
+	for (i = 0; i < MAX_LS; i++) {
+		tl = &top_lss[i];
+		if (!tl->name[0] || tl->sampled < 2)
+			continue;
+
+		printf("%-16s %7u %8u %7.1f %7.1f %7.1f %7u %7u %7u %6u %6u %6u\n",
+		       tl->name, tl->rsbs, tl->count,
+		       top_rate(tl->new_locks, elapsed_ns),
+		       top_rate(tl->gone_locks, elapsed_ns),
+		       top_rate(tl->converted, elapsed_ns),
+		       tl->waiting, tl->convert, tl->replies, tl->toss,
+		       tl->plocks, tl->plock_waiters);
+	}
+
+	if (!top_res_count)
+		goto out;
+
+	printf("\n");
+	printf("%-16s %7s %9s  %s\n", "lockspace", "waiters", "wait_ms", "resource");
+
+	for (i = 0; i < top_res_count; i++) {
+		res = &top_res[i];
+		printf("%-16s %7u %9llu  %s%s%s\n",
+		       res->ls, res->waiters,
+		       (unsigned long long)(res->age_ns / 1000000),
+		       res->hex ? "hex " : "\"", res->name, res->hex ? "" : "\"");
+	}
+ out:
+	if (!clear)
+		printf("\n");
+	fflush(stdout);
+}
+
+static void do_top(void)
+{
+	uint64_t last, now;
+	int clear = isatty(STDOUT_FILENO);
+	int i;
+
+	last = top_now_ns();
+	top_sample(last);
+
+	for (i = 0; !top_count || i < top_count; i++) {
+		sleep(top_interval);
+
+		now = top_now_ns();
+		top_sample(now);
+		top_print(now - last, clear);
+		last = now;
+	}
+}
+
 int main(int argc, char **argv)
 {
 	prog_name = argv[0];
@@ -1458,6 +2307,10 @@ int main(int argc, char **argv)
 		do_lockdebug(lsname);
 		break;
 
+	case OP_TOP:
+		do_top();
+		break;
+
 	case OP_FENCE_ACK:
 		do_fence_ack(lsname);
 		break;
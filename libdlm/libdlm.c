@@ -9,6 +9,8 @@
 
 #ifdef _REENTRANT
 #include <pthread.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
 #endif
 #include <sys/types.h>
 #include <sys/ioctl.h>
@@ -23,6 +25,12 @@
 #include <string.h>
 #include <stdio.h>
 #include <dirent.h>
+#include <poll.h>
+#include <time.h>
+#include <sys/eventfd.h>
+#include <sys/inotify.h>
+#include <sys/socket.h>
+#include <linux/netlink.h>
 #include <linux/major.h>
 #ifdef HAVE_SELINUX
 #include <selinux/selinux.h>
@@ -32,6 +40,7 @@
 #define BUILDING_LIBDLM
 #include "libdlm.h"
 #include <linux/dlm_device.h>
+#include "loopback.h"
 
 #define MISC_PREFIX		"/dev/misc/"
 #define DLM_PREFIX		"dlm_"
@@ -40,6 +49,9 @@
 #define DLM_CONTROL_PATH	MISC_PREFIX DLM_CONTROL_NAME
 #define DEFAULT_LOCKSPACE	"default"
 
+/* max results the recv thread delivers between polls */
+#define RECV_BATCH		64
+
 /*
  * V5 of the dlm_device.h kernel/user interface structs
  */
@@ -95,6 +107,12 @@ struct dlm_ls_info {
 #else
     int tid;
 #endif
+    struct ast_pool *pool;
+    struct completion_ring *ring;
+    struct lock_cache *cache;
+    struct resource_table *resources;
+    struct ls_stats *stats;
+    struct lb_handle *lb;
 };
 
 /*
@@ -108,9 +126,45 @@ static struct dlm_ls_info *default_ls = NULL;
 static int control_fd = -1;
 static struct dlm_device_version kernel_version;
 static int kernel_version_detected = 0;
+static int loopback = 0;
 
 
 static int release_lockspace(uint32_t minor, uint32_t flags);
+static void free_completion_ring(struct dlm_ls_info *lsinfo);
+static void free_lock_cache(struct dlm_ls_info *lsinfo);
+static void free_resources(struct dlm_ls_info *lsinfo);
+static void free_ls_stats(struct dlm_ls_info *lsinfo);
+static void cache_ast(void *arg);
+static void cache_bast(void *arg);
+
+/* requests and results go to the loopback backend in place of the device */
+
+static int ls_write(struct dlm_ls_info *lsinfo, void *req, int len)
+{
+	if (lsinfo->lb)
+		return lb_write(lsinfo->lb, req, len);
+	return write(lsinfo->fd, req, len);
+}
+
+static int read_result(int fd, void *buf, int len)
+{
+	if (loopback)
+		return lb_read(fd, buf, len);
+	return read(fd, buf, len);
+}
+
+static uint64_t now_usec(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static uint64_t now_ms(void)
+{
+	return now_usec() / 1000;
+}
 
 
 static void ls_dev_name(const char *lsname, char *devname, int devlen)
@@ -123,21 +177,58 @@ static void dummy_ast_routine(void *arg)
 }
 
 #ifdef _REENTRANT
-/* Used for the synchronous and "simplified, synchronous" API routines */
+/*
+ * Used for the synchronous and "simplified, synchronous" API routines.
+ * Each thread has one, so there is nothing to set up per call, and the
+ * ast wakes the waiter with a futex instead of a condvar and mutex.  The
+ * futex syscalls are skipped entirely when the ast arrives before the
+ * caller has gone to sleep.
+ */
+
+#define LWAIT_PENDING	0
+#define LWAIT_SLEEPING	1
+#define LWAIT_DONE	2
+
 struct lock_wait
 {
-    pthread_cond_t  cond;
-    pthread_mutex_t mutex;
+    int state;
     struct dlm_lksb lksb;
 };
 
+static __thread struct lock_wait thread_lwait;
+
+static struct lock_wait *get_lock_wait(void)
+{
+    struct lock_wait *lwait = &thread_lwait;
+
+    __atomic_store_n(&lwait->state, LWAIT_PENDING, __ATOMIC_RELAXED);
+    return lwait;
+}
+
 static void sync_ast_routine(void *arg)
 {
     struct lock_wait *lwait = arg;
 
-    pthread_mutex_lock(&lwait->mutex);
-    pthread_cond_signal(&lwait->cond);
-    pthread_mutex_unlock(&lwait->mutex);
+    if (__atomic_exchange_n(&lwait->state, LWAIT_DONE, __ATOMIC_RELEASE) ==
+	LWAIT_SLEEPING)
+	syscall(SYS_futex, &lwait->state, FUTEX_WAKE_PRIVATE, 1,
+		NULL, NULL, 0);
+}
+
+static void wait_lock_wait(struct lock_wait *lwait)
+{
+    int state = LWAIT_PENDING;
+
+    if (__atomic_compare_exchange_n(&lwait->state, &state, LWAIT_SLEEPING,
+				    0, __ATOMIC_ACQUIRE, __ATOMIC_ACQUIRE))
+	state = LWAIT_SLEEPING;
+
+    while (state != LWAIT_DONE)
+    {
+	syscall(SYS_futex, &lwait->state, FUTEX_WAIT_PRIVATE, LWAIT_SLEEPING,
+		NULL, NULL, 0);
+	state = __atomic_load_n(&lwait->state, __ATOMIC_ACQUIRE);
+    }
 }
 
 /* lock_resource & unlock_resource
@@ -147,7 +238,7 @@ static void sync_ast_routine(void *arg)
 int lock_resource(const char *resource, int mode, int flags, int *lockid)
 {
     int status;
-    struct lock_wait lwait;
+    struct lock_wait *lwait;
 
     if (default_ls == NULL)
     {
@@ -163,35 +254,32 @@ int lock_resource(const char *resource, int mode, int flags, int *lockid)
 	return -1;
     }
 
+    lwait = get_lock_wait();
+
     /* Conversions need the lockid in the LKSB */
     if (flags & LKF_CONVERT)
-	lwait.lksb.sb_lkid = *lockid;
-
-    pthread_cond_init(&lwait.cond, NULL);
-    pthread_mutex_init(&lwait.mutex, NULL);
-    pthread_mutex_lock(&lwait.mutex);
+	lwait->lksb.sb_lkid = *lockid;
 
     status = dlm_lock(mode,
-		      &lwait.lksb,
+		      &lwait->lksb,
 		      flags,
 		      resource,
 		      strlen(resource),
 		      0,
 		      sync_ast_routine,
-		      &lwait,
+		      lwait,
 		      NULL,
 		      NULL);
     if (status)
 	return status;
 
     /* Wait for it to complete */
-    pthread_cond_wait(&lwait.cond, &lwait.mutex);
-    pthread_mutex_unlock(&lwait.mutex);
+    wait_lock_wait(lwait);
 
-    *lockid = lwait.lksb.sb_lkid;
+    *lockid = lwait->lksb.sb_lkid;
 
-    errno = lwait.lksb.sb_status;
-    if (lwait.lksb.sb_status)
+    errno = lwait->lksb.sb_status;
+    if (lwait->lksb.sb_status)
 	return -1;
     else
 	return 0;
@@ -201,7 +289,7 @@ int lock_resource(const char *resource, int mode, int flags, int *lockid)
 int unlock_resource(int lockid)
 {
     int status;
-    struct lock_wait lwait;
+    struct lock_wait *lwait;
 
     if (default_ls == NULL)
     {
@@ -209,29 +297,32 @@ int unlock_resource(int lockid)
 	return -1;
     }
 
-    pthread_cond_init(&lwait.cond, NULL);
-    pthread_mutex_init(&lwait.mutex, NULL);
-    pthread_mutex_lock(&lwait.mutex);
+    lwait = get_lock_wait();
 
-    status = dlm_unlock(lockid, 0, &lwait.lksb, &lwait);
+    status = dlm_unlock(lockid, 0, &lwait->lksb, lwait);
 
     if (status)
 	return status;
 
     /* Wait for it to complete */
-    pthread_cond_wait(&lwait.cond, &lwait.mutex);
-    pthread_mutex_unlock(&lwait.mutex);
+    wait_lock_wait(lwait);
 
-    errno = lwait.lksb.sb_status;
-    if (lwait.lksb.sb_status != DLM_EUNLOCK)
+    errno = lwait->lksb.sb_status;
+    if (lwait->lksb.sb_status != DLM_EUNLOCK)
 	return -1;
     else
 	return 0;
 }
 
+static void free_ast_pool(struct ast_pool *pool);
+
+/* set in each AST pool worker thread to the pool it belongs to */
+static __thread struct ast_pool *worker_pool;
+
 /* Tidy up threads after a lockspace is closed */
 static int ls_pthread_cleanup(struct dlm_ls_info *lsinfo)
 {
+    struct lb_handle *lb = lsinfo->lb;
     int status = 0;
     int fd;
 
@@ -245,8 +336,17 @@ static int ls_pthread_cleanup(struct dlm_ls_info *lsinfo)
     }
     if (!status)
     {
+	if (lsinfo->pool)
+	    free_ast_pool(lsinfo->pool);
+	free_completion_ring(lsinfo);
+	free_lock_cache(lsinfo);
+	free_resources(lsinfo);
+	free_ls_stats(lsinfo);
 	free(lsinfo);
-	close(fd);
+	if (lb)
+	    lb_close(lb);
+	else
+	    close(fd);
     }
 
     return status;
@@ -270,7 +370,14 @@ int dlm_pthread_cleanup(void)
 /* Non-pthread version of cleanup */
 static int ls_pthread_cleanup(struct dlm_ls_info *lsinfo)
 {
-    close(lsinfo->fd);
+    if (lsinfo->lb)
+	lb_close(lsinfo->lb);
+    else
+	close(lsinfo->fd);
+    free_completion_ring(lsinfo);
+    free_lock_cache(lsinfo);
+    free_resources(lsinfo);
+    free_ls_stats(lsinfo);
     free(lsinfo);
     return 0;
 }
@@ -366,29 +473,122 @@ static int find_control_minor(int *minor)
 	return -1;
 }
 
+/*
+ * Waiting for udev to create a device node.  An inotify watch on /dev/misc
+ * wakes us as soon as the node appears; if /dev/misc can't be watched (it
+ * may not exist yet) the uevent netlink socket is used instead, and failing
+ * both we recheck every DEV_RECHECK_MS.  The watch is set up before the
+ * first check so that a node created in between is not missed.
+ */
+
+#define DEV_WAIT_MS		10000
+#define DEV_RECHECK_MS		100
+
+static int dev_watch_open(void)
+{
+	struct sockaddr_nl snl;
+	int fd;
+
+	fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+	if (fd >= 0) {
+		if (inotify_add_watch(fd, MISC_PREFIX,
+				      IN_CREATE | IN_ATTRIB | IN_MOVED_TO) >= 0)
+			return fd;
+		close(fd);
+	}
+
+	fd = socket(AF_NETLINK, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC,
+		    NETLINK_KOBJECT_UEVENT);
+	if (fd < 0)
+		return -1;
+
+	/* kernel uevents and the udev events sent once a node is made */
+	memset(&snl, 0, sizeof(snl));
+	snl.nl_family = AF_NETLINK;
+	snl.nl_groups = 1 | 2;
+	if (bind(fd, (struct sockaddr *)&snl, sizeof(snl)) < 0) {
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+/* returns 0 when it's time to check again, -1 once the deadline passes */
+static int dev_watch_wait(int fd, uint64_t deadline)
+{
+	char buf[4096];
+	struct pollfd pfd;
+	uint64_t now = now_ms();
+	int timeout;
+
+	if (now >= deadline)
+		return -1;
+
+	timeout = deadline - now;
+	if (fd < 0 || timeout < DEV_RECHECK_MS) {
+		if (timeout > DEV_RECHECK_MS)
+			timeout = DEV_RECHECK_MS;
+		usleep(timeout * 1000);
+		return 0;
+	}
+
+	/* a node created after an event is caught by the next recheck */
+	if (timeout > DEV_RECHECK_MS * 10)
+		timeout = DEV_RECHECK_MS * 10;
+
+	pfd.fd = fd;
+	pfd.events = POLLIN;
+	pfd.revents = 0;
+
+	if (poll(&pfd, 1, timeout) > 0) {
+		while (read(fd, buf, sizeof(buf)) > 0)
+			;
+	}
+	return 0;
+}
+
+static void dev_watch_close(int fd)
+{
+	if (fd >= 0)
+		close(fd);
+}
+
 static int open_control_device(void)
 {
 	struct stat st;
-	int i, rv, minor, found = 0;
+	uint64_t deadline;
+	int rv, minor, wfd, found = 0;
 
-	if (control_fd > -1)
+	if (control_fd > -1 || loopback)
 		goto out;
 
+	if (lb_enabled()) {
+		loopback = 1;
+		kernel_version.version[0] = DLM_DEVICE_VERSION_MAJOR;
+		kernel_version.version[1] = DLM_DEVICE_VERSION_MINOR;
+		kernel_version.version[2] = DLM_DEVICE_VERSION_PATCH;
+		kernel_version_detected = 1;
+		return 0;
+	}
+
 	rv = find_control_minor(&minor);
 	if (rv < 0)
 		return -1;
 
 	/* wait for udev to create the device */
 
-	for (i = 0; i < 10; i++) {
+	wfd = dev_watch_open();
+	deadline = now_ms() + DEV_WAIT_MS;
+
+	do {
 		if (stat(DLM_CONTROL_PATH, &st) == 0 &&
 		    minor(st.st_rdev) == minor) {
 			found = 1;
 			break;
 		}
-		sleep(1);
-		continue;
-	}
+	} while (!dev_watch_wait(wfd, deadline));
+
+	dev_watch_close(wfd);
 
 	if (!found)
 		return -1;
@@ -416,27 +616,33 @@ static int find_udev_device(const char *lockspace, int minor, char *udev_path)
 	struct dirent *de;
 	struct stat st;
 	size_t basename_len;
-	int i;
+	uint64_t deadline;
+	int wfd, rv = -1;
 
 	ls_dev_name(lockspace, udev_path, PATH_MAX);
 	snprintf(bname, PATH_MAX, DLM_PREFIX "%s", lockspace);
 	basename_len = strlen(bname);
 
-	for (i = 0; i < 10; i++) {
+	wfd = dev_watch_open();
+	deadline = now_ms() + DEV_WAIT_MS;
+
+	do {
 
 		/* look for a device with the full name */
 
-		if (stat(udev_path, &st) == 0 && minor(st.st_rdev) == minor)
-			return 0;
+		if (stat(udev_path, &st) == 0 && minor(st.st_rdev) == minor) {
+			rv = 0;
+			break;
+		}
 
-		if (basename_len < MAX_SYSFS_NAME) {
-			sleep(1);
+		if (basename_len < MAX_SYSFS_NAME)
 			continue;
-		}
 
 		/* look for a device with a truncated name */
 
 		d = opendir(MISC_PREFIX);
+		if (!d)
+			continue;
 		while ((de = readdir(d))) {
 			if (de->d_name[0] == '.')
 				continue;
@@ -453,621 +659,2350 @@ static int find_udev_device(const char *lockspace, int minor, char *udev_path)
 
 			/* truncated name */
 			strncpy(udev_path, tmp_path, PATH_MAX);
-			closedir(d);
-			return 0;
+			rv = 0;
+			break;
 		}
 		closedir(d);
-		sleep(1);
-	}
+	} while (rv && !dev_watch_wait(wfd, deadline));
 
-	return -1;
+	dev_watch_close(wfd);
+	return rv;
 }
 
 /*
- * do_dlm_dispatch()
- * Read an ast from the kernel.
+ * Lock batches
+ * dlm_ls_lock_many() and dlm_ls_unlock_many() hash the lksbs of a batch so
+ * that dispatch can count its completions.  The lock's own ast is left in
+ * place because the kernel keeps it for the lock's later unlock.
  */
 
-static int do_dlm_dispatch_v5(int fd)
-{
-	char resultbuf[sizeof(struct dlm_lock_result_v5) + DLM_USER_LVB_LEN];
-	struct dlm_lock_result_v5 *result = (struct dlm_lock_result_v5 *)resultbuf;
-	char *fullresult = NULL;
-	int status;
-	void (*astaddr)(void *astarg);
-
-	status = read(fd, result, sizeof(resultbuf));
-	if (status <= 0)
-		return -1;
-
-	/* This shouldn't happen any more, can probably be removed */
-
-	if (result->length != status) {
-		int newstat;
+#define BATCH_HASH_SIZE	256
 
-		fullresult = malloc(result->length);
-		if (!fullresult)
-			return -1;
+struct batch_entry {
+	struct batch_entry *next;
+	struct dlm_lksb *lksb;
+	struct lock_batch *batch;
+};
 
-		newstat = read(fd, (struct dlm_lock_result_v5 *)fullresult,
-			       result->length);
+struct lock_batch {
+	int remaining;
+	void (*done)(void *arg);
+	void *done_arg;
+	struct batch_entry entries[0];
+};
 
-		/* If it read OK then use the new data. otherwise we can
-		   still deliver the AST, it just might not have all the
-		   info in it...hmmm */
+static struct batch_entry *batch_hash[BATCH_HASH_SIZE];
+static int batch_entries;
 
-		if (newstat == result->length)
-			result = (struct dlm_lock_result_v5 *)fullresult;
-	} else {
-		fullresult = resultbuf;
-	}
+#ifdef _REENTRANT
+static pthread_mutex_t batch_mutex = PTHREAD_MUTEX_INITIALIZER;
+#define batch_lock()	pthread_mutex_lock(&batch_mutex)
+#define batch_unlock()	pthread_mutex_unlock(&batch_mutex)
+#else
+#define batch_lock()	do { } while (0)
+#define batch_unlock()	do { } while (0)
+#endif
 
+static unsigned int batch_hash_idx(struct dlm_lksb *lksb)
+{
+	return ((uintptr_t)lksb >> 4) % BATCH_HASH_SIZE;
+}
 
-	/* Copy lksb to user's buffer - except the LVB ptr */
-	memcpy(result->user_lksb, &result->lksb,
-	       sizeof(struct dlm_lksb) - sizeof(char*));
+/* batch_lock must be held */
+static void batch_hash_add(struct batch_entry *be)
+{
+	unsigned int i = batch_hash_idx(be->lksb);
 
-	/* Flip the status. Kernel space likes negative return codes,
-	   userspace positive ones */
-	result->user_lksb->sb_status = -result->user_lksb->sb_status;
+	be->next = batch_hash[i];
+	batch_hash[i] = be;
+	__atomic_add_fetch(&batch_entries, 1, __ATOMIC_RELAXED);
+}
 
-	/* Copy optional items */
-	if (result->lvb_offset)
-		memcpy(result->user_lksb->sb_lvbptr,
-		       fullresult + result->lvb_offset, DLM_LVB_LEN);
+/* batch_lock must be held */
+static struct batch_entry *batch_hash_del(struct dlm_lksb *lksb,
+					  struct lock_batch *batch)
+{
+	struct batch_entry *be, **pp;
 
-	/* Call AST */
-	if (result->user_astaddr) {
-		astaddr = result->user_astaddr;
-		astaddr(result->user_astparam);
+	for (pp = &batch_hash[batch_hash_idx(lksb)]; (be = *pp); pp = &be->next) {
+		if (be->lksb != lksb)
+			continue;
+		if (batch && be->batch != batch)
+			continue;
+		*pp = be->next;
+		__atomic_sub_fetch(&batch_entries, 1, __ATOMIC_RELAXED);
+		return be;
 	}
-
-	if (fullresult != resultbuf)
-		free(fullresult);
-
-	return 0;
+	return NULL;
 }
 
-static int do_dlm_dispatch_v6(int fd)
-{
-	char resultbuf[sizeof(struct dlm_lock_result) + DLM_USER_LVB_LEN];
-	struct dlm_lock_result *result = (struct dlm_lock_result *)resultbuf;
-	int status;
-	void (*astaddr)(void *astarg);
-
-	status = read(fd, result, sizeof(resultbuf));
-	if (status <= 0)
-		return -1;
+struct completion_ring;
+static void call_ast(struct completion_ring *ring, void *addr, void *astarg,
+		     struct dlm_lksb *lksb, int bast_mode);
 
-	/* Copy lksb to user's buffer - except the LVB ptr */
-	memcpy(result->user_lksb, &result->lksb,
-	       sizeof(struct dlm_lksb) - sizeof(char*));
+/*
+ * With a completion ring, done is queued behind the asts of the batch,
+ * which the application has not run yet.
+ */
+static void batch_put(struct lock_batch *batch, struct completion_ring *ring)
+{
+	if (__atomic_sub_fetch(&batch->remaining, 1, __ATOMIC_ACQ_REL))
+		return;
 
-	/* Copy lvb to user's buffer */
-	if (result->lvb_offset)
-		memcpy(result->user_lksb->sb_lvbptr,
-		       (char *)result + result->lvb_offset, DLM_LVB_LEN);
+	call_ast(ring, batch->done, batch->done_arg, NULL, 0);
+	free(batch);
+}
 
-	result->user_lksb->sb_status = -result->user_lksb->sb_status;
+/* Called by dispatch after a completion ast (not a bast) has been delivered */
+static void batch_complete(struct completion_ring *ring, struct dlm_lksb *lksb)
+{
+	struct batch_entry *be;
 
-	if (result->user_astaddr) {
-		astaddr = result->user_astaddr;
-		astaddr(result->user_astparam);
-	}
+	if (!__atomic_load_n(&batch_entries, __ATOMIC_RELAXED))
+		return;
 
-	return 0;
-}
+	batch_lock();
+	be = batch_hash_del(lksb, NULL);
+	batch_unlock();
 
-static int do_dlm_dispatch(int fd)
-{
-	if (kernel_version.version[0] == 5)
-		return do_dlm_dispatch_v5(fd);
-	else
-		return do_dlm_dispatch_v6(fd);
+	if (be)
+		batch_put(be->batch, ring);
 }
 
-
 /*
- * sync_write()
- * Helper routine which supports the synchronous DLM calls. This
- * writes a parameter block down to the DLM and waits for the
- * operation to complete. This hides the different completion mechanism
- * used when called from the main thread or the DLM 'AST' thread.
+ * Completion rings
+ * With dlm_ls_completion_ring(), asts for the lockspace are not called by
+ * dispatch.  The lksb is filled in as usual, then the ast routine and arg
+ * are put in a ring and an eventfd is signalled; the application takes
+ * them from the ring in its own thread with dlm_ls_get_completions().
+ * Anything that dispatches for the lockspace (recv thread, pool workers,
+ * dlm_dispatch) may add to the ring, only the application removes, so
+ * this is a bounded multi-producer single-consumer queue using a
+ * sequence number per slot.
+ *
+ * When the ring is full, dispatch adds to an overflow list, which is taken
+ * after the ring, instead of waiting for the application: a library thread
+ * blocked on the application could not be cancelled when the lockspace is
+ * closed.  While the list has entries everything goes on it, so asts are
+ * never taken out of order.
  */
 
-#ifdef _REENTRANT
-
-static int sync_write_v5(struct dlm_ls_info *lsinfo,
-			 struct dlm_write_request_v5 *req, int len)
-{
-	struct lock_wait lwait;
-	int status;
+#define RING_SIZE_MAX	(1 << 20)
 
-	if (pthread_self() == lsinfo->tid) {
-		/* This is the DLM worker thread, don't use lwait to sync */
-		req->i.lock.castaddr  = dummy_ast_routine;
-		req->i.lock.castparam = NULL;
+struct ring_slot {
+	unsigned long seq;
+	struct dlm_completion c;
+};
 
-		status = write(lsinfo->fd, req, len);
-		if (status < 0)
-			return -1;
+struct ring_over {
+	struct ring_over *next;
+	struct dlm_completion c;
+};
 
-		while (req->i.lock.lksb->sb_status == EINPROG) {
-			do_dlm_dispatch_v5(lsinfo->fd);
-		}
-	} else {
-		pthread_cond_init(&lwait.cond, NULL);
-		pthread_mutex_init(&lwait.mutex, NULL);
-		pthread_mutex_lock(&lwait.mutex);
+struct completion_ring {
+	struct completion_ring *next;
+	struct dlm_ls_info *lsinfo;
+	int efd;
+	int armed;
+	int over_count;
+	struct ring_over *over_head;
+	struct ring_over *over_tail;
+	unsigned long mask;
+	unsigned long head;
+	unsigned long tail;
+	struct ring_slot slots[0];
+};
 
-		req->i.lock.castaddr  = sync_ast_routine;
-		req->i.lock.castparam = &lwait;
+/* rings by fd, for dlm_dispatch() */
+static struct completion_ring *ring_list;
 
-		status = write(lsinfo->fd, req, len);
-		if (status < 0)
-			return -1;
+static struct completion_ring *find_ring(int fd)
+{
+	struct completion_ring *ring;
 
-		pthread_cond_wait(&lwait.cond, &lwait.mutex);
-		pthread_mutex_unlock(&lwait.mutex);
+	batch_lock();
+	for (ring = ring_list; ring; ring = ring->next) {
+		if (ring->lsinfo->fd == fd)
+			break;
 	}
-
-	return status; /* lock status is in the lksb */
+	batch_unlock();
+	return ring;
 }
 
-static int sync_write_v6(struct dlm_ls_info *lsinfo,
-			 struct dlm_write_request *req, int len)
+static int ring_push(struct completion_ring *ring, struct dlm_completion *c)
 {
-	struct lock_wait lwait;
-	int status;
-
-	if (pthread_self() == lsinfo->tid) {
-		/* This is the DLM worker thread, don't use lwait to sync */
-		req->i.lock.castaddr  = dummy_ast_routine;
-		req->i.lock.castparam = NULL;
-
-		status = write(lsinfo->fd, req, len);
-		if (status < 0)
+	struct ring_slot *slot;
+	unsigned long pos, seq;
+	long diff;
+
+	pos = __atomic_load_n(&ring->tail, __ATOMIC_RELAXED);
+
+	for (;;) {
+		slot = &ring->slots[pos & ring->mask];
+		seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+		diff = (long)seq - (long)pos;
+
+		if (!diff) {
+			if (__atomic_compare_exchange_n(&ring->tail, &pos,
+						pos + 1, 1, __ATOMIC_RELAXED,
+						__ATOMIC_RELAXED))
+				break;
+		} else if (diff < 0) {
 			return -1;
-
-		while (req->i.lock.lksb->sb_status == EINPROG) {
-			do_dlm_dispatch_v6(lsinfo->fd);
+		} else {
+			pos = __atomic_load_n(&ring->tail, __ATOMIC_RELAXED);
 		}
-	} else {
-		pthread_cond_init(&lwait.cond, NULL);
-		pthread_mutex_init(&lwait.mutex, NULL);
-		pthread_mutex_lock(&lwait.mutex);
+	}
 
-		req->i.lock.castaddr  = sync_ast_routine;
-		req->i.lock.castparam = &lwait;
+	slot->c = *c;
+	__atomic_store_n(&slot->seq, pos + 1, __ATOMIC_RELEASE);
+	return 0;
+}
 
-		status = write(lsinfo->fd, req, len);
-		if (status < 0)
-			return -1;
+/* only the first completion after the consumer looks needs a wakeup */
+static void ring_signal(struct completion_ring *ring)
+{
+	uint64_t one = 1;
 
-		pthread_cond_wait(&lwait.cond, &lwait.mutex);
-		pthread_mutex_unlock(&lwait.mutex);
+	if (__atomic_exchange_n(&ring->armed, 0, __ATOMIC_SEQ_CST)) {
+		if (write(ring->efd, &one, sizeof(one)) < 0)
+			return;
 	}
-
-	return status; /* lock status is in the lksb */
 }
 
-#else /* _REENTRANT */
-
-static int sync_write_v5(struct dlm_ls_info *lsinfo,
-			 struct dlm_write_request_v5 *req, int len)
+/* batch_lock must be held */
+static void ring_over_add(struct completion_ring *ring, struct ring_over *ro)
 {
-	int status;
+	ro->next = NULL;
+	if (ring->over_tail)
+		ring->over_tail->next = ro;
+	else
+		ring->over_head = ro;
+	ring->over_tail = ro;
+	__atomic_add_fetch(&ring->over_count, 1, __ATOMIC_RELEASE);
+}
 
-	req->i.lock.castaddr  = dummy_ast_routine;
-	req->i.lock.castparam = NULL;
+/* batch_lock must be held */
+static int ring_over_pop(struct completion_ring *ring, struct dlm_completion *c)
+{
+	struct ring_over *ro = ring->over_head;
 
-	status = write(lsinfo->fd, req, len);
-	if (status < 0)
+	if (!ro)
 		return -1;
 
-	while (req->i.lock.lksb->sb_status == EINPROG) {
-		do_dlm_dispatch_v5(lsinfo->fd);
-	}
+	ring->over_head = ro->next;
+	if (!ring->over_head)
+		ring->over_tail = NULL;
+	__atomic_sub_fetch(&ring->over_count, 1, __ATOMIC_RELEASE);
 
-	errno = req->i.lock.lksb->sb_status;
-	if (errno && errno != EUNLOCK)
-		return -1;
+	*c = ro->c;
+	free(ro);
 	return 0;
 }
 
-static int sync_write_v6(struct dlm_ls_info *lsinfo,
-			 struct dlm_write_request *req, int len)
+static int ring_pop(struct completion_ring *ring, struct dlm_completion *c)
 {
-	int status;
+	struct ring_slot *slot;
+	unsigned long pos = ring->head;
 
-	req->i.lock.castaddr  = dummy_ast_routine;
-	req->i.lock.castparam = NULL;
+	slot = &ring->slots[pos & ring->mask];
 
-	status = write(lsinfo->fd, req, len);
-	if (status < 0)
+	if ((long)__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) -
+	    (long)(pos + 1) < 0)
 		return -1;
 
-	while (req->i.lock.lksb->sb_status == EINPROG) {
-		do_dlm_dispatch_v6(lsinfo->fd);
-	}
-
-	errno = req->i.lock.lksb->sb_status;
-	if (errno && errno != EUNLOCK)
-		return -1;
+	*c = slot->c;
+	__atomic_store_n(&slot->seq, pos + ring->mask + 1, __ATOMIC_RELEASE);
+	ring->head = pos + 1;
 	return 0;
 }
 
-#endif /* _REENTRANT */
-
+static void batch_wait_done(void *arg);
 
-/*
- * Lock
+/* the asts the library uses itself are always called directly */
+static int internal_ast(void (*astaddr)(void *astarg))
+{
+	if (astaddr == dummy_ast_routine || astaddr == cache_ast ||
+	    astaddr == cache_bast || astaddr == batch_wait_done)
+		return 1;
+#ifdef _REENTRANT
+	if (astaddr == sync_ast_routine)
+		return 1;
+#endif
+	return 0;
+}
+
+static void call_ast(struct completion_ring *ring, void *addr, void *astarg,
+		     struct dlm_lksb *lksb, int bast_mode)
+{
+	void (*astaddr)(void *astarg) = addr;
+	struct dlm_completion c;
+	struct ring_over *ro;
+
+	if (!astaddr)
+		return;
+
+	if (!ring || internal_ast(astaddr))
+		goto call;
+
+	c.astaddr = astaddr;
+	c.astarg = astarg;
+	c.lksb = lksb;
+	c.bast_mode = bast_mode;
+
+	if (!__atomic_load_n(&ring->over_count, __ATOMIC_ACQUIRE) &&
+	    !ring_push(ring, &c))
+		goto out;
+
+	/* the ring is full, or the overflow is still being taken */
+	ro = malloc(sizeof(struct ring_over));
+	if (!ro) {
+		/* nothing better to do with it */
+		astaddr(astarg);
+		return;
+	}
+	ro->c = c;
+
+	batch_lock();
+	ring_over_add(ring, ro);
+	batch_unlock();
+ out:
+	ring_signal(ring);
+	return;
+ call:
+	astaddr(astarg);
+}
+
+static void free_completion_ring(struct dlm_ls_info *lsinfo)
+{
+	struct completion_ring *ring = lsinfo->ring;
+	struct completion_ring **pp;
+	struct dlm_completion c;
+
+	if (!ring)
+		return;
+
+	while (!ring_over_pop(ring, &c))
+		;
+
+	batch_lock();
+	for (pp = &ring_list; *pp; pp = &(*pp)->next) {
+		if (*pp == ring) {
+			*pp = ring->next;
+			break;
+		}
+	}
+	batch_unlock();
+
+	close(ring->efd);
+	free(ring);
+	lsinfo->ring = NULL;
+}
+
+int dlm_ls_completion_ring(dlm_lshandle_t ls, unsigned int size)
+{
+	struct dlm_ls_info *lsinfo = (struct dlm_ls_info *)ls;
+	struct completion_ring *ring;
+	unsigned long n, i;
+
+	if (ls == NULL) {
+		errno = ENOTCONN;
+		return -1;
+	}
+
+	if (lsinfo->ring) {
+		errno = EEXIST;
+		return -1;
+	}
+
+	if (!size || size > RING_SIZE_MAX) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	for (n = 1; n < size; n <<= 1)
+		;
+
+	ring = malloc(sizeof(struct completion_ring) +
+		      n * sizeof(struct ring_slot));
+	if (!ring)
+		return -1;
+	memset(ring, 0, sizeof(struct completion_ring));
+
+	ring->efd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (ring->efd < 0) {
+		free(ring);
+		return -1;
+	}
+
+	ring->lsinfo = lsinfo;
+	ring->armed = 1;
+	ring->mask = n - 1;
+	for (i = 0; i < n; i++)
+		ring->slots[i].seq = i;
+
+	batch_lock();
+	ring->next = ring_list;
+	ring_list = ring;
+	batch_unlock();
+
+	__atomic_store_n(&lsinfo->ring, ring, __ATOMIC_RELEASE);
+	return ring->efd;
+}
+
+int dlm_ls_get_completions(dlm_lshandle_t ls, struct dlm_completion *comps,
+			   int max)
+{
+	struct dlm_ls_info *lsinfo = (struct dlm_ls_info *)ls;
+	struct completion_ring *ring;
+	uint64_t val;
+	int count = 0;
+
+	if (ls == NULL || !lsinfo->ring || !comps || max <= 0) {
+		errno = EINVAL;
+		return -1;
+	}
+	ring = lsinfo->ring;
+
+	/* clear the eventfd and ask for a wakeup before looking */
+	if (read(ring->efd, &val, sizeof(val)) < 0 && errno != EAGAIN)
+		return -1;
+	__atomic_store_n(&ring->armed, 1, __ATOMIC_SEQ_CST);
+
+	while (count < max && !ring_pop(ring, &comps[count]))
+		count++;
+
+	/* the ring is empty, overflow entries come after everything in it */
+	if (count < max &&
+	    __atomic_load_n(&ring->over_count, __ATOMIC_ACQUIRE)) {
+		batch_lock();
+		while (count < max && !ring_over_pop(ring, &comps[count]))
+			count++;
+		batch_unlock();
+	}
+
+	/* keep the eventfd readable if we left some behind */
+	if (count == max && __atomic_exchange_n(&ring->armed, 0, __ATOMIC_SEQ_CST)) {
+		val = 1;
+		if (write(ring->efd, &val, sizeof(val)) < 0)
+			return count;
+	}
+
+	return count;
+}
+
+/*
+ * Lock statistics
+ *
+ * Collected for a lockspace once dlm_ls_reset_stats() has been called.  The
+ * submit time of each request, conversion and unlock is kept by lksb until
+ * its completion is read, and the latency goes in a log2 histogram.
+ * Results are matched to a lockspace by fd, as dlm_dispatch() only has that.
+ */
+
+#define STATS_HASH_SIZE	256
+
+#define STATS_REQUEST	0
+#define STATS_CONVERT	1
+#define STATS_UNLOCK	2
+
+struct stats_pending {
+	struct stats_pending *next;
+	struct dlm_lksb *lksb;
+	uint64_t start;
+	int op;
+	int mode;
+};
+
+struct ls_stats {
+	struct ls_stats *next;
+	struct dlm_ls_info *lsinfo;
+#ifdef _REENTRANT
+	pthread_mutex_t mutex;
+#endif
+	struct dlm_ls_stats s;
+	struct stats_pending *free_list;
+	struct stats_pending *hash[STATS_HASH_SIZE];
+};
+
+static struct ls_stats *stats_list;
+static int stats_count;
+
+#ifdef _REENTRANT
+#define st_lock(st)	pthread_mutex_lock(&(st)->mutex)
+#define st_unlock(st)	pthread_mutex_unlock(&(st)->mutex)
+#else
+#define st_lock(st)	do { } while (0)
+#define st_unlock(st)	do { } while (0)
+#endif
+
+static unsigned int stats_hash_idx(struct dlm_lksb *lksb)
+{
+	return ((uintptr_t)lksb >> 4) % STATS_HASH_SIZE;
+}
+
+static struct ls_stats *find_stats(int fd)
+{
+	struct ls_stats *st;
+
+	if (!__atomic_load_n(&stats_count, __ATOMIC_ACQUIRE))
+		return NULL;
+
+	batch_lock();
+	for (st = stats_list; st; st = st->next) {
+		if (st->lsinfo->fd == fd)
+			break;
+	}
+	batch_unlock();
+	return st;
+}
+
+/* remember when the request for lksb was made */
+static void stats_submit(struct dlm_ls_info *lsinfo, struct dlm_lksb *lksb,
+			 int op, int mode)
+{
+	struct ls_stats *st = lsinfo->stats;
+	struct stats_pending *sp;
+	unsigned int idx;
+
+	if (!st)
+		return;
+
+	idx = stats_hash_idx(lksb);
+
+	st_lock(st);
+	for (sp = st->hash[idx]; sp; sp = sp->next) {
+		if (sp->lksb == lksb)
+			goto out;
+	}
+
+	sp = st->free_list;
+	if (sp)
+		st->free_list = sp->next;
+	else
+		sp = malloc(sizeof(struct stats_pending));
+	if (!sp)
+		goto out;
+
+	sp->lksb = lksb;
+	sp->start = now_usec();
+	sp->op = op;
+	sp->mode = mode;
+	sp->next = st->hash[idx];
+	st->hash[idx] = sp;
+	st->s.in_flight++;
+ out:
+	st_unlock(st);
+}
+
+/* take back the record of a request that the device did not accept */
+static void stats_unsubmit(struct dlm_ls_info *lsinfo, struct dlm_lksb *lksb)
+{
+	struct ls_stats *st = lsinfo->stats;
+	struct stats_pending **pp, *sp;
+
+	if (!st)
+		return;
+
+	st_lock(st);
+	for (pp = &st->hash[stats_hash_idx(lksb)]; *pp; pp = &(*pp)->next) {
+		sp = *pp;
+		if (sp->lksb == lksb) {
+			*pp = sp->next;
+			sp->next = st->free_list;
+			st->free_list = sp;
+			st->s.in_flight--;
+			break;
+		}
+	}
+	st_unlock(st);
+}
+
+static void stats_add(uint64_t *hist, uint64_t usec)
+{
+	int b = 0;
+
+	while (usec && b < DLM_STATS_BUCKETS - 1) {
+		usec >>= 1;
+		b++;
+	}
+	hist[b]++;
+}
+
+/* called with a result as read, before the status is flipped */
+static void stats_result(struct ls_stats *st, struct dlm_lock_result *result)
+{
+	struct stats_pending **pp, *sp;
+	int status = -result->lksb.sb_status;
+	uint64_t usec;
+
+	st_lock(st);
+	if (result->bast_mode) {
+		st->s.basts++;
+		goto out;
+	}
+
+	if (status == EAGAIN)
+		st->s.noqueue_fails++;
+	else if (status && status != EUNLOCK)
+		st->s.errors++;
+	if (result->lksb.sb_flags & DLM_SBF_DEMOTED)
+		st->s.demoted++;
+	if (result->lksb.sb_flags & DLM_SBF_VALNOTVALID)
+		st->s.valnotvalid++;
+
+	for (pp = &st->hash[stats_hash_idx(result->user_lksb)]; *pp;
+	     pp = &(*pp)->next) {
+		sp = *pp;
+		if (sp->lksb != result->user_lksb)
+			continue;
+
+		*pp = sp->next;
+		st->s.in_flight--;
+
+		usec = now_usec() - sp->start;
+		st->s.count[sp->op]++;
+		st->s.total_usec[sp->op] += usec;
+		if (usec > st->s.max_usec[sp->op])
+			st->s.max_usec[sp->op] = usec;
+
+		if (sp->op == STATS_UNLOCK)
+			stats_add(st->s.unlock, usec);
+		else if (sp->op == STATS_CONVERT)
+			stats_add(st->s.convert[sp->mode], usec);
+		else
+			stats_add(st->s.request[sp->mode], usec);
+
+		sp->next = st->free_list;
+		st->free_list = sp;
+		break;
+	}
+ out:
+	st_unlock(st);
+}
+
+int dlm_ls_reset_stats(dlm_lshandle_t ls)
+{
+	struct dlm_ls_info *lsinfo = (struct dlm_ls_info *)ls;
+	struct ls_stats *st;
+	uint32_t in_flight;
+
+	if (ls == NULL) {
+		errno = ENOTCONN;
+		return -1;
+	}
+
+	st = lsinfo->stats;
+	if (st) {
+		/* requests still in flight are timed as before */
+		st_lock(st);
+		in_flight = st->s.in_flight;
+		memset(&st->s, 0, sizeof(struct dlm_ls_stats));
+		st->s.in_flight = in_flight;
+		st_unlock(st);
+		return 0;
+	}
+
+	st = malloc(sizeof(struct ls_stats));
+	if (!st)
+		return -1;
+	memset(st, 0, sizeof(struct ls_stats));
+	st->lsinfo = lsinfo;
+#ifdef _REENTRANT
+	pthread_mutex_init(&st->mutex, NULL);
+#endif
+
+	batch_lock();
+	st->next = stats_list;
+	stats_list = st;
+	batch_unlock();
+
+	__atomic_store_n(&lsinfo->stats, st, __ATOMIC_RELEASE);
+	__atomic_add_fetch(&stats_count, 1, __ATOMIC_ACQ_REL);
+	return 0;
+}
+
+int dlm_ls_get_stats(dlm_lshandle_t ls, struct dlm_ls_stats *stats)
+{
+	struct dlm_ls_info *lsinfo = (struct dlm_ls_info *)ls;
+	struct ls_stats *st;
+
+	if (ls == NULL) {
+		errno = ENOTCONN;
+		return -1;
+	}
+
+	st = lsinfo->stats;
+	if (!st || !stats) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	st_lock(st);
+	memcpy(stats, &st->s, sizeof(struct dlm_ls_stats));
+	st_unlock(st);
+	return 0;
+}
+
+static void free_ls_stats(struct dlm_ls_info *lsinfo)
+{
+	struct ls_stats *st = lsinfo->stats;
+	struct ls_stats **pp;
+	struct stats_pending *sp;
+	int i;
+
+	if (!st)
+		return;
+
+	batch_lock();
+	for (pp = &stats_list; *pp; pp = &(*pp)->next) {
+		if (*pp == st) {
+			*pp = st->next;
+			break;
+		}
+	}
+	batch_unlock();
+	__atomic_sub_fetch(&stats_count, 1, __ATOMIC_ACQ_REL);
+
+	for (i = 0; i < STATS_HASH_SIZE; i++) {
+		while ((sp = st->hash[i])) {
+			st->hash[i] = sp->next;
+			free(sp);
+		}
+	}
+	while ((sp = st->free_list)) {
+		st->free_list = sp->next;
+		free(sp);
+	}
+
+#ifdef _REENTRANT
+	pthread_mutex_destroy(&st->mutex);
+#endif
+	free(st);
+	lsinfo->stats = NULL;
+}
+
+/*
+ * do_dlm_dispatch()
+ * Read an ast from the kernel.
+ */
+
+static int do_dlm_dispatch_v5(int fd, struct completion_ring *ring)
+{
+	char resultbuf[sizeof(struct dlm_lock_result_v5) + DLM_USER_LVB_LEN];
+	struct dlm_lock_result_v5 *result = (struct dlm_lock_result_v5 *)resultbuf;
+	char *fullresult = NULL;
+	int status;
+
+	status = read(fd, result, sizeof(resultbuf));
+	if (status <= 0)
+		return -1;
+
+	/* This shouldn't happen any more, can probably be removed */
+
+	if (result->length != status) {
+		int newstat;
+
+		fullresult = malloc(result->length);
+		if (!fullresult)
+			return -1;
+
+		newstat = read(fd, (struct dlm_lock_result_v5 *)fullresult,
+			       result->length);
+
+		/* If it read OK then use the new data. otherwise we can
+		   still deliver the AST, it just might not have all the
+		   info in it...hmmm */
+
+		if (newstat == result->length)
+			result = (struct dlm_lock_result_v5 *)fullresult;
+	} else {
+		fullresult = resultbuf;
+	}
+
+
+	/* Copy lksb to user's buffer - except the LVB ptr */
+	memcpy(result->user_lksb, &result->lksb,
+	       sizeof(struct dlm_lksb) - sizeof(char*));
+
+	/* Flip the status. Kernel space likes negative return codes,
+	   userspace positive ones */
+	result->user_lksb->sb_status = -result->user_lksb->sb_status;
+
+	/* Copy optional items */
+	if (result->lvb_offset)
+		memcpy(result->user_lksb->sb_lvbptr,
+		       fullresult + result->lvb_offset, DLM_LVB_LEN);
+
+	/* Call AST */
+	call_ast(ring, result->user_astaddr, result->user_astparam,
+		 result->user_lksb, result->bast_mode);
+
+	if (!result->bast_mode)
+		batch_complete(ring, result->user_lksb);
+
+	if (fullresult != resultbuf)
+		free(fullresult);
+
+	return 0;
+}
+
+static void deliver_result_v6(struct dlm_lock_result *result,
+			      struct completion_ring *ring)
+{
+	/* Copy lksb to user's buffer - except the LVB ptr */
+	memcpy(result->user_lksb, &result->lksb,
+	       sizeof(struct dlm_lksb) - sizeof(char*));
+
+	/* Copy lvb to user's buffer */
+	if (result->lvb_offset)
+		memcpy(result->user_lksb->sb_lvbptr,
+		       (char *)result + result->lvb_offset, DLM_LVB_LEN);
+
+	result->user_lksb->sb_status = -result->user_lksb->sb_status;
+
+	call_ast(ring, result->user_astaddr, result->user_astparam,
+		 result->user_lksb, result->bast_mode);
+
+	if (!result->bast_mode)
+		batch_complete(ring, result->user_lksb);
+}
+
+static int do_dlm_dispatch_v6(int fd, struct completion_ring *ring)
+{
+	char resultbuf[sizeof(struct dlm_lock_result) + DLM_USER_LVB_LEN];
+	struct dlm_lock_result *result = (struct dlm_lock_result *)resultbuf;
+	struct ls_stats *st;
+	int status;
+
+	status = read_result(fd, result, sizeof(resultbuf));
+	if (status <= 0)
+		return -1;
+
+	st = find_stats(fd);
+	if (st)
+		stats_result(st, result);
+
+	deliver_result_v6(result, ring);
+	return 0;
+}
+
+static int do_dlm_dispatch(int fd, struct completion_ring *ring)
+{
+	if (kernel_version.version[0] == 5)
+		return do_dlm_dispatch_v5(fd, ring);
+	else
+		return do_dlm_dispatch_v6(fd, ring);
+}
+
+/*
+ * do_dlm_dispatch_batch()
+ * Deliver up to max (0 for no limit) asts from a non-blocking fd.  If none
+ * are pending, wait up to timeout ms (-1 forever) for some to arrive.
+ * Returns the number delivered.
+ */
+
+static int do_dlm_dispatch_batch(int fd, struct completion_ring *ring,
+				 int max, int timeout)
+{
+	struct pollfd pfd;
+	int count = 0;
+	int rv;
+
+	for (;;) {
+		while (!max || count < max) {
+			if (do_dlm_dispatch(fd, ring) < 0) {
+				if (errno != EAGAIN && !count)
+					return -1;
+				break;
+			}
+			count++;
+		}
+
+		if (count || !timeout)
+			return count;
+
+		pfd.fd = fd;
+		pfd.events = POLLIN;
+		pfd.revents = 0;
+
+		rv = poll(&pfd, 1, timeout);
+		if (rv < 0)
+			return -1;
+		if (!rv)
+			return 0;
+	}
+}
+
+/*
+ * Used by the synchronous calls when the fd has been made non-blocking by
+ * the recv thread or dlm_ls_dispatch_batch().
+ */
+
+static void wait_dlm_result(int fd)
+{
+	struct pollfd pfd;
+
+	if (errno != EAGAIN)
+		return;
+
+	pfd.fd = fd;
+	pfd.events = POLLIN;
+	pfd.revents = 0;
+
+	poll(&pfd, 1, -1);
+}
+
+
+/*
+ * sync_write()
+ * Helper routine which supports the synchronous DLM calls. This
+ * writes a parameter block down to the DLM and waits for the
+ * operation to complete. This hides the different completion mechanism
+ * used when called from the main thread or the DLM 'AST' thread.
+ */
+
+#ifdef _REENTRANT
+
+static int sync_write_v5(struct dlm_ls_info *lsinfo,
+			 struct dlm_write_request_v5 *req, int len)
+{
+	struct lock_wait *lwait;
+	int status;
+
+	if (pthread_self() == lsinfo->tid) {
+		/* This is the DLM worker thread, don't use lwait to sync */
+		req->i.lock.castaddr  = dummy_ast_routine;
+		req->i.lock.castparam = NULL;
+
+		status = ls_write(lsinfo, req, len);
+		if (status < 0)
+			return -1;
+
+		while (req->i.lock.lksb->sb_status == EINPROG) {
+			if (do_dlm_dispatch_v5(lsinfo->fd, lsinfo->ring) < 0)
+				wait_dlm_result(lsinfo->fd);
+		}
+	} else {
+		lwait = get_lock_wait();
+
+		req->i.lock.castaddr  = sync_ast_routine;
+		req->i.lock.castparam = lwait;
+
+		status = ls_write(lsinfo, req, len);
+		if (status < 0)
+			return -1;
+
+		wait_lock_wait(lwait);
+	}
+
+	return status; /* lock status is in the lksb */
+}
+
+static int sync_write_v6(struct dlm_ls_info *lsinfo,
+			 struct dlm_write_request *req, int len)
+{
+	struct lock_wait *lwait;
+	int status;
+
+	if (pthread_self() == lsinfo->tid) {
+		/* This is the DLM worker thread, don't use lwait to sync */
+		req->i.lock.castaddr  = dummy_ast_routine;
+		req->i.lock.castparam = NULL;
+
+		status = ls_write(lsinfo, req, len);
+		if (status < 0)
+			return -1;
+
+		while (req->i.lock.lksb->sb_status == EINPROG) {
+			if (do_dlm_dispatch_v6(lsinfo->fd, lsinfo->ring) < 0)
+				wait_dlm_result(lsinfo->fd);
+		}
+	} else {
+		lwait = get_lock_wait();
+
+		req->i.lock.castaddr  = sync_ast_routine;
+		req->i.lock.castparam = lwait;
+
+		status = ls_write(lsinfo, req, len);
+		if (status < 0)
+			return -1;
+
+		wait_lock_wait(lwait);
+	}
+
+	return status; /* lock status is in the lksb */
+}
+
+#else /* _REENTRANT */
+
+static int sync_write_v5(struct dlm_ls_info *lsinfo,
+			 struct dlm_write_request_v5 *req, int len)
+{
+	int status;
+
+	req->i.lock.castaddr  = dummy_ast_routine;
+	req->i.lock.castparam = NULL;
+
+	status = ls_write(lsinfo, req, len);
+	if (status < 0)
+		return -1;
+
+	while (req->i.lock.lksb->sb_status == EINPROG) {
+		if (do_dlm_dispatch_v5(lsinfo->fd, lsinfo->ring) < 0)
+			wait_dlm_result(lsinfo->fd);
+	}
+
+	errno = req->i.lock.lksb->sb_status;
+	if (errno && errno != EUNLOCK)
+		return -1;
+	return 0;
+}
+
+static int sync_write_v6(struct dlm_ls_info *lsinfo,
+			 struct dlm_write_request *req, int len)
+{
+	int status;
+
+	req->i.lock.castaddr  = dummy_ast_routine;
+	req->i.lock.castparam = NULL;
+
+	status = ls_write(lsinfo, req, len);
+	if (status < 0)
+		return -1;
+
+	while (req->i.lock.lksb->sb_status == EINPROG) {
+		if (do_dlm_dispatch_v6(lsinfo->fd, lsinfo->ring) < 0)
+			wait_dlm_result(lsinfo->fd);
+	}
+
+	errno = req->i.lock.lksb->sb_status;
+	if (errno && errno != EUNLOCK)
+		return -1;
+	return 0;
+}
+
+#endif /* _REENTRANT */
+
+
+/*
+ * Lock
  * All the ways to request/convert a lock
  */
 
-static int ls_lock_v5(dlm_lshandle_t ls,
-		uint32_t mode,
-		struct dlm_lksb *lksb,
-		uint32_t flags,
-		const void *name,
-		unsigned int namelen,
-		uint32_t parent,
-		void (*astaddr) (void *astarg),
-		void *astarg,
-		void (*bastaddr) (void *astarg))
+static int ls_lock_v5(dlm_lshandle_t ls,
+		uint32_t mode,
+		struct dlm_lksb *lksb,
+		uint32_t flags,
+		const void *name,
+		unsigned int namelen,
+		uint32_t parent,
+		void (*astaddr) (void *astarg),
+		void *astarg,
+		void (*bastaddr) (void *astarg))
+{
+	char parambuf[sizeof(struct dlm_write_request_v5) + DLM_RESNAME_MAXLEN];
+	struct dlm_write_request_v5 *req = (struct dlm_write_request_v5 *)parambuf;
+	struct dlm_ls_info *lsinfo = (struct dlm_ls_info *)ls;
+	int status;
+	int len;
+
+	memset(req, 0, sizeof(*req));
+	set_version_v5(req);
+
+	req->cmd = DLM_USER_LOCK;
+	req->i.lock.mode = mode;
+	req->i.lock.flags = (flags & ~LKF_WAIT);
+	req->i.lock.lkid = lksb->sb_lkid;
+	req->i.lock.parent = parent;
+	req->i.lock.lksb = lksb;
+	req->i.lock.castaddr = astaddr;
+	req->i.lock.bastaddr = bastaddr;
+	req->i.lock.castparam = astarg;	/* same comp and blocking ast arg */
+	req->i.lock.bastparam = astarg;
+
+	if (flags & LKF_CONVERT) {
+		req->i.lock.namelen = 0;
+	} else {
+		if (namelen > DLM_RESNAME_MAXLEN) {
+			errno = EINVAL;
+			return -1;
+		}
+		req->i.lock.namelen = namelen;
+		memcpy(req->i.lock.name, name, namelen);
+	}
+
+	if (flags & LKF_VALBLK) {
+		memcpy(req->i.lock.lvb, lksb->sb_lvbptr, DLM_LVB_LEN);
+	}
+
+	len = sizeof(struct dlm_write_request_v5) + namelen;
+	lksb->sb_status = EINPROG;
+
+	if (flags & LKF_WAIT)
+		status = sync_write_v5(lsinfo, req, len);
+	else
+		status = ls_write(lsinfo, req, len);
+
+	if (status < 0)
+		return -1;
+
+	/*
+	 * the lock id is the return value from the write on the device
+	 */
+
+	if (status > 0)
+		lksb->sb_lkid = status;
+	return 0;
+}
+
+static int ls_lock_v6(dlm_lshandle_t ls,
+		uint32_t mode,
+		struct dlm_lksb *lksb,
+		uint32_t flags,
+		const void *name,
+		unsigned int namelen,
+		uint32_t parent,
+		void (*astaddr) (void *astarg),
+		void *astarg,
+		void (*bastaddr) (void *astarg),
+		uint64_t *xid,
+		uint64_t *timeout)
+{
+	char parambuf[sizeof(struct dlm_write_request) + DLM_RESNAME_MAXLEN];
+	struct dlm_write_request *req = (struct dlm_write_request *)parambuf;
+	struct dlm_ls_info *lsinfo = (struct dlm_ls_info *)ls;
+	int status;
+	int len;
+
+	memset(req, 0, sizeof(*req));
+	set_version_v6(req);
+
+	req->cmd = DLM_USER_LOCK;
+	req->i.lock.mode = mode;
+	req->i.lock.flags = (flags & ~LKF_WAIT);
+	req->i.lock.lkid = lksb->sb_lkid;
+	req->i.lock.parent = parent;
+	req->i.lock.lksb = lksb;
+	req->i.lock.castaddr = astaddr;
+	req->i.lock.bastaddr = bastaddr;
+	req->i.lock.castparam = astarg;	/* same comp and blocking ast arg */
+	req->i.lock.bastparam = astarg;
+
+	if (xid)
+		req->i.lock.xid = *xid;
+	if (timeout)
+		req->i.lock.timeout = *timeout;
+
+	if (flags & LKF_CONVERT) {
+		req->i.lock.namelen = 0;
+	} else {
+		if (namelen > DLM_RESNAME_MAXLEN) {
+			errno = EINVAL;
+			return -1;
+		}
+		req->i.lock.namelen = namelen;
+		memcpy(req->i.lock.name, name, namelen);
+	}
+
+	if (flags & LKF_VALBLK) {
+		memcpy(req->i.lock.lvb, lksb->sb_lvbptr, DLM_LVB_LEN);
+	}
+
+	len = sizeof(struct dlm_write_request) + namelen;
+	lksb->sb_status = EINPROG;
+
+	stats_submit(lsinfo, lksb, (flags & LKF_CONVERT) ? STATS_CONVERT :
+		     STATS_REQUEST, mode);
+
+	if (flags & LKF_WAIT)
+		status = sync_write_v6(lsinfo, req, len);
+	else
+		status = ls_write(lsinfo, req, len);
+
+	if (status < 0) {
+		stats_unsubmit(lsinfo, lksb);
+		return -1;
+	}
+
+	/*
+	 * the lock id is the return value from the write on the device
+	 */
+
+	if (status > 0)
+		lksb->sb_lkid = status;
+	return 0;
+}
+
+static int ls_lock(dlm_lshandle_t ls,
+		uint32_t mode,
+		struct dlm_lksb *lksb,
+		uint32_t flags,
+		const void *name,
+		unsigned int namelen,
+		uint32_t parent,
+		void (*astaddr) (void *astarg),
+		void *astarg,
+		void (*bastaddr) (void *astarg),
+		void *range)
+{
+	/* no support for range locks */
+	if (range) {
+		errno = ENOSYS;
+		return -1;
+	}
+
+	if (flags & LKF_VALBLK && !lksb->sb_lvbptr) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	if (kernel_version.version[0] == 5)
+		return ls_lock_v5(ls, mode, lksb, flags, name, namelen, parent,
+				  astaddr, astarg, bastaddr);
+	else
+		return ls_lock_v6(ls, mode, lksb, flags, name, namelen, parent,
+				  astaddr, astarg, bastaddr, NULL, NULL);
+}
+
+/*
+ * Extended async locking in own lockspace
+ */
+int dlm_ls_lockx(dlm_lshandle_t ls,
+		 uint32_t mode,
+		 struct dlm_lksb *lksb,
+		 uint32_t flags,
+		 const void *name,
+		 unsigned int namelen,
+		 uint32_t parent,
+		 void (*astaddr) (void *astarg),
+		 void *astarg,
+		 void (*bastaddr) (void *astarg),
+		 uint64_t *xid,
+		 uint64_t *timeout)
+{
+	if (kernel_version.version[0] < 6) {
+		errno = ENOSYS;
+		return -1;
+	}
+
+	return ls_lock_v6(ls, mode, lksb, flags, name, namelen, parent,
+			  astaddr, astarg, bastaddr, xid, timeout);
+}
+
+/*
+ * Async locking in own lockspace
+ */
+int dlm_ls_lock(dlm_lshandle_t ls,
+		uint32_t mode,
+		struct dlm_lksb *lksb,
+		uint32_t flags,
+		const void *name,
+		unsigned int namelen,
+		uint32_t parent,
+		void (*astaddr) (void *astarg),
+		void *astarg,
+		void (*bastaddr) (void *astarg),
+		void *range)
+{
+	return ls_lock(ls, mode, lksb, flags, name, namelen, parent,
+		       astaddr, astarg, bastaddr, range);
+}
+
+/*
+ * Sync locking in own lockspace
+ */
+int dlm_ls_lock_wait(dlm_lshandle_t ls,
+		     uint32_t mode,
+		     struct dlm_lksb *lksb,
+		     uint32_t flags,
+		     const void *name,
+		     unsigned int namelen,
+		     uint32_t parent,
+		     void *bastarg,
+		     void (*bastaddr) (void *bastarg),
+		     void *range)
+{
+	return ls_lock(ls, mode, lksb, flags | LKF_WAIT, name, namelen, parent,
+		       NULL, bastarg, bastaddr, range);
+}
+
+/*
+ * Async locking in the default lockspace
+ */
+int dlm_lock(uint32_t mode,
+	     struct dlm_lksb *lksb,
+	     uint32_t flags,
+	     const void *name,
+	     unsigned int namelen,
+	     uint32_t parent,
+	     void (*astaddr) (void *astarg),
+	     void *astarg,
+	     void (*bastaddr) (void *astarg),
+	     void *range)
+{
+	if (open_default_lockspace())
+		return -1;
+
+	return ls_lock(default_ls, mode, lksb, flags, name, namelen, parent,
+		       astaddr, astarg, bastaddr, range);
+}
+
+/*
+ * Sync locking in the default lockspace
+ */
+int dlm_lock_wait(uint32_t mode,
+		     struct dlm_lksb *lksb,
+		     uint32_t flags,
+		     const void *name,
+		     unsigned int namelen,
+		     uint32_t parent,
+		     void *bastarg,
+		     void (*bastaddr) (void *bastarg),
+		     void *range)
+{
+	if (open_default_lockspace())
+		return -1;
+
+	return ls_lock(default_ls, mode, lksb, flags | LKF_WAIT, name, namelen,
+		       parent, NULL, bastarg, bastaddr, range);
+}
+
+
+/*
+ * Unlock
+ * All the ways to unlock/cancel a lock
+ */
+
+static int ls_unlock_v5(struct dlm_ls_info *lsinfo, uint32_t lkid,
+			uint32_t flags, struct dlm_lksb *lksb, void *astarg)
+{
+	struct dlm_write_request_v5 req;
+
+	set_version_v5(&req);
+	req.cmd = DLM_USER_UNLOCK;
+	req.i.lock.lkid = lkid;
+	req.i.lock.flags = (flags & ~LKF_WAIT);
+	req.i.lock.lksb  = lksb;
+	req.i.lock.castparam = astarg;
+	/* DLM_USER_UNLOCK will default to existing completion AST */
+	req.i.lock.castaddr = 0;
+	lksb->sb_status = EINPROG;
+
+	if (flags & LKF_WAIT)
+		return sync_write_v5(lsinfo, &req, sizeof(req));
+	else
+		return ls_write(lsinfo, &req, sizeof(req));
+}
+
+static int ls_unlock_v6(struct dlm_ls_info *lsinfo, uint32_t lkid,
+			uint32_t flags, struct dlm_lksb *lksb, void *astarg)
+{
+	struct dlm_write_request req;
+	int rv;
+
+	set_version_v6(&req);
+	req.cmd = DLM_USER_UNLOCK;
+	req.i.lock.lkid = lkid;
+	req.i.lock.flags = (flags & ~LKF_WAIT);
+	req.i.lock.lksb  = lksb;
+	req.i.lock.namelen = 0;
+	req.i.lock.castparam = astarg;
+	/* DLM_USER_UNLOCK will default to existing completion AST */
+	req.i.lock.castaddr = 0;
+	lksb->sb_status = EINPROG;
+
+	/* a cancel completes the request it cancels */
+	if (!(flags & LKF_CANCEL))
+		stats_submit(lsinfo, lksb, STATS_UNLOCK, 0);
+
+	if (flags & LKF_WAIT)
+		rv = sync_write_v6(lsinfo, &req, sizeof(req));
+	else
+		rv = ls_write(lsinfo, &req, sizeof(req));
+
+	if (rv < 0 && !(flags & LKF_CANCEL))
+		stats_unsubmit(lsinfo, lksb);
+	return rv;
+}
+
+int dlm_ls_unlock(dlm_lshandle_t ls, uint32_t lkid, uint32_t flags,
+		  struct dlm_lksb *lksb, void *astarg)
 {
-	char parambuf[sizeof(struct dlm_write_request_v5) + DLM_RESNAME_MAXLEN];
-	struct dlm_write_request_v5 *req = (struct dlm_write_request_v5 *)parambuf;
 	struct dlm_ls_info *lsinfo = (struct dlm_ls_info *)ls;
 	int status;
-	int len;
 
-	memset(req, 0, sizeof(*req));
-	set_version_v5(req);
+	if (ls == NULL) {
+		errno = ENOTCONN;
+		return -1;
+	}
 
-	req->cmd = DLM_USER_LOCK;
-	req->i.lock.mode = mode;
-	req->i.lock.flags = (flags & ~LKF_WAIT);
-	req->i.lock.lkid = lksb->sb_lkid;
-	req->i.lock.parent = parent;
-	req->i.lock.lksb = lksb;
-	req->i.lock.castaddr = astaddr;
-	req->i.lock.bastaddr = bastaddr;
-	req->i.lock.castparam = astarg;	/* same comp and blocking ast arg */
-	req->i.lock.bastparam = astarg;
+	if (!lkid) {
+		errno = EINVAL;
+		return -1;
+	}
 
-	if (flags & LKF_CONVERT) {
-		req->i.lock.namelen = 0;
+	if (kernel_version.version[0] == 5)
+		status = ls_unlock_v5(lsinfo, lkid, flags, lksb, astarg);
+	else
+		status = ls_unlock_v6(lsinfo, lkid, flags, lksb, astarg);
+
+	if (status < 0)
+		return -1;
+	return 0;
+}
+
+int dlm_ls_unlock_wait(dlm_lshandle_t ls, uint32_t lkid, uint32_t flags,
+		       struct dlm_lksb *lksb)
+{
+	return dlm_ls_unlock(ls, lkid, flags | LKF_WAIT, lksb, NULL);
+}
+
+int dlm_unlock_wait(uint32_t lkid, uint32_t flags, struct dlm_lksb *lksb)
+{
+	return dlm_ls_unlock_wait(default_ls, lkid, flags | LKF_WAIT, lksb);
+}
+
+int dlm_unlock(uint32_t lkid, uint32_t flags, struct dlm_lksb *lksb,
+	       void *astarg)
+{
+	return dlm_ls_unlock(default_ls, lkid, flags, lksb, astarg);
+}
+
+static void batch_wait_done(void *arg)
+{
+	*(int *)arg = 1;
+}
+
+static int ls_submit_many(dlm_lshandle_t ls, struct dlm_lock_req *reqs,
+			  int count, int unlock,
+			  void (*done)(void *arg), void *done_arg)
+{
+	struct dlm_ls_info *lsinfo = (struct dlm_ls_info *)ls;
+	struct lock_batch *batch;
+	struct dlm_lock_req *r;
+#ifdef _REENTRANT
+	struct lock_wait *lwait = NULL;
+#endif
+	int wait_done = 0;
+	int submitted = 0;
+	int saved_errno = 0;
+	int i, rv;
+
+	if (ls == NULL) {
+		errno = ENOTCONN;
+		return -1;
+	}
+
+	if (!reqs || count <= 0) {
+		errno = EINVAL;
+		return -1;
+	}
+
+#ifdef _REENTRANT
+	/*
+	 * The asts of the batch may be queued on this worker, which could
+	 * not run them while it waits here.
+	 */
+	if (!done && worker_pool && worker_pool == lsinfo->pool) {
+		errno = EDEADLK;
+		return -1;
+	}
+#endif
+
+	batch = malloc(sizeof(struct lock_batch) +
+		       count * sizeof(struct batch_entry));
+	if (!batch)
+		return -1;
+
+	/* the extra reference is dropped once all are submitted */
+	batch->remaining = count + 1;
+
+	if (done) {
+		batch->done = done;
+		batch->done_arg = done_arg;
+#ifdef _REENTRANT
+	} else if (pthread_self() != lsinfo->tid) {
+		lwait = get_lock_wait();
+		batch->done = sync_ast_routine;
+		batch->done_arg = lwait;
+#endif
 	} else {
-		if (namelen > DLM_RESNAME_MAXLEN) {
-			errno = EINVAL;
+		batch->done = batch_wait_done;
+		batch->done_arg = &wait_done;
+	}
+
+	batch_lock();
+	for (i = 0; i < count; i++) {
+		batch->entries[i].lksb = reqs[i].lksb;
+		batch->entries[i].batch = batch;
+		batch_hash_add(&batch->entries[i]);
+	}
+	batch_unlock();
+
+	/* the device takes one request per write, and returns its lock id */
+	for (i = 0; i < count; i++) {
+		r = &reqs[i];
+
+		if (unlock)
+			rv = dlm_ls_unlock(ls, r->lksb->sb_lkid,
+					   r->flags & ~LKF_WAIT, r->lksb,
+					   r->astarg);
+		else
+			rv = ls_lock(ls, r->mode, r->lksb,
+				     r->flags & ~LKF_WAIT, r->name, r->namelen,
+				     0, r->astaddr ? r->astaddr : dummy_ast_routine,
+				     r->astarg, r->bastaddr, NULL);
+		if (rv < 0) {
+			saved_errno = errno;
+			break;
+		}
+		submitted++;
+	}
+
+	/* requests that were not submitted will not complete */
+	if (submitted < count) {
+		batch_lock();
+		for (i = submitted; i < count; i++)
+			batch_hash_del(reqs[i].lksb, batch);
+		batch_unlock();
+
+		if (!submitted) {
+			free(batch);
+			errno = saved_errno;
 			return -1;
 		}
-		req->i.lock.namelen = namelen;
-		memcpy(req->i.lock.name, name, namelen);
+
+		__atomic_sub_fetch(&batch->remaining, count - submitted,
+				   __ATOMIC_ACQ_REL);
+	}
+
+	batch_put(batch, lsinfo->ring);
+
+	if (done)
+		goto out;
+
+#ifdef _REENTRANT
+	if (lwait) {
+		wait_lock_wait(lwait);
+		goto out;
+	}
+#endif
+	while (!wait_done) {
+		if (do_dlm_dispatch(lsinfo->fd, lsinfo->ring) < 0)
+			wait_dlm_result(lsinfo->fd);
+	}
+ out:
+	if (submitted < count)
+		errno = saved_errno;
+	return submitted;
+}
+
+int dlm_ls_lock_many(dlm_lshandle_t ls, struct dlm_lock_req *reqs, int count,
+		     void (*done)(void *arg), void *done_arg)
+{
+	return ls_submit_many(ls, reqs, count, 0, done, done_arg);
+}
+
+int dlm_ls_unlock_many(dlm_lshandle_t ls, struct dlm_lock_req *reqs, int count,
+		       void (*done)(void *arg), void *done_arg)
+{
+	return ls_submit_many(ls, reqs, count, 1, done, done_arg);
+}
+
+/*
+ * Lock cache
+ *
+ * dlm_ls_cache_unlock() does not unlock; the lock stays granted in the cache
+ * and the next dlm_ls_cache_lock() of the same resource takes it back with
+ * no request to the dlm if the mode is the same, or with a conversion.  The
+ * lock is really unlocked when a blocking ast says another lock wants it
+ * (at once if idle, else when the user is done with it), when it has been
+ * idle for idle_ms, or when more than max are idle (oldest first).
+ *
+ * The cache owns each lock's lksb.  Entries being unlocked are off the hash
+ * and on the release list until the unlock completes.
+ */
+
+#define CACHE_HASH_SIZE	256
+
+#define CACHE_BUSY	1
+#define CACHE_IDLE	2
+#define CACHE_RELEASING	3
+
+struct cache_entry {
+	struct cache_entry *next;		/* name hash */
+	struct cache_entry *lkid_next;		/* lkid hash */
+	struct cache_entry *list_prev;		/* idle or release list */
+	struct cache_entry *list_next;
+	struct lock_cache *cache;
+	struct dlm_lksb lksb;
+	char lvb[DLM_LVB_LEN];
+	int state;
+	int mode;
+	int blocked;
+	int done;
+#ifdef _REENTRANT
+	struct lock_wait *lwait;
+#endif
+	uint64_t idle_since;
+	unsigned int namelen;
+	char name[DLM_RESNAME_MAXLEN];
+};
+
+struct cache_list {
+	struct cache_entry *first;
+	struct cache_entry *last;
+};
+
+struct lock_cache {
+	struct dlm_ls_info *lsinfo;
+#ifdef _REENTRANT
+	pthread_mutex_t mutex;
+#endif
+	unsigned int max;
+	int idle_ms;
+	unsigned int idle_count;
+	struct cache_list idle;		/* oldest first */
+	struct cache_list release;
+	struct dlm_cache_stats stats;
+	struct cache_entry *hash[CACHE_HASH_SIZE];
+	struct cache_entry *lkid_hash[CACHE_HASH_SIZE];
+};
+
+#ifdef _REENTRANT
+#define lc_lock(c)	pthread_mutex_lock(&(c)->mutex)
+#define lc_unlock(c)	pthread_mutex_unlock(&(c)->mutex)
+#else
+#define lc_lock(c)	do { } while (0)
+#define lc_unlock(c)	do { } while (0)
+#endif
+
+static unsigned int cache_hash_idx(const char *name, unsigned int namelen)
+{
+	unsigned int i, h = 5381;
+
+	for (i = 0; i < namelen; i++)
+		h = h * 33 + (unsigned char)name[i];
+	return h % CACHE_HASH_SIZE;
+}
+
+static void list_add_tail(struct cache_list *l, struct cache_entry *ce)
+{
+	ce->list_next = NULL;
+	ce->list_prev = l->last;
+	if (l->last)
+		l->last->list_next = ce;
+	else
+		l->first = ce;
+	l->last = ce;
+}
+
+static void list_del(struct cache_list *l, struct cache_entry *ce)
+{
+	if (ce->list_prev)
+		ce->list_prev->list_next = ce->list_next;
+	else
+		l->first = ce->list_next;
+	if (ce->list_next)
+		ce->list_next->list_prev = ce->list_prev;
+	else
+		l->last = ce->list_prev;
+}
+
+/* lc_lock must be held for the cache_ functions */
+
+static struct cache_entry *cache_find(struct lock_cache *c, const char *name,
+				      unsigned int namelen)
+{
+	struct cache_entry *ce;
+
+	for (ce = c->hash[cache_hash_idx(name, namelen)]; ce; ce = ce->next) {
+		if (ce->namelen == namelen && !memcmp(ce->name, name, namelen))
+			return ce;
+	}
+	return NULL;
+}
+
+static struct cache_entry *cache_find_lkid(struct lock_cache *c, uint32_t lkid)
+{
+	struct cache_entry *ce;
+
+	for (ce = c->lkid_hash[lkid % CACHE_HASH_SIZE]; ce;
+	     ce = ce->lkid_next) {
+		if (ce->lksb.sb_lkid == lkid)
+			return ce;
+	}
+	return NULL;
+}
+
+static void cache_unhash(struct lock_cache *c, struct cache_entry *ce)
+{
+	struct cache_entry **pp;
+
+	for (pp = &c->hash[cache_hash_idx(ce->name, ce->namelen)]; *pp;
+	     pp = &(*pp)->next) {
+		if (*pp == ce) {
+			*pp = ce->next;
+			break;
+		}
+	}
+
+	for (pp = &c->lkid_hash[ce->lksb.sb_lkid % CACHE_HASH_SIZE]; *pp;
+	     pp = &(*pp)->lkid_next) {
+		if (*pp == ce) {
+			*pp = ce->lkid_next;
+			break;
+		}
+	}
+}
+
+/* unlock an idle or busy entry, cache_ast frees it when that completes */
+static void cache_release(struct lock_cache *c, struct cache_entry *ce)
+{
+	if (ce->state == CACHE_IDLE) {
+		list_del(&c->idle, ce);
+		c->idle_count--;
+	} else {
+		c->stats.in_use--;
+	}
+
+	cache_unhash(c, ce);
+	c->stats.cached--;
+	ce->state = CACHE_RELEASING;
+
+	if (dlm_ls_unlock((dlm_lshandle_t)c->lsinfo, ce->lksb.sb_lkid, 0,
+			  &ce->lksb, ce) < 0) {
+		free(ce);
+		return;
+	}
+	list_add_tail(&c->release, ce);
+}
+
+static void cache_expire(struct lock_cache *c, uint64_t now)
+{
+	struct cache_entry *ce;
+
+	while ((ce = c->idle.first)) {
+		if (c->idle_count <= c->max &&
+		    (c->idle_ms <= 0 || ce->idle_since + c->idle_ms > now))
+			break;
+		c->stats.idle_releases++;
+		cache_release(c, ce);
+	}
+}
+
+/* the user is done with a busy entry */
+static void cache_put(struct lock_cache *c, struct cache_entry *ce,
+		      uint64_t now)
+{
+	if (ce->blocked) {
+		c->stats.bast_releases++;
+		cache_release(c, ce);
+		return;
+	}
+
+	c->stats.in_use--;
+	ce->state = CACHE_IDLE;
+	ce->idle_since = now;
+	list_add_tail(&c->idle, ce);
+	c->idle_count++;
+	cache_expire(c, now);
+}
+
+static void cache_ast(void *arg)
+{
+	struct cache_entry *ce = arg;
+	struct lock_cache *c = ce->cache;
+#ifdef _REENTRANT
+	struct lock_wait *lwait;
+#endif
+
+	if (ce->state == CACHE_RELEASING) {
+		lc_lock(c);
+		list_del(&c->release, ce);
+		lc_unlock(c);
+		free(ce);
+		return;
+	}
+
+#ifdef _REENTRANT
+	lwait = ce->lwait;
+	if (lwait) {
+		sync_ast_routine(lwait);
+		return;
+	}
+#endif
+	__atomic_store_n(&ce->done, 1, __ATOMIC_RELEASE);
+}
+
+static void cache_bast(void *arg)
+{
+	struct cache_entry *ce = arg;
+	struct lock_cache *c = ce->cache;
+
+	lc_lock(c);
+	if (ce->state == CACHE_IDLE) {
+		c->stats.bast_releases++;
+		cache_release(c, ce);
+	} else if (ce->state == CACHE_BUSY) {
+		ce->blocked = 1;
 	}
+	lc_unlock(c);
+}
 
-	if (flags & LKF_VALBLK) {
-		memcpy(req->i.lock.lvb, lksb->sb_lvbptr, DLM_LVB_LEN);
-	}
+/* a lock or conversion for a busy entry, waiting for it to complete */
+static int cache_request(struct lock_cache *c, struct cache_entry *ce,
+			 uint32_t mode, uint32_t flags, struct dlm_lksb *lksb)
+{
+	struct dlm_ls_info *lsinfo = c->lsinfo;
 
-	len = sizeof(struct dlm_write_request_v5) + namelen;
-	lksb->sb_status = EINPROG;
+	if ((flags & LKF_VALBLK) && lksb->sb_lvbptr)
+		memcpy(ce->lvb, lksb->sb_lvbptr, DLM_LVB_LEN);
 
-	if (flags & LKF_WAIT)
-		status = sync_write_v5(lsinfo, req, len);
-	else
-		status = write(lsinfo->fd, req, len);
+	ce->done = 0;
+#ifdef _REENTRANT
+	ce->lwait = NULL;
+	if (pthread_self() != lsinfo->tid)
+		ce->lwait = get_lock_wait();
+#endif
 
-	if (status < 0)
+	if (ls_lock((dlm_lshandle_t)lsinfo, mode, &ce->lksb, flags & ~LKF_WAIT,
+		    ce->name, ce->namelen, 0, cache_ast, ce, cache_bast,
+		    NULL) < 0)
 		return -1;
 
-	/*
-	 * the lock id is the return value from the write on the device
-	 */
+#ifdef _REENTRANT
+	if (ce->lwait)
+		wait_lock_wait(ce->lwait);
+	else
+#endif
+	while (!__atomic_load_n(&ce->done, __ATOMIC_ACQUIRE)) {
+		if (do_dlm_dispatch(lsinfo->fd, lsinfo->ring) < 0)
+			wait_dlm_result(lsinfo->fd);
+	}
 
-	if (status > 0)
-		lksb->sb_lkid = status;
+	if ((flags & LKF_VALBLK) && lksb->sb_lvbptr)
+		memcpy(lksb->sb_lvbptr, ce->lvb, DLM_LVB_LEN);
+
+	if (ce->lksb.sb_status) {
+		errno = ce->lksb.sb_status;
+		return -1;
+	}
 	return 0;
 }
 
-static int ls_lock_v6(dlm_lshandle_t ls,
-		uint32_t mode,
-		struct dlm_lksb *lksb,
-		uint32_t flags,
-		const void *name,
-		unsigned int namelen,
-		uint32_t parent,
-		void (*astaddr) (void *astarg),
-		void *astarg,
-		void (*bastaddr) (void *astarg),
-		uint64_t *xid,
-		uint64_t *timeout)
+int dlm_ls_cache_init(dlm_lshandle_t ls, unsigned int max, int idle_ms)
 {
-	char parambuf[sizeof(struct dlm_write_request) + DLM_RESNAME_MAXLEN];
-	struct dlm_write_request *req = (struct dlm_write_request *)parambuf;
 	struct dlm_ls_info *lsinfo = (struct dlm_ls_info *)ls;
-	int status;
-	int len;
+	struct lock_cache *c;
 
-	memset(req, 0, sizeof(*req));
-	set_version_v6(req);
+	if (ls == NULL) {
+		errno = ENOTCONN;
+		return -1;
+	}
 
-	req->cmd = DLM_USER_LOCK;
-	req->i.lock.mode = mode;
-	req->i.lock.flags = (flags & ~LKF_WAIT);
-	req->i.lock.lkid = lksb->sb_lkid;
-	req->i.lock.parent = parent;
-	req->i.lock.lksb = lksb;
-	req->i.lock.castaddr = astaddr;
-	req->i.lock.bastaddr = bastaddr;
-	req->i.lock.castparam = astarg;	/* same comp and blocking ast arg */
-	req->i.lock.bastparam = astarg;
+	c = lsinfo->cache;
+	if (c) {
+		lc_lock(c);
+		c->max = max;
+		c->idle_ms = idle_ms;
+		cache_expire(c, now_ms());
+		lc_unlock(c);
+		return 0;
+	}
 
-	if (xid)
-		req->i.lock.xid = *xid;
-	if (timeout)
-		req->i.lock.timeout = *timeout;
+	c = malloc(sizeof(struct lock_cache));
+	if (!c)
+		return -1;
+	memset(c, 0, sizeof(struct lock_cache));
+	c->lsinfo = lsinfo;
+	c->max = max;
+	c->idle_ms = idle_ms;
+#ifdef _REENTRANT
+	pthread_mutex_init(&c->mutex, NULL);
+#endif
+	__atomic_store_n(&lsinfo->cache, c, __ATOMIC_RELEASE);
+	return 0;
+}
 
-	if (flags & LKF_CONVERT) {
-		req->i.lock.namelen = 0;
-	} else {
-		if (namelen > DLM_RESNAME_MAXLEN) {
-			errno = EINVAL;
-			return -1;
-		}
-		req->i.lock.namelen = namelen;
-		memcpy(req->i.lock.name, name, namelen);
+int dlm_ls_cache_lock(dlm_lshandle_t ls, uint32_t mode, struct dlm_lksb *lksb,
+		      uint32_t flags, const void *name, unsigned int namelen)
+{
+	struct dlm_ls_info *lsinfo = (struct dlm_ls_info *)ls;
+	struct lock_cache *c;
+	struct cache_entry *ce;
+	int saved_errno;
+
+	if (ls == NULL) {
+		errno = ENOTCONN;
+		return -1;
 	}
 
-	if (flags & LKF_VALBLK) {
-		memcpy(req->i.lock.lvb, lksb->sb_lvbptr, DLM_LVB_LEN);
+	c = lsinfo->cache;
+	if (!c || !lksb || !namelen || namelen > DLM_RESNAME_MAXLEN ||
+	    mode > LKM_EXMODE ||
+	    (flags & (LKF_CONVERT | LKF_PERSISTENT | LKF_ORPHAN))) {
+		errno = EINVAL;
+		return -1;
 	}
 
-	len = sizeof(struct dlm_write_request) + namelen;
-	lksb->sb_status = EINPROG;
+	lc_lock(c);
+	ce = cache_find(c, name, namelen);
+	if (ce && ce->state == CACHE_BUSY) {
+		lc_unlock(c);
+		errno = EBUSY;
+		return -1;
+	}
 
-	if (flags & LKF_WAIT)
-		status = sync_write_v6(lsinfo, req, len);
-	else
-		status = write(lsinfo->fd, req, len);
+	if (ce) {
+		list_del(&c->idle, ce);
+		c->idle_count--;
+		c->stats.in_use++;
+		ce->state = CACHE_BUSY;
+
+		/* a value block is only read or written by a request */
+		if (ce->mode == mode && !(flags & LKF_VALBLK)) {
+			c->stats.hits++;
+			lc_unlock(c);
+			ce->lksb.sb_flags = 0;
+			goto out;
+		}
+		c->stats.converts++;
+		lc_unlock(c);
+
+		if (cache_request(c, ce, mode, flags | LKF_CONVERT, lksb) < 0) {
+			/* still granted in the old mode */
+			saved_errno = errno;
+			lksb->sb_status = ce->lksb.sb_status;
+			lc_lock(c);
+			cache_put(c, ce, now_ms());
+			lc_unlock(c);
+			errno = saved_errno;
+			return -1;
+		}
+		ce->mode = mode;
+		goto out;
+	}
 
-	if (status < 0)
+	ce = malloc(sizeof(struct cache_entry));
+	if (!ce) {
+		lc_unlock(c);
 		return -1;
+	}
+	memset(ce, 0, sizeof(struct cache_entry));
+	ce->cache = c;
+	ce->state = CACHE_BUSY;
+	ce->mode = mode;
+	ce->lksb.sb_lvbptr = ce->lvb;
+	ce->namelen = namelen;
+	memcpy(ce->name, name, namelen);
+
+	ce->next = c->hash[cache_hash_idx(name, namelen)];
+	c->hash[cache_hash_idx(name, namelen)] = ce;
+	c->stats.misses++;
+	c->stats.cached++;
+	c->stats.in_use++;
+	lc_unlock(c);
+
+	if (cache_request(c, ce, mode, flags, lksb) < 0) {
+		saved_errno = errno;
+		lksb->sb_status = ce->lksb.sb_status;
+		lc_lock(c);
+		cache_unhash(c, ce);
+		c->stats.cached--;
+		c->stats.in_use--;
+		lc_unlock(c);
+		free(ce);
+		errno = saved_errno;
+		return -1;
+	}
 
-	/*
-	 * the lock id is the return value from the write on the device
-	 */
-
-	if (status > 0)
-		lksb->sb_lkid = status;
+	lc_lock(c);
+	ce->lkid_next = c->lkid_hash[ce->lksb.sb_lkid % CACHE_HASH_SIZE];
+	c->lkid_hash[ce->lksb.sb_lkid % CACHE_HASH_SIZE] = ce;
+	lc_unlock(c);
+ out:
+	lksb->sb_lkid = ce->lksb.sb_lkid;
+	lksb->sb_flags = ce->lksb.sb_flags;
+	lksb->sb_status = 0;
 	return 0;
 }
 
-static int ls_lock(dlm_lshandle_t ls,
-		uint32_t mode,
-		struct dlm_lksb *lksb,
-		uint32_t flags,
-		const void *name,
-		unsigned int namelen,
-		uint32_t parent,
-		void (*astaddr) (void *astarg),
-		void *astarg,
-		void (*bastaddr) (void *astarg),
-		void *range)
+int dlm_ls_cache_unlock(dlm_lshandle_t ls, struct dlm_lksb *lksb,
+			uint32_t flags)
 {
-	/* no support for range locks */
-	if (range) {
-		errno = ENOSYS;
+	struct dlm_ls_info *lsinfo = (struct dlm_ls_info *)ls;
+	struct lock_cache *c;
+	struct cache_entry *ce;
+	int rv = 0;
+
+	if (ls == NULL) {
+		errno = ENOTCONN;
 		return -1;
 	}
 
-	if (flags & LKF_VALBLK && !lksb->sb_lvbptr) {
+	c = lsinfo->cache;
+	if (!c || !lksb) {
 		errno = EINVAL;
 		return -1;
 	}
 
-	if (kernel_version.version[0] == 5)
-		return ls_lock_v5(ls, mode, lksb, flags, name, namelen, parent,
-				  astaddr, astarg, bastaddr);
-	else
-		return ls_lock_v6(ls, mode, lksb, flags, name, namelen, parent,
-				  astaddr, astarg, bastaddr, NULL, NULL);
+	lc_lock(c);
+	ce = cache_find_lkid(c, lksb->sb_lkid);
+	if (!ce || ce->state != CACHE_BUSY) {
+		lc_unlock(c);
+		errno = ENOENT;
+		return -1;
+	}
+	lc_unlock(c);
+
+	/* write the value block with a conversion to the same mode */
+	if (flags & LKF_VALBLK)
+		rv = cache_request(c, ce, ce->mode, LKF_CONVERT | LKF_VALBLK,
+				   lksb);
+
+	lc_lock(c);
+	cache_put(c, ce, now_ms());
+	lc_unlock(c);
+
+	lksb->sb_status = rv ? errno : EUNLOCK;
+	return rv;
 }
 
-/*
- * Extended async locking in own lockspace
- */
-int dlm_ls_lockx(dlm_lshandle_t ls,
-		 uint32_t mode,
-		 struct dlm_lksb *lksb,
-		 uint32_t flags,
-		 const void *name,
-		 unsigned int namelen,
-		 uint32_t parent,
-		 void (*astaddr) (void *astarg),
-		 void *astarg,
-		 void (*bastaddr) (void *astarg),
-		 uint64_t *xid,
-		 uint64_t *timeout)
+int dlm_ls_cache_flush(dlm_lshandle_t ls)
 {
-	if (kernel_version.version[0] < 6) {
-		errno = ENOSYS;
+	struct dlm_ls_info *lsinfo = (struct dlm_ls_info *)ls;
+	struct lock_cache *c;
+	int count = 0;
+
+	if (ls == NULL) {
+		errno = ENOTCONN;
 		return -1;
 	}
 
-	return ls_lock_v6(ls, mode, lksb, flags, name, namelen, parent,
-			  astaddr, astarg, bastaddr, xid, timeout);
+	c = lsinfo->cache;
+	if (!c)
+		return 0;
+
+	lc_lock(c);
+	while (c->idle.first) {
+		cache_release(c, c->idle.first);
+		count++;
+	}
+	lc_unlock(c);
+
+	return count;
 }
 
-/*
- * Async locking in own lockspace
- */
-int dlm_ls_lock(dlm_lshandle_t ls,
-		uint32_t mode,
-		struct dlm_lksb *lksb,
-		uint32_t flags,
-		const void *name,
-		unsigned int namelen,
-		uint32_t parent,
-		void (*astaddr) (void *astarg),
-		void *astarg,
-		void (*bastaddr) (void *astarg),
-		void *range)
+int dlm_ls_cache_stats(dlm_lshandle_t ls, struct dlm_cache_stats *stats)
 {
-	return ls_lock(ls, mode, lksb, flags, name, namelen, parent,
-		       astaddr, astarg, bastaddr, range);
+	struct dlm_ls_info *lsinfo = (struct dlm_ls_info *)ls;
+	struct lock_cache *c;
+
+	if (ls == NULL) {
+		errno = ENOTCONN;
+		return -1;
+	}
+
+	c = lsinfo->cache;
+	if (!c) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	lc_lock(c);
+	memcpy(stats, &c->stats, sizeof(struct dlm_cache_stats));
+	lc_unlock(c);
+	return 0;
 }
 
-/*
- * Sync locking in own lockspace
- */
-int dlm_ls_lock_wait(dlm_lshandle_t ls,
-		     uint32_t mode,
-		     struct dlm_lksb *lksb,
-		     uint32_t flags,
-		     const void *name,
-		     unsigned int namelen,
-		     uint32_t parent,
-		     void *bastarg,
-		     void (*bastaddr) (void *bastarg),
-		     void *range)
+#ifdef _REENTRANT
+/* the recv thread's poll timeout, so idle locks expire without calls */
+static int cache_timeout(struct dlm_ls_info *lsinfo)
 {
-	return ls_lock(ls, mode, lksb, flags | LKF_WAIT, name, namelen, parent,
-		       NULL, bastarg, bastaddr, range);
+	struct lock_cache *c = __atomic_load_n(&lsinfo->cache,
+					       __ATOMIC_ACQUIRE);
+
+	if (!c || c->idle_ms <= 0)
+		return -1;
+	return c->idle_ms;
 }
 
-/*
- * Async locking in the default lockspace
- */
-int dlm_lock(uint32_t mode,
-	     struct dlm_lksb *lksb,
-	     uint32_t flags,
-	     const void *name,
-	     unsigned int namelen,
-	     uint32_t parent,
-	     void (*astaddr) (void *astarg),
-	     void *astarg,
-	     void (*bastaddr) (void *astarg),
-	     void *range)
+static void expire_lock_cache(struct dlm_ls_info *lsinfo)
 {
-	if (open_default_lockspace())
-		return -1;
+	struct lock_cache *c = __atomic_load_n(&lsinfo->cache,
+					       __ATOMIC_ACQUIRE);
 
-	return ls_lock(default_ls, mode, lksb, flags, name, namelen, parent,
-		       astaddr, astarg, bastaddr, range);
+	if (!c)
+		return;
+
+	lc_lock(c);
+	cache_expire(c, now_ms());
+	lc_unlock(c);
 }
+#endif
 
-/*
- * Sync locking in the default lockspace
- */
-int dlm_lock_wait(uint32_t mode,
-		     struct dlm_lksb *lksb,
-		     uint32_t flags,
-		     const void *name,
-		     unsigned int namelen,
-		     uint32_t parent,
-		     void *bastarg,
-		     void (*bastaddr) (void *bastarg),
-		     void *range)
+/* the locks themselves go when the lockspace fd is closed */
+static void free_lock_cache(struct dlm_ls_info *lsinfo)
 {
-	if (open_default_lockspace())
-		return -1;
+	struct lock_cache *c = lsinfo->cache;
+	struct cache_entry *ce;
+	int i;
 
-	return ls_lock(default_ls, mode, lksb, flags | LKF_WAIT, name, namelen,
-		       parent, NULL, bastarg, bastaddr, range);
-}
+	if (!c)
+		return;
+
+	for (i = 0; i < CACHE_HASH_SIZE; i++) {
+		while ((ce = c->hash[i])) {
+			c->hash[i] = ce->next;
+			free(ce);
+		}
+	}
+
+	while ((ce = c->release.first)) {
+		c->release.first = ce->list_next;
+		free(ce);
+	}
 
+#ifdef _REENTRANT
+	pthread_mutex_destroy(&c->mutex);
+#endif
+	free(c);
+	lsinfo->cache = NULL;
+}
 
 /*
- * Unlock
- * All the ways to unlock/cancel a lock
+ * Resource handles
+ *
+ * A handle holds an NL lock on its resource for as long as it is in use,
+ * so dlm_ls_resource_lock() and dlm_ls_resource_unlock() are conversions
+ * of that lock, and the kernel does not look up the name or the master
+ * again.  Handles are interned: getting a name again takes a reference to
+ * the same handle.
  */
 
-static int ls_unlock_v5(struct dlm_ls_info *lsinfo, uint32_t lkid,
-			uint32_t flags, struct dlm_lksb *lksb, void *astarg)
+#define RES_HASH_SIZE	256
+
+struct dlm_resource {
+	struct dlm_resource *next;
+	struct dlm_ls_info *lsinfo;
+	int refcount;
+	struct dlm_lksb lksb;
+	unsigned int namelen;
+	char name[DLM_RESNAME_MAXLEN];
+};
+
+struct resource_table {
+	struct dlm_resource *hash[RES_HASH_SIZE];
+};
+
+#ifdef _REENTRANT
+static pthread_mutex_t res_mutex = PTHREAD_MUTEX_INITIALIZER;
+#define res_lock()	pthread_mutex_lock(&res_mutex)
+#define res_unlock()	pthread_mutex_unlock(&res_mutex)
+#else
+#define res_lock()	do { } while (0)
+#define res_unlock()	do { } while (0)
+#endif
+
+static unsigned int res_hash_idx(const char *name, unsigned int namelen)
 {
-	struct dlm_write_request_v5 req;
+	unsigned int i, h = 5381;
 
-	set_version_v5(&req);
-	req.cmd = DLM_USER_UNLOCK;
-	req.i.lock.lkid = lkid;
-	req.i.lock.flags = (flags & ~LKF_WAIT);
-	req.i.lock.lksb  = lksb;
-	req.i.lock.castparam = astarg;
-	/* DLM_USER_UNLOCK will default to existing completion AST */
-	req.i.lock.castaddr = 0;
-	lksb->sb_status = EINPROG;
+	for (i = 0; i < namelen; i++)
+		h = h * 33 + (unsigned char)name[i];
+	return h % RES_HASH_SIZE;
+}
 
-	if (flags & LKF_WAIT)
-		return sync_write_v5(lsinfo, &req, sizeof(req));
-	else
-		return write(lsinfo->fd, &req, sizeof(req));
+/* res_lock must be held */
+static struct dlm_resource *res_find(struct resource_table *rt,
+				     const char *name, unsigned int namelen)
+{
+	struct dlm_resource *res;
+
+	for (res = rt->hash[res_hash_idx(name, namelen)]; res;
+	     res = res->next) {
+		if (res->namelen == namelen && !memcmp(res->name, name, namelen))
+			return res;
+	}
+	return NULL;
 }
 
-static int ls_unlock_v6(struct dlm_ls_info *lsinfo, uint32_t lkid,
-			uint32_t flags, struct dlm_lksb *lksb, void *astarg)
+/* a synchronous request on the handle's lock, -1 if it failed */
+static int res_request(struct dlm_resource *res, uint32_t mode, uint32_t flags,
+		       void (*bastaddr) (void *bastarg), void *bastarg)
 {
-	struct dlm_write_request req;
+	struct dlm_lksb *lksb = &res->lksb;
 
-	set_version_v6(&req);
-	req.cmd = DLM_USER_UNLOCK;
-	req.i.lock.lkid = lkid;
-	req.i.lock.flags = (flags & ~LKF_WAIT);
-	req.i.lock.lksb  = lksb;
-	req.i.lock.namelen = 0;
-	req.i.lock.castparam = astarg;
-	/* DLM_USER_UNLOCK will default to existing completion AST */
-	req.i.lock.castaddr = 0;
-	lksb->sb_status = EINPROG;
+	if (dlm_ls_lock_wait((dlm_lshandle_t)res->lsinfo, mode, lksb, flags,
+			     res->name, res->namelen, 0, bastarg, bastaddr,
+			     NULL))
+		return -1;
 
-	if (flags & LKF_WAIT)
-		return sync_write_v6(lsinfo, &req, sizeof(req));
-	else
-		return write(lsinfo->fd, &req, sizeof(req));
+	if (lksb->sb_status) {
+		errno = lksb->sb_status;
+		return -1;
+	}
+	return 0;
 }
 
-int dlm_ls_unlock(dlm_lshandle_t ls, uint32_t lkid, uint32_t flags,
-		  struct dlm_lksb *lksb, void *astarg)
+dlm_reshandle_t dlm_ls_resource_get(dlm_lshandle_t ls, const void *name,
+				    unsigned int namelen)
 {
 	struct dlm_ls_info *lsinfo = (struct dlm_ls_info *)ls;
-	int status;
+	struct resource_table *rt;
+	struct dlm_resource *res, *found;
+	unsigned int idx;
 
 	if (ls == NULL) {
 		errno = ENOTCONN;
-		return -1;
+		return NULL;
 	}
 
-	if (!lkid) {
+	if (!name || !namelen || namelen > DLM_RESNAME_MAXLEN) {
+		errno = EINVAL;
+		return NULL;
+	}
+
+	res_lock();
+	if (!lsinfo->resources) {
+		rt = malloc(sizeof(struct resource_table));
+		if (!rt) {
+			res_unlock();
+			return NULL;
+		}
+		memset(rt, 0, sizeof(struct resource_table));
+		lsinfo->resources = rt;
+	}
+
+	found = res_find(lsinfo->resources, name, namelen);
+	if (found) {
+		found->refcount++;
+		res_unlock();
+		return (dlm_reshandle_t)found;
+	}
+	res_unlock();
+
+	res = malloc(sizeof(struct dlm_resource));
+	if (!res)
+		return NULL;
+	memset(res, 0, sizeof(struct dlm_resource));
+	res->lsinfo = lsinfo;
+	res->refcount = 1;
+	res->namelen = namelen;
+	memcpy(res->name, name, namelen);
+
+	/* an NL lock is granted at once, but not while holding res_mutex */
+	if (res_request(res, LKM_NLMODE, LKF_EXPEDITE, NULL, NULL)) {
+		free(res);
+		return NULL;
+	}
+
+	res_lock();
+	found = res_find(lsinfo->resources, name, namelen);
+	if (found) {
+		/* another thread got there first */
+		found->refcount++;
+		res_unlock();
+		dlm_ls_unlock_wait(ls, res->lksb.sb_lkid, 0, &res->lksb);
+		free(res);
+		return (dlm_reshandle_t)found;
+	}
+	idx = res_hash_idx(name, namelen);
+	res->next = lsinfo->resources->hash[idx];
+	lsinfo->resources->hash[idx] = res;
+	res_unlock();
+
+	return (dlm_reshandle_t)res;
+}
+
+int dlm_ls_resource_put(dlm_reshandle_t rh)
+{
+	struct dlm_resource *res = (struct dlm_resource *)rh;
+	struct dlm_resource **pp;
+	struct resource_table *rt;
+	int rv;
+
+	if (!res) {
 		errno = EINVAL;
 		return -1;
 	}
 
-	if (kernel_version.version[0] == 5)
-		status = ls_unlock_v5(lsinfo, lkid, flags, lksb, astarg);
-	else
-		status = ls_unlock_v6(lsinfo, lkid, flags, lksb, astarg);
+	res_lock();
+	if (--res->refcount) {
+		res_unlock();
+		return 0;
+	}
 
-	if (status < 0)
+	rt = res->lsinfo->resources;
+	for (pp = &rt->hash[res_hash_idx(res->name, res->namelen)]; *pp;
+	     pp = &(*pp)->next) {
+		if (*pp == res) {
+			*pp = res->next;
+			break;
+		}
+	}
+	res_unlock();
+
+	rv = dlm_ls_unlock_wait((dlm_lshandle_t)res->lsinfo, res->lksb.sb_lkid,
+				0, &res->lksb);
+	free(res);
+	return rv;
+}
+
+int dlm_ls_resource_lock(dlm_reshandle_t rh, uint32_t mode, uint32_t flags,
+			 void (*bastaddr) (void *bastarg), void *bastarg)
+{
+	struct dlm_resource *res = (struct dlm_resource *)rh;
+
+	if (!res || (flags & (LKF_PERSISTENT | LKF_ORPHAN))) {
+		errno = EINVAL;
 		return -1;
-	return 0;
+	}
+
+	return res_request(res, mode, flags | LKF_CONVERT, bastaddr, bastarg);
 }
 
-int dlm_ls_unlock_wait(dlm_lshandle_t ls, uint32_t lkid, uint32_t flags,
-		       struct dlm_lksb *lksb)
+int dlm_ls_resource_unlock(dlm_reshandle_t rh, uint32_t flags)
 {
-	return dlm_ls_unlock(ls, lkid, flags | LKF_WAIT, lksb, NULL);
+	struct dlm_resource *res = (struct dlm_resource *)rh;
+
+	if (!res) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	return res_request(res, LKM_NLMODE,
+			   LKF_CONVERT | (flags & (LKF_VALBLK | LKF_IVVALBLK)),
+			   NULL, NULL);
 }
 
-int dlm_unlock_wait(uint32_t lkid, uint32_t flags, struct dlm_lksb *lksb)
+struct dlm_lksb *dlm_ls_resource_lksb(dlm_reshandle_t rh)
 {
-	return dlm_ls_unlock_wait(default_ls, lkid, flags | LKF_WAIT, lksb);
+	struct dlm_resource *res = (struct dlm_resource *)rh;
+
+	return res ? &res->lksb : NULL;
 }
 
-int dlm_unlock(uint32_t lkid, uint32_t flags, struct dlm_lksb *lksb,
-	       void *astarg)
+/* the locks go when the lockspace fd is closed */
+static void free_resources(struct dlm_ls_info *lsinfo)
 {
-	return dlm_ls_unlock(default_ls, lkid, flags, lksb, astarg);
+	struct resource_table *rt = lsinfo->resources;
+	struct dlm_resource *res;
+	int i;
+
+	if (!rt)
+		return;
+
+	for (i = 0; i < RES_HASH_SIZE; i++) {
+		while ((res = rt->hash[i])) {
+			rt->hash[i] = res->next;
+			free(res);
+		}
+	}
+	free(rt);
+	lsinfo->resources = NULL;
 }
 
 int dlm_ls_deadlock_cancel(dlm_lshandle_t ls, uint32_t lkid, uint32_t flags)
@@ -1095,7 +3030,7 @@ int dlm_ls_deadlock_cancel(dlm_lshandle_t ls, uint32_t lkid, uint32_t flags)
 	req.i.lock.lkid = lkid;
 	req.i.lock.flags = flags;
 
-	return write(lsinfo->fd, &req, sizeof(req));
+	return ls_write(lsinfo, &req, sizeof(req));
 }
 
 
@@ -1125,7 +3060,7 @@ int dlm_ls_purge(dlm_lshandle_t ls, int nodeid, int pid)
 	req.i.purge.nodeid = nodeid;
 	req.i.purge.pid = pid;
 
-	status = write(lsinfo->fd, &req, sizeof(req));
+	status = ls_write(lsinfo, &req, sizeof(req));
 
 	if (status < 0)
 		return -1;
@@ -1154,14 +3089,17 @@ int dlm_get_fd(void)
 
 int dlm_dispatch(int fd)
 {
+    struct completion_ring *ring;
     int status;
     int fdflags;
 
+    ring = find_ring(fd);
+
     fdflags = fcntl(fd, F_GETFL, 0);
     fcntl(fd, F_SETFL,  fdflags | O_NONBLOCK);
     do
     {
-	status = do_dlm_dispatch(fd);
+	status = do_dlm_dispatch(fd, ring);
     } while (status == 0);
 
     /* EAGAIN is not an error */
@@ -1172,6 +3110,26 @@ int dlm_dispatch(int fd)
     return status;
 }
 
+/* Delivers pending asts for a lockspace in one call, leaves the fd
+   non-blocking */
+int dlm_ls_dispatch_batch(dlm_lshandle_t lockspace, int max, int timeout)
+{
+    struct dlm_ls_info *lsinfo = (struct dlm_ls_info *)lockspace;
+    int fdflags;
+
+    if (lockspace == NULL || max < 0)
+    {
+	errno = EINVAL;
+	return -1;
+    }
+
+    fdflags = fcntl(lsinfo->fd, F_GETFL, 0);
+    if (!(fdflags & O_NONBLOCK))
+	fcntl(lsinfo->fd, F_SETFL, fdflags | O_NONBLOCK);
+
+    return do_dlm_dispatch_batch(lsinfo->fd, lsinfo->ring, max, timeout);
+}
+
 /* Converts a lockspace handle into a file descriptor */
 int dlm_ls_get_fd(dlm_lshandle_t lockspace)
 {
@@ -1184,9 +3142,17 @@ int dlm_ls_get_fd(dlm_lshandle_t lockspace)
 static void *dlm_recv_thread(void *lsinfo)
 {
 	struct dlm_ls_info *lsi = lsinfo;
+	int fdflags;
+
+	/* drain each burst of results without blocking, then poll */
+	fdflags = fcntl(lsi->fd, F_GETFL, 0);
+	fcntl(lsi->fd, F_SETFL, fdflags | O_NONBLOCK);
 
-	for (;;)
-		do_dlm_dispatch(lsi->fd);
+	for (;;) {
+		do_dlm_dispatch_batch(lsi->fd, lsi->ring, RECV_BATCH,
+				      cache_timeout(lsi));
+		expire_lock_cache(lsi);
+	}
 
 	return NULL;
 }
@@ -1228,6 +3194,295 @@ int dlm_ls_pthread_init(dlm_lshandle_t ls)
 
     return pthread_create(&lsinfo->tid, NULL, dlm_recv_thread, (void *)ls);
 }
+
+/*
+ * AST delivery pool
+ *
+ * One reader thread takes results from the device and queues each on a
+ * worker chosen by hashing the lock id, so results for one lock are
+ * delivered in order, by one worker, while results for different locks
+ * run in parallel.  Completions for the synchronous calls only wake the
+ * caller, so the reader delivers those itself; a worker's AST can then
+ * make synchronous calls without waiting on its own queue.
+ */
+
+#define AST_POOL_MAX	64
+#define AST_POOL_ENTRIES	16	/* preallocated per worker */
+
+struct ast_entry {
+	struct ast_entry *next;
+	char buf[sizeof(struct dlm_lock_result) + DLM_USER_LVB_LEN];
+};
+
+struct ast_worker {
+	pthread_t tid;
+	pthread_mutex_t mutex;
+	pthread_cond_t cond;
+	struct ast_entry *head;
+	struct ast_entry *tail;
+	struct ast_pool *pool;
+};
+
+struct ast_pool {
+	struct dlm_ls_info *lsinfo;
+	int count;
+	pthread_mutex_t free_mutex;
+	pthread_cond_t free_cond;
+	struct ast_entry *free_list;
+	struct ast_worker workers[AST_POOL_MAX];
+};
+
+static void unlock_free(void *arg)
+{
+	struct ast_pool *pool = arg;
+
+	pthread_mutex_unlock(&pool->free_mutex);
+}
+
+/* If the free list is empty and malloc fails, the preallocated entries are
+   all queued on workers, so wait for one to be returned; results are left
+   in the device meanwhile. */
+static struct ast_entry *get_ast_entry(struct ast_pool *pool)
+{
+	struct ast_entry *ae;
+
+	pthread_mutex_lock(&pool->free_mutex);
+	ae = pool->free_list;
+	if (ae)
+		pool->free_list = ae->next;
+	pthread_mutex_unlock(&pool->free_mutex);
+	if (ae)
+		return ae;
+
+	ae = malloc(sizeof(struct ast_entry));
+	if (ae)
+		return ae;
+
+	pthread_mutex_lock(&pool->free_mutex);
+	pthread_cleanup_push(unlock_free, pool);
+	while (!pool->free_list)
+		pthread_cond_wait(&pool->free_cond, &pool->free_mutex);
+	ae = pool->free_list;
+	pool->free_list = ae->next;
+	pthread_cleanup_pop(1);
+	return ae;
+}
+
+/* return a chain of entries, first to last, to the free list */
+static void put_ast_entries(struct ast_pool *pool, struct ast_entry *first,
+			    struct ast_entry *last)
+{
+	int was_empty;
+
+	pthread_mutex_lock(&pool->free_mutex);
+	was_empty = !pool->free_list;
+	last->next = pool->free_list;
+	pool->free_list = first;
+	pthread_mutex_unlock(&pool->free_mutex);
+
+	if (was_empty)
+		pthread_cond_signal(&pool->free_cond);
+}
+
+static void queue_ast_entry(struct ast_worker *w, struct ast_entry *ae)
+{
+	int was_empty;
+
+	ae->next = NULL;
+
+	pthread_mutex_lock(&w->mutex);
+	was_empty = !w->head;
+	if (w->tail)
+		w->tail->next = ae;
+	else
+		w->head = ae;
+	w->tail = ae;
+	pthread_mutex_unlock(&w->mutex);
+
+	if (was_empty)
+		pthread_cond_signal(&w->cond);
+}
+
+static void unlock_worker(void *arg)
+{
+	struct ast_worker *w = arg;
+
+	pthread_mutex_unlock(&w->mutex);
+}
+
+static void *ast_worker_thread(void *arg)
+{
+	struct ast_worker *w = arg;
+	struct ast_entry *list, *ae, *last;
+
+	worker_pool = w->pool;
+
+	for (;;) {
+		pthread_mutex_lock(&w->mutex);
+		pthread_cleanup_push(unlock_worker, w);
+		while (!w->head)
+			pthread_cond_wait(&w->cond, &w->mutex);
+		list = w->head;
+		w->head = NULL;
+		w->tail = NULL;
+		pthread_cleanup_pop(1);
+
+		last = NULL;
+		for (ae = list; ae; ae = ae->next) {
+			deliver_result_v6((struct dlm_lock_result *)ae->buf,
+					  w->pool->lsinfo->ring);
+			last = ae;
+		}
+		put_ast_entries(w->pool, list, last);
+	}
+
+	return NULL;
+}
+
+static void *dlm_pool_recv_thread(void *lsinfo)
+{
+	struct dlm_ls_info *lsi = lsinfo;
+	struct ast_pool *pool = lsi->pool;
+	struct dlm_lock_result *result;
+	struct ast_entry *ae;
+	uintptr_t key;
+	int rv;
+
+	for (;;) {
+		ae = get_ast_entry(pool);
+
+		rv = read_result(lsi->fd, ae->buf, sizeof(ae->buf));
+		if (rv <= 0) {
+			put_ast_entries(pool, ae, ae);
+			if (rv < 0)
+				wait_dlm_result(lsi->fd);
+			continue;
+		}
+
+		result = (struct dlm_lock_result *)ae->buf;
+
+		if (lsi->stats)
+			stats_result(lsi->stats, result);
+
+		if (result->user_astaddr == sync_ast_routine) {
+			deliver_result_v6(result, lsi->ring);
+			put_ast_entries(pool, ae, ae);
+			continue;
+		}
+
+		key = result->lksb.sb_lkid;
+		if (!key)
+			key = (uintptr_t)result->user_lksb;
+
+		queue_ast_entry(&pool->workers[key % pool->count], ae);
+	}
+
+	return NULL;
+}
+
+static void free_ast_pool(struct ast_pool *pool)
+{
+	struct ast_worker *w;
+	struct ast_entry *ae;
+	int i;
+
+	for (i = 0; i < pool->count; i++) {
+		w = &pool->workers[i];
+		if (!pthread_cancel(w->tid))
+			pthread_join(w->tid, NULL);
+
+		while ((ae = w->head)) {
+			w->head = ae->next;
+			free(ae);
+		}
+		pthread_cond_destroy(&w->cond);
+		pthread_mutex_destroy(&w->mutex);
+	}
+
+	while ((ae = pool->free_list)) {
+		pool->free_list = ae->next;
+		free(ae);
+	}
+	pthread_cond_destroy(&pool->free_cond);
+	pthread_mutex_destroy(&pool->free_mutex);
+	free(pool);
+}
+
+/* Like dlm_ls_pthread_init, but ASTs run in a pool of nthreads workers */
+int dlm_ls_pthread_init_pool(dlm_lshandle_t ls, int nthreads)
+{
+    struct dlm_ls_info *lsinfo = (struct dlm_ls_info *)ls;
+    struct ast_pool *pool;
+    struct ast_worker *w;
+    struct ast_entry *ae;
+    int i, rv;
+
+    if (lsinfo->tid)
+    {
+	errno = EEXIST;
+	return -1;
+    }
+
+    if (nthreads < 1 || nthreads > AST_POOL_MAX)
+    {
+	errno = EINVAL;
+	return -1;
+    }
+
+    /* v5 results are variable length, keep those on one thread */
+    if (kernel_version.version[0] == 5)
+	return dlm_ls_pthread_init(ls);
+
+    pool = malloc(sizeof(struct ast_pool));
+    if (!pool)
+	return -1;
+    memset(pool, 0, sizeof(struct ast_pool));
+    pool->lsinfo = lsinfo;
+    pthread_mutex_init(&pool->free_mutex, NULL);
+    pthread_cond_init(&pool->free_cond, NULL);
+
+    for (i = 0; i < nthreads * AST_POOL_ENTRIES; i++)
+    {
+	ae = malloc(sizeof(struct ast_entry));
+	if (!ae)
+	{
+	    free_ast_pool(pool);
+	    return -1;
+	}
+	ae->next = pool->free_list;
+	pool->free_list = ae;
+    }
+
+    for (i = 0; i < nthreads; i++)
+    {
+	w = &pool->workers[i];
+	w->pool = pool;
+	pthread_mutex_init(&w->mutex, NULL);
+	pthread_cond_init(&w->cond, NULL);
+
+	rv = pthread_create(&w->tid, NULL, ast_worker_thread, w);
+	if (rv)
+	{
+	    free_ast_pool(pool);
+	    errno = rv;
+	    return -1;
+	}
+	pool->count++;
+    }
+
+    lsinfo->pool = pool;
+
+    rv = pthread_create(&lsinfo->tid, NULL, dlm_pool_recv_thread, lsinfo);
+    if (rv)
+    {
+	lsinfo->pool = NULL;
+	lsinfo->tid = 0;
+	free_ast_pool(pool);
+	errno = rv;
+	return -1;
+    }
+    return 0;
+}
 #endif
 
 /*
@@ -1299,6 +3554,21 @@ static dlm_lshandle_t create_lockspace(const char *name, mode_t mode,
 	if (!newls)
 		return NULL;
 
+	newls->tid = 0;
+	newls->pool = NULL;
+	newls->ring = NULL;
+	newls->cache = NULL;
+	newls->resources = NULL;
+	newls->stats = NULL;
+	newls->lb = NULL;
+
+	if (loopback) {
+		newls->lb = lb_open(name, 1, &newls->fd);
+		if (!newls->lb)
+			goto fail;
+		return (dlm_lshandle_t)newls;
+	}
+
 	ls_dev_name(name, dev_path, sizeof(dev_path));
 
 	if (kernel_version.version[0] == 5)
@@ -1332,7 +3602,6 @@ static dlm_lshandle_t create_lockspace(const char *name, mode_t mode,
 		goto fail;
 	if (mode)
 		fchmod(newls->fd, mode);
-	newls->tid = 0;
 	fcntl(newls->fd, F_SETFD, 1);
 	return (dlm_lshandle_t)newls;
 
@@ -1393,6 +3662,14 @@ int dlm_release_lockspace(const char *name, dlm_lshandle_t ls, int force)
 	uint32_t flags = 0;
 	int fd, is_symlink = 0;
 
+	if (loopback && lsinfo->lb) {
+		/* lsinfo is still the caller's if the lockspace is busy */
+		if (lb_release(lsinfo->lb, force))
+			return -1;
+		ls_pthread_cleanup(lsinfo);
+		return 0;
+	}
+
 	ls_dev_name(name, dev_path, sizeof(dev_path));
 	if (!lstat(dev_path, &st) && S_ISLNK(st.st_mode))
 		is_symlink = 1;
@@ -1453,6 +3730,24 @@ dlm_lshandle_t dlm_open_lockspace(const char *name)
 		return NULL;
 
 	newls->tid = 0;
+	newls->pool = NULL;
+	newls->ring = NULL;
+	newls->cache = NULL;
+	newls->resources = NULL;
+	newls->stats = NULL;
+	newls->lb = NULL;
+
+	if (loopback) {
+		newls->lb = lb_open(name, 0, &newls->fd);
+		if (!newls->lb) {
+			saved_errno = errno;
+			free(newls);
+			errno = saved_errno;
+			return NULL;
+		}
+		return (dlm_lshandle_t)newls;
+	}
+
 	ls_dev_name(name, dev_name, sizeof(dev_name));
 
 	newls->fd = open(dev_name, O_RDWR);
@@ -134,6 +134,7 @@ extern int dlm_dispatch(int fd);
  */
 
 typedef void *dlm_lshandle_t;
+typedef void *dlm_reshandle_t;
 
 extern dlm_lshandle_t dlm_create_lockspace(const char *name, mode_t mode);
 extern int dlm_release_lockspace(const char *name, dlm_lshandle_t ls,
@@ -144,6 +145,35 @@ extern int dlm_ls_get_fd(dlm_lshandle_t ls);
 extern dlm_lshandle_t dlm_new_lockspace(const char *name, mode_t mode,
 		uint32_t flags);
 
+/*
+ * dlm_ls_dispatch_batch() - dispatches up to max (0 for all) pending asts and
+ *                           basts on a lockspace, waiting up to timeout ms
+ *                           (-1 forever, 0 not at all) if none are pending.
+ *                           Returns the number dispatched.  The lockspace fd
+ *                           is left non-blocking.
+ */
+
+extern int dlm_ls_dispatch_batch(dlm_lshandle_t ls, int max, int timeout);
+
+/*
+ * dlm_ls_completion_ring() - instead of calling asts for the lockspace,
+ *                            dispatch queues them in a ring of size entries
+ *                            and signals the returned eventfd.
+ * dlm_ls_get_completions() - takes up to max queued asts from the ring, for
+ *                            the application to run in its own thread.
+ */
+
+struct dlm_completion {
+	void (*astaddr) (void *astarg);	/* completion or blocking ast */
+	void *astarg;
+	struct dlm_lksb *lksb;
+	int bast_mode;			/* blocking ast mode, 0 for completion */
+};
+
+extern int dlm_ls_completion_ring(dlm_lshandle_t ls, unsigned int size);
+extern int dlm_ls_get_completions(dlm_lshandle_t ls,
+		struct dlm_completion *comps, int max);
+
 
 /*
  * Using your own lockspace
@@ -153,6 +183,10 @@ extern dlm_lshandle_t dlm_new_lockspace(const char *name, mode_t mode,
  * dlm_ls_unlock()
  * dlm_ls_lock_wait()
  * dlm_ls_unlock_wait()
+ * dlm_ls_lock_many()
+ * dlm_ls_unlock_many()
+ * dlm_ls_cache_lock()
+ * dlm_ls_cache_unlock()
  * dlm_ls_deadlock_cancel()
  * dlm_ls_purge()
  */
@@ -204,6 +238,140 @@ extern int dlm_ls_unlock_wait(dlm_lshandle_t lockspace,
 		uint32_t flags,
 		struct dlm_lksb *lksb);
 
+/*
+ * dlm_ls_lock_many() - submit an array of lock requests
+ * dlm_ls_unlock_many() - submit an array of unlocks, the lock id of each is
+ *                        taken from its lksb
+ *
+ * Each request still gets its own ast.  done(done_arg) is called once after
+ * the completion asts of all submitted requests have run; if done is NULL the
+ * call waits for them instead, which fails with EDEADLK in an ast pool worker
+ * of the lockspace.  With a completion ring, done is queued behind the asts
+ * of the batch with a NULL lksb.  Returns the number of requests submitted,
+ * which is less than count (with errno set) if one failed.
+ */
+
+struct dlm_lock_req {
+	uint32_t mode;
+	uint32_t flags;
+	const void *name;
+	unsigned int namelen;
+	struct dlm_lksb *lksb;
+	void (*astaddr) (void *astarg);
+	void *astarg;
+	void (*bastaddr) (void *astarg);
+};
+
+extern int dlm_ls_lock_many(dlm_lshandle_t lockspace,
+		struct dlm_lock_req *reqs,
+		int count,
+		void (*done) (void *arg),
+		void *done_arg);
+
+extern int dlm_ls_unlock_many(dlm_lshandle_t lockspace,
+		struct dlm_lock_req *reqs,
+		int count,
+		void (*done) (void *arg),
+		void *done_arg);
+
+/*
+ * dlm_ls_reset_stats() - start, or zero, the lockspace's statistics
+ * dlm_ls_get_stats() - copy them out
+ *
+ * Latencies are from submitting a request to reading its result, in log2
+ * histograms: bucket 0 counts results in under 1 usec, bucket n those in
+ * [2^(n-1), 2^n) usec, and the last bucket everything longer.  Requests and
+ * conversions are counted by the requested mode.
+ */
+
+#define DLM_STATS_BUCKETS	32
+
+struct dlm_ls_stats {
+	uint64_t request[6][DLM_STATS_BUCKETS];
+	uint64_t convert[6][DLM_STATS_BUCKETS];
+	uint64_t unlock[DLM_STATS_BUCKETS];
+	uint64_t count[3];		/* request, convert, unlock */
+	uint64_t total_usec[3];
+	uint64_t max_usec[3];
+	uint64_t basts;			/* blocking asts received */
+	uint64_t noqueue_fails;		/* NOQUEUE requests not granted */
+	uint64_t errors;		/* other failed requests */
+	uint64_t demoted;		/* DLM_SBF_DEMOTED results */
+	uint64_t valnotvalid;		/* DLM_SBF_VALNOTVALID results */
+	uint32_t in_flight;		/* requests not yet completed */
+};
+
+extern int dlm_ls_reset_stats(dlm_lshandle_t ls);
+extern int dlm_ls_get_stats(dlm_lshandle_t ls, struct dlm_ls_stats *stats);
+
+/*
+ * dlm_ls_cache_init() - cache locks in the lockspace, holding at most max
+ *                       idle locks for at most idle_ms each (0 no limit).
+ * dlm_ls_cache_lock() - synchronous lock that reuses a cached lock of the
+ *                       same resource, converting it if the mode differs.
+ * dlm_ls_cache_unlock() - return the lock to the cache; it is unlocked when
+ *                       a blocking ast arrives, it expires or is evicted.
+ *                       LKF_VALBLK writes the lksb's value block first.
+ * dlm_ls_cache_flush() - unlock all idle cached locks.
+ */
+
+struct dlm_cache_stats {
+	uint64_t hits;		/* reused with no request to the dlm */
+	uint64_t converts;	/* reused with a conversion */
+	uint64_t misses;	/* new lock */
+	uint64_t bast_releases;	/* unlocked for a blocking ast */
+	uint64_t idle_releases;	/* unlocked after idle_ms or to make room */
+	uint32_t cached;	/* locks held by the cache */
+	uint32_t in_use;	/* of those, locks taken by the application */
+};
+
+extern int dlm_ls_cache_init(dlm_lshandle_t lockspace,
+		unsigned int max,
+		int idle_ms);
+
+extern int dlm_ls_cache_lock(dlm_lshandle_t lockspace,
+		uint32_t mode,
+		struct dlm_lksb *lksb,
+		uint32_t flags,
+		const void *name,
+		unsigned int namelen);
+
+extern int dlm_ls_cache_unlock(dlm_lshandle_t lockspace,
+		struct dlm_lksb *lksb,
+		uint32_t flags);
+
+extern int dlm_ls_cache_flush(dlm_lshandle_t lockspace);
+
+extern int dlm_ls_cache_stats(dlm_lshandle_t lockspace,
+		struct dlm_cache_stats *stats);
+
+/*
+ * dlm_ls_resource_get() - returns a handle for the named resource that holds
+ *                         an NL lock on it; getting the same name again
+ *                         returns the same handle with another reference.
+ * dlm_ls_resource_put() - drops a reference, the last unlocks the resource.
+ * dlm_ls_resource_lock() - synchronously converts the handle's lock to mode.
+ * dlm_ls_resource_unlock() - synchronously converts it back to NL.
+ * dlm_ls_resource_lksb() - the handle's lksb, for the lock id and lvb.
+ */
+
+extern dlm_reshandle_t dlm_ls_resource_get(dlm_lshandle_t lockspace,
+		const void *name,
+		unsigned int namelen);
+
+extern int dlm_ls_resource_put(dlm_reshandle_t res);
+
+extern int dlm_ls_resource_lock(dlm_reshandle_t res,
+		uint32_t mode,
+		uint32_t flags,
+		void (*bastaddr) (void *bastarg),
+		void *bastarg);
+
+extern int dlm_ls_resource_unlock(dlm_reshandle_t res,
+		uint32_t flags);
+
+extern struct dlm_lksb *dlm_ls_resource_lksb(dlm_reshandle_t res);
+
 extern int dlm_ls_deadlock_cancel(dlm_lshandle_t ls,
 		uint32_t lkid,
 		uint32_t flags);
@@ -219,6 +387,9 @@ extern int dlm_ls_purge(dlm_lshandle_t lockspace,
  * dlm_pthread_init()
  * dlm_ls_pthread_init() - call this before any locking operations and the ASTs
  *                         will be delivered in their own thread.
+ * dlm_ls_pthread_init_pool() - as dlm_ls_pthread_init() but ASTs are delivered
+ *                         by nthreads worker threads.  ASTs for one lock are
+ *                         always delivered in order by the same worker.
  * dlm_pthread_cleanup() - call the cleanup routine at application exit
  *			   (optional) or, if the locking functions are in a
  *			   shared library that is to be unloaded.
@@ -230,6 +401,7 @@ extern int dlm_ls_purge(dlm_lshandle_t lockspace,
 #ifdef _REENTRANT
 extern int dlm_pthread_init(void);
 extern int dlm_ls_pthread_init(dlm_lshandle_t lockspace);
+extern int dlm_ls_pthread_init_pool(dlm_lshandle_t lockspace, int nthreads);
 extern int dlm_pthread_cleanup(void);
 #endif
 
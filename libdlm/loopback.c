@@ -0,0 +1,1119 @@
+/*
+ * Copyright 2026 The dlm authors.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ */
+
+/*
+ * In-process loopback backend
+ *
+ * With LIBDLM_BACKEND=loopback in the environment, libdlm does not use the
+ * kernel dlm.  Lockspaces live in this process, the requests libdlm would
+ * write to a lockspace device are carried out here, and results are queued
+ * on the handle and signalled on an eventfd (in semaphore mode, so it stays
+ * readable while results are queued) which stands in for the device fd.
+ *
+ * This follows the kernel's rules for a single node: the mode compatibility
+ * matrix, grant order with the convert and wait queues, NOQUEUE, QUECVT,
+ * EXPEDITE, NOORDER, HEADQUE, conversion deadlock (CONVDEADLK), lock value
+ * blocks, blocking asts, cancel and forced unlock, and orphans of
+ * PERSISTENT locks which can be adopted (ORPHAN) or purged.  ALTPR, ALTCW
+ * and TIMEOUT are ignored.
+ */
+
+#ifdef _REENTRANT
+#include <pthread.h>
+#endif
+#include <sys/types.h>
+#include <sys/eventfd.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <string.h>
+#include <linux/types.h>
+#include <linux/dlm.h>
+#define BUILDING_LIBDLM
+#include "libdlm.h"
+#include <linux/dlm_device.h>
+#include "loopback.h"
+
+#define LB_RSB_HASH	1024
+#define LB_LKB_HASH	1024
+
+#define LB_GRANTED	1
+#define LB_CONVERT	2
+#define LB_WAITING	3
+
+struct lb_lkb;
+struct lb_result;
+
+struct lb_queue {
+	struct lb_lkb *first;
+	struct lb_lkb *last;
+};
+
+struct lb_rsb {
+	struct lb_rsb *next;
+	struct lb_queue grant;
+	struct lb_queue convert;
+	struct lb_queue wait;
+	int lvb_set;
+	int lvb_invalid;
+	char lvb[DLM_USER_LVB_LEN];
+	unsigned int namelen;
+	char name[DLM_RESNAME_MAXLEN];
+};
+
+struct lb_lkb {
+	struct lb_lkb *hash_next;
+	struct lb_lkb *prev;
+	struct lb_lkb *next;
+	struct lb_rsb *rsb;
+	struct lb_handle *h;		/* NULL for an orphan */
+	uint32_t lkid;
+	pid_t pid;
+	int status;
+	int grmode;
+	int rqmode;
+	int highbast;
+	uint32_t exflags;
+	uint8_t sbflags;
+	void *castparam;
+	void *castaddr;
+	void *bastparam;
+	void *bastaddr;
+	struct dlm_lksb *user_lksb;
+	struct lb_result *spare;	/* reserve_results() */
+	struct lb_result *bast_spare;
+	char lvb[DLM_USER_LVB_LEN];
+};
+
+struct lb_space {
+	struct lb_space *next;
+	char name[DLM_LOCKSPACE_LEN + 1];
+	int create_count;
+	int handle_count;
+	uint32_t next_lkid;
+	struct lb_rsb *rsbs[LB_RSB_HASH];
+	struct lb_lkb *lkbs[LB_LKB_HASH];
+};
+
+struct lb_result {
+	struct lb_result *next;
+	struct dlm_lock_result res;
+	char lvb[DLM_USER_LVB_LEN];
+};
+
+struct lb_handle {
+	struct lb_handle *next;
+	struct lb_space *space;
+	int efd;
+	struct lb_result *first;
+	struct lb_result *last;
+};
+
+static struct lb_space *spaces;
+static struct lb_handle *handles;
+
+#ifdef _REENTRANT
+static pthread_mutex_t lb_mutex = PTHREAD_MUTEX_INITIALIZER;
+#define lb_lock()	pthread_mutex_lock(&lb_mutex)
+#define lb_unlock()	pthread_mutex_unlock(&lb_mutex)
+#else
+#define lb_lock()	do { } while (0)
+#define lb_unlock()	do { } while (0)
+#endif
+
+/* modes NL, CR, CW, PR, PW, EX */
+
+static const int lb_compat[6][6] = {
+	{ 1, 1, 1, 1, 1, 1 },
+	{ 1, 1, 1, 1, 1, 0 },
+	{ 1, 1, 1, 0, 0, 0 },
+	{ 1, 1, 0, 1, 0, 0 },
+	{ 1, 1, 0, 0, 0, 0 },
+	{ 1, 0, 0, 0, 0, 0 },
+};
+
+/*
+ * From the kernel: [grmode+1][rqmode+1], 1 reads the resource lvb into the
+ * lock, 0 writes the lock's lvb to the resource, -1 does neither.
+ */
+
+static const int lb_lvb_ops[7][7] = {
+	/* UN  NL  CR  CW  PR  PW  EX */
+	{  -1,  1,  1,  1,  1,  1,  1 },	/* UN */
+	{  -1,  1,  1,  1,  1,  1,  1 },	/* NL */
+	{  -1, -1,  1,  1,  1,  1,  1 },	/* CR */
+	{  -1, -1, -1,  1,  1,  1,  1 },	/* CW */
+	{  -1, -1, -1, -1,  1,  1,  1 },	/* PR */
+	{  -1,  0,  0,  0,  0,  0,  1 },	/* PW */
+	{  -1,  0,  0,  0,  0,  0,  0 },	/* EX */
+};
+
+int lb_enabled(void)
+{
+	const char *s = getenv("LIBDLM_BACKEND");
+
+	return s && !strcmp(s, "loopback");
+}
+
+static void queue_add(struct lb_queue *q, struct lb_lkb *lkb, int head)
+{
+	if (head) {
+		lkb->prev = NULL;
+		lkb->next = q->first;
+		if (q->first)
+			q->first->prev = lkb;
+		else
+			q->last = lkb;
+		q->first = lkb;
+	} else {
+		lkb->next = NULL;
+		lkb->prev = q->last;
+		if (q->last)
+			q->last->next = lkb;
+		else
+			q->first = lkb;
+		q->last = lkb;
+	}
+}
+
+static void queue_del(struct lb_queue *q, struct lb_lkb *lkb)
+{
+	if (lkb->prev)
+		lkb->prev->next = lkb->next;
+	else
+		q->first = lkb->next;
+	if (lkb->next)
+		lkb->next->prev = lkb->prev;
+	else
+		q->last = lkb->prev;
+	lkb->prev = NULL;
+	lkb->next = NULL;
+}
+
+static struct lb_queue *lkb_queue(struct lb_lkb *lkb)
+{
+	switch (lkb->status) {
+	case LB_GRANTED:
+		return &lkb->rsb->grant;
+	case LB_CONVERT:
+		return &lkb->rsb->convert;
+	default:
+		return &lkb->rsb->wait;
+	}
+}
+
+static void move_lkb(struct lb_lkb *lkb, int status, int head)
+{
+	if (lkb->status)
+		queue_del(lkb_queue(lkb), lkb);
+	lkb->status = status;
+	if (status)
+		queue_add(lkb_queue(lkb), lkb, head);
+}
+
+static unsigned int rsb_hash(const char *name, unsigned int namelen)
+{
+	unsigned int i, h = 5381;
+
+	for (i = 0; i < namelen; i++)
+		h = h * 33 + (unsigned char)name[i];
+	return h % LB_RSB_HASH;
+}
+
+static struct lb_rsb *find_rsb(struct lb_space *ls, const char *name,
+			       unsigned int namelen, int create)
+{
+	unsigned int i = rsb_hash(name, namelen);
+	struct lb_rsb *r;
+
+	for (r = ls->rsbs[i]; r; r = r->next) {
+		if (r->namelen == namelen && !memcmp(r->name, name, namelen))
+			return r;
+	}
+
+	if (!create)
+		return NULL;
+
+	r = malloc(sizeof(struct lb_rsb));
+	if (!r)
+		return NULL;
+	memset(r, 0, sizeof(struct lb_rsb));
+	memcpy(r->name, name, namelen);
+	r->namelen = namelen;
+	r->next = ls->rsbs[i];
+	ls->rsbs[i] = r;
+	return r;
+}
+
+/*
+ * Free the resource once it has no locks.  One that has had a value block
+ * written is kept, as the kernel keeps it cached, so the value survives
+ * until the lockspace goes away.
+ */
+static void put_rsb(struct lb_space *ls, struct lb_rsb *r)
+{
+	struct lb_rsb **pp;
+
+	if (r->grant.first || r->convert.first || r->wait.first)
+		return;
+	if (r->lvb_set)
+		return;
+
+	for (pp = &ls->rsbs[rsb_hash(r->name, r->namelen)]; *pp;
+	     pp = &(*pp)->next) {
+		if (*pp == r) {
+			*pp = r->next;
+			break;
+		}
+	}
+	free(r);
+}
+
+static struct lb_lkb *find_lkb(struct lb_space *ls, uint32_t lkid)
+{
+	struct lb_lkb *lkb;
+
+	for (lkb = ls->lkbs[lkid % LB_LKB_HASH]; lkb; lkb = lkb->hash_next) {
+		if (lkb->lkid == lkid)
+			return lkb;
+	}
+	return NULL;
+}
+
+static void free_spares(struct lb_lkb *lkb)
+{
+	struct lb_result *rs;
+
+	while ((rs = lkb->spare)) {
+		lkb->spare = rs->next;
+		free(rs);
+	}
+	free(lkb->bast_spare);
+	lkb->bast_spare = NULL;
+}
+
+static void free_lkb(struct lb_space *ls, struct lb_lkb *lkb)
+{
+	struct lb_lkb **pp;
+
+	move_lkb(lkb, 0, 0);
+
+	for (pp = &ls->lkbs[lkb->lkid % LB_LKB_HASH]; *pp;
+	     pp = &(*pp)->hash_next) {
+		if (*pp == lkb) {
+			*pp = lkb->hash_next;
+			break;
+		}
+	}
+	free_spares(lkb);
+	free(lkb);
+}
+
+/*
+ * Every request on a lock ends in one completion, so its result is
+ * allocated with the request, which fails with ENOMEM rather than losing
+ * the ast later.  One blocking ast is kept ready for a lock with a bast
+ * routine; more before the next request are sent if there is memory.
+ */
+
+static int reserve_results(struct lb_lkb *lkb, int bast)
+{
+	struct lb_result *rs;
+
+	rs = malloc(sizeof(struct lb_result));
+	if (!rs)
+		goto fail;
+
+	if (bast && !lkb->bast_spare) {
+		lkb->bast_spare = malloc(sizeof(struct lb_result));
+		if (!lkb->bast_spare) {
+			free(rs);
+			goto fail;
+		}
+	}
+
+	rs->next = lkb->spare;
+	lkb->spare = rs;
+	return 0;
+ fail:
+	errno = ENOMEM;
+	return -1;
+}
+
+/*
+ * Queue a completion (bast_mode 0) or blocking ast for the lock's handle,
+ * in the form the device returns from read.
+ */
+
+static void queue_result(struct lb_lkb *lkb, int status, int bast_mode)
+{
+	struct lb_handle *h = lkb->h;
+	struct lb_result *rs;
+	uint64_t one = 1;
+
+	if (!h)
+		return;
+	if (bast_mode && !lkb->bastaddr)
+		return;
+
+	if (bast_mode) {
+		rs = lkb->bast_spare;
+		lkb->bast_spare = NULL;
+	} else {
+		rs = lkb->spare;
+		if (rs)
+			lkb->spare = rs->next;
+	}
+	if (!rs)
+		rs = malloc(sizeof(struct lb_result));
+	if (!rs)
+		return;
+	memset(rs, 0, sizeof(struct lb_result));
+
+	rs->res.version[0] = DLM_DEVICE_VERSION_MAJOR;
+	rs->res.version[1] = DLM_DEVICE_VERSION_MINOR;
+	rs->res.version[2] = DLM_DEVICE_VERSION_PATCH;
+	rs->res.length = sizeof(struct dlm_lock_result);
+	rs->res.user_lksb = lkb->user_lksb;
+	rs->res.lksb.sb_lkid = lkb->lkid;
+	rs->res.bast_mode = bast_mode;
+
+	if (bast_mode) {
+		rs->res.user_astaddr = lkb->bastaddr;
+		rs->res.user_astparam = lkb->bastparam;
+	} else {
+		rs->res.user_astaddr = lkb->castaddr;
+		rs->res.user_astparam = lkb->castparam;
+		rs->res.lksb.sb_status = status;
+		rs->res.lksb.sb_flags = lkb->sbflags;
+
+		if (lkb->exflags & LKF_VALBLK) {
+			memcpy(rs->lvb, lkb->lvb, DLM_USER_LVB_LEN);
+			rs->res.lvb_offset = sizeof(struct dlm_lock_result);
+			rs->res.length += DLM_USER_LVB_LEN;
+		}
+	}
+
+	if (h->last)
+		h->last->next = rs;
+	else
+		h->first = rs;
+	h->last = rs;
+
+	if (write(h->efd, &one, sizeof(one)) < 0)
+		return;
+}
+
+static void set_lvb_lock(struct lb_rsb *r, struct lb_lkb *lkb)
+{
+	int b;
+
+	if (!(lkb->exflags & LKF_VALBLK))
+		return;
+
+	b = lb_lvb_ops[lkb->grmode + 1][lkb->rqmode + 1];
+
+	if (b == 1) {
+		memcpy(lkb->lvb, r->lvb, DLM_USER_LVB_LEN);
+		if (r->lvb_invalid)
+			lkb->sbflags |= DLM_SBF_VALNOTVALID;
+	} else if (!b) {
+		memcpy(r->lvb, lkb->lvb, DLM_USER_LVB_LEN);
+		r->lvb_set = 1;
+		r->lvb_invalid = 0;
+	}
+
+	if (lkb->exflags & LKF_IVVALBLK)
+		r->lvb_invalid = 1;
+}
+
+static void set_lvb_unlock(struct lb_rsb *r, struct lb_lkb *lkb)
+{
+	if (lkb->grmode < LKM_PWMODE)
+		return;
+
+	if (lkb->exflags & LKF_VALBLK) {
+		memcpy(r->lvb, lkb->lvb, DLM_USER_LVB_LEN);
+		r->lvb_set = 1;
+		r->lvb_invalid = 0;
+	}
+
+	if (lkb->exflags & LKF_IVVALBLK)
+		r->lvb_invalid = 1;
+}
+
+/* no lock on q other than lkb holds a mode incompatible with mode */
+static int queue_compat(struct lb_queue *q, struct lb_lkb *lkb, int mode)
+{
+	struct lb_lkb *x;
+
+	for (x = q->first; x; x = x->next) {
+		if (x != lkb && !lb_compat[x->grmode][mode])
+			return 0;
+	}
+	return 1;
+}
+
+/* now is set for a new request or conversion, clear when regranting */
+static int can_be_granted(struct lb_rsb *r, struct lb_lkb *lkb, int now)
+{
+	int conv = (lkb->grmode != -1);
+
+	if (!queue_compat(&r->grant, lkb, lkb->rqmode) ||
+	    !queue_compat(&r->convert, lkb, lkb->rqmode))
+		return 0;
+
+	if (conv) {
+		if ((lkb->exflags & LKF_QUECVT) && r->convert.first &&
+		    r->convert.first != lkb)
+			return 0;
+		return 1;
+	}
+
+	if (lkb->rqmode == LKM_NLMODE && (lkb->exflags & LKF_EXPEDITE))
+		return 1;
+
+	if (lkb->exflags & LKF_NOORDER)
+		return 1;
+
+	if (r->convert.first)
+		return 0;
+
+	if (now)
+		return !r->wait.first;
+
+	return r->wait.first == lkb;
+}
+
+static void grant_lkb(struct lb_rsb *r, struct lb_lkb *lkb)
+{
+	set_lvb_lock(r, lkb);
+	lkb->grmode = lkb->rqmode;
+	lkb->rqmode = -1;
+	lkb->highbast = 0;
+	move_lkb(lkb, LB_GRANTED, 0);
+	queue_result(lkb, 0, 0);
+}
+
+/* blocking asts to the holders of modes that keep lkb from being granted */
+static void send_basts(struct lb_rsb *r, struct lb_lkb *lkb)
+{
+	struct lb_queue *qs[2] = { &r->grant, &r->convert };
+	struct lb_lkb *x;
+	int i;
+
+	for (i = 0; i < 2; i++) {
+		for (x = qs[i]->first; x; x = x->next) {
+			if (x == lkb || lb_compat[x->grmode][lkb->rqmode])
+				continue;
+			if (x->highbast >= lkb->rqmode)
+				continue;
+			x->highbast = lkb->rqmode;
+			queue_result(x, 0, lkb->rqmode);
+		}
+	}
+}
+
+static void grant_pending(struct lb_space *ls, struct lb_rsb *r)
+{
+	struct lb_lkb *lkb;
+
+ again:
+	for (lkb = r->convert.first; lkb; lkb = lkb->next) {
+		if (can_be_granted(r, lkb, 0)) {
+			grant_lkb(r, lkb);
+			goto again;
+		}
+	}
+
+	for (lkb = r->wait.first; lkb; lkb = lkb->next) {
+		if (can_be_granted(r, lkb, 0)) {
+			grant_lkb(r, lkb);
+			goto again;
+		}
+		if (!(lkb->exflags & LKF_NOORDER))
+			break;
+	}
+
+	if (r->convert.first)
+		send_basts(r, r->convert.first);
+	if (r->wait.first)
+		send_basts(r, r->wait.first);
+
+	put_rsb(ls, r);
+}
+
+/* two converters each blocked by the other's granted mode */
+static int conversion_deadlock(struct lb_rsb *r, struct lb_lkb *lkb)
+{
+	struct lb_lkb *x;
+
+	for (x = r->convert.first; x; x = x->next) {
+		if (x == lkb)
+			continue;
+		if (!lb_compat[x->grmode][lkb->rqmode] &&
+		    !lb_compat[lkb->grmode][x->rqmode])
+			return 1;
+	}
+	return 0;
+}
+
+static void set_asts(struct lb_lkb *lkb, struct dlm_lock_params *p)
+{
+	if (p->castaddr)
+		lkb->castaddr = p->castaddr;
+	if (p->castparam)
+		lkb->castparam = p->castparam;
+	if (p->bastaddr)
+		lkb->bastaddr = p->bastaddr;
+	if (p->bastparam)
+		lkb->bastparam = p->bastparam;
+	if (p->lksb)
+		lkb->user_lksb = p->lksb;
+}
+
+static int adopt_orphan(struct lb_handle *h, struct lb_rsb *r,
+			struct dlm_lock_params *p)
+{
+	struct lb_lkb *lkb;
+	int found = 0;
+
+	for (lkb = r->grant.first; lkb; lkb = lkb->next) {
+		if (lkb->h)
+			continue;
+		found = 1;
+		if (lkb->grmode == p->mode)
+			break;
+	}
+
+	if (!lkb) {
+		errno = found ? EAGAIN : ENOENT;
+		return -1;
+	}
+
+	if (reserve_results(lkb, p->bastaddr || lkb->bastaddr))
+		return -1;
+
+	lkb->h = h;
+	lkb->pid = getpid();
+	lkb->sbflags = 0;
+	set_asts(lkb, p);
+	queue_result(lkb, 0, 0);
+	return lkb->lkid;
+}
+
+static int do_request(struct lb_handle *h, struct dlm_lock_params *p)
+{
+	struct lb_space *ls = h->space;
+	struct lb_lkb *lkb;
+	struct lb_rsb *r;
+	int lkid;
+
+	if (!p->namelen || p->namelen > DLM_RESNAME_MAXLEN) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	r = find_rsb(ls, p->name, p->namelen, !(p->flags & LKF_ORPHAN));
+	if (!r) {
+		errno = (p->flags & LKF_ORPHAN) ? ENOENT : ENOMEM;
+		return -1;
+	}
+
+	if (p->flags & LKF_ORPHAN)
+		return adopt_orphan(h, r, p);
+
+	lkb = malloc(sizeof(struct lb_lkb));
+	if (!lkb) {
+		put_rsb(ls, r);
+		errno = ENOMEM;
+		return -1;
+	}
+	memset(lkb, 0, sizeof(struct lb_lkb));
+
+	if (reserve_results(lkb, p->bastaddr != NULL)) {
+		free(lkb);
+		put_rsb(ls, r);
+		return -1;
+	}
+
+	do {
+		lkb->lkid = ls->next_lkid++;
+	} while (!lkb->lkid || find_lkb(ls, lkb->lkid));
+
+	lkb->hash_next = ls->lkbs[lkb->lkid % LB_LKB_HASH];
+	ls->lkbs[lkb->lkid % LB_LKB_HASH] = lkb;
+
+	lkb->rsb = r;
+	lkb->h = h;
+	lkb->pid = getpid();
+	lkb->grmode = -1;
+	lkb->rqmode = p->mode;
+	lkb->exflags = p->flags;
+	set_asts(lkb, p);
+	if (p->flags & LKF_VALBLK)
+		memcpy(lkb->lvb, p->lvb, DLM_USER_LVB_LEN);
+
+	lkid = lkb->lkid;
+
+	if (can_be_granted(r, lkb, 1)) {
+		grant_lkb(r, lkb);
+		return lkid;
+	}
+
+	if (p->flags & LKF_NOQUEUE) {
+		if (p->flags & LKF_NOQUEUEBAST)
+			send_basts(r, lkb);
+		queue_result(lkb, -EAGAIN, 0);
+		free_lkb(ls, lkb);
+		put_rsb(ls, r);
+		return lkid;
+	}
+
+	move_lkb(lkb, LB_WAITING, p->flags & LKF_HEADQUE);
+	send_basts(r, lkb);
+	return lkid;
+}
+
+static int do_convert(struct lb_handle *h, struct dlm_lock_params *p)
+{
+	struct lb_space *ls = h->space;
+	struct lb_lkb *lkb;
+	struct lb_rsb *r;
+
+	lkb = find_lkb(ls, p->lkid);
+	if (!lkb || lkb->h != h) {
+		errno = ENOENT;
+		return -1;
+	}
+
+	if (lkb->status != LB_GRANTED) {
+		errno = EBUSY;
+		return -1;
+	}
+
+	if (reserve_results(lkb, p->bastaddr || lkb->bastaddr))
+		return -1;
+
+	r = lkb->rsb;
+	set_asts(lkb, p);
+	lkb->exflags = p->flags;
+	lkb->sbflags = 0;
+	lkb->rqmode = p->mode;
+	if (p->flags & LKF_VALBLK)
+		memcpy(lkb->lvb, p->lvb, DLM_USER_LVB_LEN);
+
+	/* off the grant queue while we see if the new mode fits */
+	move_lkb(lkb, LB_CONVERT, 0);
+
+	if (can_be_granted(r, lkb, 1))
+		goto grant;
+
+	if (p->flags & LKF_NOQUEUE) {
+		if (p->flags & LKF_NOQUEUEBAST)
+			send_basts(r, lkb);
+		lkb->rqmode = -1;
+		move_lkb(lkb, LB_GRANTED, 0);
+		queue_result(lkb, -EAGAIN, 0);
+		return 0;
+	}
+
+	if (conversion_deadlock(r, lkb)) {
+		if (!(p->flags & LKF_CONVDEADLK)) {
+			lkb->rqmode = -1;
+			move_lkb(lkb, LB_GRANTED, 0);
+			queue_result(lkb, -EDEADLK, 0);
+			return 0;
+		}
+		lkb->grmode = LKM_NLMODE;
+		lkb->sbflags |= DLM_SBF_DEMOTED;
+		if (can_be_granted(r, lkb, 1))
+			goto grant;
+	}
+
+	if (p->flags & LKF_HEADQUE)
+		move_lkb(lkb, LB_CONVERT, 1);
+	send_basts(r, lkb);
+	grant_pending(ls, r);
+	return 0;
+
+ grant:
+	grant_lkb(r, lkb);
+	grant_pending(ls, r);
+	return 0;
+}
+
+/* cancel a queued request or conversion with the given status */
+static int cancel_lkb(struct lb_space *ls, struct lb_lkb *lkb, int status)
+{
+	struct lb_rsb *r = lkb->rsb;
+
+	if (lkb->status == LB_WAITING) {
+		queue_result(lkb, status, 0);
+		free_lkb(ls, lkb);
+	} else if (lkb->status == LB_CONVERT) {
+		lkb->rqmode = -1;
+		move_lkb(lkb, LB_GRANTED, 0);
+		queue_result(lkb, status, 0);
+	} else {
+		errno = EBUSY;
+		return -1;
+	}
+
+	grant_pending(ls, r);
+	return 0;
+}
+
+static int do_unlock(struct lb_handle *h, struct dlm_lock_params *p)
+{
+	struct lb_space *ls = h->space;
+	struct lb_lkb *lkb;
+	struct lb_rsb *r;
+
+	lkb = find_lkb(ls, p->lkid);
+	if (!lkb || lkb->h != h) {
+		errno = ENOENT;
+		return -1;
+	}
+
+	/* a queued request that is canceled or force unlocked completes
+	   with the result reserved for it */
+	if (lkb->status == LB_GRANTED && !(p->flags & LKF_CANCEL) &&
+	    reserve_results(lkb, 0))
+		return -1;
+
+	if (p->castparam)
+		lkb->castparam = p->castparam;
+	if (p->lksb)
+		lkb->user_lksb = p->lksb;
+
+	if (p->flags & LKF_CANCEL)
+		return cancel_lkb(ls, lkb, -DLM_ECANCEL);
+
+	if (lkb->status != LB_GRANTED) {
+		if (!(p->flags & LKF_FORCEUNLOCK)) {
+			errno = EBUSY;
+			return -1;
+		}
+		/* give up the queued request, the lock ends with the unlock */
+		if (lkb->status == LB_CONVERT)
+			lkb->rqmode = -1;
+		move_lkb(lkb, LB_GRANTED, 0);
+	}
+
+	r = lkb->rsb;
+	/* the unlock request carries no lvb, the lock's own is written */
+	if (lkb->grmode != -1) {
+		lkb->exflags |= p->flags & (LKF_VALBLK | LKF_IVVALBLK);
+		set_lvb_unlock(r, lkb);
+	}
+
+	lkb->sbflags = 0;
+	queue_result(lkb, -DLM_EUNLOCK, 0);
+	free_lkb(ls, lkb);
+	grant_pending(ls, r);
+	return 0;
+}
+
+static int do_deadlock(struct lb_handle *h, struct dlm_lock_params *p)
+{
+	struct lb_lkb *lkb;
+
+	lkb = find_lkb(h->space, p->lkid);
+	if (!lkb || lkb->h != h) {
+		errno = ENOENT;
+		return -1;
+	}
+	return cancel_lkb(h->space, lkb, -EDEADLK);
+}
+
+static int do_purge(struct lb_handle *h, struct dlm_purge_params *p)
+{
+	struct lb_space *ls = h->space;
+	struct lb_lkb *lkb, *next;
+	struct lb_rsb *r;
+	int i;
+
+	for (i = 0; i < LB_LKB_HASH; i++) {
+		for (lkb = ls->lkbs[i]; lkb; lkb = next) {
+			next = lkb->hash_next;
+			if (lkb->h)
+				continue;
+			if (p->pid && lkb->pid != p->pid)
+				continue;
+			r = lkb->rsb;
+			free_lkb(ls, lkb);
+			grant_pending(ls, r);
+		}
+	}
+	return 0;
+}
+
+int lb_write(struct lb_handle *h, struct dlm_write_request *req, int len)
+{
+	int rv;
+
+	if (len < sizeof(struct dlm_write_request)) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	if (req->cmd == DLM_USER_LOCK && req->i.lock.mode > LKM_EXMODE) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	lb_lock();
+	switch (req->cmd) {
+	case DLM_USER_LOCK:
+		if (req->i.lock.flags & LKF_CONVERT)
+			rv = do_convert(h, &req->i.lock);
+		else
+			rv = do_request(h, &req->i.lock);
+		break;
+	case DLM_USER_UNLOCK:
+		rv = do_unlock(h, &req->i.lock);
+		break;
+	case DLM_USER_DEADLOCK:
+		rv = do_deadlock(h, &req->i.lock);
+		break;
+	case DLM_USER_PURGE:
+		rv = do_purge(h, &req->i.purge);
+		break;
+	default:
+		errno = EINVAL;
+		rv = -1;
+	}
+	lb_unlock();
+
+	return rv;
+}
+
+int lb_read(int fd, void *buf, int len)
+{
+	struct lb_handle *h;
+	struct lb_result *rs;
+	uint64_t val;
+	int rv;
+
+	lb_lock();
+	for (h = handles; h; h = h->next) {
+		if (h->efd == fd)
+			break;
+	}
+	lb_unlock();
+
+	if (!h)
+		return read(fd, buf, len);
+
+	if (len < sizeof(struct dlm_lock_result) + DLM_USER_LVB_LEN) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	/* semaphore mode, one count per queued result; blocks per O_NONBLOCK */
+	rv = read(fd, &val, sizeof(val));
+	if (rv < 0)
+		return -1;
+
+	lb_lock();
+	rs = h->first;
+	if (rs) {
+		h->first = rs->next;
+		if (!h->first)
+			h->last = NULL;
+	}
+	lb_unlock();
+
+	if (!rs) {
+		errno = EAGAIN;
+		return -1;
+	}
+
+	memcpy(buf, &rs->res, sizeof(struct dlm_lock_result));
+	memcpy((char *)buf + sizeof(struct dlm_lock_result), rs->lvb,
+	       DLM_USER_LVB_LEN);
+	rv = rs->res.length;
+	free(rs);
+	return rv;
+}
+
+static struct lb_space *find_space(const char *name)
+{
+	struct lb_space *ls;
+
+	for (ls = spaces; ls; ls = ls->next) {
+		if (!strcmp(ls->name, name))
+			return ls;
+	}
+	return NULL;
+}
+
+static void free_space(struct lb_space *ls)
+{
+	struct lb_space **pp;
+	struct lb_lkb *lkb;
+	struct lb_rsb *r;
+	int i;
+
+	for (pp = &spaces; *pp; pp = &(*pp)->next) {
+		if (*pp == ls) {
+			*pp = ls->next;
+			break;
+		}
+	}
+
+	for (i = 0; i < LB_LKB_HASH; i++) {
+		while ((lkb = ls->lkbs[i])) {
+			ls->lkbs[i] = lkb->hash_next;
+			free_spares(lkb);
+			free(lkb);
+		}
+	}
+
+	for (i = 0; i < LB_RSB_HASH; i++) {
+		while ((r = ls->rsbs[i])) {
+			ls->rsbs[i] = r->next;
+			free(r);
+		}
+	}
+
+	free(ls);
+}
+
+struct lb_handle *lb_open(const char *name, int create, int *fd)
+{
+	struct lb_space *ls;
+	struct lb_handle *h;
+
+	if (strlen(name) > DLM_LOCKSPACE_LEN) {
+		errno = EINVAL;
+		return NULL;
+	}
+
+	h = malloc(sizeof(struct lb_handle));
+	if (!h)
+		return NULL;
+	memset(h, 0, sizeof(struct lb_handle));
+
+	h->efd = eventfd(0, EFD_SEMAPHORE | EFD_CLOEXEC);
+	if (h->efd < 0) {
+		free(h);
+		return NULL;
+	}
+
+	lb_lock();
+	ls = find_space(name);
+	if (!ls && create) {
+		ls = malloc(sizeof(struct lb_space));
+		if (ls) {
+			memset(ls, 0, sizeof(struct lb_space));
+			strcpy(ls->name, name);
+			ls->next_lkid = 1;
+			ls->next = spaces;
+			spaces = ls;
+		}
+	}
+	if (!ls) {
+		lb_unlock();
+		close(h->efd);
+		free(h);
+		errno = create ? ENOMEM : ENOENT;
+		return NULL;
+	}
+
+	if (create)
+		ls->create_count++;
+	ls->handle_count++;
+	h->space = ls;
+	h->next = handles;
+	handles = h;
+	lb_unlock();
+
+	*fd = h->efd;
+	return h;
+}
+
+/*
+ * As when a lockspace device is closed: PERSISTENT granted locks become
+ * orphans, other locks are dropped without asts.
+ */
+
+void lb_close(struct lb_handle *h)
+{
+	struct lb_space *ls = h->space;
+	struct lb_handle **pp;
+	struct lb_result *rs;
+	struct lb_lkb *lkb, *next;
+	struct lb_rsb *r, *rnext;
+	int i;
+
+	lb_lock();
+	for (pp = &handles; *pp; pp = &(*pp)->next) {
+		if (*pp == h) {
+			*pp = h->next;
+			break;
+		}
+	}
+
+	for (i = 0; i < LB_LKB_HASH; i++) {
+		for (lkb = ls->lkbs[i]; lkb; lkb = next) {
+			next = lkb->hash_next;
+			if (lkb->h != h)
+				continue;
+			if (lkb->status == LB_GRANTED &&
+			    (lkb->exflags & LKF_PERSISTENT)) {
+				lkb->h = NULL;
+				continue;
+			}
+			free_lkb(ls, lkb);
+		}
+	}
+
+	for (i = 0; i < LB_RSB_HASH; i++) {
+		for (r = ls->rsbs[i]; r; r = rnext) {
+			rnext = r->next;
+			grant_pending(ls, r);
+		}
+	}
+
+	if (!--ls->handle_count && !ls->create_count)
+		free_space(ls);
+	lb_unlock();
+
+	while ((rs = h->first)) {
+		h->first = rs->next;
+		free(rs);
+	}
+	close(h->efd);
+	free(h);
+}
+
+/*
+ * The caller still has h open, it is not counted as a user of the space.
+ * The space is freed when the caller closes h.
+ */
+int lb_release(struct lb_handle *h, int force)
+{
+	struct lb_space *ls = h->space;
+	int rv = 0;
+
+	lb_lock();
+	if (ls->handle_count > 1 && !force) {
+		errno = EBUSY;
+		rv = -1;
+	} else if (ls->create_count) {
+		ls->create_count--;
+	}
+	lb_unlock();
+
+	return rv;
+}
@@ -0,0 +1,30 @@
+/*
+ * Copyright 2026 The dlm authors.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ */
+
+#ifndef __LIBDLM_LOOPBACK_H
+#define __LIBDLM_LOOPBACK_H
+
+/*
+ * In-process loopback backend, used in place of the dlm devices when
+ * LIBDLM_BACKEND=loopback.  A handle stands for one open of a lockspace
+ * device: lb_write() takes the same requests as a write to the device,
+ * and lb_read() returns results from the handle's eventfd as a read from
+ * the device would.
+ */
+
+struct lb_handle;
+
+int lb_enabled(void);
+struct lb_handle *lb_open(const char *name, int create, int *fd);
+void lb_close(struct lb_handle *h);
+int lb_release(struct lb_handle *h, int force);
+int lb_write(struct lb_handle *h, struct dlm_write_request *req, int len);
+int lb_read(int fd, void *buf, int len);
+
+#endif